@@ -20,10 +20,280 @@
 // SOFTWARE.
 
 #include <bfack.h>
+#include <bftypes.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <hve/arch/intel_x64/exit_hotspot_entry.h>
+#include <hve/arch/intel_x64/exit_stats_page.h>
+
+#include "cpus.h"
+
+using namespace eapis::intel_x64;
+
+// -----------------------------------------------------------------------------
+// Exit Stats
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The stats page is read 16 bytes at a time using CPUID, relayed to the
+// cpu whose vCPU owns the page. The counters keep moving while the page is
+// read, so the result is a close, but not exact, snapshot.
+//
+
+static_assert(exit_stats_cpuid_leaf >= EAPIS_RELAY_LEAF_FIRST);
+static_assert(exit_stats_cpuid_leaf <= EAPIS_RELAY_LEAF_LAST);
+
+static bool
+read_exit_stats(const cpuid_relay &relay, uint64_t cpu, exit_stats_page_t &page)
+{
+    std::vector<uint32_t> words((sizeof(exit_stats_page_t) + 15) / 16 * 4);
+
+    for (uint32_t i = 0; i < words.size() / 4; i++) {
+        auto [eax, ebx, ecx, edx] = relay.get(cpu, exit_stats_cpuid_leaf, i);
+
+        words[(i * 4) + 0] = eax;
+        words[(i * 4) + 1] = ebx;
+        words[(i * 4) + 2] = ecx;
+        words[(i * 4) + 3] = edx;
+    }
+
+    std::memcpy(&page, words.data(), sizeof(exit_stats_page_t));
+
+    return
+        page.magic == exit_stats_magic &&
+        page.version == exit_stats_version &&
+        page.num_reasons == exit_stats_num_reasons &&
+        page.num_buckets == exit_stats_num_buckets;
+}
+
+static std::vector<exit_stats_page_t>
+read_all_exit_stats(const cpuid_relay &relay)
+{
+    std::vector<exit_stats_page_t> pages;
+
+    for (uint64_t cpu = 0; cpu < num_cpus(); cpu++) {
+        exit_stats_page_t page{};
+
+        if (!read_exit_stats(relay, cpu, page)) {
+            std::clog << "ack: unable to read exit stats on cpu " << cpu << '\n';
+            continue;
+        }
+
+        pages.push_back(page);
+    }
+
+    return pages;
+}
+
+// Note:
+//
+// If an interval is given, the stats are sampled twice and the difference
+// is printed as a rate. The histogram buckets are 32 bits and wrap, which
+// the unsigned subtraction takes care of.
+//
+
+static void
+print_exit_stats(
+    const exit_stats_page_t &cur, const exit_stats_page_t *prev, double seconds)
+{
+    auto rate = [&](uint64_t now, uint64_t then) {
+        return prev != nullptr ? static_cast<double>(now - then) / seconds : static_cast<double>(now);
+    };
+
+    std::cout << "vcpu " << cur.vcpuid << ": "
+              << std::fixed << std::setprecision(0)
+              << rate(cur.exits, prev != nullptr ? prev->exits : 0)
+              << (prev != nullptr ? " exits/s" : " exits") << '\n';
+
+    for (uint32_t r = 0; r < exit_stats_num_reasons; r++) {
+        const auto count = rate(cur.count[r], prev != nullptr ? prev->count[r] : 0);
+        if (count == 0) {
+            continue;
+        }
+
+        std::cout << "  reason " << std::setw(2) << r << ": " << std::setw(12) << count << "  [";
+
+        for (uint32_t b = 0; b < exit_stats_num_buckets; b++) {
+            const auto then = prev != nullptr ? prev->hist[r][b] : 0U;
+            std::cout << (b == 0 ? "" : " ") << static_cast<uint32_t>(cur.hist[r][b] - then);
+        }
+
+        std::cout << "]\n";
+    }
+}
 
-int main()
+static int
+stats(int argc, const char *argv[])
 {
+    const auto seconds = argc > 2 ? std::stod(argv[2]) : 0.0;
+
+    cpuid_relay relay;
+    if (!relay.is_open()) {
+        std::clog << "ack: unable to open " << EAPIS_RELAY_DEVICE << '\n';
+        return EXIT_FAILURE;
+    }
+
+    auto prev = read_all_exit_stats(relay);
+    if (prev.empty()) {
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "latency buckets: < 2^" << exit_stats_bucket_shift + 1
+              << " ticks, then x2 each, last >= 2^"
+              << exit_stats_bucket_shift + exit_stats_num_buckets - 1 << " ticks\n";
+
+    if (seconds <= 0.0) {
+        for (const auto &page : prev) {
+            print_exit_stats(page, nullptr, 1.0);
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+
+    auto cur = read_all_exit_stats(relay);
+    if (cur.size() != prev.size()) {
+        return EXIT_FAILURE;
+    }
+
+    for (auto i = 0ULL; i < cur.size(); i++) {
+        print_exit_stats(cur[i], &prev[i], seconds);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Exit Hot Spots
+// -----------------------------------------------------------------------------
+
+static_assert(exit_hotspot_cpuid_leaf >= EAPIS_RELAY_LEAF_FIRST);
+static_assert(exit_hotspot_cpuid_leaf <= EAPIS_RELAY_LEAF_LAST);
+
+static auto
+hotspot_op(
+    const cpuid_relay &relay, uint64_t cpu, exit_hotspot_op_t op, uint32_t index = 0, uint32_t arg = 0)
+{ return relay.get(cpu, exit_hotspot_cpuid_leaf, (index << 8) | op, arg); }
+
+static bool
+set_hotspot_period(const cpuid_relay &relay, uint32_t period)
+{
+    for (uint64_t cpu = 0; cpu < num_cpus(); cpu++) {
+        auto [cur, used, num, samples] = hotspot_op(relay, cpu, exit_hotspot_op_set_period, 0, period);
+        bfignored(used);
+        bfignored(samples);
+
+        if (cur != period || num != exit_hotspot_num_entries) {
+            std::clog << "ack: unable to set the hot spot period on cpu " << cpu << '\n';
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Note:
+//
+// The output is one tuple per line, largest count first, so that it can
+// be fed to a symbolizer on the host (e.g. matching the CR3 to a process
+// and the RIP to /proc/<pid>/maps or /proc/kallsyms).
+//
+
+static void
+print_hotspots(const cpuid_relay &relay, uint64_t cpu)
+{
+    std::vector<exit_hotspot_entry_t> entries;
+
+    for (uint32_t i = 0; i < exit_hotspot_num_entries; i++) {
+        auto [rip_lo, rip_hi, cr3_lo, cr3_hi] = hotspot_op(relay, cpu, exit_hotspot_op_read_lo, i);
+        auto [count_lo, count_hi, error, reason] = hotspot_op(relay, cpu, exit_hotspot_op_read_hi, i);
+
+        exit_hotspot_entry_t entry{};
+        entry.rip = (static_cast<uint64_t>(rip_hi) << 32) | rip_lo;
+        entry.cr3 = (static_cast<uint64_t>(cr3_hi) << 32) | cr3_lo;
+        entry.count = (static_cast<uint64_t>(count_hi) << 32) | count_lo;
+        entry.error = error;
+        entry.reason = reason;
+
+        if (entry.count != 0) {
+            entries.push_back(entry);
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+        return a.count > b.count;
+    });
+
+    for (const auto &entry : entries) {
+        std::cout << "cpu " << std::dec << cpu
+                  << " reason " << entry.reason
+                  << " rip 0x" << std::hex << entry.rip
+                  << " cr3 0x" << entry.cr3 << std::dec
+                  << " count " << entry.count
+                  << " error " << entry.error << '\n';
+    }
+}
+
+static int
+hotspots(int argc, const char *argv[])
+{
+    cpuid_relay relay;
+    if (!relay.is_open()) {
+        std::clog << "ack: unable to open " << EAPIS_RELAY_DEVICE << '\n';
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 3) {
+        const auto period = static_cast<uint32_t>(std::stoul(argv[2]));
+        const auto seconds = std::stod(argv[3]);
+
+        if (!set_hotspot_period(relay, period)) {
+            set_hotspot_period(relay, 0);
+            return EXIT_FAILURE;
+        }
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    }
+
+    for (uint64_t cpu = 0; cpu < num_cpus(); cpu++) {
+        print_hotspots(relay, cpu);
+    }
+
+    // Sampling costs every exit a branch and a countdown, so it is turned
+    // back off once the table has been printed. This also clears it.
+
+    if (argc > 3) {
+        set_hotspot_period(relay, 0);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Main
+// -----------------------------------------------------------------------------
+
+int main(int argc, const char *argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "stats") {
+        return stats(argc, argv);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "hotspots") {
+        return hotspots(argc, argv);
+    }
+
     if (bfack() != 0) {
         std::clog << "ack: success" << '\n';
     }
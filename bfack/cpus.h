@@ -0,0 +1,145 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#ifndef BFACK_CPUS_H
+#define BFACK_CPUS_H
+
+#include <array>
+#include <cstdint>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "driver/relay.h"
+
+// Note:
+//
+// The ack tools talk to the VMM using CPUID, which always traps to the
+// vCPU of the core it is executed on. The exit stats, trace and hot spot
+// leaves are only answered from CPL 0, so the tools send them through
+// the relay driver (see driver/relay.h), which executes them from ring 0
+// on the requested core. The relay must be loaded, and the tools run with
+// CAP_SYS_ADMIN.
+//
+
+/// CPUID Relay
+///
+/// Executes one of the relayed CPUID leaves on a given cpu
+///
+class cpuid_relay
+{
+public:
+
+    using result_type = std::array<uint32_t, 4>;
+
+    /// Constructor
+    ///
+    /// Opens the relay device
+    ///
+    cpuid_relay()
+    {
+#ifdef __linux__
+        m_fd = open(EAPIS_RELAY_DEVICE, O_RDWR | O_CLOEXEC);
+#endif
+    }
+
+    /// Destructor
+    ///
+    ~cpuid_relay()
+    {
+#ifdef __linux__
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+#endif
+    }
+
+    /// Is Open
+    ///
+    /// @return true if the relay device was opened, false otherwise
+    ///
+    bool is_open() const noexcept
+    { return m_fd >= 0; }
+
+    /// Get
+    ///
+    /// @param cpu the cpu to execute CPUID on
+    /// @param eax the leaf
+    /// @param ecx the value of ECX
+    /// @param edx the value of EDX
+    /// @return EAX, EBX, ECX and EDX after CPUID, or all 0 if the request
+    ///     failed (which is also what the VMM returns when it refuses one)
+    ///
+    result_type get(uint64_t cpu, uint32_t eax, uint32_t ecx = 0, uint32_t edx = 0) const noexcept
+    {
+#ifdef __linux__
+        eapis_relay_cpuid args{static_cast<uint32_t>(cpu), eax, 0, ecx, edx};
+
+        if (m_fd >= 0 && ioctl(m_fd, EAPIS_RELAY_IOCTL_CPUID, &args) == 0) {
+            return {args.eax, args.ebx, args.ecx, args.edx};
+        }
+#else
+        static_cast<void>(cpu);
+        static_cast<void>(eax);
+        static_cast<void>(ecx);
+        static_cast<void>(edx);
+#endif
+
+        return {};
+    }
+
+private:
+
+    int m_fd{-1};
+
+public:
+
+    /// @cond
+
+    cpuid_relay(cpuid_relay &&) = delete;
+    cpuid_relay &operator=(cpuid_relay &&) = delete;
+
+    cpuid_relay(const cpuid_relay &) = delete;
+    cpuid_relay &operator=(const cpuid_relay &) = delete;
+
+    /// @endcond
+};
+
+/// Number of CPUs
+///
+/// @return the number of online cpus
+///
+inline uint64_t
+num_cpus()
+{
+#ifdef __linux__
+    return static_cast<uint64_t>(sysconf(_SC_NPROCESSORS_ONLN));
+#else
+    return 1;
+#endif
+}
+
+#endif
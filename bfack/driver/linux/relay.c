@@ -0,0 +1,117 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <linux/capability.h>
+#include <linux/cpumask.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/smp.h>
+#include <linux/uaccess.h>
+
+#include "../relay.h"
+
+// -----------------------------------------------------------------------------
+// CPUID
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The eapis leaves take arguments in ECX and EDX as well as EAX, which
+// the kernel's cpuid helpers do not load, so CPUID is executed directly.
+// This runs from the IPI on the requested cpu, at CPL 0, so the CPUID
+// traps to that cpu's vCPU and passes its ring 0 check.
+//
+
+static void
+relay_cpuid_on_cpu(void *info)
+{
+    struct eapis_relay_cpuid *args = info;
+
+    __asm__ volatile(
+        "cpuid"
+        : "+a"(args->eax), "+b"(args->ebx), "+c"(args->ecx), "+d"(args->edx)
+        :
+        : "memory"
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Device
+// -----------------------------------------------------------------------------
+
+static long
+relay_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    int ret;
+    struct eapis_relay_cpuid args;
+
+    (void) file;
+
+    if (cmd != EAPIS_RELAY_IOCTL_CPUID) {
+        return -ENOTTY;
+    }
+
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+
+    if (copy_from_user(&args, (void __user *)arg, sizeof(args)) != 0) {
+        return -EFAULT;
+    }
+
+    if (args.eax < EAPIS_RELAY_LEAF_FIRST || args.eax > EAPIS_RELAY_LEAF_LAST) {
+        return -EINVAL;
+    }
+
+    if (args.cpu >= nr_cpu_ids) {
+        return -ENODEV;
+    }
+
+    ret = smp_call_function_single(args.cpu, relay_cpuid_on_cpu, &args, 1);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (copy_to_user((void __user *)arg, &args, sizeof(args)) != 0) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static const struct file_operations relay_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = relay_ioctl,
+};
+
+static struct miscdevice relay_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = EAPIS_RELAY_NAME,
+    .fops = &relay_fops,
+    .mode = 0600,
+};
+
+module_misc_device(relay_dev);
+
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_DESCRIPTION("Relays the eapis exit stats, trace and hot spot CPUID leaves to user mode");
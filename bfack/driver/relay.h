@@ -0,0 +1,85 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BFACK_DRIVER_RELAY_H
+#define BFACK_DRIVER_RELAY_H
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
+#endif
+
+// Note:
+//
+// The VMM only answers the exit stats, trace and hot spot CPUID leaves
+// when CPUID is executed at CPL 0, as they expose (and control) state
+// that belongs to every process in the guest. User mode tools reach them
+// through the relay, a small driver that executes one of these leaves
+// from ring 0 on the requested cpu and copies the result back. The relay
+// refuses any other leaf, and any caller without CAP_SYS_ADMIN.
+//
+// This header is shared by the driver and the tools, so it must be C.
+//
+
+/// Relay Name
+///
+#define EAPIS_RELAY_NAME "eapis_relay"
+
+/// Relay Device
+///
+#define EAPIS_RELAY_DEVICE "/dev/" EAPIS_RELAY_NAME
+
+/// Relayed Leaves
+///
+/// The first and last CPUID leaf the relay will execute (exit stats,
+/// exit trace and exit hot spots)
+///
+#define EAPIS_RELAY_LEAF_FIRST 0x4BF00010U
+#define EAPIS_RELAY_LEAF_LAST 0x4BF00012U
+
+/// Relay CPUID Arguments
+///
+/// eax to edx are loaded before CPUID is executed on cpu, and hold the
+/// result when the ioctl returns.
+///
+struct eapis_relay_cpuid {
+    uint32_t cpu;
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+};
+
+#if defined(__KERNEL__) || defined(__linux__)
+
+/// Relay CPUID Ioctl
+///
+#define EAPIS_RELAY_IOCTL_CPUID _IOWR(0xBF, 0x10, struct eapis_relay_cpuid)
+
+#endif
+
+#endif
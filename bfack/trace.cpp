@@ -0,0 +1,168 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Note:
+//
+// Drains the per-vCPU exit trace rings (see exit_trace_record.h) and
+// writes them to stdout in the Chrome trace event format, which can be
+// loaded by chrome://tracing, Perfetto, speedscope, etc. Each vCPU is
+// shown as a thread, and each exit as a slice named after its reason.
+//
+// The rings are reached through the relay driver (see cpus.h), and each
+// vCPU's ring must have been armed by the VMM (see
+// vcpu::arm_exit_trace) before tracing can be enabled on it.
+//
+// usage: exit_trace [seconds]
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <bftypes.h>
+#include <hve/arch/intel_x64/exit_trace_record.h>
+
+#include "cpus.h"
+
+using namespace eapis::intel_x64;
+
+static_assert(exit_trace_cpuid_leaf >= EAPIS_RELAY_LEAF_FIRST);
+static_assert(exit_trace_cpuid_leaf <= EAPIS_RELAY_LEAF_LAST);
+
+static auto
+trace_op(const cpuid_relay &relay, uint64_t cpu, exit_trace_op_t op)
+{ return relay.get(cpu, exit_trace_cpuid_leaf, op); }
+
+static bool
+for_each_cpu(const cpuid_relay &relay, bool (*func)(const cpuid_relay &relay, uint64_t cpu))
+{
+    auto success = true;
+
+    for (uint64_t cpu = 0; cpu < num_cpus(); cpu++) {
+        if (!func(relay, cpu)) {
+            std::clog << "exit_trace: failed on cpu " << cpu << '\n';
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+static bool
+enable(const cpuid_relay &relay, uint64_t cpu)
+{
+    auto [enabled, pending, dropped, armed] = trace_op(relay, cpu, exit_trace_op_enable);
+    bfignored(pending);
+    bfignored(dropped);
+
+    if (armed == 0) {
+        std::clog << "exit_trace: cpu " << cpu << " is not armed by the VMM\n";
+    }
+
+    return enabled == 1;
+}
+
+static bool
+disable(const cpuid_relay &relay, uint64_t cpu)
+{
+    auto [enabled, pending, dropped, armed] = trace_op(relay, cpu, exit_trace_op_disable);
+    bfignored(pending);
+    bfignored(armed);
+
+    if (dropped != 0) {
+        std::clog << "exit_trace: cpu " << cpu << " dropped " << dropped << " records\n";
+    }
+
+    return enabled == 0;
+}
+
+static bool s_first = true;
+
+static bool
+drain(const cpuid_relay &relay, uint64_t cpu)
+{
+    auto [vcpuid, tsc_khz, num_records, version] = trace_op(relay, cpu, exit_trace_op_info);
+    bfignored(num_records);
+
+    if (version != exit_trace_version || tsc_khz == 0) {
+        return false;
+    }
+
+    const auto ticks_per_us = static_cast<double>(tsc_khz) / 1000.0;
+
+    while (true) {
+        auto [tsc_lo, tsc_hi, rip_lo, rip_hi] = trace_op(relay, cpu, exit_trace_op_read_lo);
+        auto [qual_lo, qual_hi, ticks, reason] = trace_op(relay, cpu, exit_trace_op_read_hi);
+
+        const auto tsc = (static_cast<uint64_t>(tsc_hi) << 32) | tsc_lo;
+        const auto rip = (static_cast<uint64_t>(rip_hi) << 32) | rip_lo;
+        const auto qual = (static_cast<uint64_t>(qual_hi) << 32) | qual_lo;
+
+        if (tsc == 0) {
+            break;
+        }
+
+        std::cout << (s_first ? "\n" : ",\n")
+                  << "{\"name\":\"exit " << (reason & 0xFFFF) << "\",\"cat\":\"vmexit\",\"ph\":\"X\""
+                  << ",\"pid\":0,\"tid\":" << vcpuid
+                  << ",\"ts\":" << static_cast<double>(tsc) / ticks_per_us
+                  << ",\"dur\":" << static_cast<double>(ticks) / ticks_per_us
+                  << ",\"args\":{\"rip\":\"0x" << std::hex << rip
+                  << "\",\"qualification\":\"0x" << qual << std::dec
+                  << "\",\"advanced\":" << (((reason >> 16) & exit_trace_flag_advanced) != 0 ? "true" : "false")
+                  << "}}";
+
+        s_first = false;
+    }
+
+    return true;
+}
+
+int main(int argc, const char *argv[])
+{
+    const auto seconds = argc > 1 ? std::stod(argv[1]) : 1.0;
+
+    cpuid_relay relay;
+    if (!relay.is_open()) {
+        std::clog << "exit_trace: unable to open " << EAPIS_RELAY_DEVICE << '\n';
+        return EXIT_FAILURE;
+    }
+
+    if (!for_each_cpu(relay, enable)) {
+        for_each_cpu(relay, disable);
+        return EXIT_FAILURE;
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+
+    for_each_cpu(relay, disable);
+
+    std::cout.precision(3);
+    std::cout << std::fixed << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+    const auto success = for_each_cpu(relay, drain);
+
+    std::cout << "\n]}\n";
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
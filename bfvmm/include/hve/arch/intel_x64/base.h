@@ -34,6 +34,22 @@
 #define EAPIS_LOG_MAX 10
 #endif
 
+// The handlers below are optional and can be compiled out of eapis_hve by
+// defining the matching macro to 0 (see EAPIS_HVE_* in the CMake config).
+// The same value must be used by every VMM that links against eapis_hve.
+
+#ifndef EAPIS_HVE_HLT
+#define EAPIS_HVE_HLT 1
+#endif
+
+#ifndef EAPIS_HVE_PAUSE
+#define EAPIS_HVE_PAUSE 1
+#endif
+
+#ifndef EAPIS_HVE_RDTSC
+#define EAPIS_HVE_RDTSC 1
+#endif
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
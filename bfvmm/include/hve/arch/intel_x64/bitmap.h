@@ -0,0 +1,292 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BITMAP_INTEL_X64_EAPIS_H
+#define BITMAP_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <memory>
+
+#include <intrinsics.h>
+#include <bfvmm/hve/arch/intel_x64/vmcs.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// Bitmap Policy
+///
+/// A page sized image of an MSR or I/O bitmap that can be built at compile
+/// time, and used to create a bitmap template.
+///
+/// Example:
+/// @code
+/// constexpr auto policy = bitmap_policy{}.trap_msr(0x79).trap_wrmsr(0x3A);
+/// @endcode
+///
+class bitmap_policy
+{
+public:
+
+    /// The size of a bitmap in bytes
+    ///
+    static constexpr std::size_t size = 0x1000;
+
+    /// Set Bit
+    ///
+    /// @param bit the bit in the bitmap to set
+    /// @return *this
+    ///
+    constexpr bitmap_policy &set(std::size_t bit)
+    {
+        m_bits[bit >> 3] = static_cast<uint8_t>(m_bits[bit >> 3] | (1U << (bit & 7)));
+        return *this;
+    }
+
+    /// Trap RDMSR
+    ///
+    /// @param msr the msr to trap reads from
+    /// @return *this
+    ///
+    constexpr bitmap_policy &trap_rdmsr(uint32_t msr)
+    {
+        if (msr <= 0x00001FFFU) {
+            return this->set(msr - 0x00000000U);
+        }
+
+        return this->set((msr - 0xC0000000U) + 0x2000);
+    }
+
+    /// Trap WRMSR
+    ///
+    /// @param msr the msr to trap writes to
+    /// @return *this
+    ///
+    constexpr bitmap_policy &trap_wrmsr(uint32_t msr)
+    {
+        if (msr <= 0x00001FFFU) {
+            return this->set((msr - 0x00000000U) + 0x4000);
+        }
+
+        return this->set((msr - 0xC0000000U) + 0x6000);
+    }
+
+    /// Trap MSR
+    ///
+    /// @param msr the msr to trap reads from and writes to
+    /// @return *this
+    ///
+    constexpr bitmap_policy &trap_msr(uint32_t msr)
+    { return this->trap_rdmsr(msr).trap_wrmsr(msr); }
+
+    /// Data
+    ///
+    /// @return the bitmap image
+    ///
+    constexpr const std::array<uint8_t, size> &data() const noexcept
+    { return m_bits; }
+
+private:
+
+    std::array<uint8_t, size> m_bits{};
+};
+
+/// Default MSR Policy
+///
+/// The MSRs every eapis vcpu traps on construction (see microcode_handler)
+///
+constexpr auto default_msr_policy =
+    bitmap_policy{}
+    .trap_msr(::intel_x64::msrs::ia32_bios_updt_trig::addr)
+    .trap_msr(::intel_x64::msrs::ia32_bios_sign_id::addr);
+
+/// Default I/O Policy
+///
+/// Pass through all ports
+///
+constexpr auto default_io_policy = bitmap_policy{};
+
+/// Bitmap
+///
+/// An MSR or I/O bitmap backed by a shared, reference counted template
+/// page. vCPUs that use the same policy share a single page (and thus the
+/// same cache lines). The first modification that actually changes a bit
+/// copies the template into a private page and repoints the VMCS at it.
+/// Modifications that do not change anything (e.g. trapping an MSR the
+/// template already traps) keep the page shared.
+///
+/// The VMCS field is always written through the owning vCPU's vmcs_cache,
+/// so the address only reaches the hardware on that vCPU's next VM entry,
+/// with its own VMCS loaded.
+///
+class EXPORT_EAPIS_HVE bitmap
+{
+public:
+
+    /// Template type
+    ///
+    using template_type = std::shared_ptr<uint8_t>;
+
+    /// Make Template
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param policy the image to initialize the template with
+    /// @return a new template that can be shared by any number of bitmaps
+    ///
+    static template_type make_template(const bitmap_policy &policy);
+
+    /// Default MSR Template
+    ///
+    /// @return the template built from default_msr_policy
+    ///
+    static const template_type &default_msr_template();
+
+    /// Default I/O Template
+    ///
+    /// @return the template built from default_io_policy
+    ///
+    static const template_type &default_io_template();
+
+    /// Constructor
+    ///
+    /// Points the given VMCS field at the template
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu whose VMCS uses this bitmap
+    /// @param tmpl the template to share
+    /// @param field the VMCS field that holds the bitmap's physical address
+    ///
+    bitmap(
+        gsl::not_null<vcpu *> vcpu, template_type tmpl, vmcs_n::value_type field);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~bitmap() = default;
+
+public:
+
+    /// Set Bit
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bit the bit to set
+    ///
+    void set(std::size_t bit);
+
+    /// Clear Bit
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bit the bit to clear
+    ///
+    void clear(std::size_t bit);
+
+    /// Fill
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param offset the byte offset into the bitmap to start at
+    /// @param len the number of bytes to fill
+    /// @param val the value to fill each byte with
+    ///
+    void fill(std::size_t offset, std::size_t len, uint8_t val);
+
+    /// Is Shared
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if this bitmap is still using its template
+    ///
+    bool is_shared() const noexcept
+    { return !m_private; }
+
+    /// Data
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the page currently backing this bitmap
+    ///
+    const uint8_t *data() const noexcept
+    { return m_page.get(); }
+
+private:
+
+    void make_private();
+
+private:
+
+    vcpu *m_vcpu;
+
+    template_type m_page;
+    vmcs_n::value_type m_field;
+
+    bool m_private{false};
+
+public:
+
+    /// @cond
+
+    bitmap(bitmap &&) = default;
+    bitmap &operator=(bitmap &&) = default;
+
+    bitmap(const bitmap &) = delete;
+    bitmap &operator=(const bitmap &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,303 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef DELEGATE_PROFILE_INTEL_X64_EAPIS_H
+#define DELEGATE_PROFILE_INTEL_X64_EAPIS_H
+
+#include <unordered_map>
+#include <utility>
+
+#include <intrinsics.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+/// Delegate Profile
+///
+/// Optional instrumentation for the delegate lists of a handler class.
+/// Each time a handler walks one of its lists (e.g. the delegates
+/// registered for a given MSR), the walk is counted, along with how many
+/// delegates were called before one handled the exit. Each delegate's
+/// call count, hit count (the number of times it returned true) and TSC
+/// ticks are recorded as well.
+///
+/// Profiling is off by default, in which case a walk costs a couple of
+/// extra branches. While on, the first call to a delegate, and the first
+/// walk of a list, allocate.
+///
+/// Example:
+/// @code
+/// auto walk = m_profile.walk(msr);
+/// for (const auto &d : hdlrs->second) {
+///     if (walk(d, vcpu, info)) {
+///         ...
+///     }
+/// }
+/// @endcode
+///
+class EXPORT_EAPIS_HVE delegate_profile
+{
+public:
+
+    /// Delegate Stats
+    ///
+    struct delegate_stats_t {
+        uint64_t key{0};            ///< The key of the delegate's list
+        uint64_t position{0};       ///< The delegate's position in the list
+        uint64_t calls{0};          ///< Number of times called
+        uint64_t hits{0};           ///< Number of times it returned true
+        uint64_t ticks{0};          ///< TSC ticks spent in the delegate
+    };
+
+    /// List Stats
+    ///
+    struct list_stats_t {
+        uint64_t walks{0};          ///< Number of times the list was walked
+        uint64_t calls{0};          ///< Number of delegates called
+        uint64_t hits{0};           ///< Number of walks a delegate handled
+    };
+
+    /// Walk
+    ///
+    /// Calls the delegates of a single list walk, recording their stats
+    /// while profiling is on. The walk itself is recorded when this object
+    /// is destroyed.
+    ///
+    class walk_t
+    {
+    public:
+
+        /// @cond
+
+        walk_t(delegate_profile *profile, uint64_t key) :
+            m_profile{profile->m_enabled ? profile : nullptr},
+            m_list{profile->m_enabled ? &profile->m_lists[key] : nullptr},
+            m_key{key}
+        { }
+
+        ~walk_t()
+        {
+            if (m_list != nullptr) {
+                m_list->walks++;
+                m_list->calls += m_position;
+                m_list->hits += m_hit ? 1 : 0;
+            }
+        }
+
+        template<typename D, typename... Args>
+        bool operator()(const D &d, Args &&... args)
+        {
+            if (m_profile == nullptr) {
+                return d(std::forward<Args>(args)...);
+            }
+
+            const auto start = ::x64::read_tsc::get();
+            m_hit = d(std::forward<Args>(args)...);
+
+            m_profile->add_call(
+                &d, m_key, m_position++, m_hit, ::x64::read_tsc::get() - start
+            );
+
+            return m_hit;
+        }
+
+        walk_t(walk_t &&) = delete;
+        walk_t &operator=(walk_t &&) = delete;
+
+        walk_t(const walk_t &) = delete;
+        walk_t &operator=(const walk_t &) = delete;
+
+        /// @endcond
+
+    private:
+
+        delegate_profile *m_profile;
+        list_stats_t *m_list;
+        uint64_t m_key;
+        uint64_t m_position{0};
+        bool m_hit{false};
+    };
+
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param name the name of the handler being profiled
+    ///
+    explicit delegate_profile(const char *name) noexcept :
+        m_name{name}
+    { }
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~delegate_profile() = default;
+
+public:
+
+    /// Walk
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param key identifies the list being walked (e.g. the MSR, leaf or
+    ///     port). Handlers with a single list use 0.
+    /// @return an object used to call each delegate in the list
+    ///
+    walk_t walk(uint64_t key = 0)
+    { return {this, key}; }
+
+    /// Enable
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable() noexcept
+    { m_enabled = true; }
+
+    /// Disable
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable() noexcept
+    { m_enabled = false; }
+
+    /// Reset
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void reset()
+    {
+        m_delegates.clear();
+        m_lists.clear();
+    }
+
+    /// Forget
+    ///
+    /// Drops the stats of a single list and of every delegate called from
+    /// it. Delegates are keyed by their address in the list, so a handler
+    /// must call this whenever it removes a delegate from a list. Otherwise
+    /// a new delegate that reuses the node would inherit its stats.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param key the key of the list to forget
+    ///
+    void forget(uint64_t key);
+
+    /// Name
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the name of the handler being profiled
+    ///
+    const char *name() const noexcept
+    { return m_name; }
+
+    /// Delegates
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the stats of each delegate called, keyed by the delegate's
+    ///     address in its list
+    ///
+    const std::unordered_map<const void *, delegate_stats_t> &delegates() const noexcept
+    { return m_delegates; }
+
+    /// Lists
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the stats of each list walked, keyed by the list's key
+    ///
+    const std::unordered_map<uint64_t, list_stats_t> &lists() const noexcept
+    { return m_lists; }
+
+    /// Dump
+    ///
+    /// Prints each list, followed by its delegates in the order they are
+    /// called.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump() const;
+
+private:
+
+    void add_call(
+        const void *d, uint64_t key, uint64_t position, bool hit, uint64_t ticks);
+
+private:
+
+    const char *m_name;
+    bool m_enabled{false};
+
+    std::unordered_map<const void *, delegate_stats_t> m_delegates;
+    std::unordered_map<uint64_t, list_stats_t> m_lists;
+
+public:
+
+    /// @cond
+
+    delegate_profile(delegate_profile &&) = default;
+    delegate_profile &operator=(delegate_profile &&) = default;
+
+    delegate_profile(const delegate_profile &) = delete;
+    delegate_profile &operator=(const delegate_profile &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -24,6 +24,11 @@
 
 #include <mutex>
 
+#ifdef ENABLE_BUILD_TEST
+#include <atomic>
+#include <chrono>
+#endif
+
 #include <bfgsl.h>
 #include <bfdebug.h>
 #include <bfupperlower.h>
@@ -1203,6 +1208,72 @@ private:
         return false;
     }
 
+#ifdef ENABLE_BUILD_TEST
+
+public:
+
+    /// Lock Wait
+    ///
+    /// Only available to the unit tests. Returns the total time (in ns)
+    /// callers have spent blocked on this mmap's lock, and the number of
+    /// times a caller had to block, since the last reset_lock_wait().
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return {wait ns, number of waits}
+    ///
+    std::pair<uint64_t, uint64_t>
+    lock_wait() const noexcept
+    { return {m_mutex.wait_ns.load(), m_mutex.waits.load()}; }
+
+    /// Reset Lock Wait
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void
+    reset_lock_wait() noexcept
+    {
+        m_mutex.wait_ns = 0;
+        m_mutex.waits = 0;
+    }
+
+private:
+
+    struct mutex_type {
+        std::mutex mutex;
+        std::atomic<uint64_t> wait_ns{};
+        std::atomic<uint64_t> waits{};
+
+        void lock()
+        {
+            if (mutex.try_lock()) {
+                return;
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+            mutex.lock();
+
+            wait_ns += static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count()
+            );
+            waits++;
+        }
+
+        void unlock()
+        { mutex.unlock(); }
+    };
+
+#else
+
+private:
+
+    using mutex_type = std::mutex;
+
+#endif
+
 private:
 
     pair m_pml4;
@@ -1210,7 +1281,7 @@ private:
     pair m_pd;
     pair m_pt;
 
-    mutable std::mutex m_mutex;
+    mutable mutex_type m_mutex;
 
 public:
 
@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EXIT_HOTSPOT_ENTRY_INTEL_X64_EAPIS_H
+#define EXIT_HOTSPOT_ENTRY_INTEL_X64_EAPIS_H
+
+#include <cstdint>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// This header describes the exit hot spot entries and the CPUID interface
+// used to read them, and is shared with userspace (see bfack), so it must
+// not depend on anything from the VMM.
+//
+
+namespace eapis::intel_x64
+{
+
+/// Exit Hot Spots CPUID Leaf
+///
+/// Executing CPUID with this leaf in EAX and ECX = (index << 8) | op, where
+/// op is one of the exit_hotspot_op_t values, controls and reads the calling
+/// vCPU's hot spot table. CPUID exits for this leaf are never sampled.
+/// Calls made from outside of ring 0 return 0 in every register. User
+/// mode tools read the table through the bfack relay driver (see
+/// bfack/driver).
+///
+constexpr uint32_t exit_hotspot_cpuid_leaf = 0x4BF00012;
+
+/// Exit Hot Spots Table Size
+///
+/// The number of (reason, rip, cr3) tuples each vCPU tracks (K)
+///
+constexpr uint32_t exit_hotspot_num_entries = 64;
+
+/// Exit Hot Spot Operations
+///
+/// - info: EAX = sample period (0 = off), EBX = entries in use,
+///   ECX = exit_hotspot_num_entries, EDX = samples taken (low 32 bits)
+/// - set_period: sets the sample period to EDX (0 turns sampling off),
+///   clears the table, and returns the same as info
+/// - read_lo: EAX:EBX = rip, ECX:EDX = cr3 of entry index
+/// - read_hi: EAX:EBX = count, ECX = error, EDX = reason of entry index
+///
+/// Entries are not sorted, and reading an unused entry returns all 0.
+///
+enum exit_hotspot_op_t : uint32_t {
+    exit_hotspot_op_info = 0,
+    exit_hotspot_op_set_period = 1,
+    exit_hotspot_op_read_lo = 2,
+    exit_hotspot_op_read_hi = 3
+};
+
+/// Exit Hot Spot Entry
+///
+/// The table uses the space-saving algorithm: when it is full, a new tuple
+/// replaces the entry with the smallest count and inherits that count as
+/// its error. An entry's true number of samples is therefore somewhere in
+/// [count - error, count], and any tuple sampled more than
+/// (samples / exit_hotspot_num_entries) times is guaranteed to be present.
+///
+struct exit_hotspot_entry_t {
+    uint64_t rip;                   ///< Guest RIP at the time of the exit
+    uint64_t cr3;                   ///< Guest CR3 at the time of the exit
+    uint64_t count;                 ///< Number of samples (upper bound)
+    uint32_t error;                 ///< Overestimation of count
+    uint32_t reason;                ///< Basic exit reason
+};
+
+static_assert(sizeof(exit_hotspot_entry_t) == 32);
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EXIT_HOTSPOTS_INTEL_X64_EAPIS_H
+#define EXIT_HOTSPOTS_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <vector>
+
+#include "exit_hotspot_entry.h"
+#include "vmexit/cpuid.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// Exit Hot Spots
+///
+/// Attributes VM exits to the guest code that caused them. When sampling
+/// is on, every Nth exit is attributed to its (exit reason, guest RIP,
+/// guest CR3) tuple in a fixed-size, per-vCPU table that keeps the top-K
+/// tuples using the space-saving algorithm (see exit_hotspot_entry_t).
+///
+/// The table is open addressed, and entries are never removed (only
+/// replaced), so a lookup stops at the first empty slot, and only scans
+/// the whole table once it is full. Sampling is off by default, which
+/// costs a single branch per exit.
+///
+/// The table can be read from the VMM using hotspots(), or from the guest
+/// using CPUID (see exit_hotspot_cpuid_leaf), and the RIP / CR3 pairs can
+/// then be symbolized on the host.
+///
+class EXPORT_EAPIS_HVE exit_hotspot_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    exit_hotspot_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~exit_hotspot_handler() = default;
+
+public:
+
+    /// Set Sample Period
+    ///
+    /// Clears the table and samples one out of every period exits from
+    /// now on.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param period the number of exits per sample. 0 turns sampling off.
+    ///
+    void set_period(uint64_t period) noexcept;
+
+    /// Hot Spots
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the entries in use, sorted by count (largest first)
+    ///
+    std::vector<exit_hotspot_entry_t> hotspots() const;
+
+    /// Dump Hot Spots
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_hotspots() const;
+
+    /// @cond
+
+    bool handle_exit(gsl::not_null<vcpu_t *> vcpu);
+    bool handle_cpuid(gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    void sample(uint64_t reason, uint64_t rip, uint64_t cr3) noexcept;
+    void info(cpuid_handler::info_t &info) const noexcept;
+
+private:
+
+    uint64_t m_period{};
+    uint64_t m_countdown{};
+    uint64_t m_samples{};
+    uint64_t m_used{};
+
+    std::array<exit_hotspot_entry_t, exit_hotspot_num_entries> m_entries{};
+
+#ifdef ENABLE_BUILD_TEST
+    friend struct exit_hotspot_handler_test;
+#endif
+
+public:
+
+    /// @cond
+
+    exit_hotspot_handler(exit_hotspot_handler &&) = default;
+    exit_hotspot_handler &operator=(exit_hotspot_handler &&) = default;
+
+    exit_hotspot_handler(const exit_hotspot_handler &) = delete;
+    exit_hotspot_handler &operator=(const exit_hotspot_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,150 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EXIT_STATS_INTEL_X64_EAPIS_H
+#define EXIT_STATS_INTEL_X64_EAPIS_H
+
+#include <memory>
+
+#include "exit_stats_page.h"
+#include "vmexit/cpuid.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// Exit Stats
+///
+/// Counts VM exits per basic exit reason, and records how long each exit
+/// took to handle in a log2 histogram. An exit is timed from the start of
+/// the exit handler to the vCPU's VM entry delegate, so the latency
+/// includes every handler that ran for the exit, as well as any state
+/// that was loaded on the way back to the guest.
+///
+/// The counters live in a single page (see exit_stats_page_t) that is
+/// exported read-only to the guest using CPUID (see exit_stats_cpuid_leaf).
+/// Recording an exit takes a few arithmetic operations and does not lock
+/// or allocate.
+///
+class EXPORT_EAPIS_HVE exit_stats_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    exit_stats_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~exit_stats_handler() = default;
+
+public:
+
+    /// Record
+    ///
+    /// Closes the current exit, charging the ticks since the start of the
+    /// exit handler to the exit's reason. This is called by the vcpu just
+    /// before VM entry.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void record() noexcept;
+
+    /// Page
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the exit stats page for this vCPU
+    ///
+    const exit_stats_page_t &page() const noexcept
+    { return *m_page; }
+
+    /// Dump Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_stats() const;
+
+    /// @cond
+
+    bool handle_exit(gsl::not_null<vcpu_t *> vcpu);
+    bool handle_cpuid(gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    vcpu *m_vcpu;
+
+    uint64_t m_start{};
+    uint64_t m_reason{};
+
+    std::unique_ptr<exit_stats_page_t, void(*)(void *)> m_page;
+
+public:
+
+    /// @cond
+
+    exit_stats_handler(exit_stats_handler &&) = default;
+    exit_stats_handler &operator=(exit_stats_handler &&) = default;
+
+    exit_stats_handler(const exit_stats_handler &) = delete;
+    exit_stats_handler &operator=(const exit_stats_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
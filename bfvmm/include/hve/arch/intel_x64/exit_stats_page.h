@@ -0,0 +1,101 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EXIT_STATS_PAGE_INTEL_X64_EAPIS_H
+#define EXIT_STATS_PAGE_INTEL_X64_EAPIS_H
+
+#include <cstdint>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// This header describes the layout of the exit stats page, and is shared
+// with userspace (see bfack), so it must not depend on anything from the
+// VMM.
+//
+
+namespace eapis::intel_x64
+{
+
+/// Exit Stats CPUID Leaf
+///
+/// Executing CPUID with this leaf in EAX and a chunk index in ECX returns
+/// the 16 bytes of the calling vCPU's exit stats page found at
+/// (index * 16) in EAX, EBX, ECX and EDX. Indexes past the end of the
+/// page, and calls made from outside of ring 0, return 0. User mode tools
+/// read the page through the bfack relay driver (see bfack/driver).
+///
+constexpr uint32_t exit_stats_cpuid_leaf = 0x4BF00010;
+
+/// Exit Stats Magic ("EXIT")
+///
+constexpr uint32_t exit_stats_magic = 0x54495845;
+
+/// Exit Stats Version
+///
+constexpr uint32_t exit_stats_version = 1;
+
+/// Number of Exit Reasons
+///
+/// One slot per basic exit reason (0 to 64). Exits with a larger basic
+/// exit reason are counted in the last slot.
+///
+constexpr uint32_t exit_stats_num_reasons = 65;
+
+/// Number of Histogram Buckets
+///
+/// Bucket b counts exits whose latency (in TSC ticks) was in
+/// [2^(b + shift), 2^(b + shift + 1)). The first bucket also counts
+/// anything faster, and the last bucket anything slower.
+///
+constexpr uint32_t exit_stats_num_buckets = 12;
+
+/// Histogram Bucket Shift
+///
+constexpr uint32_t exit_stats_bucket_shift = 8;
+
+/// Exit Stats Page
+///
+/// Per-vCPU exit counters. The page is only written by the vCPU that owns
+/// it, from its own exit path, so no locking is needed. Histogram buckets
+/// are 32 bits wide and wrap, so rates should be computed from the
+/// difference between two samples.
+///
+struct exit_stats_page_t {
+    uint32_t magic;                 ///< exit_stats_magic
+    uint32_t version;               ///< exit_stats_version
+    uint32_t num_reasons;           ///< exit_stats_num_reasons
+    uint32_t num_buckets;           ///< exit_stats_num_buckets
+    uint64_t vcpuid;                ///< The id of the vCPU
+    uint64_t exits;                 ///< Total number of exits
+
+    uint64_t count[exit_stats_num_reasons];                             ///< Exits per reason
+    uint32_t hist[exit_stats_num_reasons][exit_stats_num_buckets];      ///< Latency per reason
+};
+
+static_assert(sizeof(exit_stats_page_t) <= 0x1000);
+
+}
+
+#endif
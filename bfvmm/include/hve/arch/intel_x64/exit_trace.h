@@ -0,0 +1,235 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EXIT_TRACE_INTEL_X64_EAPIS_H
+#define EXIT_TRACE_INTEL_X64_EAPIS_H
+
+#include <atomic>
+#include <memory>
+
+#include "exit_trace_record.h"
+#include "vmexit/cpuid.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// Exit Trace
+///
+/// Records every VM exit into a per-vCPU, single-producer / single-consumer
+/// ring of exit_trace_record_t. The vCPU that owns the ring is the only
+/// producer. The consumer is either the guest, draining the ring through
+/// CPUID (see exit_trace_cpuid_leaf), or the VMM using pop().
+///
+/// Tracing is off by default, and costs a single branch per exit while
+/// off. The ring is not allocated until the VMM arms tracing (see arm()),
+/// so a vCPU that is never traced does not pay for it, and the ring is
+/// never allocated from an exit. Once armed, the guest can turn tracing on
+/// and off through CPUID. While on, an exit costs a TSC read on the way in
+/// and, on the way out, another TSC read plus a handful of stores, as the
+/// exit reason and qualification are served by the VMCS cache. A record's
+/// ticks cover the time from the start of the exit handler to the start of
+/// the VM entry delegate.
+///
+/// The guest can only reach the ring from ring 0.
+///
+class EXPORT_EAPIS_HVE exit_trace_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    exit_trace_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~exit_trace_handler() = default;
+
+public:
+
+    /// Arm
+    ///
+    /// Allocates the ring, if that has not been done yet, which allows
+    /// the guest to enable tracing through CPUID. This must not be called
+    /// from an exit handler.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void arm();
+
+    /// Armed
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if the ring has been allocated, false otherwise
+    ///
+    bool armed() const noexcept
+    { return m_records != nullptr; }
+
+    /// Enable
+    ///
+    /// Arms tracing if needed, and starts recording exits. This must not be
+    /// called from an exit handler.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable();
+
+    /// Disable
+    ///
+    /// Stops recording exits. Records already in the ring are kept.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable() noexcept
+    { m_enabled = false; }
+
+    /// Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if exits are being recorded, false otherwise
+    ///
+    bool enabled() const noexcept
+    { return m_enabled; }
+
+    /// Record
+    ///
+    /// Closes the current exit, adding it to the ring. This is called by
+    /// the vcpu just before VM entry, while the exit's VMCS reads are still
+    /// cached.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void record() noexcept;
+
+    /// Pop
+    ///
+    /// Removes the oldest record from the ring. This may be called from
+    /// a different CPU than the one producing records.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param rec where to store the record
+    /// @return true if a record was removed, false if the ring was empty
+    ///
+    bool pop(exit_trace_record_t &rec) noexcept;
+
+    /// Pending
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of records in the ring
+    ///
+    uint64_t pending() const noexcept
+    { return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire); }
+
+    /// Dropped
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of records dropped because the ring was full
+    ///
+    uint64_t dropped() const noexcept
+    { return m_dropped; }
+
+    /// @cond
+
+    bool handle_exit(gsl::not_null<vcpu_t *> vcpu);
+    bool handle_cpuid(gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    void status(cpuid_handler::info_t &info) const noexcept;
+
+private:
+
+    vcpu *m_vcpu;
+
+    bool m_enabled{false};
+    bool m_skip{false};
+
+    uint64_t m_start{};
+    uint64_t m_rip{};
+    uint64_t m_dropped{};
+
+    std::atomic<uint64_t> m_head{};
+    std::atomic<uint64_t> m_tail{};
+
+    std::unique_ptr<exit_trace_record_t[]> m_records;
+
+public:
+
+    /// @cond
+
+    exit_trace_handler(exit_trace_handler &&) = delete;
+    exit_trace_handler &operator=(exit_trace_handler &&) = delete;
+
+    exit_trace_handler(const exit_trace_handler &) = delete;
+    exit_trace_handler &operator=(const exit_trace_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
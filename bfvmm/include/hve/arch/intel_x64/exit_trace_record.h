@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EXIT_TRACE_RECORD_INTEL_X64_EAPIS_H
+#define EXIT_TRACE_RECORD_INTEL_X64_EAPIS_H
+
+#include <cstdint>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// This header describes the exit trace records and the CPUID interface
+// used to drain them, and is shared with userspace (see bfack), so it must
+// not depend on anything from the VMM.
+//
+
+namespace eapis::intel_x64
+{
+
+/// Exit Trace CPUID Leaf
+///
+/// Executing CPUID with this leaf in EAX and one of the exit_trace_op_t
+/// values in ECX controls and drains the calling vCPU's trace ring. CPUID
+/// exits for this leaf are never recorded. Calls made from outside of
+/// ring 0 return 0 in every register. User mode tools drain the ring
+/// through the bfack relay driver (see bfack/driver).
+///
+constexpr uint32_t exit_trace_cpuid_leaf = 0x4BF00011;
+
+/// Exit Trace Version
+///
+constexpr uint32_t exit_trace_version = 1;
+
+/// Exit Trace Ring Size
+///
+/// The number of records each vCPU can hold (must be a power of 2). When
+/// the ring is full, new records are dropped and counted.
+///
+constexpr uint32_t exit_trace_num_records = 8192;
+
+/// Exit Trace Operations
+///
+/// - info: EAX = vcpuid, EBX = TSC frequency (kHz),
+///   ECX = exit_trace_num_records, EDX = exit_trace_version
+/// - status, enable, disable: EAX = 1 if enabled, EBX = pending records,
+///   ECX = dropped records (low 32 bits), EDX = 1 if the VMM has armed
+///   tracing. Enable has no effect until the VMM arms tracing (see
+///   vcpu::arm_exit_trace).
+/// - read_lo: EAX:EBX = tsc, ECX:EDX = rip of the oldest record, or all 0
+///   if the ring is empty
+/// - read_hi: EAX:EBX = qualification, ECX = ticks, EDX = reason |
+///   (flags << 16) of the oldest record, which is then removed
+///
+enum exit_trace_op_t : uint32_t {
+    exit_trace_op_info = 0,
+    exit_trace_op_status = 1,
+    exit_trace_op_enable = 2,
+    exit_trace_op_disable = 3,
+    exit_trace_op_read_lo = 4,
+    exit_trace_op_read_hi = 5
+};
+
+/// Exit Trace Flags
+///
+/// - advanced: the guest's RIP changed while handling the exit (i.e. the
+///   instruction was emulated rather than retried)
+///
+enum exit_trace_flag_t : uint16_t {
+    exit_trace_flag_advanced = 1U << 0
+};
+
+/// Exit Trace Record
+///
+struct exit_trace_record_t {
+    uint64_t tsc;                   ///< TSC at the start of the exit handler
+    uint64_t rip;                   ///< Guest RIP at the time of the exit
+    uint64_t qualification;         ///< Exit qualification
+    uint32_t ticks;                 ///< TSC ticks spent handling the exit
+    uint16_t reason;                ///< Basic exit reason
+    uint16_t flags;                 ///< exit_trace_flag_t
+};
+
+static_assert(sizeof(exit_trace_record_t) == 32);
+
+}
+
+#endif
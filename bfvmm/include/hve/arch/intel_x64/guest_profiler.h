@@ -0,0 +1,259 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GUEST_PROFILER_INTEL_X64_EAPIS_H
+#define GUEST_PROFILER_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "vmexit/preemption_timer.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// Guest Profiler
+///
+/// A statistical profiler for unmodified guests (including kernels). While
+/// running, a software timer on the vCPU's preemption timer fires every
+/// period, and each time it does, the guest's RIP, CR3 and CPL, and
+/// optionally a frame pointer walk of the guest's stack, are recorded into
+/// a per-vCPU sample buffer.
+///
+/// The overhead is bounded: the period cannot be shorter than
+/// min_period_ns, a stack walk maps at most max_depth guest frames, and the
+/// sample buffer is allocated once by start(). When the buffer is full,
+/// new samples are counted as dropped rather than recorded.
+///
+/// The stack walk assumes the guest was built with frame pointers. It is
+/// only done in 64-bit mode, and it stops at the first frame that is not
+/// mapped, is not write-back RAM according to the MTRRs, is not aligned,
+/// or does not move up the stack, so a guest without frame pointers simply
+/// yields shorter stacks.
+///
+/// The samples can be read using folded(), which aggregates them into the
+/// folded stack format (one "cr3;cpl;frame;...;rip count" line per unique
+/// stack) that flame graph tools consume.
+///
+class EXPORT_EAPIS_HVE guest_profiler
+{
+public:
+
+    /// The shortest supported sample period
+    ///
+    static constexpr uint64_t min_period_ns = 10000;
+
+    /// The deepest supported stack walk
+    ///
+    static constexpr std::size_t max_depth = 16;
+
+    /// The default number of samples the buffer can hold
+    ///
+    static constexpr std::size_t default_max_samples = 4096;
+
+    /// Sample
+    ///
+    /// frames[0] is the guest RIP, and frames[1] to frames[depth - 1] are
+    /// the return addresses found by the stack walk, innermost first.
+    ///
+    struct sample_t {
+        uint64_t cr3;
+        uint64_t cpl;
+        uint64_t depth;
+        std::array<uint64_t, max_depth + 1> frames;
+    };
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    guest_profiler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~guest_profiler() = default;
+
+public:
+
+    /// Start
+    ///
+    /// Clears the sample buffer and starts sampling the guest.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param period_ns the time between samples. Periods shorter than
+    ///     min_period_ns are rounded up to it.
+    /// @param depth the number of guest stack frames to walk per sample.
+    ///     0 records the RIP only. Depths above max_depth are capped.
+    /// @param max_samples the number of samples the buffer can hold
+    ///
+    void start(
+        uint64_t period_ns,
+        std::size_t depth = 0,
+        std::size_t max_samples = default_max_samples);
+
+    /// Stop
+    ///
+    /// Stops sampling. The samples are kept until the next start().
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void stop();
+
+    /// Running
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if the profiler is sampling, false otherwise
+    ///
+    bool running() const noexcept
+    { return m_running; }
+
+    /// Samples
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of samples in the buffer
+    ///
+    std::size_t samples() const noexcept
+    { return m_num_samples; }
+
+    /// Dropped
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of samples lost because the buffer was full
+    ///
+    uint64_t dropped() const noexcept
+    { return m_dropped; }
+
+    /// Sample
+    ///
+    /// @expects index < samples()
+    /// @ensures
+    ///
+    /// @param index the index of the sample to return
+    /// @return the sample at index
+    ///
+    const sample_t &sample(std::size_t index) const;
+
+    /// Folded
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the samples, aggregated into folded stack format
+    ///
+    std::string folded() const;
+
+    /// Dump Folded
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_folded() const;
+
+    /// @cond
+
+    void handle_timer(gsl::not_null<vcpu_t *> vcpu);
+
+    /// @endcond
+
+#ifndef ENABLE_BUILD_TEST
+private:
+#endif
+
+    void arm(uint64_t deadline_ns);
+    uint64_t walk(sample_t &sample) const;
+    bool frame_is_ram(uint64_t fp) const;
+
+    VIRTUAL bool is_ram(uint64_t gpa) const;
+    VIRTUAL std::pair<uint64_t, uint64_t> read_frame(uint64_t fp) const;
+
+#ifndef ENABLE_BUILD_TEST
+private:
+#endif
+
+    vcpu *m_vcpu;
+
+    bool m_running{};
+    uint64_t m_period_ns{};
+    uint64_t m_deadline_ns{};
+    std::size_t m_depth{};
+    preemption_timer_handler::timer_id_t m_timer_id{};
+
+    std::unique_ptr<sample_t[]> m_samples;
+    std::size_t m_max_samples{};
+    std::size_t m_num_samples{};
+    uint64_t m_dropped{};
+
+public:
+
+    /// @cond
+
+    guest_profiler(guest_profiler &&) = default;
+    guest_profiler &operator=(guest_profiler &&) = default;
+
+    guest_profiler(const guest_profiler &) = delete;
+    guest_profiler &operator=(const guest_profiler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
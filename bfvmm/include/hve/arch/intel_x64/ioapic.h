@@ -30,16 +30,20 @@ namespace eapis::intel_x64::ioapic
 {
 
 //
-// Each IOAPIC register is 32-bits, and each RTE is 64
-//
-// NOTE: the subfields have not been implemented yet
+// Each IOAPIC register is 32-bits, and each RTE is 64. The RTE for pin n
+// is accessed as two 32-bit registers through the window, with the low
+// dword at redtbl::indx + (n * 2) and the high dword right after it.
 //
 
 using reg_t = uint32_t;
 using rte_t = uint64_t;
 
+constexpr const auto default_base = 0xFEC00000ULL;
+constexpr const auto mmio_size = 0x1000ULL;
+
 constexpr const auto sel_offset = 0x00;
 constexpr const auto win_offset = 0x10;
+constexpr const auto eoi_offset = 0x40;
 
 namespace id
 {
@@ -128,6 +132,235 @@ namespace redtbl
 constexpr const auto name = "redtbl";
 constexpr const auto indx = 16;
 constexpr const auto size = 24;
+constexpr const auto reset_val = (1ULL << 16U);
+
+namespace vector
+{
+constexpr const auto name = "vector";
+constexpr const auto mask = 0x00000000000000FFULL;
+constexpr const auto from = 0ULL;
+
+inline auto get(rte_t val) noexcept
+{ return get_bits(val, mask) >> from; }
+
+inline void set(rte_t &rte, rte_t val) noexcept
+{ rte = set_bits(rte, mask, val << from); }
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{ bfdebug_subnhex(lev, name, get(val), msg); }
+}
+
+namespace delivery_mode
+{
+constexpr const auto name = "delivery_mode";
+constexpr const auto mask = 0x0000000000000700ULL;
+constexpr const auto from = 8ULL;
+
+constexpr const auto fixed = 0ULL;
+constexpr const auto lowest_priority = 1ULL;
+constexpr const auto smi = 2ULL;
+constexpr const auto nmi = 4ULL;
+constexpr const auto init = 5ULL;
+constexpr const auto extint = 7ULL;
+
+inline auto get(rte_t val) noexcept
+{ return get_bits(val, mask) >> from; }
+
+inline void set(rte_t &rte, rte_t val) noexcept
+{ rte = set_bits(rte, mask, val << from); }
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{
+    switch (get(val)) {
+        case fixed: bfdebug_subtext(lev, name, "fixed", msg); break;
+        case lowest_priority: bfdebug_subtext(lev, name, "lowest_priority", msg); break;
+        case smi: bfdebug_subtext(lev, name, "smi", msg); break;
+        case nmi: bfdebug_subtext(lev, name, "nmi", msg); break;
+        case init: bfdebug_subtext(lev, name, "init", msg); break;
+        case extint: bfdebug_subtext(lev, name, "extint", msg); break;
+
+        default:
+            bfalert_subtext(lev, name, "reserved", msg);
+            bfalert_subnhex(lev, "value", get(val), msg);
+    }
+}
+}
+
+namespace dest_mode
+{
+constexpr const auto name = "dest_mode";
+constexpr const auto mask = 0x0000000000000800ULL;
+constexpr const auto from = 11ULL;
+
+constexpr const auto physical = 0ULL;
+constexpr const auto logical = 1ULL;
+
+inline auto get(rte_t val) noexcept
+{ return get_bits(val, mask) >> from; }
+
+inline void set(rte_t &rte, rte_t val) noexcept
+{ rte = set_bits(rte, mask, val << from); }
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{
+    if (get(val) == physical) {
+        bfdebug_subtext(lev, name, "physical", msg);
+        return;
+    }
+    bfdebug_subtext(lev, name, "logical", msg);
+}
+}
+
+namespace delivery_status
+{
+constexpr const auto name = "delivery_status";
+constexpr const auto mask = 0x0000000000001000ULL;
+constexpr const auto from = 12ULL;
+
+constexpr const auto idle = 0ULL;
+constexpr const auto send_pending = 1ULL;
+
+inline auto get(rte_t val) noexcept
+{ return get_bits(val, mask) >> from; }
+
+inline void set(rte_t &rte, rte_t val) noexcept
+{ rte = set_bits(rte, mask, val << from); }
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{
+    if (get(val) == idle) {
+        bfdebug_subtext(lev, name, "idle", msg);
+        return;
+    }
+    bfdebug_subtext(lev, name, "send_pending", msg);
+}
+}
+
+namespace polarity
+{
+constexpr const auto name = "polarity";
+constexpr const auto mask = 0x0000000000002000ULL;
+constexpr const auto from = 13ULL;
+
+constexpr const auto active_high = 0ULL;
+constexpr const auto active_low = 1ULL;
+
+inline auto get(rte_t val) noexcept
+{ return get_bits(val, mask) >> from; }
+
+inline void set(rte_t &rte, rte_t val) noexcept
+{ rte = set_bits(rte, mask, val << from); }
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{
+    if (get(val) == active_high) {
+        bfdebug_subtext(lev, name, "active_high", msg);
+        return;
+    }
+    bfdebug_subtext(lev, name, "active_low", msg);
+}
+}
+
+namespace remote_irr
+{
+constexpr const auto name = "remote_irr";
+constexpr const auto mask = 0x0000000000004000ULL;
+constexpr const auto from = 14ULL;
+
+inline auto is_enabled(rte_t val)
+{ return is_bit_set(val, from); }
+
+inline auto is_disabled(rte_t val)
+{ return is_bit_cleared(val, from); }
+
+inline void enable(rte_t &val)
+{ val = set_bit(val, from); }
+
+inline void disable(rte_t &val)
+{ val = clear_bit(val, from); }
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{ bfdebug_subbool(lev, name, is_enabled(val), msg); }
+}
+
+namespace trigger_mode
+{
+constexpr const auto name = "trigger_mode";
+constexpr const auto mask = 0x0000000000008000ULL;
+constexpr const auto from = 15ULL;
+
+constexpr const auto edge = 0ULL;
+constexpr const auto level = 1ULL;
+
+inline auto get(rte_t val) noexcept
+{ return get_bits(val, mask) >> from; }
+
+inline void set(rte_t &rte, rte_t val) noexcept
+{ rte = set_bits(rte, mask, val << from); }
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{
+    if (get(val) == edge) {
+        bfdebug_subtext(lev, name, "edge", msg);
+        return;
+    }
+    bfdebug_subtext(lev, name, "level", msg);
+}
+}
+
+namespace mask_bit
+{
+constexpr const auto name = "mask_bit";
+constexpr const auto mask = 0x0000000000010000ULL;
+constexpr const auto from = 16ULL;
+
+inline auto is_enabled(rte_t val)
+{ return is_bit_set(val, from); }
+
+inline auto is_disabled(rte_t val)
+{ return is_bit_cleared(val, from); }
+
+inline void enable(rte_t &val)
+{ val = set_bit(val, from); }
+
+inline void disable(rte_t &val)
+{ val = clear_bit(val, from); }
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{ bfdebug_subbool(lev, name, is_enabled(val), msg); }
+}
+
+namespace destination
+{
+constexpr const auto name = "destination";
+constexpr const auto mask = 0xFF00000000000000ULL;
+constexpr const auto from = 56ULL;
+
+constexpr const auto broadcast = 0xFFULL;
+
+inline auto get(rte_t val) noexcept
+{ return get_bits(val, mask) >> from; }
+
+inline void set(rte_t &rte, rte_t val) noexcept
+{ rte = set_bits(rte, mask, val << from); }
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{ bfdebug_subnhex(lev, name, get(val), msg); }
+}
+
+inline void dump(int lev, rte_t val, std::string *msg = nullptr)
+{
+    bfdebug_nhex(lev, name, val, msg);
+    vector::dump(lev, val, msg);
+    delivery_mode::dump(lev, val, msg);
+    dest_mode::dump(lev, val, msg);
+    delivery_status::dump(lev, val, msg);
+    polarity::dump(lev, val, msg);
+    remote_irr::dump(lev, val, msg);
+    trigger_mode::dump(lev, val, msg);
+    mask_bit::dump(lev, val, msg);
+    destination::dump(lev, val, msg);
+}
 }
 }
 
@@ -34,6 +34,16 @@ namespace eapis::intel_x64::lapic
 //
 using value_t = uint32_t;
 
+//
+// In x2APIC mode, each register is accessed using an MSR instead of
+// MMIO. The MSR address is 0x800 + (offset >> 4), and since indx is
+// (offset >> 2), the MSR for a given indx is 0x800 + (indx >> 2).
+//
+constexpr const auto x2apic_base_msr = 0x800U;
+
+constexpr auto x2apic_msr(uint32_t indx) noexcept
+{ return x2apic_base_msr + (indx >> 2U); }
+
 inline void dump_delivery_status(int lev, value_t val, std::string *msg)
 {
     const auto name = "delivery_status";
@@ -1313,6 +1323,31 @@ namespace divide_config
 constexpr const auto name = "divide_config";
 constexpr const auto indx = (0x3E0U >> 2U);
 constexpr const auto reset_val = 0U;
+
+//
+// The divide value is encoded in bits 0, 1 and 3. A value of 0b111
+// divides by 1, and every other value n divides by 2^(n + 1).
+//
+namespace divide_shift
+{
+constexpr const auto mask = 0x0000000BU;
+constexpr const auto name = "divide_shift";
+
+inline auto get(value_t val) noexcept
+{
+    const auto n = (val & 0x3U) | ((val & 0x8U) >> 1U);
+    return (n + 1U) & 0x7U;
+}
+
+inline void dump(int lev, value_t val, std::string *msg = nullptr)
+{ bfdebug_subndec(lev, name, get(val), msg); }
+}
+
+inline void dump(int lev, value_t val, std::string *msg = nullptr)
+{
+    bfdebug_nhex(lev, name, val, msg);
+    divide_shift::dump(lev, val, msg);
+}
 }
 
 namespace self_ipi
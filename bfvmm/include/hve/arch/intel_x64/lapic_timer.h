@@ -0,0 +1,161 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef LAPIC_TIMER_INTEL_X64_EAPIS_H
+#define LAPIC_TIMER_INTEL_X64_EAPIS_H
+
+#include "lapic.h"
+#include "vmexit/rdmsr.h"
+#include "vmexit/wrmsr.h"
+#include "vmexit/preemption_timer.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// LAPIC Timer Handler
+///
+/// Emulates the guest's LAPIC timer on top of the vCPU's software timer
+/// service (see preemption_timer_handler). Writes to IA32_TSC_DEADLINE and
+/// to the x2APIC timer registers (LVT timer, initial count, current count
+/// and divide configuration) are trapped and never reach the physical
+/// LAPIC. Instead, a software timer is armed for the deadline, and the
+/// LVT timer vector is queued for injection when it expires. One-shot,
+/// periodic and TSC-deadline modes are supported.
+///
+/// The emulated timer counts at the provided frequency (defaults to the
+/// crystal clock reported by CPUID 0x15, or the bus clock), divided by the
+/// divide configuration register. Since the guest calibrates its LAPIC
+/// timer against another clock source, the frequency only has to be
+/// stable, not exact.
+///
+/// Note that xAPIC mode (MMIO) accesses are not trapped.
+///
+class EXPORT_EAPIS_HVE lapic_timer_handler
+{
+public:
+
+    using value_t = lapic::value_t;     ///< LAPIC register type
+
+    /// IA32_TSC_DEADLINE MSR address
+    ///
+    static constexpr const uint32_t ia32_tsc_deadline = 0x6E0;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this LAPIC timer handler
+    /// @param freq_hz the frequency of the emulated LAPIC timer (before
+    ///     the divide configuration is applied). If 0, a default
+    ///     frequency is used.
+    ///
+    lapic_timer_handler(
+        gsl::not_null<vcpu *> vcpu, uint64_t freq_hz = 0);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~lapic_timer_handler() = default;
+
+public:
+
+    /// @cond
+
+    bool handle_rdmsr(gsl::not_null<vcpu_t *> vcpu, rdmsr_handler::info_t &info);
+    bool handle_wrmsr(gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info);
+
+    void handle_expired(gsl::not_null<vcpu_t *> vcpu);
+
+    /// @endcond
+
+private:
+
+    void write_lvt(value_t val);
+    void write_initial_count(value_t val);
+    void write_tsc_deadline(uint64_t val);
+
+    value_t current_count() const;
+
+    void arm(uint64_t deadline_tsc);
+    void disarm();
+
+    uint64_t count_to_tsc(uint64_t count) const noexcept;
+    uint64_t tsc_to_count(uint64_t tsc) const noexcept;
+
+private:
+
+    vcpu *m_vcpu;
+    const time::clock *m_clock;
+
+    value_t m_lvt{lapic::lvt::reset_val};
+    value_t m_initial_count{lapic::initial_count::reset_val};
+    value_t m_divide_config{lapic::divide_config::reset_val};
+    uint64_t m_tsc_deadline{0};
+
+    bool m_armed{false};
+    uint64_t m_deadline{0};
+    uint64_t m_period{0};
+    preemption_timer_handler::timer_id_t m_timer_id{0};
+
+    uint64_t m_count_to_tsc_mult{0};
+    uint64_t m_tsc_to_count_mult{0};
+
+public:
+
+    /// @cond
+
+    lapic_timer_handler(lapic_timer_handler &&) = default;
+    lapic_timer_handler &operator=(lapic_timer_handler &&) = default;
+
+    lapic_timer_handler(const lapic_timer_handler &) = delete;
+    lapic_timer_handler &operator=(const lapic_timer_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,195 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STATIC_VCPU_INTEL_X64_EAPIS_H
+#define STATIC_VCPU_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <tuple>
+#include <type_traits>
+
+#include "vcpu.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+/// Static vCPU
+///
+/// An opt-in alternative to registering delegates with the eapis handler
+/// classes. A product lists its exit handlers as template arguments, and
+/// they are composed at compile time into a vcpu subclass. All of the
+/// handlers for a given exit reason are chained in template argument order
+/// into a single function that is registered with the base vCPU, so an exit
+/// costs one delegate call, and the chain itself (including each handler's
+/// handle function) can be fully inlined.
+///
+/// Each handler type must provide:
+/// - static constexpr vmcs_n::value_type exit_reason, the basic exit reason
+///   the handler is for
+/// - a constructor that takes a gsl::not_null<vcpu *>
+/// - bool handle(gsl::not_null<vcpu_t *> vcpu), which returns true if the
+///   exit was handled
+///
+/// If every handler in a chain returns false, the exit falls through to
+/// the delegates registered for that exit reason the usual way (including
+/// the eapis handler classes), so a static handler only needs to cover the
+/// hot cases.
+///
+/// Example:
+/// @code
+/// struct my_cpuid_handler {
+///     static constexpr auto exit_reason =
+///         vmcs_n::exit_reason::basic_exit_reason::cpuid;
+///
+///     explicit my_cpuid_handler(gsl::not_null<eapis::intel_x64::vcpu *> vcpu)
+///     { bfignored(vcpu); }
+///
+///     bool handle(gsl::not_null<vcpu_t *> vcpu)
+///     { ... }
+/// };
+///
+/// using my_vcpu = eapis::intel_x64::static_vcpu<my_cpuid_handler>;
+/// @endcode
+///
+template<typename... Handlers>
+class static_vcpu : public vcpu
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param id the id of this vcpu
+    /// @param vcpu_global_state a pointer to the vCPUs state
+    ///
+    explicit static_vcpu(
+        vcpuid::type id,
+        vcpu_global_state_t *vcpu_global_state = nullptr
+    ) :
+        vcpu{id, vcpu_global_state},
+        m_handlers{this->handler_arg<Handlers>()...}
+    {
+        (this->add_static_handler<Handlers>(), ...);
+    }
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~static_vcpu() override = default;
+
+    /// Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the instance of handler type H owned by this vcpu
+    ///
+    template<typename H>
+    H &handler() noexcept
+    { return std::get<H>(m_handlers); }
+
+private:
+
+    template<typename H>
+    gsl::not_null<vcpu *> handler_arg() noexcept
+    { return this; }
+
+    template<typename H>
+    static constexpr bool first_of_reason() noexcept
+    {
+        constexpr std::array<vmcs_n::value_type, sizeof...(Handlers)> reasons = {
+            Handlers::exit_reason...
+        };
+
+        constexpr std::array<bool, sizeof...(Handlers)> same = {
+            std::is_same_v<H, Handlers>...
+        };
+
+        for (std::size_t i = 0; i < reasons.size(); i++) {
+            if (reasons[i] == H::exit_reason) {
+                return same[i];
+            }
+        }
+
+        return false;
+    }
+
+    template<typename H>
+    void add_static_handler()
+    {
+        if constexpr (first_of_reason<H>()) {
+            constexpr auto reason = H::exit_reason;
+
+            this->add_handler(
+                reason,
+                ::handler_delegate_t::create<static_vcpu, &static_vcpu::dispatch<reason>>(this)
+            );
+        }
+    }
+
+    template<vmcs_n::value_type reason, typename H>
+    bool dispatch_one(gsl::not_null<vcpu_t *> vcpu)
+    {
+        if constexpr (H::exit_reason == reason) {
+            return std::get<H>(m_handlers).handle(vcpu);
+        }
+        else {
+            bfignored(vcpu);
+            return false;
+        }
+    }
+
+    template<vmcs_n::value_type reason>
+    bool dispatch(gsl::not_null<vcpu_t *> vcpu)
+    { return (this->dispatch_one<reason, Handlers>(vcpu) || ...); }
+
+private:
+
+    std::tuple<Handlers...> m_handlers;
+
+#ifdef ENABLE_BUILD_TEST
+    friend struct static_vcpu_test;
+#endif
+
+public:
+
+    /// @cond
+
+    static_vcpu(static_vcpu &&) = delete;
+    static_vcpu &operator=(static_vcpu &&) = delete;
+
+    static_vcpu(const static_vcpu &) = delete;
+    static_vcpu &operator=(const static_vcpu &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -30,6 +30,7 @@
 #ifndef TIME_INTEL_X64_EAPIS_H
 #define TIME_INTEL_X64_EAPIS_H
 
+#include <intrinsics.h>
 #include <arch/intel_x64/msrs.h>
 #include <arch/intel_x64/cpuid.h>
 #include "cpuid.h"
@@ -166,6 +167,224 @@ inline bool tsc_art_ratio_valid(uint32_t numerator)
 inline bool art_freq_valid(uint32_t freq)
 { return freq > 0; }
 
+//
+// CPUID 0x16 reports the processor base frequency in MHz. This is not
+// architecturally the TSC frequency, but on every processor with an
+// invariant TSC that also reports 0x16, the two are the same, which makes
+// it a reasonable fallback when 0x15 does not report the ART frequency.
+//
+inline uint32_t base_freq_MHz()
+{
+    auto [max, ebx, ecx, edx] = ::x64::cpuid::get(0, 0, 0, 0);
+
+    bfignored(ebx);
+    bfignored(ecx);
+    bfignored(edx);
+
+    if (max < 0x16) {
+        return 0;
+    }
+
+    auto [eax, unused1, unused2, unused3] = ::x64::cpuid::get(0x16, 0, 0, 0);
+
+    bfignored(unused1);
+    bfignored(unused2);
+    bfignored(unused3);
+
+    return eax & 0xFFFFU;
+}
+
+//
+// Computes the TSC frequency in Hz, trying each of the methods described
+// above in order:
+//
+// - MSR_PLATFORM_INFO, for known models
+// - cpuid.15H, when the ART frequency is reported
+// - cpuid.16H, as a last resort
+//
+// Returns 0 if none of the methods work.
+//
+inline uint64_t tsc_freq_hz()
+{
+    if (const auto bus = bus_freq_MHz(); bus != 0) {
+        return tsc_freq_MHz(bus) * 1000000ULL;
+    }
+
+    const auto num = tsc_art_numerator();
+    const auto den = tsc_art_denominator();
+    const auto art = art_freq_hz();
+
+    if (tsc_art_ratio_valid(num) && den != 0 && art_freq_valid(art)) {
+        return (static_cast<uint64_t>(art) * num) / den;
+    }
+
+    return static_cast<uint64_t>(base_freq_MHz()) * 1000000ULL;
+}
+
+/// Mult / Shift
+///
+/// Computes (val * mult) >> shift using a 128-bit intermediate, so that a
+/// conversion factor can be applied to any 64-bit value without a divide
+/// or an overflow.
+///
+inline uint64_t mul_shift(uint64_t val, uint64_t mult, uint64_t shift) noexcept
+{
+    const auto prod = static_cast<unsigned __int128>(val) * mult;
+    return static_cast<uint64_t>(prod >> shift);
+}
+
+/// Clock
+///
+/// A calibrated clock that is computed once per boot. The TSC and
+/// VMX-preemption timer frequencies are determined when the clock is
+/// created, and conversions between TSC ticks, PET ticks and nanoseconds
+/// are precomputed as multiply / shift pairs. None of the conversion
+/// functions divide, execute CPUID or read an MSR, so they are safe to use
+/// on the VM exit path.
+///
+class clock
+{
+public:
+
+    /// Fractional bits used by the multiply / shift pairs
+    ///
+    static constexpr const uint64_t shift = 32;
+
+    /// Constructor
+    ///
+    /// Calibrates the clock using the current CPU
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    clock() :
+        clock{time::tsc_freq_hz(), pet_decrement()}
+    { }
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tsc_freq_hz the frequency of the TSC in Hz
+    /// @param pet_shift the number of TSC bits per PET tick
+    ///
+    clock(uint64_t tsc_freq_hz, uint64_t pet_shift) noexcept :
+        m_tsc_freq_hz{tsc_freq_hz},
+        m_pet_shift{pet_shift}
+    {
+        if (m_tsc_freq_hz == 0) {
+            return;
+        }
+
+        m_tsc_to_ns_mult = static_cast<uint64_t>(
+            (static_cast<unsigned __int128>(1000000000ULL) << shift) / m_tsc_freq_hz
+        );
+
+        m_ns_to_tsc_mult = static_cast<uint64_t>(
+            (static_cast<unsigned __int128>(m_tsc_freq_hz) << shift) / 1000000000ULL
+        );
+    }
+
+    /// Valid
+    ///
+    /// @return true if the TSC frequency could be determined, false
+    ///     otherwise. If false, all conversions to and from nanoseconds
+    ///     return 0.
+    ///
+    bool valid() const noexcept
+    { return m_tsc_freq_hz != 0; }
+
+    /// TSC Frequency (Hz)
+    ///
+    /// @return the frequency of the TSC in Hz
+    ///
+    uint64_t tsc_freq_hz() const noexcept
+    { return m_tsc_freq_hz; }
+
+    /// PET Frequency (Hz)
+    ///
+    /// @return the frequency of the VMX-preemption timer in Hz
+    ///
+    uint64_t pet_freq_hz() const noexcept
+    { return m_tsc_freq_hz >> m_pet_shift; }
+
+    /// PET Shift
+    ///
+    /// @return the number of TSC bits per VMX-preemption timer tick
+    ///
+    uint64_t pet_shift() const noexcept
+    { return m_pet_shift; }
+
+    /// TSC to Nanoseconds
+    ///
+    /// @param tsc the number of TSC ticks to convert
+    /// @return the provided value in nanoseconds
+    ///
+    uint64_t tsc_to_ns(uint64_t tsc) const noexcept
+    { return mul_shift(tsc, m_tsc_to_ns_mult, shift); }
+
+    /// Nanoseconds to TSC
+    ///
+    /// @param ns the number of nanoseconds to convert
+    /// @return the provided value in TSC ticks
+    ///
+    uint64_t ns_to_tsc(uint64_t ns) const noexcept
+    { return mul_shift(ns, m_ns_to_tsc_mult, shift); }
+
+    /// TSC to PET
+    ///
+    /// @param tsc the number of TSC ticks to convert
+    /// @return the provided value in PET ticks
+    ///
+    uint64_t tsc_to_pet(uint64_t tsc) const noexcept
+    { return tsc >> m_pet_shift; }
+
+    /// PET to TSC
+    ///
+    /// @param pet the number of PET ticks to convert
+    /// @return the provided value in TSC ticks
+    ///
+    uint64_t pet_to_tsc(uint64_t pet) const noexcept
+    { return pet << m_pet_shift; }
+
+    /// PET to Nanoseconds
+    ///
+    /// @param pet the number of PET ticks to convert
+    /// @return the provided value in nanoseconds
+    ///
+    uint64_t pet_to_ns(uint64_t pet) const noexcept
+    { return this->tsc_to_ns(this->pet_to_tsc(pet)); }
+
+    /// Nanoseconds to PET
+    ///
+    /// @param ns the number of nanoseconds to convert
+    /// @return the provided value in PET ticks
+    ///
+    uint64_t ns_to_pet(uint64_t ns) const noexcept
+    { return this->tsc_to_pet(this->ns_to_tsc(ns)); }
+
+    /// Now
+    ///
+    /// @return the current TSC, in nanoseconds
+    ///
+    uint64_t now_ns() const noexcept
+    { return this->tsc_to_ns(::x64::read_tsc::get()); }
+
+private:
+
+    static uint64_t pet_decrement()
+    { return ::intel_x64::msrs::ia32_vmx_misc::preemption_timer_decrement::get(); }
+
+private:
+
+    uint64_t m_tsc_freq_hz{0};
+    uint64_t m_pet_shift{0};
+
+    uint64_t m_tsc_to_ns_mult{0};
+    uint64_t m_ns_to_tsc_mult{0};
+};
+
 }
 
 #endif
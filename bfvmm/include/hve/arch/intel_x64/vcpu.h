@@ -29,20 +29,35 @@
 #include "vmexit/ept_misconfiguration.h"
 #include "vmexit/ept_violation.h"
 #include "vmexit/external_interrupt.h"
+#if EAPIS_HVE_HLT
+#include "vmexit/hlt.h"
+#endif
 #include "vmexit/init_signal.h"
 #include "vmexit/interrupt_window.h"
 #include "vmexit/io_instruction.h"
 #include "vmexit/monitor_trap.h"
+#if EAPIS_HVE_PAUSE
+#include "vmexit/pause.h"
+#endif
 #include "vmexit/rdmsr.h"
+#if EAPIS_HVE_RDTSC
+#include "vmexit/rdtsc.h"
+#endif
 #include "vmexit/sipi_signal.h"
 #include "vmexit/preemption_timer.h"
 #include "vmexit/wrmsr.h"
 #include "vmexit/xsetbv.h"
 
+#include "bitmap.h"
 #include "ept.h"
+#include "exit_hotspots.h"
+#include "exit_stats.h"
+#include "guest_profiler.h"
+#include "exit_trace.h"
 #include "interrupt_queue.h"
 #include "lapic.h"
 #include "microcode.h"
+#include "vmcs_cache.h"
 #include "vcpu_global_state.h"
 #include "vpid.h"
 
@@ -128,6 +143,266 @@ public:
     ///
     VIRTUAL void disable_vpid();
 
+    //--------------------------------------------------------------------------
+    // Init Stats
+    //--------------------------------------------------------------------------
+
+    /// Dump Init Stats
+    ///
+    /// Prints the average time (in ns) each vcpu spent in each phase of
+    /// construction, over every vcpu that shares this vcpu's global state
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void dump_init_stats() const;
+
+    //--------------------------------------------------------------------------
+    // VMCS Cache
+    //--------------------------------------------------------------------------
+
+    /// VMCS Read
+    ///
+    /// Reads a VMCS field through the per-exit cache. See vmcs_cache for
+    /// which fields are safe to access this way.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the encoding of the VMCS field to read
+    /// @return the value of the field
+    ///
+    VIRTUAL vmcs_n::value_type vmcs_read(vmcs_n::value_type addr);
+
+    /// VMCS Write
+    ///
+    /// Writes a VMCS field through the per-exit cache. The write reaches
+    /// the VMCS just before the next VM entry.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the encoding of the VMCS field to write
+    /// @param val the value to write
+    ///
+    VIRTUAL void vmcs_write(vmcs_n::value_type addr, vmcs_n::value_type val);
+
+    /// VMCS Set Bits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the encoding of the VMCS field to modify
+    /// @param mask the bits to set
+    ///
+    VIRTUAL void vmcs_set_bits(vmcs_n::value_type addr, vmcs_n::value_type mask);
+
+    /// VMCS Clear Bits
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the encoding of the VMCS field to modify
+    /// @param mask the bits to clear
+    ///
+    VIRTUAL void vmcs_clear_bits(vmcs_n::value_type addr, vmcs_n::value_type mask);
+
+    /// VMCS Cache Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the VMCS cache counters for this vCPU
+    ///
+    VIRTUAL const vmcs_cache::stats_t &vmcs_cache_stats() const;
+
+    //--------------------------------------------------------------------------
+    // Exit Stats
+    //--------------------------------------------------------------------------
+
+    /// Exit Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the exit counters and latency histograms for this vCPU.
+    ///     See exit_stats_handler for more information.
+    ///
+    VIRTUAL const exit_stats_page_t &exit_stats() const;
+
+    /// Dump Exit Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void dump_exit_stats() const;
+
+    //--------------------------------------------------------------------------
+    // Exit Trace
+    //--------------------------------------------------------------------------
+
+    /// Arm Exit Trace
+    ///
+    /// Allocates this vCPU's trace ring so that the guest can turn tracing
+    /// on and off through CPUID (e.g. using bfack's exit_trace). Must not
+    /// be called from an exit handler. See exit_trace_handler for more
+    /// information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void arm_exit_trace();
+
+    /// Enable Exit Trace
+    ///
+    /// Arms tracing if needed, and starts recording every VM exit into
+    /// this vCPU's trace ring. Must not be called from an exit handler.
+    /// See exit_trace_handler for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void enable_exit_trace();
+
+    /// Disable Exit Trace
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_exit_trace();
+
+    /// Pop Exit Trace
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param rec where to store the oldest record in the trace ring
+    /// @return true if a record was removed, false if the ring was empty
+    ///
+    VIRTUAL bool pop_exit_trace(exit_trace_record_t &rec);
+
+    //--------------------------------------------------------------------------
+    // Exit Hot Spots
+    //--------------------------------------------------------------------------
+
+    /// Set Exit Hot Spot Period
+    ///
+    /// Clears this vCPU's hot spot table and attributes one out of every
+    /// period exits to the guest code that caused it. See
+    /// exit_hotspot_handler for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param period the number of exits per sample. 0 turns sampling off.
+    ///
+    VIRTUAL void set_exit_hotspot_period(uint64_t period);
+
+    /// Exit Hot Spots
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the sampled (reason, rip, cr3) tuples, largest count first
+    ///
+    VIRTUAL std::vector<exit_hotspot_entry_t> exit_hotspots() const;
+
+    /// Dump Exit Hot Spots
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void dump_exit_hotspots() const;
+
+    //--------------------------------------------------------------------------
+    // Guest Profiler
+    //--------------------------------------------------------------------------
+
+    /// Start Guest Profiler
+    ///
+    /// Clears this vCPU's profile and starts sampling the guest's RIP, CR3,
+    /// CPL and (optionally) stack. See guest_profiler for more
+    /// information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param period_ns the time between samples
+    /// @param depth the number of guest stack frames to walk per sample
+    /// @param max_samples the number of samples the profile can hold
+    ///
+    VIRTUAL void start_guest_profiler(
+        uint64_t period_ns,
+        std::size_t depth = 0,
+        std::size_t max_samples = guest_profiler::default_max_samples);
+
+    /// Stop Guest Profiler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void stop_guest_profiler();
+
+    /// Guest Profile
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return this vCPU's samples, in folded stack format
+    ///
+    VIRTUAL std::string guest_profile() const;
+
+    /// Dump Guest Profile
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void dump_guest_profile() const;
+
+    //--------------------------------------------------------------------------
+    // Delegate Profiling
+    //--------------------------------------------------------------------------
+
+    /// Enable Delegate Profiling
+    ///
+    /// Turns on the delegate profile of every handler class. See
+    /// delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void enable_delegate_profiling();
+
+    /// Disable Delegate Profiling
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_delegate_profiling();
+
+    /// Handler Profile
+    ///
+    /// Example:
+    /// @code
+    /// vcpu->handler_profile("rdmsr").dump();
+    /// @endcode
+    ///
+    /// @expects name is the name of a profiled handler (e.g. "cpuid",
+    ///     "rdmsr", "wrmsr", "io instruction", "ept violation", ...)
+    /// @ensures
+    ///
+    /// @param name the name of the handler
+    /// @return the delegate profile of the handler
+    ///
+    VIRTUAL delegate_profile &handler_profile(const std::string &name);
+
+    /// Dump Delegate Profiles
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void dump_delegate_profiles();
+
     //==========================================================================
     // Helpers
     //==========================================================================
@@ -171,13 +446,23 @@ public:
     /// @expects
     /// @ensures
     ///
-    /// @param mask the CR0 enable/disable mask
+    /// @param mask the CR0 bits the delegate is interested in
     /// @param d the delegate to call when a mov-to-cr0 exit occurs
     ///
     VIRTUAL void add_wrcr0_handler(
         vmcs_n::value_type mask,
         const control_register_handler::handler_delegate_t &d);
 
+    /// Remove Write CR0 Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate previously passed to add_wrcr0_handler
+    ///
+    VIRTUAL void remove_wrcr0_handler(
+        const control_register_handler::handler_delegate_t &d);
+
     /// Add Read CR3 Handler
     ///
     /// @expects
@@ -203,13 +488,51 @@ public:
     /// @expects
     /// @ensures
     ///
-    /// @param mask the CR0 enable/disable mask
+    /// @param mask the CR4 bits the delegate is interested in
     /// @param d the delegate to call when a mov-to-cr4 exit occurs
     ///
     VIRTUAL void add_wrcr4_handler(
         vmcs_n::value_type mask,
         const control_register_handler::handler_delegate_t &d);
 
+    /// Remove Write CR4 Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate previously passed to add_wrcr4_handler
+    ///
+    VIRTUAL void remove_wrcr4_handler(
+        const control_register_handler::handler_delegate_t &d);
+
+    /// Add CR3 Target
+    ///
+    /// Writes to CR3 of a value in the CR3-target list do not exit, even
+    /// when a write CR3 handler has been added.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param val the CR3 value to add to the target list
+    ///
+    VIRTUAL void add_cr3_target(vmcs_n::value_type val);
+
+    /// Remove CR3 Target
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param val the CR3 value to remove from the target list
+    ///
+    VIRTUAL void remove_cr3_target(vmcs_n::value_type val);
+
+    /// Clear CR3 Targets
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void clear_cr3_targets();
+
     //--------------------------------------------------------------------------
     // CPUID
     //--------------------------------------------------------------------------
@@ -344,6 +667,32 @@ public:
     VIRTUAL void add_external_interrupt_handler(
         const external_interrupt_handler::handler_delegate_t &d);
 
+    /// Add External Interrupt Handler (Vector)
+    ///
+    /// Turns on external interrupt handling and adds an external interrupt
+    /// handler for a single vector. Vectors without a handler are
+    /// reflected to the guest.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector to handle
+    /// @param d the delegate to call when an exit occurs
+    ///
+    VIRTUAL void add_external_interrupt_handler(
+        uint64_t vector, const external_interrupt_handler::handler_delegate_t &d);
+
+    /// Set External Interrupt Route
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector to route
+    /// @param route what to do when the vector is trapped
+    ///
+    VIRTUAL void set_external_interrupt_route(
+        uint64_t vector, external_interrupt_handler::route_t route);
+
     /// Disable External Interrupt Support
     ///
     /// @expects
@@ -396,6 +745,90 @@ public:
     ///
     VIRTUAL void inject_external_interrupt(uint64_t vector);
 
+    /// Has Pending Interrupts
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if external interrupts are queued for injection,
+    ///     false otherwise
+    ///
+    VIRTUAL bool has_pending_interrupts() const;
+
+#if EAPIS_HVE_HLT
+
+    //--------------------------------------------------------------------------
+    // HLT / MWAIT / MONITOR
+    //--------------------------------------------------------------------------
+
+    /// Enable HLT Exiting
+    ///
+    /// Turns on HLT exiting. Idle vCPUs poll for a wake-up event for an
+    /// adaptive window before going to sleep. See hlt_handler for more
+    /// information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void enable_hlt_exiting();
+
+    /// Disable HLT Exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_hlt_exiting();
+
+    /// Enable MWAIT Exiting
+    ///
+    /// Turns on MWAIT and MONITOR exiting. MWAIT polls like HLT, but never
+    /// puts the vCPU to sleep. See hlt_handler for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void enable_mwait_exiting();
+
+    /// Disable MWAIT Exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_mwait_exiting();
+
+    /// Add Wake Delegate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call while an idle vCPU polls for a
+    ///     wake-up event
+    ///
+    VIRTUAL void add_wake_delegate(
+        const hlt_handler::wake_delegate_t &d);
+
+    /// Set HLT Poll Window
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param start_ns the window used the first time the window grows
+    /// @param max_ns the largest the window is allowed to get. A value
+    ///     of 0 turns off polling.
+    ///
+    VIRTUAL void set_hlt_poll_window(uint64_t start_ns, uint64_t max_ns);
+
+    /// HLT Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the idle counters for this vCPU
+    ///
+    VIRTUAL const hlt_handler::stats_t &hlt_stats() const;
+
+#endif
+
     //--------------------------------------------------------------------------
     // IO Instruction
     //--------------------------------------------------------------------------
@@ -487,6 +920,55 @@ public:
     ///
     VIRTUAL void enable_monitor_trap_flag();
 
+#if EAPIS_HVE_PAUSE
+
+    //--------------------------------------------------------------------------
+    // PAUSE-loop Exiting
+    //--------------------------------------------------------------------------
+
+    /// Enable PAUSE-loop Exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gap the maximum number of TSC cycles between two PAUSE
+    ///     instructions for them to be considered the same loop
+    /// @param window the number of TSC cycles a loop must spin before
+    ///     a VM exit is generated
+    ///
+    VIRTUAL void enable_pause_loop_exiting(
+        uint64_t gap = pause_handler::default_gap,
+        uint64_t window = pause_handler::default_window);
+
+    /// Disable PAUSE-loop Exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_pause_loop_exiting();
+
+    /// Add Yield Delegate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when lock-holder preemption is
+    ///     suspected
+    ///
+    VIRTUAL void add_yield_delegate(
+        const pause_handler::yield_delegate_t &d);
+
+    /// PAUSE-loop Exiting Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the PLE counters for this vCPU
+    ///
+    VIRTUAL const pause_handler::stats_t &pause_loop_stats() const;
+
+#endif
+
     //--------------------------------------------------------------------------
     // Read MSR
     //--------------------------------------------------------------------------
@@ -566,6 +1048,84 @@ public:
     VIRTUAL void add_default_rdmsr_handler(
         const ::handler_delegate_t &d);
 
+#if EAPIS_HVE_RDTSC
+
+    //--------------------------------------------------------------------------
+    // RDTSC
+    //--------------------------------------------------------------------------
+
+    /// Add RDTSC Handler
+    ///
+    /// Turns on RDTSC / RDTSCP exiting and adds a handler. This should only
+    /// be used when the guest's TSC cannot be described using an offset
+    /// and a multiplier, as every TSC read will cause a VM exit.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when the guest executes rdtsc(p)
+    ///
+    VIRTUAL void add_rdtsc_handler(
+        const rdtsc_handler::handler_delegate_t &d);
+
+    /// Set TSC Offset
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param offset the value added to the (scaled) host TSC
+    ///
+    VIRTUAL void set_tsc_offset(uint64_t offset);
+
+    /// Set TSC Multiplier
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param multiplier the TSC multiplier (48 fractional bits)
+    ///
+    VIRTUAL void set_tsc_multiplier(uint64_t multiplier);
+
+    /// Set TSC Aux
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param val the value of this vCPU's IA32_TSC_AUX shadow
+    ///
+    VIRTUAL void set_tsc_aux(uint64_t val);
+
+    /// Guest TSC
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the current TSC as seen by the guest
+    ///
+    VIRTUAL uint64_t guest_tsc() const;
+
+    /// Host TSC
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param guest_tsc a TSC value as seen by the guest
+    /// @return the earliest host TSC value at which the guest's TSC
+    ///     reaches guest_tsc
+    ///
+    VIRTUAL uint64_t host_tsc(uint64_t guest_tsc) const;
+
+    /// Set TSC Deadline Emulated
+    ///
+    /// See rdtsc_handler::set_tsc_deadline_emulated.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void set_tsc_deadline_emulated();
+
+#endif
+
     //--------------------------------------------------------------------------
     // Write MSR
     //--------------------------------------------------------------------------
@@ -659,6 +1219,19 @@ public:
     VIRTUAL void add_xsetbv_handler(
         const xsetbv_handler::handler_delegate_t &d);
 
+    /// Save Guest Extended State
+    ///
+    /// Must be called before the VMM uses any of the XSAVE state components
+    /// in mask (e.g. xsetbv_handler::xstate_avx512). The guest's state is
+    /// restored automatically before the next VM entry.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mask the XCR0 state components the VMM is about to use
+    ///
+    VIRTUAL void save_guest_xstate(uint64_t mask);
+
     //--------------------------------------------------------------------------
     // VMX preemption timer
     //--------------------------------------------------------------------------
@@ -706,6 +1279,55 @@ public:
     ///
     VIRTUAL void disable_preemption_timer();
 
+    /// Add Timer
+    ///
+    /// Adds a one-shot software timer that is multiplexed on the VMX
+    /// preemption timer. See preemption_timer_handler::add_timer.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param deadline_ns the absolute deadline, in the same time base
+    ///     as now_ns()
+    /// @param d the delegate to call when the timer expires
+    /// @return an id that can be passed to cancel_timer()
+    ///
+    VIRTUAL preemption_timer_handler::timer_id_t add_timer(
+        uint64_t deadline_ns, const preemption_timer_handler::timer_delegate_t &d);
+
+    /// Add Timer (TSC)
+    ///
+    /// See preemption_timer_handler::add_timer_tsc.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param deadline_tsc the absolute deadline, in host TSC ticks
+    /// @param d the delegate to call when the timer expires
+    /// @return an id that can be passed to cancel_timer()
+    ///
+    VIRTUAL preemption_timer_handler::timer_id_t add_timer_tsc(
+        uint64_t deadline_tsc, const preemption_timer_handler::timer_delegate_t &d);
+
+    /// Cancel Timer
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param id the id returned by add_timer()
+    ///
+    VIRTUAL void cancel_timer(preemption_timer_handler::timer_id_t id);
+
+    /// Now
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the current time in nanoseconds, as seen by the software
+    ///     timer service
+    ///
+    VIRTUAL uint64_t now_ns() const;
+
     //==========================================================================
     // Resources
     //==========================================================================
@@ -1416,14 +2038,23 @@ private:
 
     uintptr_t get_entry(uintptr_t tble_gpa, std::ptrdiff_t index);
 
+    void vmentry_delegate(bfobject *obj);
+    vcpu *init_step(vcpu_init_step_t step) noexcept;
+    std::vector<delegate_profile *> delegate_profiles();
+
 private:
 
+    uint64_t m_init_tsc{};
+    vcpu_init_step_t m_init_step{};
+
     ept::mmap *m_mmap{};
     vcpu_global_state_t *m_vcpu_global_state;
 
-    std::unique_ptr<uint8_t, void(*)(void *)> m_msr_bitmap;
-    std::unique_ptr<uint8_t, void(*)(void *)> m_io_bitmap_a;
-    std::unique_ptr<uint8_t, void(*)(void *)> m_io_bitmap_b;
+    vmcs_cache m_vmcs_cache;
+
+    bitmap m_msr_bitmap;
+    bitmap m_io_bitmap_a;
+    bitmap m_io_bitmap_b;
 
 private:
 
@@ -1431,13 +2062,22 @@ private:
     cpuid_handler m_cpuid_handler;
     io_instruction_handler m_io_instruction_handler;
     monitor_trap_handler m_monitor_trap_handler;
+#if EAPIS_HVE_PAUSE
+    pause_handler m_pause_handler;
+#endif
     rdmsr_handler m_rdmsr_handler;
+#if EAPIS_HVE_RDTSC
+    rdtsc_handler m_rdtsc_handler;
+#endif
     wrmsr_handler m_wrmsr_handler;
     xsetbv_handler m_xsetbv_handler;
 
     ept_misconfiguration_handler m_ept_misconfiguration_handler;
     ept_violation_handler m_ept_violation_handler;
     external_interrupt_handler m_external_interrupt_handler;
+#if EAPIS_HVE_HLT
+    hlt_handler m_hlt_handler;
+#endif
     init_signal_handler m_init_signal_handler;
     interrupt_window_handler m_interrupt_window_handler;
     sipi_signal_handler m_sipi_signal_handler;
@@ -1446,6 +2086,10 @@ private:
     microcode_handler m_microcode_handler;
     vpid_handler m_vpid_handler;
     preemption_timer_handler m_preemption_timer_handler;
+    exit_trace_handler m_exit_trace_handler;
+    exit_hotspot_handler m_exit_hotspot_handler;
+    exit_stats_handler m_exit_stats_handler;
+    guest_profiler m_guest_profiler;
 
 private:
 
@@ -1453,6 +2097,10 @@ private:
     friend class rdmsr_handler;
     friend class wrmsr_handler;
 
+#ifdef ENABLE_BUILD_TEST
+    friend struct vcpu_test;
+#endif
+
 public:
 
     /// @cond
@@ -22,11 +22,74 @@
 #ifndef VCPU_GLOBAL_STATE_INTEL_X64_EAPIS_H
 #define VCPU_GLOBAL_STATE_INTEL_X64_EAPIS_H
 
+#include <array>
+#include <atomic>
+
 #include <intrinsics.h>
+#include "time.h"
 
 namespace eapis::intel_x64
 {
 
+/// vCPU Init Step
+///
+/// The phases of eapis vcpu construction that are timed. Each handler is
+/// its own step, and "body" is the remainder of the vcpu's constructor.
+///
+enum class vcpu_init_step_t : std::size_t {
+    vmcs_cache,
+    control_register,
+    cpuid,
+    io_instruction,
+    monitor_trap,
+    pause,
+    rdmsr,
+    rdtsc,
+    wrmsr,
+    xsetbv,
+    ept_misconfiguration,
+    ept_violation,
+    external_interrupt,
+    hlt,
+    init_signal,
+    interrupt_window,
+    sipi_signal,
+    ept,
+    microcode,
+    vpid,
+    preemption_timer,
+    exit_trace,
+    exit_hotspots,
+    exit_stats,
+    guest_profiler,
+    body,
+    num_steps
+};
+
+/// Number of vCPU Init Steps
+///
+constexpr auto num_vcpu_init_steps =
+    static_cast<std::size_t>(vcpu_init_step_t::num_steps);
+
+/// Supported XCR0
+///
+/// @expects
+/// @ensures
+///
+/// @return the XCR0 state components supported by the processor, as
+///     reported by CPUID.(EAX=0DH,ECX=0):EDX:EAX
+///
+inline uint64_t
+supported_xcr0()
+{
+    auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0xD, 0, 0, 0);
+
+    bfignored(ebx);
+    bfignored(ecx);
+
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+}
+
 /// VM Global State
 ///
 /// The APIs require global variables that "group" up vcpus into VMs.
@@ -59,6 +122,72 @@ struct vcpu_global_state_t {
     uint64_t ia32_vmx_cr4_fixed0 {
         ::intel_x64::msrs::ia32_vmx_cr4_fixed0::get()
     };
+
+    /// Host XCR0
+    ///
+    /// The XCR0 value the VMM switches to when it needs extended state
+    /// that the guest has not enabled (see xsetbv_handler). This defaults
+    /// to every state component the processor supports, as reported by
+    /// CPUID.(EAX=0DH,ECX=0):EDX:EAX, and may be narrowed per VM.
+    ///
+    uint64_t host_xcr0 {
+        supported_xcr0()
+    };
+
+    /// Clock
+    ///
+    /// The calibrated clock used to convert between TSC ticks, PET ticks
+    /// and nanoseconds. This is calibrated once when the global state is
+    /// created.
+    ///
+    time::clock clock{};
+
+    /// Init Ticks
+    ///
+    /// The total number of TSC ticks spent in each vcpu_init_step_t,
+    /// accumulated over every vcpu constructed with this global state.
+    ///
+    std::array<std::atomic<uint64_t>, num_vcpu_init_steps> init_ticks{};
+
+    /// Init Count
+    ///
+    /// The number of vcpus accounted for in init_ticks
+    ///
+    std::atomic<uint64_t> init_count{0};
+
+    /// PLE Slots
+    ///
+    /// One bit for each slot that is claimed by a pause handler. A vCPU
+    /// that finds all 64 slots claimed does not take part in lock-holder
+    /// selection.
+    ///
+    std::atomic<uint64_t> ple_slots{0};
+
+    /// PLE vCPUs
+    ///
+    /// One bit for each claimed slot whose vCPU id has been published in
+    /// ple_ids, i.e. each vCPU that can be handed out as a candidate
+    ///
+    std::atomic<uint64_t> ple_vcpus{0};
+
+    /// PLE Spinning
+    ///
+    /// One bit for each slot whose vCPU is currently in a streak of PLE
+    /// exits, i.e. that is most likely waiting on a lock
+    ///
+    std::atomic<uint64_t> ple_spinning{0};
+
+    /// PLE Last Boosted
+    ///
+    /// The bit of the last vCPU handed out as a lock-holder candidate
+    ///
+    std::atomic<uint64_t> ple_last_boosted{0};
+
+    /// PLE IDs
+    ///
+    /// The id of the vCPU that owns each slot
+    ///
+    std::array<std::atomic<uint64_t>, 64> ple_ids{};
 };
 
 /// VM Global State Instance
@@ -0,0 +1,302 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef VIOAPIC_INTEL_X64_EAPIS_H
+#define VIOAPIC_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <atomic>
+#include <list>
+#include <mutex>
+
+#include "ioapic.h"
+#include "vmexit/ept_violation.h"
+#include "vmexit/wrmsr.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// Virtual IOAPIC
+///
+/// Emulates an IOAPIC for the guest. The MMIO window is trapped using EPT
+/// read / write violations on each vCPU that is added, and the select /
+/// window registers, the redirection table and the EOI register are all
+/// emulated in software. Interrupts are routed directly to the interrupt
+/// queue of the target vCPU(s), so device interrupts never have to bounce
+/// through the physical IOAPIC.
+///
+/// Delivery to a vCPU is posted to a per-vCPU pending bitmap, and the
+/// bitmap is drained into that vCPU's interrupt queue by the vCPU itself
+/// (on its next VM exit, while it polls in an idle loop, or right away if
+/// the vCPU is the one that triggered the delivery). This way, a vCPU
+/// never touches another vCPU's VMCS. The handlers registered on each vCPU
+/// are bound to that vCPU's target, so the exit path only ever touches its
+/// own pending bitmap, and never takes the IOAPIC's lock.
+///
+/// EOIs are taken from writes to the x2APIC EOI MSR. A vector delivered by
+/// the vioapic is tracked as in service from the time it is queued, and an
+/// EOI that belongs to it (i.e. it is higher than anything in service in
+/// the physical local APIC) is consumed here, and broadcast to the
+/// redirection table. EOIs written through the xAPIC MMIO page are not
+/// seen.
+///
+/// Only the fixed and lowest priority delivery modes are supported. In
+/// logical destination mode, the flat model is assumed, meaning bit n of
+/// the destination selects the vCPU with APIC id n.
+///
+class EXPORT_EAPIS_HVE vioapic
+{
+public:
+
+    using reg_t = ioapic::reg_t;            ///< Register type
+    using rte_t = ioapic::rte_t;            ///< Redirection table entry type
+    using pin_t = uint64_t;                 ///< Interrupt pin type
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param base the guest physical address of the MMIO window
+    /// @param id the IOAPIC id reported to the guest
+    ///
+    vioapic(
+        uintptr_t base = ioapic::default_base,
+        reg_t id = 0
+    );
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~vioapic() = default;
+
+public:
+
+    /// Add vCPU
+    ///
+    /// Adds a vCPU as a possible interrupt destination, and registers the
+    /// EPT violation handlers used to emulate the MMIO window, and the EOI
+    /// MSR handler on it. The
+    /// IOAPIC page must be mapped in the vCPU's EPT with read and write
+    /// access removed for the MMIO window to trap.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to add
+    /// @param apic_id the (x2)APIC id of the vCPU
+    ///
+    void add_vcpu(gsl::not_null<vcpu *> vcpu, uint64_t apic_id);
+
+    /// Set IRQ
+    ///
+    /// Sets the level of an input pin. Edge triggered pins deliver on the
+    /// rising edge, while level triggered pins deliver while asserted and
+    /// remote IRR is clear.
+    ///
+    /// @expects pin < ioapic::redtbl::size
+    /// @ensures
+    ///
+    /// @param pin the input pin
+    /// @param level true if the pin is asserted, false otherwise
+    ///
+    void set_irq(pin_t pin, bool level);
+
+    /// Assert IRQ
+    ///
+    /// @expects pin < ioapic::redtbl::size
+    /// @ensures
+    ///
+    /// @param pin the input pin to assert
+    ///
+    void assert_irq(pin_t pin)
+    { this->set_irq(pin, true); }
+
+    /// Deassert IRQ
+    ///
+    /// @expects pin < ioapic::redtbl::size
+    /// @ensures
+    ///
+    /// @param pin the input pin to deassert
+    ///
+    void deassert_irq(pin_t pin)
+    { this->set_irq(pin, false); }
+
+    /// EOI
+    ///
+    /// Handles an EOI broadcast from a local APIC. Any level triggered
+    /// entry programmed with the provided vector has its remote IRR
+    /// cleared, and is delivered again if its pin is still asserted.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector being EOI'd
+    ///
+    void eoi(uint64_t vector);
+
+    /// Read
+    ///
+    /// Emulates a 32-bit read from the MMIO window
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param offset the offset into the MMIO window
+    /// @return the value read
+    ///
+    reg_t read(uint64_t offset);
+
+    /// Write
+    ///
+    /// Emulates a 32-bit write to the MMIO window
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param offset the offset into the MMIO window
+    /// @param val the value to write
+    ///
+    void write(uint64_t offset, reg_t val);
+
+    /// RTE
+    ///
+    /// @expects pin < ioapic::redtbl::size
+    /// @ensures
+    ///
+    /// @param pin the input pin
+    /// @return the redirection table entry for the provided pin
+    ///
+    rte_t rte(pin_t pin);
+
+    /// Drain
+    ///
+    /// Moves any interrupts posted to the provided vCPU into its
+    /// interrupt queue. This must be called on the vCPU being drained.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to drain
+    ///
+    void drain(gsl::not_null<vcpu_t *> vcpu);
+
+private:
+
+    struct target_t {
+        vioapic *ioapic;
+        vcpu *owner;
+        uint64_t apic_id;
+
+        std::array<std::atomic<uint64_t>, 4> pending;
+        std::array<uint64_t, 4> in_service;
+
+        bool handle_read(
+            gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+        { return ioapic->handle_read(*this, vcpu, info); }
+
+        bool handle_write(
+            gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+        { return ioapic->handle_write(*this, vcpu, info); }
+
+        bool handle_eoi(
+            gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info)
+        { return ioapic->handle_eoi(*this, vcpu, info); }
+
+        bool handle_exit(gsl::not_null<vcpu_t *> vcpu)
+        { bfignored(vcpu); ioapic->drain(*this); return true; }
+
+        bool handle_wake(gsl::not_null<vcpu_t *> vcpu)
+        { bfignored(vcpu); ioapic->drain(*this); return false; }
+    };
+
+    bool handle_read(
+        target_t &target, gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info);
+
+    bool handle_write(
+        target_t &target, gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info);
+
+    bool handle_eoi(
+        target_t &target, gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info);
+
+    reg_t read_reg(reg_t indx) const;
+    void write_reg(reg_t indx, reg_t val);
+
+    void service(pin_t pin);
+    void deliver(rte_t rte);
+    void post(target_t &target, uint64_t vector);
+    void drain(target_t &target);
+
+    target_t *find(gsl::not_null<vcpu_t *> vcpu);
+
+private:
+
+    uintptr_t m_base;
+
+    reg_t m_id;
+    reg_t m_select{0};
+    uint32_t m_lines{0};
+
+    std::array<rte_t, ioapic::redtbl::size> m_rtes;
+    std::list<target_t> m_targets;
+
+    mutable std::mutex m_mutex;
+
+public:
+
+    /// @cond
+
+    vioapic(vioapic &&) = delete;
+    vioapic &operator=(vioapic &&) = delete;
+
+    vioapic(const vioapic &) = delete;
+    vioapic &operator=(const vioapic &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,248 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef VMCS_CACHE_INTEL_X64_EAPIS_H
+#define VMCS_CACHE_INTEL_X64_EAPIS_H
+
+#include <array>
+
+#include <bfvmm/hve/arch/intel_x64/vmcs.h>
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// VMCS Cache
+///
+/// Caches VMCS accesses for the duration of a single VM exit. Reads are
+/// performed lazily, once per exit, and writes are coalesced and flushed
+/// to the VMCS just before the next VM entry.
+///
+/// Only fields that are not modified behind the cache's back during an
+/// exit should go through it: the read-only exit information fields
+/// (exit qualification, guest linear/physical address, etc.) and the
+/// execution controls that eapis toggles from its exit handlers. A field
+/// with a pending write must not also be written directly during the same
+/// exit, as the flush would overwrite it.
+///
+/// For that reason, every access eapis makes to the primary and secondary
+/// processor-based VM-execution controls, the CR0/CR4 guest/host masks
+/// and read shadows, and the VPID goes through the vCPU's cache
+/// (vcpu::vmcs_read / vcpu::vmcs_write / vcpu::vmcs_set_bits /
+/// vcpu::vmcs_clear_bits), so that the handlers that toggle those fields
+/// from an exit never race with each other. This also batches the writes
+/// made while a vCPU is constructed into one VMWRITE per field.
+///
+class EXPORT_EAPIS_HVE vmcs_cache
+{
+public:
+
+    /// Number of fields that can be cached for reading in a single exit
+    ///
+    static constexpr std::size_t num_reads = 16;
+
+    /// Number of fields that can have a pending write in a single exit
+    ///
+    static constexpr std::size_t num_writes = 16;
+
+    ///
+    /// Stats
+    ///
+    /// Counters that describe how effective the cache is. The number of
+    /// VMREADs/VMWRITEs saved is the difference between the number of
+    /// requests and the number of instructions actually executed.
+    ///
+    struct stats_t {
+        uint64_t reads{0};      ///< Number of reads requested
+        uint64_t vmreads{0};    ///< Number of VMREADs executed
+        uint64_t writes{0};     ///< Number of writes requested
+        uint64_t vmwrites{0};   ///< Number of VMWRITEs executed
+    };
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this cache
+    ///
+    vmcs_cache(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~vmcs_cache() = default;
+
+public:
+
+    /// Read
+    ///
+    /// Returns the value of the field, including any pending write. The
+    /// VMCS is only read the first time a field is requested during an
+    /// exit.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the encoding of the VMCS field to read
+    /// @return the value of the field
+    ///
+    vmcs_n::value_type read(vmcs_n::value_type addr);
+
+    /// Write
+    ///
+    /// Records a write to the field. Repeated writes to the same field
+    /// during an exit result in a single VMWRITE at flush time.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the encoding of the VMCS field to write
+    /// @param val the value to write
+    ///
+    void write(vmcs_n::value_type addr, vmcs_n::value_type val);
+
+    /// Set Bits
+    ///
+    /// Read-modify-write of a control field through the cache
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the encoding of the VMCS field to modify
+    /// @param mask the bits to set
+    ///
+    void set_bits(vmcs_n::value_type addr, vmcs_n::value_type mask)
+    { this->write(addr, this->read(addr) | mask); }
+
+    /// Clear Bits
+    ///
+    /// Read-modify-write of a control field through the cache
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param addr the encoding of the VMCS field to modify
+    /// @param mask the bits to clear
+    ///
+    void clear_bits(vmcs_n::value_type addr, vmcs_n::value_type mask)
+    { this->write(addr, this->read(addr) & ~mask); }
+
+    /// Flush
+    ///
+    /// Writes all pending writes to the VMCS and invalidates the cache.
+    /// This is called by the vcpu just before VM entry.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void flush();
+
+    /// Invalidate
+    ///
+    /// Drops all cached reads. Pending writes are kept.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void invalidate() noexcept;
+
+    /// Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the cache's counters
+    ///
+    const stats_t &stats() const noexcept
+    { return m_stats; }
+
+    /// Dump Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_stats() const;
+
+    /// @cond
+
+    bool handle_exit(gsl::not_null<vcpu_t *> vcpu);
+
+    /// @endcond
+
+private:
+
+    struct entry_t {
+        vmcs_n::value_type addr;
+        vmcs_n::value_type val;
+    };
+
+private:
+
+    std::size_t m_num_reads{};
+    std::size_t m_num_writes{};
+
+    std::array<entry_t, num_reads> m_reads{};
+    std::array<entry_t, num_writes> m_writes{};
+
+    stats_t m_stats{};
+
+public:
+
+    /// @cond
+
+    vmcs_cache(vmcs_cache &&) = default;
+    vmcs_cache &operator=(vmcs_cache &&) = default;
+
+    vmcs_cache(const vmcs_cache &) = delete;
+    vmcs_cache &operator=(const vmcs_cache &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -23,8 +23,11 @@
 #define CONTROL_REGISTER_INTEL_X64_EAPIS_H
 
 #include <list>
+#include <array>
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 
+#include "../delegate_profile.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -112,6 +115,23 @@ public:
     using handler_delegate_t =
         delegate<bool(gsl::not_null<vcpu_t *>, info_t &)>;
 
+    /// Max CR3 Targets
+    ///
+    /// The number of CR3-target value fields defined by the VMCS. Hardware
+    /// may support fewer (see IA32_VMX_MISC[24:16]).
+    ///
+    static constexpr std::size_t max_cr3_targets = 4;
+
+    /// Profile Keys
+    ///
+    /// The key of each delegate list in profile(). Lists are keyed by the
+    /// control register number, with bit 8 set for reads.
+    ///
+    static constexpr uint64_t profile_wrcr0 = 0x000;
+    static constexpr uint64_t profile_wrcr3 = 0x003;
+    static constexpr uint64_t profile_wrcr4 = 0x004;
+    static constexpr uint64_t profile_rdcr3 = 0x103;
+
     /// Constructor
     ///
     /// @expects
@@ -133,12 +153,32 @@ public:
 
     /// Add Write CR0 Handler
     ///
+    /// The mask declares the CR0 bits the handler cares about. The
+    /// guest/host mask is kept at the union of all registered handler masks
+    /// (plus the fixed bits), and on a trapped write the handler is only
+    /// called if one of its bits differs from the value the guest last
+    /// wrote (i.e. the read shadow).
+    ///
     /// @expects
     /// @ensures
     ///
+    /// @param mask the CR0 bits the handler is interested in
     /// @param d the handler to call when an exit occurs
     ///
-    void add_wrcr0_handler(const handler_delegate_t &d);
+    void add_wrcr0_handler(
+        vmcs_n::value_type mask, const handler_delegate_t &d);
+
+    /// Remove Write CR0 Handler
+    ///
+    /// Removes a previously added handler and narrows the guest/host mask
+    /// to the bits still of interest to the remaining handlers.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to remove
+    ///
+    void remove_wrcr0_handler(const handler_delegate_t &d);
 
     /// Add Read CR3 Handler
     ///
@@ -160,26 +200,50 @@ public:
 
     /// Add Write CR4 Handler
     ///
+    /// The mask declares the CR4 bits the handler cares about. The
+    /// guest/host mask is kept at the union of all registered handler masks
+    /// (plus the fixed bits), and on a trapped write the handler is only
+    /// called if one of its bits differs from the value the guest last
+    /// wrote (i.e. the read shadow).
+    ///
     /// @expects
     /// @ensures
     ///
+    /// @param mask the CR4 bits the handler is interested in
     /// @param d the handler to call when an exit occurs
     ///
-    void add_wrcr4_handler(const handler_delegate_t &d);
+    void add_wrcr4_handler(
+        vmcs_n::value_type mask, const handler_delegate_t &d);
+
+    /// Remove Write CR4 Handler
+    ///
+    /// Removes a previously added handler and narrows the guest/host mask
+    /// to the bits still of interest to the remaining handlers.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to remove
+    ///
+    void remove_wrcr4_handler(const handler_delegate_t &d);
 
 public:
 
     /// Enable Write CR0 Exiting
     ///
+    /// Sets the cr0 bits that are owned by the host independent of any
+    /// handler. The guest/host mask written to the VMCS is the union of
+    /// these bits, the fixed bits, and the bits of each registered handler.
+    ///
     /// Example:
     /// @code
-    /// this->enable_wrcr0_exiting();
+    /// this->enable_wrcr0_exiting(0);
     /// @endcode
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param mask the value of the cr0 guest/host mask to set in the vmcs
+    /// @param mask the host owned cr0 bits
     ///
     void enable_wrcr0_exiting(vmcs_n::value_type mask);
 
@@ -209,18 +273,83 @@ public:
 
     /// Enable Write CR4 Exiting
     ///
+    /// Sets the cr4 bits that are owned by the host independent of any
+    /// handler. The guest/host mask written to the VMCS is the union of
+    /// these bits, the fixed bits, and the bits of each registered handler.
+    ///
     /// Example:
     /// @code
-    /// this->enable_wrcr4_exiting();
+    /// this->enable_wrcr4_exiting(0);
     /// @endcode
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param mask the value of the cr4 guest/host mask to set in the vmcs
+    /// @param mask the host owned cr4 bits
     ///
     void enable_wrcr4_exiting(vmcs_n::value_type mask);
 
+    /// Add CR3 Target
+    ///
+    /// Adds a value to the VMCS CR3-target list. A mov-to-cr3 whose source
+    /// operand matches one of the targets does not cause a VM exit even if
+    /// write CR3 exiting is enabled, which makes this useful for keeping hot
+    /// address spaces (e.g. the kernel's) off the exit path while still
+    /// monitoring the rest. Adding a value that is already present is a
+    /// no-op.
+    ///
+    /// @expects the number of targets is less than max_cr3_targets and
+    ///     the count reported by IA32_VMX_MISC[24:16]
+    /// @ensures
+    ///
+    /// @param val the CR3 value to add to the target list
+    ///
+    void add_cr3_target(vmcs_n::value_type val);
+
+    /// Remove CR3 Target
+    ///
+    /// Removes a value from the VMCS CR3-target list. Removing a value that
+    /// is not present is a no-op.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param val the CR3 value to remove from the target list
+    ///
+    void remove_cr3_target(vmcs_n::value_type val);
+
+    /// Clear CR3 Targets
+    ///
+    /// Removes all values from the VMCS CR3-target list
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void clear_cr3_targets();
+
+    /// CR3 Targets
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of values in the VMCS CR3-target list
+    ///
+    std::size_t cr3_targets() const noexcept
+    { return m_num_cr3_targets; }
+
+    /// Profile
+    ///
+    /// Lists are keyed by profile_wrcr0, profile_wrcr3, profile_wrcr4
+    /// and profile_rdcr3. See delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the delegate profile for this handler
+    ///
+    delegate_profile &profile() noexcept
+    { return m_profile; }
+
     /// @cond
 
     bool handle(gsl::not_null<vcpu_t *> vcpu);
@@ -238,14 +367,32 @@ private:
     bool handle_wrcr3(gsl::not_null<vcpu_t *> vcpu);
     bool handle_wrcr4(gsl::not_null<vcpu_t *> vcpu);
 
+    void update_wrcr0_mask();
+    void update_wrcr4_mask();
+
+    void write_cr3_targets();
+
 private:
 
     vcpu *m_vcpu;
 
-    std::list<handler_delegate_t> m_wrcr0_handlers;
+    struct wrcr_entry_t {
+        vmcs_n::value_type mask;
+        handler_delegate_t d;
+    };
+
+    std::list<wrcr_entry_t> m_wrcr0_handlers;
     std::list<handler_delegate_t> m_rdcr3_handlers;
     std::list<handler_delegate_t> m_wrcr3_handlers;
-    std::list<handler_delegate_t> m_wrcr4_handlers;
+    std::list<wrcr_entry_t> m_wrcr4_handlers;
+
+    vmcs_n::value_type m_wrcr0_host_mask{};
+    vmcs_n::value_type m_wrcr4_host_mask{};
+
+    std::size_t m_num_cr3_targets{};
+    std::array<vmcs_n::value_type, max_cr3_targets> m_cr3_targets{};
+
+    delegate_profile m_profile{"control register"};
 
 public:
 
@@ -27,6 +27,8 @@
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler.h>
 
+#include "../delegate_profile.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -179,6 +181,19 @@ public:
     ///
     void set_default_handler(const ::handler_delegate_t &d);
 
+    /// Profile
+    ///
+    /// Lists are keyed by the CPUID leaf.
+    /// See delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the delegate profile for this handler
+    ///
+    delegate_profile &profile() noexcept
+    { return m_profile; }
+
 public:
 
     /// @cond
@@ -195,6 +210,8 @@ private:
     std::unordered_map<leaf_t, bool> m_emulate;
     std::unordered_map<leaf_t, std::list<handler_delegate_t>> m_handlers;
 
+    delegate_profile m_profile{"cpuid"};
+
 public:
 
     /// @cond
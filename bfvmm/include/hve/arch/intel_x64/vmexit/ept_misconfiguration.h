@@ -27,6 +27,8 @@
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler.h>
 
+#include "../delegate_profile.h"
+
 // -----------------------------------------------------------------------------
 // Definitions
 // -----------------------------------------------------------------------------
@@ -112,6 +114,19 @@ public:
     ///
     void add_handler(const handler_delegate_t &d);
 
+    /// Profile
+    ///
+    /// This handler has a single list, keyed by 0.
+    /// See delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the delegate profile for this handler
+    ///
+    delegate_profile &profile() noexcept
+    { return m_profile; }
+
 public:
 
     /// @cond
@@ -125,6 +140,8 @@ private:
     vcpu *m_vcpu;
     std::list<handler_delegate_t> m_handlers;
 
+    delegate_profile m_profile{"ept misconfiguration"};
+
 public:
 
     /// @cond
@@ -27,6 +27,8 @@
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler.h>
 
+#include "../delegate_profile.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -206,6 +208,20 @@ public:
     ///
     void set_default_execute_handler(const ::handler_delegate_t &d);
 
+    /// Profile
+    ///
+    /// Lists are keyed by 0 for read, 1 for write and 2 for
+    /// execute violations.
+    /// See delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the delegate profile for this handler
+    ///
+    delegate_profile &profile() noexcept
+    { return m_profile; }
+
 public:
 
     /// @cond
@@ -232,6 +248,8 @@ private:
     std::list<handler_delegate_t> m_write_handlers;
     std::list<handler_delegate_t> m_execute_handlers;
 
+    delegate_profile m_profile{"ept violation"};
+
 public:
 
     /// @cond
@@ -22,6 +22,7 @@
 #ifndef EXTERNAL_INTERRUPT_INTEL_X64_EAPIS_H
 #define EXTERNAL_INTERRUPT_INTEL_X64_EAPIS_H
 
+#include <array>
 #include <list>
 
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
@@ -55,7 +56,10 @@ class vcpu;
 /// External interrupt
 ///
 /// Provides an interface for registering handlers for external-interrupt
-/// exits.
+/// exits. Each of the 256 vectors has its own entry in a routing table
+/// that says whether the vector is reflected to the guest, handled by a
+/// delegate in the VMM, or dropped, so dispatching an exit is a single
+/// indexed lookup.
 ///
 class EXPORT_EAPIS_HVE external_interrupt_handler
 {
@@ -86,6 +90,20 @@ public:
     using handler_delegate_t =
         delegate<bool(gsl::not_null<vcpu_t *>, info_t &)>;
 
+    /// Route
+    ///
+    /// What to do with an external interrupt when it is trapped
+    ///
+    enum class route_t {
+        reflect,                ///< Queue the vector for injection into the guest
+        handle,                 ///< Call the vector's delegate
+        drop                    ///< Acknowledge the vector and do nothing
+    };
+
+    /// Number of vectors in the routing table
+    ///
+    static constexpr const std::size_t num_vectors = 256;
+
     /// Constructor
     ///
     /// @expects
@@ -107,6 +125,13 @@ public:
 
     /// Add Handler
     ///
+    /// Adds a fallback delegate. Fallback delegates are called (most
+    /// recently added first) for any vector routed to route_t::handle
+    /// that has no per-vector delegate, or whose per-vector delegate
+    /// returns false. Vectors whose route has not been set (with
+    /// set_route() or the per-vector add_handler()) are routed to
+    /// route_t::handle. Per-vector delegates and routes are left alone.
+    ///
     /// @expects
     /// @ensures
     ///
@@ -114,6 +139,62 @@ public:
     ///
     void add_handler(const handler_delegate_t &d);
 
+    /// Add Handler
+    ///
+    /// Sets the delegate for a single vector, and routes that vector to
+    /// it. Any previously registered delegate for the vector is replaced.
+    ///
+    /// @expects vector < num_vectors
+    /// @ensures
+    ///
+    /// @param vector the vector to handle
+    /// @param d the handler to call when an exit occurs for the vector
+    ///
+    void add_handler(uint64_t vector, const handler_delegate_t &d);
+
+    /// Set Route
+    ///
+    /// @expects vector < num_vectors
+    /// @ensures
+    ///
+    /// @param vector the vector to route
+    /// @param route what to do when the vector is trapped
+    ///
+    void set_route(uint64_t vector, route_t route);
+
+    /// Route
+    ///
+    /// @expects vector < num_vectors
+    /// @ensures
+    ///
+    /// @param vector the vector to query
+    /// @return the route for the provided vector
+    ///
+    route_t route(uint64_t vector) const;
+
+    /// Set Unhandled Policy
+    ///
+    /// Sets what happens to a vector that is routed to the VMM, but is not
+    /// handled by its per-vector delegate or any fallback delegate.
+    /// Defaults to route_t::reflect.
+    ///
+    /// @expects policy != route_t::handle
+    /// @ensures
+    ///
+    /// @param policy either route_t::reflect or route_t::drop
+    ///
+    void set_unhandled_policy(route_t policy);
+
+    /// Count
+    ///
+    /// @expects vector < num_vectors
+    /// @ensures
+    ///
+    /// @param vector the vector to query
+    /// @return the number of times the vector has been trapped
+    ///
+    uint64_t count(uint64_t vector) const;
+
 public:
 
     /// Enable exiting
@@ -148,9 +229,23 @@ public:
 
     /// @endcond
 
+private:
+
+    struct entry_t {
+        route_t route{route_t::reflect};
+        handler_delegate_t handler{};
+        uint64_t count{0};
+        bool is_default{true};
+    };
+
+    void dispatch_unhandled(uint64_t vector);
+
 private:
 
     vcpu *m_vcpu;
+
+    route_t m_unhandled_policy{route_t::reflect};
+    std::array<entry_t, num_vectors> m_entries{};
     std::list<handler_delegate_t> m_handlers;
 
 public:
@@ -0,0 +1,268 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef HLT_INTEL_X64_EAPIS_H
+#define HLT_INTEL_X64_EAPIS_H
+
+#include <list>
+
+#include <bfvmm/hve/arch/intel_x64/vmcs.h>
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
+#include "../time.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// HLT / MWAIT / MONITOR
+///
+/// Provides idle handling for HLT, MWAIT and MONITOR exits. When the guest
+/// goes idle, the vCPU first polls for a wake-up event (an interrupt
+/// queued for injection, an interrupt pending in the physical x2APIC's
+/// IRR, or any registered wake delegate returning true) for up to the
+/// current poll window. If nothing shows up, the vCPU is put
+/// to sleep by resuming the guest with its activity state set to HLT, and
+/// the physical core halts until an interrupt or a VM exit wakes it.
+///
+/// The poll window adapts to the observed wake-up latency: a sleep that
+/// ends within the maximum window grows it, so the next wake-up is
+/// caught by polling, while a long sleep shrinks it so idle vCPUs stop
+/// burning the core.
+///
+/// MWAIT / MONITOR exiting is off unless enable_mwait_exiting() is called,
+/// so by default the guest executes them natively. When it is on, MONITOR
+/// is emulated as a NOP, and MWAIT polls like HLT but never sleeps: a
+/// halted core would not see writes to the monitored line, and with
+/// ECX[0] set the guest may be waiting with interrupts disabled. MWAIT
+/// returns once the window closes, which the architecture allows.
+///
+class EXPORT_EAPIS_HVE hlt_handler
+{
+public:
+
+    /// Wake delegate type
+    ///
+    /// The type of delegate clients must use when registering wake
+    /// delegates. A wake delegate returns true if the idle vCPU has
+    /// something to do.
+    ///
+    using wake_delegate_t = delegate<bool(gsl::not_null<vcpu_t *>)>;
+
+    ///
+    /// Stats
+    ///
+    /// Counters that describe how idle exits were handled
+    ///
+    struct stats_t {
+        uint64_t hlt_exits{0};              ///< Number of HLT exits
+        uint64_t mwait_exits{0};            ///< Number of MWAIT exits
+        uint64_t monitor_exits{0};          ///< Number of MONITOR exits
+        uint64_t poll_wakeups{0};           ///< Wake-ups caught while polling
+        uint64_t sleeps{0};                 ///< Number of times the vCPU slept
+        uint64_t poll_grows{0};             ///< Number of times the window grew
+        uint64_t poll_shrinks{0};           ///< Number of times the window shrunk
+        uint64_t poll_ns{0};                ///< Total time spent polling
+        uint64_t wake_latency_ns{0};        ///< Total idle -> wake-up time
+        uint64_t max_wake_latency_ns{0};    ///< Worst idle -> wake-up time
+    };
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this hlt handler
+    ///
+    hlt_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~hlt_handler() = default;
+
+public:
+
+    /// Add Wake Delegate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call while polling for a wake-up event
+    ///
+    void add_wake_delegate(const wake_delegate_t &d);
+
+    /// Enable exiting
+    ///
+    /// Turns on HLT exiting.
+    ///
+    /// Example:
+    /// @code
+    /// this->enable_exiting();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_exiting();
+
+    /// Disable exiting
+    ///
+    /// Turns off HLT, MWAIT and MONITOR exiting.
+    ///
+    /// Example:
+    /// @code
+    /// this->disable_exiting();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_exiting();
+
+    /// Enable MWAIT exiting
+    ///
+    /// Turns on MWAIT and MONITOR exiting.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_mwait_exiting();
+
+    /// Disable MWAIT exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_mwait_exiting();
+
+    /// Set Poll Window
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param start_ns the window used the first time the window grows
+    /// @param max_ns the largest the window is allowed to get. A value
+    ///     of 0 turns off polling.
+    ///
+    void set_poll_window(uint64_t start_ns, uint64_t max_ns) noexcept;
+
+    /// Poll Window
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the current poll window in nanoseconds
+    ///
+    uint64_t poll_window() const noexcept;
+
+    /// Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the idle counters for this vCPU
+    ///
+    const stats_t &stats() const noexcept;
+
+    /// Dump Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_stats() const;
+
+public:
+
+    /// @cond
+
+    bool handle_hlt(gsl::not_null<vcpu_t *> vcpu);
+    bool handle_mwait(gsl::not_null<vcpu_t *> vcpu);
+    bool handle_monitor(gsl::not_null<vcpu_t *> vcpu);
+    bool handle_exit(gsl::not_null<vcpu_t *> vcpu);
+
+    /// @endcond
+
+private:
+
+    bool idle(gsl::not_null<vcpu_t *> vcpu, bool can_sleep);
+    bool wake_pending(gsl::not_null<vcpu_t *> vcpu);
+    bool physical_irr_pending() const;
+
+    void record_wake(uint64_t latency_ns) noexcept;
+    void adapt(uint64_t block_ns) noexcept;
+
+private:
+
+    vcpu *m_vcpu;
+    const time::clock *m_clock;
+
+    uint64_t m_poll_ns{0};
+    uint64_t m_poll_start_ns{10000};
+    uint64_t m_poll_max_ns{200000};
+
+    bool m_x2apic{false};
+    bool m_sleeping{false};
+    uint64_t m_sleep_start{0};
+
+    stats_t m_stats{};
+    std::list<wake_delegate_t> m_wake_delegates;
+
+public:
+
+    /// @cond
+
+    hlt_handler(hlt_handler &&) = default;
+    hlt_handler &operator=(hlt_handler &&) = default;
+
+    hlt_handler(const hlt_handler &) = delete;
+    hlt_handler &operator=(const hlt_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
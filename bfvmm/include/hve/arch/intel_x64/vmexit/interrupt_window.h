@@ -118,6 +118,16 @@ public:
     ///
     void inject_external_interrupt(uint64_t vector);
 
+    /// Has Pending
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if external interrupts are queued for injection,
+    ///     false otherwise
+    ///
+    bool has_pending() const;
+
 public:
 
     /// @cond
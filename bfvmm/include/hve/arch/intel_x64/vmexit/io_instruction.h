@@ -27,6 +27,9 @@
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler.h>
 
+#include "../bitmap.h"
+#include "../delegate_profile.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -274,6 +277,20 @@ public:
     ///
     void pass_through_all_accesses();
 
+    /// Profile
+    ///
+    /// Lists are keyed by the port number, with bit 16 set for
+    /// OUT instructions.
+    /// See delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the delegate profile for this handler
+    ///
+    delegate_profile &profile() noexcept
+    { return m_profile; }
+
 public:
 
     /// @cond
@@ -297,14 +314,16 @@ private:
 
     vcpu *m_vcpu;
 
-    gsl::span<uint8_t> m_io_bitmap_a;
-    gsl::span<uint8_t> m_io_bitmap_b;
+    bitmap *m_io_bitmap_a;
+    bitmap *m_io_bitmap_b;
 
     ::handler_delegate_t m_default_handler;
     std::unordered_map<vmcs_n::value_type, bool> m_emulate;
     std::unordered_map<vmcs_n::value_type, std::list<handler_delegate_t>> m_in_handlers;
     std::unordered_map<vmcs_n::value_type, std::list<handler_delegate_t>> m_out_handlers;
 
+    delegate_profile m_profile{"io instruction"};
+
 public:
 
     /// @cond
@@ -0,0 +1,294 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PAUSE_INTEL_X64_EAPIS_H
+#define PAUSE_INTEL_X64_EAPIS_H
+
+#include <list>
+
+#include <bfvmm/hve/arch/intel_x64/vmcs.h>
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
+#include "../time.h"
+#include "../vcpu_global_state.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// PAUSE-loop Exiting
+///
+/// Provides an interface for PAUSE-loop exiting (PLE). With PLE enabled,
+/// a guest that spins in a PAUSE loop for longer than the PLE window
+/// causes a VM exit. A single PLE exit usually just means a lock is
+/// contended, but a vCPU that keeps hitting PLE exits back to back is
+/// most likely waiting on a lock whose holder is not running (lock-holder
+/// preemption). When that is detected, the registered yield delegates are
+/// called so that the VMM's scheduler can run another vCPU (ideally the
+/// preempted lock holder) instead of letting this one burn its time slice.
+///
+/// The delegates are given a lock-holder candidate. vCPUs that share a
+/// global state publish which of them are spinning, and the candidate is
+/// the next vCPU (round robin) that is not, since a vCPU spinning on the
+/// lock cannot be the one holding it. Each vCPU claims one of 64 slots in
+/// its global state, and gives it back when its handler is destroyed. A
+/// vCPU that finds every slot claimed still detects streaks, but neither
+/// publishes its state nor is handed out as a candidate.
+///
+class EXPORT_EAPIS_HVE pause_handler
+{
+public:
+
+    ///
+    /// Info
+    ///
+    /// This struct is created by pause_handler::handle before being
+    /// passed to each registered yield delegate.
+    ///
+    struct info_t {
+
+        /// Streak (in)
+        ///
+        /// The number of back to back PLE exits, including this one
+        ///
+        uint64_t streak;
+
+        /// RIP (in)
+        ///
+        /// The address of the PAUSE instruction the guest is spinning on
+        ///
+        uint64_t rip;
+
+        /// Kernel (in)
+        ///
+        /// True if the guest was spinning at CPL 0. Kernel spinlocks are
+        /// the usual victims of lock-holder preemption.
+        ///
+        bool kernel;
+
+        /// Candidate (in)
+        ///
+        /// The id of a vCPU in the same VM that is not spinning, and might
+        /// be the preempted lock holder, or no_candidate if every other
+        /// vCPU is spinning too
+        ///
+        uint64_t candidate;
+
+        /// Ignore advance (out)
+        ///
+        /// If true, do not advance the guest's instruction pointer (i.e.
+        /// because your handler (that returns true) already did).
+        ///
+        /// default: false
+        ///
+        bool ignore_advance;
+    };
+
+    /// Yield delegate type
+    ///
+    /// The type of delegate clients must use when registering yield
+    /// delegates. A yield delegate returns true if it handled the yield.
+    ///
+    using yield_delegate_t =
+        delegate<bool(gsl::not_null<vcpu_t *>, info_t &)>;
+
+    ///
+    /// Stats
+    ///
+    /// Counters that describe how PLE exits were handled
+    ///
+    struct stats_t {
+        uint64_t ple_exits{0};              ///< Number of PLE exits
+        uint64_t suspected_lhp{0};          ///< Suspected lock-holder preemptions
+        uint64_t yields{0};                 ///< Yields handled by a delegate
+    };
+
+    /// Default PLE gap (TSC cycles)
+    ///
+    static constexpr const uint64_t default_gap = 128;
+
+    /// Default PLE window (TSC cycles)
+    ///
+    static constexpr const uint64_t default_window = 4096;
+
+    /// Default streak interval (TSC cycles)
+    ///
+    /// Used instead of the interval in nanoseconds when the TSC frequency
+    /// is unknown
+    ///
+    static constexpr const uint64_t default_interval_tsc = 100000;
+
+    /// No lock-holder candidate
+    ///
+    static constexpr const uint64_t no_candidate = ~0ULL;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this pause handler
+    ///
+    pause_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~pause_handler();
+
+public:
+
+    /// Add Yield Delegate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the delegate to call when lock-holder preemption is
+    ///     suspected
+    ///
+    void add_yield_delegate(const yield_delegate_t &d);
+
+    /// Enable exiting
+    ///
+    /// Example:
+    /// @code
+    /// this->enable_exiting();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gap the maximum number of TSC cycles between two PAUSE
+    ///     instructions for them to be considered the same loop
+    /// @param window the number of TSC cycles a loop must spin before
+    ///     a VM exit is generated
+    ///
+    void enable_exiting(
+        uint64_t gap = default_gap, uint64_t window = default_window);
+
+    /// Disable exiting
+    ///
+    /// Example:
+    /// @code
+    /// this->disable_exiting();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_exiting();
+
+    /// Set Streak Threshold
+    ///
+    /// Sets how PLE exits are grouped into a streak, and how long a streak
+    /// has to get before lock-holder preemption is suspected.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param threshold the streak length at which the yield delegates
+    ///     are called
+    /// @param interval_ns PLE exits closer together than this are part of
+    ///     the same streak. If the TSC frequency is unknown,
+    ///     default_interval_tsc is used instead.
+    ///
+    void set_streak_threshold(uint64_t threshold, uint64_t interval_ns) noexcept;
+
+    /// Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the PLE counters for this vCPU
+    ///
+    const stats_t &stats() const noexcept;
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vcpu_t *> vcpu);
+
+    /// @endcond
+
+private:
+
+    uint64_t interval_to_tsc(uint64_t interval_ns) const noexcept;
+
+    uint64_t candidate() const noexcept;
+    void set_spinning(bool spinning) noexcept;
+
+private:
+
+    vcpu *m_vcpu;
+    vcpu_global_state_t *m_state;
+    uint64_t m_bit;
+    const time::clock *m_clock;
+
+    uint64_t m_threshold{2};
+    uint64_t m_interval{0};
+
+    uint64_t m_streak{0};
+    uint64_t m_last_exit{0};
+
+    stats_t m_stats{};
+    std::list<yield_delegate_t> m_yield_delegates;
+
+public:
+
+    /// @cond
+
+    pause_handler(pause_handler &&) = default;
+    pause_handler &operator=(pause_handler &&) = default;
+
+    pause_handler(const pause_handler &) = delete;
+    pause_handler &operator=(const pause_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -23,10 +23,14 @@
 #define PREEMPTION_TIMER_INTEL_X64_EAPIS_H
 
 #include <list>
+#include <vector>
 
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler.h>
 
+#include "../delegate_profile.h"
+#include "../time.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -55,7 +59,11 @@ class vcpu;
 /// VMX Preemption Timer
 ///
 /// Provides an interface for registering handlers for VMX-preemption timer
-/// exits.
+/// exits. In addition to raw handlers, this class provides a software
+/// timer service that multiplexes any number of timers on top of the one
+/// hardware timer. Timers are kept in a min-heap ordered by their TSC
+/// deadline, and the preemption timer is programmed for the earliest
+/// deadline right before each VM entry.
 ///
 class EXPORT_EAPIS_HVE preemption_timer_handler
 {
@@ -70,6 +78,15 @@ public:
     ///
     using handler_delegate_t = delegate<bool(gsl::not_null<vcpu_t *>)>;
 
+    using timer_id_t = uint64_t;        ///< Software timer id type
+
+    /// Timer delegate type
+    ///
+    /// The type of delegate clients must use when adding software
+    /// timers
+    ///
+    using timer_delegate_t = delegate<void(gsl::not_null<vcpu_t *>)>;
+
     /// Constructor
     ///
     /// @expects
@@ -123,6 +140,11 @@ public:
 
     /// Set timer
     ///
+    /// Sets a raw timer value. If software timers are pending, the
+    /// hardware timer is programmed for whichever of the raw timer and the
+    /// earliest software timer expires first, and the handlers added with
+    /// add_handler() are only called once the raw timer expires.
+    ///
     /// @expects
     /// @ensures
     ///
@@ -139,6 +161,87 @@ public:
     ///
     value_t get_timer() const;
 
+public:
+
+    /// Now
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the current time in nanoseconds, as seen by the software
+    ///     timer service
+    ///
+    uint64_t now_ns() const;
+
+    /// Add Timer
+    ///
+    /// Adds a one-shot software timer. The delegate is called from the
+    /// VMX-preemption timer exit that follows the deadline.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param deadline_ns the absolute deadline, in the same time base
+    ///     as now_ns()
+    /// @param d the delegate to call when the timer expires
+    /// @return an id that can be passed to cancel()
+    ///
+    timer_id_t add_timer(uint64_t deadline_ns, const timer_delegate_t &d);
+
+    /// Add Timer (TSC)
+    ///
+    /// Same as add_timer(), but the deadline is an absolute host TSC value.
+    /// Use this when the deadline is already known in TSC ticks, as
+    /// converting an absolute TSC value to nanoseconds and back loses
+    /// precision.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param deadline_tsc the absolute deadline, in host TSC ticks
+    /// @param d the delegate to call when the timer expires
+    /// @return an id that can be passed to cancel()
+    ///
+    timer_id_t add_timer_tsc(uint64_t deadline_tsc, const timer_delegate_t &d);
+
+    /// Cancel
+    ///
+    /// Cancels a software timer. Cancelling a timer that has already
+    /// expired (or was already cancelled) has no effect.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param id the id returned by add_timer()
+    ///
+    void cancel(timer_id_t id);
+
+    /// Program
+    ///
+    /// Programs the VMX-preemption timer for the earliest pending software
+    /// timer, or the raw timer if that expires first. Once the last
+    /// software timer expires, exiting is put back the way it was before
+    /// the first one was added. The vCPU calls this right before each VM
+    /// entry, so this should not need to be called directly.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void program();
+
+    /// Profile
+    ///
+    /// This handler has a single list, keyed by 0.
+    /// See delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the delegate profile for this handler
+    ///
+    delegate_profile &profile() noexcept
+    { return m_profile; }
+
 public:
 
     /// @cond
@@ -147,11 +250,41 @@ public:
 
     /// @endcond
 
+private:
+
+    struct soft_timer_t {
+        uint64_t deadline;
+        timer_id_t id;
+        timer_delegate_t d;
+
+        bool operator>(const soft_timer_t &other) const noexcept
+        { return deadline > other.deadline; }
+    };
+
+    bool expire(gsl::not_null<vcpu_t *> vcpu);
+    bool raw_expired();
+
+    void write_timer(value_t val);
+    value_t pet_until(uint64_t deadline) const;
+
 private:
 
     vcpu *m_vcpu;
     std::list<handler_delegate_t> m_handlers;
 
+    std::vector<soft_timer_t> m_timers;
+
+    timer_id_t m_next_id{1};
+    bool m_service_enabled{false};
+    bool m_exiting_before_service{false};
+
+    uint64_t m_raw_deadline{0};
+    bool m_raw_pending{false};
+
+    const time::clock *m_clock;
+
+    delegate_profile m_profile{"preemption timer"};
+
 public:
 
     /// @cond
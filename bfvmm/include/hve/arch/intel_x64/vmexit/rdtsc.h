@@ -0,0 +1,403 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef RDTSC_INTEL_X64_EAPIS_H
+#define RDTSC_INTEL_X64_EAPIS_H
+
+#include <list>
+
+#include <bfvmm/hve/arch/intel_x64/vmcs.h>
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
+#include "../delegate_profile.h"
+#include "rdmsr.h"
+#include "wrmsr.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// RDTSC
+///
+/// Provides an interface for virtualizing the guest's view of the TSC.
+///
+/// By default, the guest's TSC is virtualized entirely in hardware using
+/// the VMCS TSC-offset and TSC-multiplier fields, so RDTSC and RDTSCP never
+/// cause a VM exit:
+///
+///     guest_tsc = ((host_tsc * multiplier) >> 48) + offset
+///
+/// RDTSCP is enabled for the guest when the CPU allows it, otherwise RDTSCP
+/// raises #UD in the guest. Once set_tsc_aux() is called, IA32_TSC_AUX
+/// (returned in ECX by RDTSCP) is kept in a per-vCPU shadow. Guest accesses
+/// to the MSR are trapped and redirected to the shadow, and the shadow is
+/// loaded into hardware right before VM entry whenever it changed, or the
+/// core last held a different value (e.g. the vCPU migrated, or another
+/// vCPU ran there), so RDTSCP itself does not exit. A vCPU that does not
+/// shadow IA32_TSC_AUX puts back the value the core held before.
+///
+/// Hardware does not apply the offset or multiplier to IA32_TSC_DEADLINE.
+/// Once either is set, guest accesses to IA32_TSC_DEADLINE are trapped,
+/// and the deadline is converted to host TSC ticks before it is written to
+/// the MSR. If something else emulates the LAPIC timer, it can take this
+/// over by calling set_tsc_deadline_emulated().
+///
+/// RDTSC / RDTSCP exiting is only turned on when a handler is added. The
+/// handlers are given the value hardware would have returned (i.e. with
+/// the offset and multiplier applied), and can change it.
+///
+class EXPORT_EAPIS_HVE rdtsc_handler
+{
+public:
+
+    ///
+    /// Info
+    ///
+    /// This struct is created by rdtsc_handler::handle before being
+    /// passed to each registered handler.
+    ///
+    struct info_t {
+
+        /// Value (in/out)
+        ///
+        /// The TSC value to return to the guest
+        ///
+        /// default: the guest TSC (offset and multiplier applied)
+        ///
+        uint64_t val;
+
+        /// Aux (in/out)
+        ///
+        /// The value to return in ECX. Only used for RDTSCP.
+        ///
+        /// default: the IA32_TSC_AUX shadow
+        ///
+        uint64_t aux;
+
+        /// RDTSCP (in)
+        ///
+        /// True if the exit was caused by RDTSCP, false if it was caused
+        /// by RDTSC
+        ///
+        bool rdtscp;
+
+        /// Ignore write (out)
+        ///
+        /// If true, do not update the guest's register state with the
+        /// default value of info.val / info.aux.
+        ///
+        /// default: false
+        ///
+        bool ignore_write;
+
+        /// Ignore advance (out)
+        ///
+        /// If true, do not advance the guest's instruction pointer (i.e.
+        /// because your handler (that returns true) already did).
+        ///
+        /// default: false
+        ///
+        bool ignore_advance;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vcpu_t *>, info_t &)>;
+
+    /// Fractional bits of the TSC multiplier
+    ///
+    static constexpr const uint64_t multiplier_shift = 48;
+
+    /// A TSC multiplier of 1.0
+    ///
+    static constexpr const uint64_t multiplier_one = 1ULL << multiplier_shift;
+
+    /// IA32_TSC_AUX MSR address
+    ///
+    static constexpr const uint32_t ia32_tsc_aux = 0xC0000103;
+
+    /// IA32_TSC_DEADLINE MSR address
+    ///
+    static constexpr const uint32_t ia32_tsc_deadline = 0x6E0;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this rdtsc handler
+    ///
+    rdtsc_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~rdtsc_handler() = default;
+
+public:
+
+    /// Add Handler
+    ///
+    /// Adds a handler and turns on RDTSC / RDTSCP exiting
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param d the handler to call when an exit occurs
+    ///
+    void add_handler(const handler_delegate_t &d);
+
+    /// Enable exiting
+    ///
+    /// Example:
+    /// @code
+    /// this->enable_exiting();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_exiting();
+
+    /// Disable exiting
+    ///
+    /// Example:
+    /// @code
+    /// this->disable_exiting();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_exiting();
+
+public:
+
+    /// Set Offset
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param offset the value added to the (scaled) host TSC
+    ///
+    void set_offset(uint64_t offset);
+
+    /// Offset
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the TSC offset
+    ///
+    uint64_t offset() const noexcept;
+
+    /// Set Multiplier
+    ///
+    /// Sets the TSC multiplier, as a fixed point value with 48 fractional
+    /// bits. Setting the multiplier to multiplier_one turns off scaling.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param multiplier the TSC multiplier
+    ///
+    void set_multiplier(uint64_t multiplier);
+
+    /// Multiplier
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the TSC multiplier
+    ///
+    uint64_t multiplier() const noexcept;
+
+    /// Set TSC Aux
+    ///
+    /// Sets the IA32_TSC_AUX shadow. The first call also starts trapping
+    /// guest accesses to IA32_TSC_AUX.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param val the value of the IA32_TSC_AUX shadow
+    ///
+    void set_tsc_aux(uint64_t val);
+
+    /// TSC Aux
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the value of the IA32_TSC_AUX shadow
+    ///
+    uint64_t tsc_aux() const noexcept;
+
+    /// Guest TSC
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the current TSC as seen by the guest
+    ///
+    uint64_t guest_tsc() const;
+
+    /// Host TSC
+    ///
+    /// Converts a guest TSC value back to host TSC ticks by removing the
+    /// offset (modulo 2^64, so negative offsets work) and dividing by the
+    /// multiplier. The result is rounded up, so a deadline converted this
+    /// way is never early. With a positive offset, guest TSC values that
+    /// precede host TSC 0 are returned as 0.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param guest_tsc a TSC value as seen by the guest
+    /// @return the earliest host TSC value at which the guest's TSC
+    ///     reaches guest_tsc
+    ///
+    uint64_t host_tsc(uint64_t guest_tsc) const noexcept;
+
+    /// Set TSC Deadline Emulated
+    ///
+    /// Tells this handler that IA32_TSC_DEADLINE is emulated by another
+    /// handler (e.g. lapic_timer_handler), which converts the deadline
+    /// itself. Guest accesses to the MSR are then left to that handler.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void set_tsc_deadline_emulated() noexcept;
+
+    /// Load
+    ///
+    /// Loads the IA32_TSC_AUX shadow into hardware if it changed, or if
+    /// this core holds a different value (the vCPU migrated, or another
+    /// vCPU ran here). Without a shadow, the value this core held before
+    /// any shadow was loaded is put back. The vCPU calls this right before
+    /// each VM entry, so this should not need to be called directly.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void load();
+
+    /// Profile
+    ///
+    /// This handler has a single list, keyed by 0.
+    /// See delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the delegate profile for this handler
+    ///
+    delegate_profile &profile() noexcept
+    { return m_profile; }
+
+public:
+
+    /// @cond
+
+    bool handle_rdtsc(gsl::not_null<vcpu_t *> vcpu);
+    bool handle_rdtscp(gsl::not_null<vcpu_t *> vcpu);
+
+    bool handle_rdmsr_tsc_aux(gsl::not_null<vcpu_t *> vcpu, rdmsr_handler::info_t &info);
+    bool handle_wrmsr_tsc_aux(gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info);
+
+    bool handle_rdmsr_tsc_deadline(gsl::not_null<vcpu_t *> vcpu, rdmsr_handler::info_t &info);
+    bool handle_wrmsr_tsc_deadline(gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    bool handle(gsl::not_null<vcpu_t *> vcpu, bool rdtscp);
+    void trap_tsc_deadline();
+
+    void enable_tsc_offsetting();
+    void disable_tsc_offsetting();
+
+private:
+
+    vcpu *m_vcpu;
+
+    uint64_t m_offset{0};
+    uint64_t m_multiplier{multiplier_one};
+
+    uint64_t m_tsc_aux{0};
+    uint64_t m_tsc_aux_id;
+    bool m_tsc_aux_dirty{false};
+    bool m_tsc_aux_shadowed{false};
+
+    uint64_t m_tsc_deadline{0};
+    bool m_tsc_deadline_trapped{false};
+    bool m_tsc_deadline_emulated{false};
+
+    std::list<handler_delegate_t> m_handlers;
+
+    delegate_profile m_profile{"rdtsc"};
+
+public:
+
+    /// @cond
+
+    rdtsc_handler(rdtsc_handler &&) = default;
+    rdtsc_handler &operator=(rdtsc_handler &&) = default;
+
+    rdtsc_handler(const rdtsc_handler &) = delete;
+    rdtsc_handler &operator=(const rdtsc_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -27,6 +27,9 @@
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler.h>
 
+#include "../bitmap.h"
+#include "../delegate_profile.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -243,6 +246,19 @@ public:
     ///
     void pass_through_all_accesses();
 
+    /// Profile
+    ///
+    /// Lists are keyed by the MSR.
+    /// See delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the delegate profile for this handler
+    ///
+    delegate_profile &profile() noexcept
+    { return m_profile; }
+
 public:
 
     /// @cond
@@ -254,12 +270,14 @@ public:
 private:
 
     vcpu *m_vcpu;
-    gsl::span<uint8_t> m_msr_bitmap;
+    bitmap *m_msr_bitmap;
 
     ::handler_delegate_t m_default_handler;
     std::unordered_map<vmcs_n::value_type, bool> m_emulate;
     std::unordered_map<vmcs_n::value_type, std::list<handler_delegate_t>> m_handlers;
 
+    delegate_profile m_profile{"wrmsr"};
+
 public:
 
     /// @cond
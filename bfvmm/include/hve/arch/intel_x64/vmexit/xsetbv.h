@@ -23,10 +23,13 @@
 #define XSETBV_INTEL_X64_EAPIS_H
 
 #include <list>
+#include <memory>
 
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler.h>
 
+#include "../delegate_profile.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -52,9 +55,19 @@ namespace eapis::intel_x64
 
 class vcpu;
 
-/// MOV DR
+/// XSETBV
+///
+/// Provides an interface for registering handlers for xsetbv exits, and
+/// manages the guest's extended (XSAVE) state.
 ///
-/// Provides an interface for registering handlers for mov-dr exits.
+/// The guest's XCR0 and extended state stay live in the hardware while the
+/// VMM runs, so an exit that never touches extended state pays nothing for
+/// it. VMM code that needs to use a state component (e.g. AVX-512) must
+/// first call save_guest_xstate() with the components it will clobber.
+/// This saves the guest's copy of those components into a per-vCPU XSAVE
+/// area (compacted format when XSAVES is supported) and, if they differ,
+/// switches XCR0 to the host's value (vcpu_global_state_t::host_xcr0). Both are undone by
+/// load_guest_xstate() just before the next VM entry.
 ///
 class EXPORT_EAPIS_HVE xsetbv_handler
 {
@@ -106,6 +119,15 @@ public:
     using handler_delegate_t =
         delegate<bool(gsl::not_null<vcpu_t *>, info_t &)>;
 
+    /// XCR0 bits for the AVX-512 state components (opmask, ZMM_Hi256,
+    /// Hi16_ZMM)
+    ///
+    static constexpr uint64_t xstate_avx512 = 0x00000000000000E0;
+
+    /// XCR0 bits for the AMX state components (XTILECFG, XTILEDATA)
+    ///
+    static constexpr uint64_t xstate_amx = 0x0000000000060000;
+
     /// Constructor
     ///
     /// @expects
@@ -134,6 +156,53 @@ public:
     ///
     void add_handler(const handler_delegate_t &d);
 
+    /// Guest XCR0
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the value of XCR0 as last set by the guest
+    ///
+    uint64_t guest_xcr0() const noexcept
+    { return m_guest_xcr0; }
+
+    /// Save Guest Extended State
+    ///
+    /// Must be called before the VMM uses any of the state components in
+    /// mask. The guest's copy of those components is saved (once per exit),
+    /// and XCR0 is switched to the host's value if needed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mask the XCR0 state components the VMM is about to use
+    ///
+    void save_guest_xstate(uint64_t mask);
+
+    /// Load Guest Extended State
+    ///
+    /// Restores whatever save_guest_xstate() saved during this exit, along
+    /// with the guest's XCR0. This is called by the vcpu just before VM
+    /// entry.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void load_guest_xstate();
+
+    /// Profile
+    ///
+    /// This handler has a single list, keyed by 0.
+    /// See delegate_profile for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the delegate profile for this handler
+    ///
+    delegate_profile &profile() noexcept
+    { return m_profile; }
+
 public:
 
     /// @cond
@@ -142,11 +211,27 @@ public:
 
     /// @endcond
 
+private:
+
+    VIRTUAL void xsave(uint8_t *area, uint64_t mask) noexcept;
+    VIRTUAL void xrstor(uint8_t *area, uint64_t mask) noexcept;
+    VIRTUAL void write_xcr0(uint64_t val);
+
 private:
 
     vcpu *m_vcpu;
     std::list<handler_delegate_t> m_handlers;
 
+    uint64_t m_host_xcr0;
+    uint64_t m_guest_xcr0;
+
+    uint64_t m_saved{};
+    bool m_switched{};
+
+    std::unique_ptr<uint8_t, void(*)(uint8_t *)> m_xsave_area;
+
+    delegate_profile m_profile{"xsetbv"};
+
 public:
 
     /// @cond
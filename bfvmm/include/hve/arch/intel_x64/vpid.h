@@ -51,10 +51,23 @@ class vcpu;
 ///
 /// Provides an interface for enabling VPID
 ///
+/// Each vpid_handler leases a VPID from a global, lock-free allocator for
+/// as long as it lives, and returns it when it is destroyed. Returned IDs
+/// are recycled. The previous owner of a recycled ID may have left TLB
+/// entries behind on any core it ran on, so the stale entries are
+/// invalidated (single-context INVVPID) on each core, before the first VM
+/// entry that uses the ID on that core. If all
+/// 65,535 IDs are leased, the vCPU runs with VPID disabled rather than
+/// aliasing another vCPU's ID.
+///
 class EXPORT_EAPIS_HVE vpid_handler
 {
 public:
 
+    /// Number of VPIDs that can be leased (VPID 0 belongs to the host)
+    ///
+    static constexpr std::size_t max_vpids = 0xFFFF;
+
     /// Constructor
     ///
     /// @expects
@@ -67,17 +80,19 @@ public:
 
     /// Destructor
     ///
+    /// Returns the VPID to the allocator
+    ///
     /// @expects
     /// @ensures
     ///
-    ~vpid_handler() = default;
+    ~vpid_handler();
 
     /// Get ID
     ///
     /// @expects
     /// @ensures
     ///
-    /// @return Returns the VPID
+    /// @return Returns the VPID, or 0 if no VPID could be leased
     ///
     vmcs_n::value_type id() const noexcept;
 
@@ -95,17 +110,31 @@ public:
     ///
     void disable();
 
+    /// Load
+    ///
+    /// Invalidates the TLB entries left behind by a previous owner of this
+    /// VPID on the current core, if that has not been done yet. This is
+    /// called by the vcpu just before VM entry.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void load();
+
 private:
 
     vcpu *m_vcpu;
     vmcs_n::value_type m_id;
 
+    bool m_flush{false};
+    uint64_t m_flushed_cores{0};
+
 public:
 
     /// @cond
 
-    vpid_handler(vpid_handler &&) = default;
-    vpid_handler &operator=(vpid_handler &&) = default;
+    vpid_handler(vpid_handler &&other) noexcept;
+    vpid_handler &operator=(vpid_handler &&other) noexcept;
 
     vpid_handler(const vpid_handler &) = delete;
     vpid_handler &operator=(const vpid_handler &) = delete;
@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EAPIS_TEST_BENCH_H
+#define EAPIS_TEST_BENCH_H
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+// -----------------------------------------------------------------------------
+// Benchmark Support
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The benchmarks are regular unit tests that are hidden (tagged "[.]"), so
+// they are built with the same mocks as the tests, but are skipped by
+// ctest. To run them, pass the "[bench]" tag to the test binary:
+//
+//     ./bench_mmap "[bench]"
+//
+// EAPIS_BENCH_SCALE (default 1) multiplies the iteration counts, which is
+// useful when a change needs to be measured more precisely.
+//
+
+namespace bench
+{
+
+using clock = std::chrono::steady_clock;
+
+inline uint64_t
+scale()
+{
+    static const uint64_t s_scale = [] {
+        const auto str = std::getenv("EAPIS_BENCH_SCALE");
+        const auto val = str != nullptr ? std::strtoull(str, nullptr, 10) : 0ULL;
+
+        return val != 0 ? val : 1ULL;
+    }();
+
+    return s_scale;
+}
+
+inline uint64_t
+ns_since(clock::time_point start)
+{
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count()
+    );
+}
+
+template<typename F>
+inline uint64_t
+elapsed_ns(F &&f)
+{
+    const auto start = clock::now();
+    f();
+    return ns_since(start);
+}
+
+/// Do Not Optimize
+///
+/// Keeps the compiler from discarding a result that the benchmark only
+/// computes for its cost.
+///
+template<typename T>
+inline void
+do_not_optimize(const T &val)
+{ asm volatile("" : : "r,m"(val) : "memory"); }
+
+inline void
+header(const char *title, const char *extra = "")
+{
+    std::printf("\n%s\n", title);
+    std::printf("%-48s %12s %10s %s\n", "case", "ops", "ns/op", extra);
+}
+
+inline void
+report(const std::string &name, uint64_t ops, uint64_t ns, const std::string &extra = "")
+{
+    const auto ns_per_op = ops != 0 ? static_cast<double>(ns) / static_cast<double>(ops) : 0.0;
+    std::printf("%-48s %12" PRIu64 " %10.1f %s\n", name.c_str(), ops, ns_per_op, extra.c_str());
+}
+
+}
+
+#endif
@@ -21,8 +21,9 @@
 
 #ifdef BF_INTEL_X64
 
-#include "../hve/arch/intel_x64/apis.h"
 #include "../hve/arch/intel_x64/mtrrs.h"
+#include "../hve/arch/intel_x64/vcpu.h"
+
 using namespace eapis::intel_x64;
 
 constexpr auto uc = ept::mmap::memory_type::uncacheable;
@@ -107,49 +108,6 @@ add_variable_range(uint8_t vnum, mtrrs::range_t range, bool disabled = false)
     ::intel_x64::msrs::set(ia32_mtrr_physmask::addr + (vnum * 2), ia32_mtrr_physmask);
 }
 
-inline apis *
-setup_eapis(MockRepository &mocks)
-{
-    auto eapis = mocks.Mock<apis>();
-
-    mocks.OnCall(eapis, apis::set_eptp);
-    mocks.OnCall(eapis, apis::disable_ept);
-    mocks.OnCall(eapis, apis::enable_vpid);
-    mocks.OnCall(eapis, apis::disable_vpid);
-    mocks.OnCall(eapis, apis::add_wrcr0_handler);
-    mocks.OnCall(eapis, apis::add_rdcr3_handler);
-    mocks.OnCall(eapis, apis::add_wrcr3_handler);
-    mocks.OnCall(eapis, apis::add_wrcr4_handler);
-    mocks.OnCall(eapis, apis::add_cpuid_handler);
-    mocks.OnCall(eapis, apis::add_ept_misconfiguration_handler);
-    mocks.OnCall(eapis, apis::add_ept_read_violation_handler);
-    mocks.OnCall(eapis, apis::add_ept_write_violation_handler);
-    mocks.OnCall(eapis, apis::add_ept_execute_violation_handler);
-    mocks.OnCall(eapis, apis::add_external_interrupt_handler);
-    mocks.OnCall(eapis, apis::disable_external_interrupts);
-    mocks.OnCall(eapis, apis::trap_on_next_interrupt_window);
-    mocks.OnCall(eapis, apis::disable_interrupt_window);
-    mocks.OnCall(eapis, apis::add_interrupt_window_handler);
-    mocks.OnCall(eapis, apis::is_interrupt_window_open);
-    mocks.OnCall(eapis, apis::inject_external_interrupt);
-    mocks.OnCall(eapis, apis::add_io_instruction_handler);
-    mocks.OnCall(eapis, apis::trap_all_io_instruction_accesses);
-    mocks.OnCall(eapis, apis::pass_through_all_io_instruction_accesses);
-    mocks.OnCall(eapis, apis::add_monitor_trap_handler);
-    mocks.OnCall(eapis, apis::enable_monitor_trap_flag);
-    mocks.OnCall(eapis, apis::add_mov_dr_handler);
-    mocks.OnCall(eapis, apis::trap_all_rdmsr_accesses);
-    mocks.OnCall(eapis, apis::pass_through_all_rdmsr_accesses);
-    mocks.OnCall(eapis, apis::add_rdmsr_handler);
-    mocks.OnCall(eapis, apis::trap_all_wrmsr_accesses);
-    mocks.OnCall(eapis, apis::pass_through_all_wrmsr_accesses);
-    mocks.OnCall(eapis, apis::add_wrmsr_handler);
-    mocks.OnCall(eapis, apis::add_xsetbv_handler);
-    mocks.OnCall(eapis, apis::add_handler);
-
-    return eapis;
-}
-
 inline bfvmm::intel_x64::vmcs *
 setup_vmcs(MockRepository &mocks)
 {
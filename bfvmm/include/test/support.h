@@ -22,6 +22,8 @@
 #ifndef EAPIS_TEST_SUPPORT_H
 #define EAPIS_TEST_SUPPORT_H
 
+#include <memory>
+
 #include <bfarch.h>
 #include <bfvmm/test/support.h>
 
@@ -38,4 +40,25 @@ void setup_eapis_test_support()
 #endif
 }
 
+#ifdef BF_INTEL_X64
+
+/// Make vCPU
+///
+/// Creates a vCPU (or a subclass of one, like a static_vcpu) on top of the
+/// bfvmm mocks. The VMCS fields that the vCPU reads while it is being
+/// constructed are taken from g_vmcs_fields, so set those first. Tests
+/// that need a known clock can pass their own global state.
+///
+template<typename V = eapis::intel_x64::vcpu>
+inline std::unique_ptr<V>
+make_vcpu(
+    vcpuid::type id = 0,
+    eapis::intel_x64::vcpu_global_state_t *state = nullptr)
+{
+    setup_eapis_test_support();
+    return std::make_unique<V>(id, state);
+}
+
+#endif
+
 #endif
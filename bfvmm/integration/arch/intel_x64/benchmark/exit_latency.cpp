@@ -0,0 +1,583 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// TIDY_EXCLUSION=-cert-err58-cpp
+//
+// Reason:
+//     This test triggers on the use of a std::mutex being globally defined
+//     from the EPT map.
+//
+
+#include <algorithm>
+#include <array>
+
+#include <bfcallonce.h>
+
+#include <bfvmm/vcpu/vcpu_factory.h>
+#include <eapis/hve/arch/intel_x64/vcpu.h>
+
+using namespace eapis::intel_x64;
+
+// -----------------------------------------------------------------------------
+// Samples
+// -----------------------------------------------------------------------------
+
+namespace test
+{
+
+#ifndef SAMPLE_SIZE
+#define SAMPLE_SIZE 1024
+#endif
+
+class samples_t
+{
+public:
+
+    void add(uint64_t ticks) noexcept
+    {
+        if (m_num < m_samples.size()) {
+            m_samples.at(m_num++) = ticks;
+        }
+    }
+
+    void report(const char *name)
+    {
+        bfdebug_info(0, name);
+        bfdebug_subndec(0, "samples", m_num);
+
+        if (m_num == 0) {
+            return;
+        }
+
+        std::sort(m_samples.begin(), m_samples.begin() + m_num);
+
+        bfdebug_subndec(0, "min", m_samples.at(0));
+        bfdebug_subndec(0, "median", m_samples.at(m_num / 2));
+        bfdebug_subndec(0, "p99", m_samples.at((m_num * 99) / 100));
+        bfdebug_subndec(0, "max", m_samples.at(m_num - 1));
+    }
+
+private:
+
+    std::size_t m_num{};
+    std::array<uint64_t, SAMPLE_SIZE> m_samples{};
+};
+
+// Note:
+//
+// Every sample is the number of TSC ticks the guest sees around a single
+// exiting instruction, i.e. a full exit / handler / entry round trip. The
+// "rdtsc" row is the cost of the measurement itself. EPT violations are
+// measured with the page's access removed: the violation handler restores
+// access and single steps the instruction with the monitor trap flag, and
+// the MTF handler removes access again, so each of these samples is two
+// round trips. The "interrupt window" row is measured in the VMM instead,
+// from an external interrupt exit to the interrupt-window exit that
+// injects it back into the guest. The benchmark does not generate these
+// interrupts: the row passively samples whichever host interrupts happen
+// to arrive while it runs, so its sample count varies from run to run.
+//
+// The benchmark only runs on vCPU 0, from its HLT delegate.
+//
+
+samples_t g_rdtsc;
+samples_t g_cpuid;
+samples_t g_rdmsr;
+samples_t g_wrmsr;
+samples_t g_in;
+samples_t g_out;
+samples_t g_wrcr0;
+samples_t g_rdcr3;
+samples_t g_wrcr3;
+samples_t g_wrcr4;
+samples_t g_ept_read;
+samples_t g_ept_write;
+samples_t g_ept_execute;
+samples_t g_interrupt_window;
+
+template<typename F>
+void
+measure(samples_t &samples, F op)
+{
+    for (auto i = 0; i < SAMPLE_SIZE; i++) {
+        const auto start = ::x64::read_tsc::get();
+        op();
+        samples.add(::x64::read_tsc::get() - start);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Guest
+// -----------------------------------------------------------------------------
+
+constexpr auto bench_cpuid_leaf = 42U;
+constexpr auto bench_ctl_leaf = 43U;
+constexpr auto bench_msr = 0x3BU;           // IA32_TSC_ADJUST (writes ignored)
+constexpr auto bench_port = 0x80U;          // POST codes (emulated)
+
+constexpr auto ctl_unprotect = 0U;
+constexpr auto ctl_protect_read = 1U;
+constexpr auto ctl_protect_write = 2U;
+constexpr auto ctl_protect_execute = 3U;
+
+bfn::once_flag flag;
+ept::mmap g_guest_map;
+
+bool g_running{};
+uint64_t g_irq_tsc{};
+
+alignas(0x1000) std::array<uint8_t, 0x1000> g_buffer;
+
+// Note:
+//
+// Execute protection is applied to the whole 4k page that holds
+// bench_execute_target, so nothing else can live on that page: any other
+// code there would take the same violation. The target is written in
+// assembly, so that it can be given its own section whose contents are
+// exactly one page (a RET and padding). The section is page aligned, and
+// its size is a multiple of a page, so whatever the linker places before
+// or after it starts on a different page.
+//
+
+extern "C" void bench_execute_target();
+
+asm(
+    ".pushsection .text.bench_exec, \"ax\", @progbits\n"
+    ".balign 0x1000\n"
+    ".type bench_execute_target, @function\n"
+    "bench_execute_target:\n"
+    "    ret\n"
+    ".size bench_execute_target, . - bench_execute_target\n"
+    ".balign 0x1000, 0xCC\n"
+    ".popsection\n"
+);
+
+void
+ctl(uint32_t op)
+{ ::x64::cpuid::get(bench_ctl_leaf, 0, op, 0); }
+
+void
+benchmark(bfobject *obj)
+{
+    bfignored(obj);
+
+    auto buffer = reinterpret_cast<volatile uint8_t *>(g_buffer.data());
+    const auto cr3 = ::intel_x64::cr3::get();
+
+    g_running = true;
+
+    measure(g_rdtsc, [] { });
+    measure(g_cpuid, [] { ::x64::cpuid::get(bench_cpuid_leaf, 0, 0, 0); });
+    measure(g_rdmsr, [] { ::x64::msrs::get(bench_msr); });
+    measure(g_wrmsr, [] { ::x64::msrs::set(bench_msr, 0); });
+    measure(g_in, [] { ::x64::portio::inb(bench_port); });
+    measure(g_out, [] { ::x64::portio::outb(bench_port, 0); });
+    measure(g_wrcr0, [] { ::intel_x64::cr0::set(0); });
+    measure(g_rdcr3, [] { ::intel_x64::cr3::get(); });
+    measure(g_wrcr3, [&] { ::intel_x64::cr3::set(cr3); });
+    measure(g_wrcr4, [] { ::intel_x64::cr4::set(0); });
+
+    ctl(ctl_protect_read);
+    measure(g_ept_read, [&] { const uint8_t val = buffer[0]; bfignored(val); });
+
+    ctl(ctl_protect_write);
+    measure(g_ept_write, [&] { buffer[0] = 0; });
+
+    ctl(ctl_protect_execute);
+    measure(g_ept_execute, [] { bench_execute_target(); });
+
+    ctl(ctl_unprotect);
+
+    g_running = false;
+
+    g_rdtsc.report("rdtsc");
+    g_cpuid.report("cpuid");
+    g_rdmsr.report("rdmsr");
+    g_wrmsr.report("wrmsr");
+    g_in.report("in");
+    g_out.report("out");
+    g_wrcr0.report("mov to cr0");
+    g_rdcr3.report("mov from cr3");
+    g_wrcr3.report("mov to cr3");
+    g_wrcr4.report("mov to cr4");
+    g_ept_read.report("ept read violation + mtf");
+    g_ept_write.report("ept write violation + mtf");
+    g_ept_execute.report("ept execute violation + mtf");
+    g_interrupt_window.report("interrupt window");
+}
+
+// -----------------------------------------------------------------------------
+// vCPU
+// -----------------------------------------------------------------------------
+
+class vcpu : public eapis::intel_x64::vcpu
+{
+public:
+    explicit vcpu(vcpuid::type id) :
+        eapis::intel_x64::vcpu{id}
+    {
+        if (id != 0) {
+            return;
+        }
+
+        bfn::call_once(flag, [&] {
+            ept::identity_map(
+                g_guest_map,
+                MAX_PHYS_ADDR
+            );
+        });
+
+        m_buffer_gpa = g_mm->virtptr_to_physint(g_buffer.data());
+        m_execute_gpa = g_mm->virtptr_to_physint(reinterpret_cast<void *>(&bench_execute_target));
+
+        this->split_4k(m_buffer_gpa);
+        this->split_4k(m_execute_gpa);
+
+        this->add_hlt_delegate(
+            hlt_delegate_t::create<benchmark>()
+        );
+
+        this->add_exit_handler(
+            ::handler_delegate_t::create<vcpu, &vcpu::exit_handler>(this)
+        );
+
+        this->add_cpuid_handler(
+            bench_cpuid_leaf,
+            cpuid_handler::handler_delegate_t::create<vcpu, &vcpu::cpuid_handler>(this)
+        );
+
+        this->add_cpuid_handler(
+            bench_ctl_leaf,
+            cpuid_handler::handler_delegate_t::create<vcpu, &vcpu::ctl_handler>(this)
+        );
+
+        this->add_rdmsr_handler(
+            bench_msr,
+            rdmsr_handler::handler_delegate_t::create<vcpu, &vcpu::rdmsr_handler>(this)
+        );
+
+        this->add_wrmsr_handler(
+            bench_msr,
+            wrmsr_handler::handler_delegate_t::create<vcpu, &vcpu::wrmsr_handler>(this)
+        );
+
+        this->add_io_instruction_handler(
+            bench_port,
+            io_instruction_handler::handler_delegate_t::create<vcpu, &vcpu::io_handler>(this),
+            io_instruction_handler::handler_delegate_t::create<vcpu, &vcpu::io_handler>(this)
+        );
+
+        this->add_wrcr0_handler(
+            0xFFFFFFFFFFFFFFFF,
+            control_register_handler::handler_delegate_t::create<vcpu, &vcpu::wrcr0_handler>(this)
+        );
+
+        this->add_rdcr3_handler(
+            control_register_handler::handler_delegate_t::create<vcpu, &vcpu::cr3_handler>(this)
+        );
+
+        this->add_wrcr3_handler(
+            control_register_handler::handler_delegate_t::create<vcpu, &vcpu::cr3_handler>(this)
+        );
+
+        this->add_wrcr4_handler(
+            0xFFFFFFFFFFFFFFFF,
+            control_register_handler::handler_delegate_t::create<vcpu, &vcpu::wrcr4_handler>(this)
+        );
+
+        this->add_ept_read_violation_handler(
+            ept_violation_handler::handler_delegate_t::create<vcpu, &vcpu::ept_violation_handler>(this)
+        );
+
+        this->add_ept_write_violation_handler(
+            ept_violation_handler::handler_delegate_t::create<vcpu, &vcpu::ept_violation_handler>(this)
+        );
+
+        this->add_ept_execute_violation_handler(
+            ept_violation_handler::handler_delegate_t::create<vcpu, &vcpu::ept_violation_handler>(this)
+        );
+
+        this->add_monitor_trap_handler(
+            monitor_trap_handler::handler_delegate_t::create<vcpu, &vcpu::monitor_trap_handler>(this)
+        );
+
+        this->add_external_interrupt_handler(
+            external_interrupt_handler::handler_delegate_t::create<vcpu, &vcpu::external_interrupt_handler>(this)
+        );
+
+        this->set_eptp(g_guest_map);
+    }
+
+    ~vcpu() override = default;
+
+    bool
+    exit_handler(gsl::not_null<vcpu_t *> vcpu)
+    {
+        using namespace vmcs_n::exit_reason;
+        bfignored(vcpu);
+
+        if (g_irq_tsc != 0 && basic_exit_reason::get() == basic_exit_reason::interrupt_window) {
+            g_interrupt_window.add(::x64::read_tsc::get() - g_irq_tsc);
+            g_irq_tsc = 0;
+        }
+
+        return false;
+    }
+
+    bool
+    cpuid_handler(
+        gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+    { bfignored(vcpu); bfignored(info); return true; }
+
+    // Note:
+    //
+    // Read protecting the buffer also removes execute access. A read-only
+    // violation would need an execute-only entry (R = 0, W = 0, X = 1),
+    // which is an EPT misconfiguration on CPUs that do not report
+    // execute-only support in IA32_VMX_EPT_VPID_CAP. The buffer only
+    // holds data, so taking away X as well does not change what the
+    // guest's read measures.
+    //
+
+    bool
+    ctl_handler(
+        gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+    {
+        bfignored(info);
+
+        this->unprotect();
+
+        switch (vcpu->rcx() & 0xFFFFFFFF) {
+            case ctl_protect_read:
+                this->protect(m_buffer_gpa, true, true, true);
+                break;
+
+            case ctl_protect_write:
+                this->protect(m_buffer_gpa, false, true, false);
+                break;
+
+            case ctl_protect_execute:
+                this->protect(m_execute_gpa, false, false, true);
+                break;
+
+            default:
+                break;
+        }
+
+        return true;
+    }
+
+    bool
+    rdmsr_handler(
+        gsl::not_null<vcpu_t *> vcpu, rdmsr_handler::info_t &info)
+    { bfignored(vcpu); bfignored(info); return true; }
+
+    bool
+    wrmsr_handler(
+        gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info)
+    {
+        bfignored(vcpu);
+
+        info.ignore_write = true;
+        return true;
+    }
+
+    bool
+    io_handler(
+        gsl::not_null<vcpu_t *> vcpu, io_instruction_handler::info_t &info)
+    {
+        bfignored(vcpu);
+
+        info.ignore_write = true;
+        return true;
+    }
+
+    // Note:
+    //
+    // The CR0 / CR4 handlers trap every bit, so the guest's writes of 0
+    // always exit, and are then emulated as a write of the current value
+    // (and shadow). Outside of the benchmark, they defer to the default
+    // handlers.
+    //
+
+    bool
+    wrcr0_handler(
+        gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
+    {
+        bfignored(vcpu);
+
+        if (!g_running) {
+            return false;
+        }
+
+        info.val = vmcs_n::guest_cr0::get();
+        info.shadow = vmcs_n::cr0_read_shadow::get();
+
+        return true;
+    }
+
+    bool
+    cr3_handler(
+        gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
+    { bfignored(vcpu); bfignored(info); return false; }
+
+    bool
+    wrcr4_handler(
+        gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
+    {
+        bfignored(vcpu);
+
+        if (!g_running) {
+            return false;
+        }
+
+        info.val = vmcs_n::guest_cr4::get();
+        info.shadow = vmcs_n::cr4_read_shadow::get();
+
+        return true;
+    }
+
+    bool
+    ept_violation_handler(
+        gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+    {
+        bfignored(vcpu);
+        bfignored(info);
+
+        this->set_access(m_protected_gpa, true, true, true);
+        this->enable_monitor_trap_flag();
+
+        return true;
+    }
+
+    bool
+    monitor_trap_handler(
+        gsl::not_null<vcpu_t *> vcpu, monitor_trap_handler::info_t &info)
+    {
+        bfignored(vcpu);
+        bfignored(info);
+
+        if (m_protected_gpa != 0) {
+            this->set_access(m_protected_gpa, !m_read, !m_write, !m_execute);
+        }
+
+        return true;
+    }
+
+    bool
+    external_interrupt_handler(
+        gsl::not_null<vcpu_t *> vcpu, external_interrupt_handler::info_t &info)
+    {
+        bfignored(vcpu);
+
+        if (g_running && g_irq_tsc == 0) {
+            g_irq_tsc = ::x64::read_tsc::get();
+        }
+
+        this->queue_external_interrupt(info.vector);
+        return true;
+    }
+
+private:
+
+    void
+    split_4k(uintptr_t gpa)
+    {
+        const auto gpa_2m = bfn::upper(gpa, ::intel_x64::ept::pd::from);
+
+        if (g_guest_map.is_2m(gpa_2m)) {
+            ept::identity_map_convert_2m_to_4k(g_guest_map, gpa_2m);
+        }
+    }
+
+    void
+    set_access(uintptr_t gpa, bool read, bool write, bool execute)
+    {
+        using namespace ::intel_x64::ept::pt::entry;
+        auto [pte, unused] = g_guest_map.entry(gpa);
+
+        read ? read_access::enable(pte) : read_access::disable(pte);
+        write ? write_access::enable(pte) : write_access::disable(pte);
+        execute ? execute_access::enable(pte) : execute_access::disable(pte);
+
+        ::intel_x64::vmx::invept_global();
+    }
+
+    void
+    protect(uintptr_t gpa, bool read, bool write, bool execute)
+    {
+        m_protected_gpa = gpa;
+        m_read = read;
+        m_write = write;
+        m_execute = execute;
+
+        this->set_access(gpa, !read, !write, !execute);
+    }
+
+    void
+    unprotect()
+    {
+        if (m_protected_gpa != 0) {
+            this->set_access(m_protected_gpa, true, true, true);
+            m_protected_gpa = 0;
+        }
+    }
+
+private:
+
+    uintptr_t m_buffer_gpa{};
+    uintptr_t m_execute_gpa{};
+
+    uintptr_t m_protected_gpa{};
+    bool m_read{};
+    bool m_write{};
+    bool m_execute{};
+
+public:
+
+    /// @cond
+
+    vcpu(vcpu &&) = delete;
+    vcpu &operator=(vcpu &&) = delete;
+
+    vcpu(const vcpu &) = delete;
+    vcpu &operator=(const vcpu &) = delete;
+
+    /// @endcond
+};
+
+}
+
+// -----------------------------------------------------------------------------
+// vCPU Factory
+// -----------------------------------------------------------------------------
+
+namespace bfvmm
+{
+
+std::unique_ptr<vcpu>
+vcpu_factory::make(vcpuid::type vcpuid, bfobject *obj)
+{
+    bfignored(obj);
+    return std::make_unique<test::vcpu>(vcpuid);
+}
+
+}
@@ -23,7 +23,6 @@
 #include <algorithm>
 
 #include <bfvmm/vcpu/vcpu_factory.h>
-#include <eapis/hve/arch/intel_x64/time.h>
 #include <eapis/hve/arch/intel_x64/vcpu.h>
 
 using namespace eapis::intel_x64;
@@ -86,27 +85,24 @@ public:
 
     ~vcpu() override
     {
+        if (m_sample.empty()) {
+            return;
+        }
+
         uint64_t sum = 0;
         for (const auto &sample : m_sample) {
             sum += sample;
         }
 
-        uint64_t tsc = sum >> 8; // Divide by SAMPLE_SIZE
-        uint64_t ticks_per_usec = eapis::intel_x64::time::pet_freq_MHz();
-        uint64_t div = ::intel_x64::msrs::ia32_vmx_misc::preemption_timer_decrement::get();
-        uint64_t bus = eapis::intel_x64::time::bus_freq_MHz();
-
-        // NOTE: we should try to avoid / here. We could use multiplies and shifts
-        // or we could start a static table of 'ticks_per_usec', and then at initialization
-        // assign a conversion function that has compile-time constants so the compiler
-        // will do the mult/shift for us.
+        uint64_t tsc = sum / m_sample.size();
+        const auto &clock = this->global_state()->clock;
 
-        if (ticks_per_usec != 0) {
-            bfdebug_ndec(0, "BUS (MHz)", bus);
-            bfdebug_ndec(0, "TSC (MHz)", eapis::intel_x64::time::tsc_freq_MHz(bus));
-            bfdebug_ndec(0, "Avg vmentry->vmexit latency (us)", tsc / ticks_per_usec);
+        if (clock.valid()) {
+            bfdebug_ndec(0, "TSC (MHz)", clock.tsc_freq_hz() / 1000000);
+            bfdebug_ndec(0, "PET (MHz)", clock.pet_freq_hz() / 1000000);
+            bfdebug_ndec(0, "Avg vmentry->vmexit latency (ns)", clock.tsc_to_ns(tsc));
             bfdebug_ndec(0, "Avg vmentry->vmexit latency TSC ticks", tsc);
-            bfdebug_ndec(0, "Avg vmentry->vmexit latency PET ticks", tsc >> div);
+            bfdebug_ndec(0, "Avg vmentry->vmexit latency PET ticks", clock.tsc_to_pet(tsc));
         }
     }
 
@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <array>
+#include <algorithm>
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis::intel_x64
+{
+
+bitmap::template_type
+bitmap::make_template(const bitmap_policy &policy)
+{
+    auto page = static_cast<uint8_t *>(alloc_page());
+    std::copy(policy.data().begin(), policy.data().end(), page);
+
+    return template_type(page, free_page);
+}
+
+const bitmap::template_type &
+bitmap::default_msr_template()
+{
+    static const auto s_template = make_template(default_msr_policy);
+    return s_template;
+}
+
+const bitmap::template_type &
+bitmap::default_io_template()
+{
+    static const auto s_template = make_template(default_io_policy);
+    return s_template;
+}
+
+bitmap::bitmap(
+    gsl::not_null<vcpu *> vcpu, template_type tmpl, vmcs_n::value_type field
+) :
+    m_vcpu{vcpu},
+    m_page{std::move(tmpl)},
+    m_field{field}
+{ m_vcpu->vmcs_write(m_field, g_mm->virtptr_to_physint(m_page.get())); }
+
+// -----------------------------------------------------------------------------
+// Modifiers
+// -----------------------------------------------------------------------------
+
+void
+bitmap::set(std::size_t bit)
+{
+    const auto mask = static_cast<uint8_t>(1U << (bit & 7));
+
+    if ((m_page.get()[bit >> 3] & mask) == 0) {
+        this->make_private();
+        m_page.get()[bit >> 3] |= mask;
+    }
+}
+
+void
+bitmap::clear(std::size_t bit)
+{
+    const auto mask = static_cast<uint8_t>(1U << (bit & 7));
+
+    if ((m_page.get()[bit >> 3] & mask) != 0) {
+        this->make_private();
+        m_page.get()[bit >> 3] &= static_cast<uint8_t>(~mask);
+    }
+}
+
+void
+bitmap::fill(std::size_t offset, std::size_t len, uint8_t val)
+{
+    auto begin = m_page.get() + offset;
+    auto end = begin + len;
+
+    auto differs = [val](const auto byte) {
+        return byte != val;
+    };
+
+    if (std::any_of(begin, end, differs)) {
+        this->make_private();
+        std::fill(m_page.get() + offset, m_page.get() + offset + len, val);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void
+bitmap::make_private()
+{
+    if (m_private) {
+        return;
+    }
+
+    auto page = static_cast<uint8_t *>(alloc_page());
+    std::copy(m_page.get(), m_page.get() + bitmap_policy::size, page);
+
+    m_page = template_type(page, free_page);
+    m_private = true;
+
+    m_vcpu->vmcs_write(m_field, g_mm->virtptr_to_physint(m_page.get()));
+}
+
+}
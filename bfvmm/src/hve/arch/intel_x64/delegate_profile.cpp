@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <vector>
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/delegate_profile.h>
+
+namespace eapis::intel_x64
+{
+
+void
+delegate_profile::add_call(
+    const void *d, uint64_t key, uint64_t position, bool hit, uint64_t ticks)
+{
+    auto &stats = m_delegates[d];
+
+    stats.key = key;
+    stats.position = position;
+    stats.calls++;
+    stats.hits += hit ? 1 : 0;
+    stats.ticks += ticks;
+}
+
+void
+delegate_profile::forget(uint64_t key)
+{
+    m_lists.erase(key);
+
+    for (auto iter = m_delegates.begin(); iter != m_delegates.end();) {
+        if (iter->second.key == key) {
+            iter = m_delegates.erase(iter);
+        }
+        else {
+            ++iter;
+        }
+    }
+}
+
+void
+delegate_profile::dump() const
+{
+    bfdebug_info(0, m_name);
+
+    std::vector<std::pair<uint64_t, list_stats_t>> lists(m_lists.begin(), m_lists.end());
+    std::sort(lists.begin(), lists.end(), [](const auto &a, const auto &b) {
+        return a.first < b.first;
+    });
+
+    std::vector<delegate_stats_t> delegates;
+    for (const auto &[d, stats] : m_delegates) {
+        bfignored(d);
+        delegates.push_back(stats);
+    }
+
+    std::sort(delegates.begin(), delegates.end(), [](const auto &a, const auto &b) {
+        return a.key != b.key ? a.key < b.key : a.position < b.position;
+    });
+
+    for (const auto &[key, list] : lists) {
+        bfdebug_subnhex(0, "list", key);
+        bfdebug_subndec(0, "walks", list.walks);
+        bfdebug_subndec(0, "delegates called", list.calls);
+        bfdebug_subndec(0, "handled", list.hits);
+
+        for (const auto &stats : delegates) {
+            if (stats.key != key) {
+                continue;
+            }
+
+            bfdebug_subndec(0, "position", stats.position);
+            bfdebug_subndec(0, "  calls", stats.calls);
+            bfdebug_subndec(0, "  hits", stats.hits);
+            bfdebug_subndec(0, "  ticks per call", stats.ticks / stats.calls);
+        }
+    }
+}
+
+}
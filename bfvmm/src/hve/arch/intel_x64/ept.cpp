@@ -44,8 +44,10 @@ void ept_handler::set_eptp(ept::mmap *map)
             ept_pointer::accessed_and_dirty_flags::disable();
             ept_pointer::page_walk_length_minus_one::set(3U);
 
-            enable_ept::enable();
-            unrestricted_guest::enable();
+            m_vcpu->vmcs_set_bits(
+                secondary_processor_based_vm_execution_controls::addr,
+                enable_ept::mask | unrestricted_guest::mask
+            );
         }
 
         ept_pointer::phys_addr::set(map->eptp());
@@ -59,8 +61,10 @@ void ept_handler::set_eptp(ept::mmap *map)
             ept_pointer::accessed_and_dirty_flags::disable();
             ept_pointer::page_walk_length_minus_one::set(0);
 
-            enable_ept::disable();
-            unrestricted_guest::disable();
+            m_vcpu->vmcs_clear_bits(
+                secondary_processor_based_vm_execution_controls::addr,
+                enable_ept::mask | unrestricted_guest::mask
+            );
         }
 
         ept_pointer::phys_addr::set(0);
@@ -0,0 +1,220 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis::intel_x64
+{
+
+static auto
+hash(uint64_t reason, uint64_t rip, uint64_t cr3) noexcept
+{
+    const auto key = rip ^ (cr3 >> 12) ^ (reason << 56);
+    return ((key * 0x9E3779B97F4A7C15ULL) >> 32) % exit_hotspot_num_entries;
+}
+
+exit_hotspot_handler::exit_hotspot_handler(
+    gsl::not_null<vcpu *> vcpu)
+{
+    vcpu->add_exit_handler(
+        ::handler_delegate_t::create<exit_hotspot_handler, &exit_hotspot_handler::handle_exit>(this)
+    );
+
+    vcpu->emulate_cpuid(
+        exit_hotspot_cpuid_leaf,
+        cpuid_handler::handler_delegate_t::create<exit_hotspot_handler, &exit_hotspot_handler::handle_cpuid>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Hot Spots
+// -----------------------------------------------------------------------------
+
+void
+exit_hotspot_handler::set_period(uint64_t period) noexcept
+{
+    m_period = period;
+    m_countdown = period;
+    m_samples = 0;
+    m_used = 0;
+
+    m_entries.fill({});
+}
+
+std::vector<exit_hotspot_entry_t>
+exit_hotspot_handler::hotspots() const
+{
+    std::vector<exit_hotspot_entry_t> entries;
+
+    for (const auto &entry : m_entries) {
+        if (entry.count != 0) {
+            entries.push_back(entry);
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+        return a.count > b.count;
+    });
+
+    return entries;
+}
+
+void
+exit_hotspot_handler::dump_hotspots() const
+{
+    bfdebug_info(0, "exit hot spots");
+    bfdebug_subndec(0, "period", m_period);
+    bfdebug_subndec(0, "samples", m_samples);
+
+    for (const auto &entry : this->hotspots()) {
+        bfdebug_info(0, vmcs_n::exit_reason::basic_exit_reason::description(entry.reason));
+        bfdebug_subnhex(0, "rip", entry.rip);
+        bfdebug_subnhex(0, "cr3", entry.cr3);
+        bfdebug_subndec(0, "count", entry.count);
+        bfdebug_subndec(0, "error", entry.error);
+    }
+}
+
+// Note:
+//
+// Space-saving: a tuple that is already in the table has its count
+// incremented. Otherwise it takes an empty slot if there is one, or
+// replaces the entry with the smallest count, whose count it inherits
+// (plus 1) and records as its error.
+//
+
+void
+exit_hotspot_handler::sample(uint64_t reason, uint64_t rip, uint64_t cr3) noexcept
+{
+    m_samples++;
+
+    auto min = &m_entries[0];
+    const auto start = hash(reason, rip, cr3);
+
+    for (auto i = 0ULL; i < exit_hotspot_num_entries; i++) {
+        auto &entry = m_entries[(start + i) % exit_hotspot_num_entries];
+
+        if (entry.count == 0) {
+            entry = {rip, cr3, 1, 0, gsl::narrow_cast<uint32_t>(reason)};
+            m_used++;
+            return;
+        }
+
+        if (entry.rip == rip && entry.cr3 == cr3 && entry.reason == reason) {
+            entry.count++;
+            return;
+        }
+
+        if (entry.count < min->count) {
+            min = &entry;
+        }
+    }
+
+    const auto error = std::min<uint64_t>(min->count, 0xFFFFFFFF);
+    *min = {rip, cr3, min->count + 1, gsl::narrow_cast<uint32_t>(error), gsl::narrow_cast<uint32_t>(reason)};
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+exit_hotspot_handler::handle_exit(gsl::not_null<vcpu_t *> vcpu)
+{
+    using namespace vmcs_n;
+
+    if (m_period == 0 || --m_countdown != 0) {
+        return false;
+    }
+
+    m_countdown = m_period;
+
+    const auto reason = exit_reason::basic_exit_reason::get();
+    if (reason == exit_reason::basic_exit_reason::cpuid && vcpu->rax() == exit_hotspot_cpuid_leaf) {
+        return false;
+    }
+
+    this->sample(reason, vcpu->rip(), guest_cr3::get());
+    return false;
+}
+
+void
+exit_hotspot_handler::info(cpuid_handler::info_t &info) const noexcept
+{
+    info.rax = m_period & 0x00000000FFFFFFFFULL;
+    info.rbx = m_used;
+    info.rcx = exit_hotspot_num_entries;
+    info.rdx = m_samples & 0x00000000FFFFFFFFULL;
+}
+
+bool
+exit_hotspot_handler::handle_cpuid(
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+{
+    const auto op = vcpu->rcx() & 0xFF;
+    const auto index = (vcpu->rcx() & 0x00000000FFFFFFFFULL) >> 8;
+
+    // The table holds kernel and user RIPs and CR3s from every process, so
+    // it is only exported to the guest's kernel. The leaf is emulated, so
+    // a user mode caller gets all 0.
+
+    if (vmcs_n::guest_ss_access_rights::dpl::get() != 0) {
+        return true;
+    }
+
+    switch (op) {
+        case exit_hotspot_op_set_period:
+            this->set_period(vcpu->rdx() & 0x00000000FFFFFFFFULL);
+            this->info(info);
+            break;
+
+        case exit_hotspot_op_read_lo:
+            if (index < exit_hotspot_num_entries) {
+                const auto &entry = m_entries[index];
+                info.rax = entry.rip & 0x00000000FFFFFFFFULL;
+                info.rbx = entry.rip >> 32;
+                info.rcx = entry.cr3 & 0x00000000FFFFFFFFULL;
+                info.rdx = entry.cr3 >> 32;
+            }
+            break;
+
+        case exit_hotspot_op_read_hi:
+            if (index < exit_hotspot_num_entries) {
+                const auto &entry = m_entries[index];
+                info.rax = entry.count & 0x00000000FFFFFFFFULL;
+                info.rbx = entry.count >> 32;
+                info.rcx = entry.error;
+                info.rdx = entry.reason;
+            }
+            break;
+
+        default:
+            this->info(info);
+            break;
+    }
+
+    return true;
+}
+
+}
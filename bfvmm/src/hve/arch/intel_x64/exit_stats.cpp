@@ -0,0 +1,161 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstring>
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis::intel_x64
+{
+
+static auto
+bucket(uint64_t ticks) noexcept
+{
+    const auto log2 = 63U - static_cast<uint32_t>(__builtin_clzll(ticks | 1));
+
+    if (log2 < exit_stats_bucket_shift) {
+        return 0U;
+    }
+
+    if (log2 - exit_stats_bucket_shift >= exit_stats_num_buckets) {
+        return exit_stats_num_buckets - 1;
+    }
+
+    return log2 - exit_stats_bucket_shift;
+}
+
+exit_stats_handler::exit_stats_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu},
+    m_page{static_cast<exit_stats_page_t *>(alloc_page()), free_page}
+{
+    std::memset(m_page.get(), 0, BAREFLANK_PAGE_SIZE);
+
+    m_page->magic = exit_stats_magic;
+    m_page->version = exit_stats_version;
+    m_page->num_reasons = exit_stats_num_reasons;
+    m_page->num_buckets = exit_stats_num_buckets;
+    m_page->vcpuid = vcpu->id();
+
+    vcpu->add_exit_handler(
+        ::handler_delegate_t::create<exit_stats_handler, &exit_stats_handler::handle_exit>(this)
+    );
+
+    vcpu->emulate_cpuid(
+        exit_stats_cpuid_leaf,
+        cpuid_handler::handler_delegate_t::create<exit_stats_handler, &exit_stats_handler::handle_cpuid>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Stats
+// -----------------------------------------------------------------------------
+
+void
+exit_stats_handler::record() noexcept
+{
+    if (m_start == 0) {
+        return;
+    }
+
+    const auto ticks = ::x64::read_tsc::get() - m_start;
+    const auto reason = std::min<uint64_t>(m_reason, exit_stats_num_reasons - 1);
+
+    m_page->exits++;
+    m_page->count[reason]++;
+    m_page->hist[reason][bucket(ticks)]++;
+
+    m_start = 0;
+}
+
+void
+exit_stats_handler::dump_stats() const
+{
+    bfdebug_info(0, "exit stats");
+    bfdebug_subndec(0, "vcpuid", m_page->vcpuid);
+    bfdebug_subndec(0, "exits", m_page->exits);
+
+    for (auto i = 0ULL; i < exit_stats_num_reasons; i++) {
+        if (m_page->count[i] != 0) {
+            bfdebug_subndec(
+                0, vmcs_n::exit_reason::basic_exit_reason::description(i), m_page->count[i]
+            );
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+exit_stats_handler::handle_exit(gsl::not_null<vcpu_t *> vcpu)
+{
+    using namespace vmcs_n;
+    bfignored(vcpu);
+
+    m_start = ::x64::read_tsc::get();
+    m_reason = m_vcpu->vmcs_read(exit_reason::addr) & exit_reason::basic_exit_reason::mask;
+
+    return false;
+}
+
+bool
+exit_stats_handler::handle_cpuid(
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+{
+    constexpr auto chunk_size = 16ULL;
+    constexpr auto num_chunks = (sizeof(exit_stats_page_t) + chunk_size - 1) / chunk_size;
+
+    const auto index = vcpu->rcx() & 0x00000000FFFFFFFFULL;
+
+    // The stats are only exported to the guest's kernel (bfack reads them
+    // through its relay driver). A user mode caller sees the leaf as if it
+    // had no data.
+
+    if (vmcs_n::guest_ss_access_rights::dpl::get() != 0 || index >= num_chunks) {
+        info.rax = 0;
+        info.rbx = 0;
+        info.rcx = 0;
+        info.rdx = 0;
+
+        return true;
+    }
+
+    // The page is zeroed in full, so the last chunk can safely read past
+    // the end of the stats.
+
+    std::array<uint32_t, 4> words{};
+    std::memcpy(
+        words.data(), reinterpret_cast<const uint8_t *>(m_page.get()) + (index * chunk_size), chunk_size
+    );
+
+    info.rax = words[0];
+    info.rbx = words[1];
+    info.rcx = words[2];
+    info.rdx = words[3];
+
+    return true;
+}
+
+}
@@ -0,0 +1,209 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <utility>
+
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis::intel_x64
+{
+
+static_assert((exit_trace_num_records & (exit_trace_num_records - 1)) == 0);
+
+exit_trace_handler::exit_trace_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    vcpu->add_exit_handler(
+        ::handler_delegate_t::create<exit_trace_handler, &exit_trace_handler::handle_exit>(this)
+    );
+
+    vcpu->emulate_cpuid(
+        exit_trace_cpuid_leaf,
+        cpuid_handler::handler_delegate_t::create<exit_trace_handler, &exit_trace_handler::handle_cpuid>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Ring
+// -----------------------------------------------------------------------------
+
+void
+exit_trace_handler::arm()
+{
+    if (m_records == nullptr) {
+        m_records = std::make_unique<exit_trace_record_t[]>(exit_trace_num_records);
+    }
+}
+
+void
+exit_trace_handler::enable()
+{
+    this->arm();
+    m_enabled = true;
+}
+
+void
+exit_trace_handler::record() noexcept
+{
+    using namespace vmcs_n;
+
+    const auto start = std::exchange(m_start, 0);
+    const auto skip = std::exchange(m_skip, false);
+
+    if (start == 0 || skip) {
+        return;
+    }
+
+    const auto head = m_head.load(std::memory_order_relaxed);
+    if (head - m_tail.load(std::memory_order_acquire) == exit_trace_num_records) {
+        m_dropped++;
+        return;
+    }
+
+    auto &rec = m_records[head & (exit_trace_num_records - 1)];
+
+    rec.tsc = start;
+    rec.rip = m_rip;
+    rec.qualification = m_vcpu->vmcs_read(exit_qualification::addr);
+    rec.ticks = gsl::narrow_cast<uint32_t>(::x64::read_tsc::get() - start);
+    rec.reason = gsl::narrow_cast<uint16_t>(m_vcpu->vmcs_read(exit_reason::addr) & 0xFFFF);
+    rec.flags = m_vcpu->rip() != m_rip ? exit_trace_flag_advanced : 0;
+
+    m_head.store(head + 1, std::memory_order_release);
+}
+
+bool
+exit_trace_handler::pop(exit_trace_record_t &rec) noexcept
+{
+    const auto tail = m_tail.load(std::memory_order_relaxed);
+    if (tail == m_head.load(std::memory_order_acquire)) {
+        return false;
+    }
+
+    rec = m_records[tail & (exit_trace_num_records - 1)];
+    m_tail.store(tail + 1, std::memory_order_release);
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+exit_trace_handler::handle_exit(gsl::not_null<vcpu_t *> vcpu)
+{
+    if (m_enabled) {
+        m_start = ::x64::read_tsc::get();
+        m_rip = vcpu->rip();
+    }
+
+    return false;
+}
+
+void
+exit_trace_handler::status(cpuid_handler::info_t &info) const noexcept
+{
+    info.rax = m_enabled ? 1 : 0;
+    info.rbx = this->pending();
+    info.rcx = m_dropped & 0x00000000FFFFFFFFULL;
+    info.rdx = this->armed() ? 1 : 0;
+}
+
+// Note:
+//
+// The guest can only enable tracing once the VMM has armed it, as the
+// ring cannot be allocated from here. Until then, an empty ring reads
+// back as all 0, like any other empty ring.
+//
+// Reading a record takes two CPUIDs, read_lo followed by read_hi, and only
+// read_hi removes it from the ring. Exits for this leaf are never recorded,
+// so draining the ring does not refill it. The leaf is emulated, so info
+// starts out as all 0, which is what an empty ring returns, and what a
+// caller outside of ring 0 gets for every operation.
+//
+
+bool
+exit_trace_handler::handle_cpuid(
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+{
+    m_skip = true;
+
+    if (vmcs_n::guest_ss_access_rights::dpl::get() != 0) {
+        return true;
+    }
+
+    switch (vcpu->rcx() & 0x00000000FFFFFFFFULL) {
+        case exit_trace_op_info:
+            info.rax = m_vcpu->id();
+            info.rbx = m_vcpu->global_state()->clock.tsc_freq_hz() / 1000;
+            info.rcx = exit_trace_num_records;
+            info.rdx = exit_trace_version;
+            break;
+
+        case exit_trace_op_enable:
+            m_enabled = this->armed();
+            this->status(info);
+            break;
+
+        case exit_trace_op_disable:
+            this->disable();
+            this->status(info);
+            break;
+
+        case exit_trace_op_read_lo: {
+            const auto tail = m_tail.load(std::memory_order_relaxed);
+            if (tail == m_head.load(std::memory_order_acquire)) {
+                break;
+            }
+
+            const auto &rec = m_records[tail & (exit_trace_num_records - 1)];
+            info.rax = rec.tsc & 0x00000000FFFFFFFFULL;
+            info.rbx = rec.tsc >> 32;
+            info.rcx = rec.rip & 0x00000000FFFFFFFFULL;
+            info.rdx = rec.rip >> 32;
+            break;
+        }
+
+        case exit_trace_op_read_hi: {
+            exit_trace_record_t rec{};
+            if (!this->pop(rec)) {
+                break;
+            }
+
+            info.rax = rec.qualification & 0x00000000FFFFFFFFULL;
+            info.rbx = rec.qualification >> 32;
+            info.rcx = rec.ticks;
+            info.rdx = rec.reason | (static_cast<uint64_t>(rec.flags) << 16);
+            break;
+        }
+
+        default:
+            this->status(info);
+            break;
+    }
+
+    return true;
+}
+
+}
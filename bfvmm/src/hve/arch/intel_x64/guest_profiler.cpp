@@ -0,0 +1,292 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/mtrrs.h>
+
+namespace eapis::intel_x64
+{
+
+// The largest distance the stack walk will follow between two frames.
+// Anything larger is assumed to be a corrupt (or non) frame pointer.
+//
+static constexpr uint64_t max_frame_size = 0x100000;
+
+static bool
+is_canonical(uint64_t addr) noexcept
+{
+    const auto upper = addr >> 47;
+    return upper == 0 || upper == 0x1FFFF;
+}
+
+guest_profiler::guest_profiler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{ }
+
+// -----------------------------------------------------------------------------
+// Profiler
+// -----------------------------------------------------------------------------
+
+void
+guest_profiler::start(
+    uint64_t period_ns, std::size_t depth, std::size_t max_samples)
+{
+    this->stop();
+
+    if (max_samples != m_max_samples) {
+        m_samples = std::make_unique<sample_t[]>(max_samples);
+        m_max_samples = max_samples;
+    }
+
+    m_period_ns = std::max(period_ns, min_period_ns);
+    m_depth = std::min(depth, max_depth);
+    m_num_samples = 0;
+    m_dropped = 0;
+
+    m_running = true;
+    this->arm(m_vcpu->now_ns() + m_period_ns);
+}
+
+void
+guest_profiler::stop()
+{
+    if (!m_running) {
+        return;
+    }
+
+    m_vcpu->cancel_timer(m_timer_id);
+    m_running = false;
+}
+
+const guest_profiler::sample_t &
+guest_profiler::sample(std::size_t index) const
+{
+    expects(index < m_num_samples);
+    return m_samples[index];
+}
+
+// Note:
+//
+// Stacks are keyed root first, so the outermost return address comes
+// right after the CR3 / CPL prefix and the sampled RIP comes last. A
+// std::map keeps the output sorted, which is what most flame graph
+// tools expect anyway.
+//
+
+std::string
+guest_profiler::folded() const
+{
+    std::map<std::string, uint64_t> stacks;
+
+    for (auto i = 0ULL; i < m_num_samples; i++) {
+        const auto &s = m_samples[i];
+
+        auto key = bfn::to_string(s.cr3, 16) + ";cpl" + std::to_string(s.cpl);
+        for (auto d = s.depth; d > 0; d--) {
+            key += ";" + bfn::to_string(s.frames[d - 1], 16);
+        }
+
+        stacks[key]++;
+    }
+
+    std::string str;
+    for (const auto &[key, count] : stacks) {
+        str += key + " " + std::to_string(count) + "\n";
+    }
+
+    return str;
+}
+
+void
+guest_profiler::dump_folded() const
+{
+    bfdebug_info(0, "guest profile");
+    bfdebug_subndec(0, "samples", m_num_samples);
+    bfdebug_subndec(0, "dropped", m_dropped);
+
+    const auto str = this->folded();
+
+    std::string::size_type pos = 0;
+    while (pos < str.size()) {
+        const auto end = str.find('\n', pos);
+        bfdebug_info(0, str.substr(pos, end - pos).c_str());
+        pos = end + 1;
+    }
+}
+
+void
+guest_profiler::arm(uint64_t deadline_ns)
+{
+    m_deadline_ns = deadline_ns;
+
+    m_timer_id = m_vcpu->add_timer(
+        deadline_ns,
+        preemption_timer_handler::timer_delegate_t::create <
+        guest_profiler, &guest_profiler::handle_timer > (this)
+    );
+}
+
+// Note:
+//
+// The walk follows the standard x64 frame layout, where [rbp] holds the
+// caller's rbp and [rbp + 8] holds the return address. Each frame costs a
+// guest page walk and a map / unmap, which is why the depth is capped.
+// The walk ends at a frame pointer that is not aligned, is not canonical,
+// or does not move up the stack by a sane amount, and at a frame that is
+// not mapped or is not RAM. The last check matters because rbp is just a
+// general purpose register in a guest built without frame pointers, and
+// reading an MMIO page to find out whether it is a frame can have side
+// effects on the device behind it. Any failure while reading a frame,
+// whatever it throws, simply ends the walk, as a sample is never worth
+// losing the exit over.
+//
+
+uint64_t
+guest_profiler::walk(sample_t &sample) const
+{
+    using namespace vmcs_n;
+
+    if (guest_ia32_efer::lma::is_disabled() || guest_cs_access_rights::l::is_disabled()) {
+        return 1;
+    }
+
+    auto depth = 1ULL;
+    auto fp = m_vcpu->rbp();
+
+    while (depth <= m_depth) {
+        if (fp == 0 || (fp & 7) != 0 || !is_canonical(fp)) {
+            break;
+        }
+
+        uint64_t next = 0;
+        uint64_t ret = 0;
+
+        try {
+            if (!this->frame_is_ram(fp)) {
+                break;
+            }
+
+            std::tie(next, ret) = this->read_frame(fp);
+        }
+        catch (...) {
+            break;
+        }
+
+        if (ret == 0) {
+            break;
+        }
+
+        sample.frames[depth++] = ret;
+
+        if (next <= fp || next - fp > max_frame_size) {
+            break;
+        }
+
+        fp = next;
+    }
+
+    return depth;
+}
+
+bool
+guest_profiler::frame_is_ram(uint64_t fp) const
+{
+    if (!this->is_ram(m_vcpu->gva_to_gpa(fp).first)) {
+        return false;
+    }
+
+    if (bfn::upper(fp + 8) == bfn::upper(fp)) {
+        return true;
+    }
+
+    return this->is_ram(m_vcpu->gva_to_gpa(fp + 8).first);
+}
+
+bool
+guest_profiler::is_ram(uint64_t gpa) const
+{
+    const auto &ranges = g_mtrrs->ranges();
+
+    for (auto i = 0U; i < g_mtrrs->size(); i++) {
+        const auto &range = ranges.at(i);
+
+        if (gpa >= range.base && gpa - range.base < range.size) {
+            return range.type == ept::mmap::memory_type::write_back;
+        }
+    }
+
+    return false;
+}
+
+std::pair<uint64_t, uint64_t>
+guest_profiler::read_frame(uint64_t fp) const
+{
+    auto frame = m_vcpu->map_gva_4k<uint64_t>(fp, 2);
+    auto span = gsl::span(frame.get(), 2);
+
+    return {span[0], span[1]};
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+void
+guest_profiler::handle_timer(gsl::not_null<vcpu_t *> vcpu)
+{
+    if (!m_running) {
+        return;
+    }
+
+    if (m_num_samples < m_max_samples) {
+        auto &sample = m_samples[m_num_samples++];
+
+        sample.cr3 = vmcs_n::guest_cr3::get();
+        sample.cpl = vmcs_n::guest_ss_access_rights::dpl::get();
+        sample.frames[0] = vcpu->rip();
+        sample.depth = this->walk(sample);
+    }
+    else {
+        m_dropped++;
+    }
+
+    //
+    // Rearm relative to the previous deadline so that the sample rate does
+    // not drift with exit latency, unless we fell behind by more than a
+    // period, in which case the missed samples are skipped, not bunched.
+    //
+
+    auto next = m_deadline_ns + m_period_ns;
+    if (const auto now = m_vcpu->now_ns(); next <= now) {
+        next = now + m_period_ns;
+    }
+
+    this->arm(next);
+}
+
+}
@@ -0,0 +1,345 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <array>
+#include <algorithm>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/lapic_timer.h>
+
+namespace eapis::intel_x64
+{
+
+static uint64_t
+default_freq_hz()
+{
+    if (const auto art = time::art_freq_hz(); time::art_freq_valid(art)) {
+        return art;
+    }
+
+    if (const auto bus = time::bus_freq_MHz(); bus != 0) {
+        return bus * 1000000ULL;
+    }
+
+    return 100000000ULL;
+}
+
+static uint64_t
+ratio(uint64_t num, uint64_t den)
+{
+    if (den == 0) {
+        return 0;
+    }
+
+    return static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(num) << time::clock::shift) / den
+    );
+}
+
+lapic_timer_handler::lapic_timer_handler(
+    gsl::not_null<vcpu *> vcpu, uint64_t freq_hz
+) :
+    m_vcpu{vcpu},
+    m_clock{&vcpu->global_state()->clock}
+{
+    using namespace lapic;
+
+    if (freq_hz == 0) {
+        freq_hz = default_freq_hz();
+    }
+
+    m_count_to_tsc_mult = ratio(m_clock->tsc_freq_hz(), freq_hz);
+    m_tsc_to_count_mult = ratio(freq_hz, m_clock->tsc_freq_hz());
+
+#if EAPIS_HVE_RDTSC
+    vcpu->set_tsc_deadline_emulated();
+#endif
+
+    const std::array<uint32_t, 5> msrs = {
+        ia32_tsc_deadline,
+        x2apic_msr(lvt::timer::indx),
+        x2apic_msr(initial_count::indx),
+        x2apic_msr(current_count::indx),
+        x2apic_msr(divide_config::indx)
+    };
+
+    for (const auto msr : msrs) {
+        vcpu->add_rdmsr_handler(
+            msr,
+            rdmsr_handler::handler_delegate_t::create <
+            lapic_timer_handler, &lapic_timer_handler::handle_rdmsr > (this)
+        );
+
+        vcpu->add_wrmsr_handler(
+            msr,
+            wrmsr_handler::handler_delegate_t::create <
+            lapic_timer_handler, &lapic_timer_handler::handle_wrmsr > (this)
+        );
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+lapic_timer_handler::handle_rdmsr(
+    gsl::not_null<vcpu_t *> vcpu, rdmsr_handler::info_t &info)
+{
+    using namespace lapic;
+    bfignored(vcpu);
+
+    switch (info.msr) {
+        case ia32_tsc_deadline:
+            info.val = m_tsc_deadline;
+            return true;
+
+        case x2apic_msr(lvt::timer::indx):
+            info.val = m_lvt;
+            return true;
+
+        case x2apic_msr(initial_count::indx):
+            info.val = m_initial_count;
+            return true;
+
+        case x2apic_msr(current_count::indx):
+            info.val = this->current_count();
+            return true;
+
+        case x2apic_msr(divide_config::indx):
+            info.val = m_divide_config;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+bool
+lapic_timer_handler::handle_wrmsr(
+    gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info)
+{
+    using namespace lapic;
+    bfignored(vcpu);
+
+    info.ignore_write = true;
+
+    switch (info.msr) {
+        case ia32_tsc_deadline:
+            this->write_tsc_deadline(info.val);
+            return true;
+
+        case x2apic_msr(lvt::timer::indx):
+            this->write_lvt(gsl::narrow_cast<value_t>(info.val));
+            return true;
+
+        case x2apic_msr(initial_count::indx):
+            this->write_initial_count(gsl::narrow_cast<value_t>(info.val));
+            return true;
+
+        case x2apic_msr(current_count::indx):
+            return true;
+
+        case x2apic_msr(divide_config::indx):
+            m_divide_config = gsl::narrow_cast<value_t>(info.val) & divide_config::divide_shift::mask;
+            return true;
+
+        default:
+            info.ignore_write = false;
+            return false;
+    }
+}
+
+void
+lapic_timer_handler::handle_expired(gsl::not_null<vcpu_t *> vcpu)
+{
+    using namespace lapic::lvt::timer;
+    bfignored(vcpu);
+
+    m_armed = false;
+
+    if (mask_bit::is_disabled(m_lvt)) {
+        m_vcpu->queue_external_interrupt(vector::get(m_lvt));
+    }
+
+    switch (mode::get(m_lvt)) {
+        case mode::periodic: {
+
+            //
+            // Rearm relative to the previous deadline so that the period
+            // does not drift with exit latency. If the guest fell behind
+            // by more than a period, resync instead of firing a burst of
+            // back to back interrupts.
+            //
+
+            auto next = m_deadline + m_period;
+            if (const auto now = ::x64::read_tsc::get(); next <= now) {
+                next = now + m_period;
+            }
+
+            this->arm(next);
+            break;
+        }
+
+        case mode::tsc_deadline:
+            m_tsc_deadline = 0;
+            break;
+
+        default:
+            break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void
+lapic_timer_handler::write_lvt(value_t val)
+{
+    using namespace lapic::lvt::timer;
+
+    lapic::value_t lvt = val;
+    delivery_status::set(lvt, delivery_status::idle);
+
+    if (mode::get(lvt) != mode::get(m_lvt)) {
+        this->disarm();
+
+        m_initial_count = 0;
+        m_tsc_deadline = 0;
+    }
+
+    m_lvt = lvt;
+}
+
+void
+lapic_timer_handler::write_initial_count(value_t val)
+{
+    using namespace lapic::lvt::timer;
+
+    if (mode::get(m_lvt) == mode::tsc_deadline) {
+        return;
+    }
+
+    this->disarm();
+    m_initial_count = val;
+
+    if (val == 0) {
+        return;
+    }
+
+    m_period = this->count_to_tsc(val);
+    this->arm(::x64::read_tsc::get() + m_period);
+}
+
+void
+lapic_timer_handler::write_tsc_deadline(uint64_t val)
+{
+    using namespace lapic::lvt::timer;
+
+    if (mode::get(m_lvt) != mode::tsc_deadline) {
+        return;
+    }
+
+    this->disarm();
+    m_tsc_deadline = val;
+
+    if (val == 0) {
+        return;
+    }
+
+    //
+    // The guest writes IA32_TSC_DEADLINE in terms of its own TSC, which
+    // may be offset and scaled. The timer is armed in host TSC ticks.
+    //
+
+#if EAPIS_HVE_RDTSC
+    this->arm(m_vcpu->host_tsc(val));
+#else
+    this->arm(val);
+#endif
+}
+
+lapic_timer_handler::value_t
+lapic_timer_handler::current_count() const
+{
+    using namespace lapic::lvt::timer;
+
+    if (!m_armed || mode::get(m_lvt) == mode::tsc_deadline) {
+        return 0;
+    }
+
+    const auto now = ::x64::read_tsc::get();
+    if (m_deadline <= now) {
+        return 0;
+    }
+
+    //
+    // Round up, so that the count only reads 0 once the timer has
+    // actually expired.
+    //
+
+    return gsl::narrow_cast<value_t>(
+        std::min<uint64_t>(this->tsc_to_count(m_deadline - now) + 1, m_initial_count)
+    );
+}
+
+void
+lapic_timer_handler::arm(uint64_t deadline_tsc)
+{
+    this->disarm();
+
+    m_armed = true;
+    m_deadline = deadline_tsc;
+
+    m_timer_id = m_vcpu->add_timer_tsc(
+        deadline_tsc,
+        preemption_timer_handler::timer_delegate_t::create <
+        lapic_timer_handler, &lapic_timer_handler::handle_expired > (this)
+    );
+}
+
+void
+lapic_timer_handler::disarm()
+{
+    if (!m_armed) {
+        return;
+    }
+
+    m_vcpu->cancel_timer(m_timer_id);
+    m_armed = false;
+}
+
+uint64_t
+lapic_timer_handler::count_to_tsc(uint64_t count) const noexcept
+{
+    const auto shift = lapic::divide_config::divide_shift::get(m_divide_config);
+    return time::mul_shift(count << shift, m_count_to_tsc_mult, time::clock::shift);
+}
+
+uint64_t
+lapic_timer_handler::tsc_to_count(uint64_t tsc) const noexcept
+{
+    const auto shift = lapic::divide_config::divide_shift::get(m_divide_config);
+    return time::mul_shift(tsc, m_tsc_to_count_mult, time::clock::shift) >> shift;
+}
+
+}
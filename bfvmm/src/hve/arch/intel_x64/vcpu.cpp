@@ -32,40 +32,177 @@ vcpu::vcpu(
 
     m_vcpu_global_state{vcpu_global_state != nullptr ? vcpu_global_state : & g_vcpu_global_state},
 
-    m_msr_bitmap{static_cast<uint8_t *>(alloc_page()), free_page},
-    m_io_bitmap_a{static_cast<uint8_t *>(alloc_page()), free_page},
-    m_io_bitmap_b{static_cast<uint8_t *>(alloc_page()), free_page},
-
-    m_control_register_handler{this},
-    m_cpuid_handler{this},
-    m_io_instruction_handler{this},
-    m_monitor_trap_handler{this},
-    m_rdmsr_handler{this},
-    m_wrmsr_handler{this},
-    m_xsetbv_handler{this},
-
-    m_ept_misconfiguration_handler{this},
-    m_ept_violation_handler{this},
-    m_external_interrupt_handler{this},
-    m_init_signal_handler{this},
-    m_interrupt_window_handler{this},
-    m_sipi_signal_handler{this},
-
-    m_ept_handler{this},
-    m_microcode_handler{this},
-    m_vpid_handler{this},
-    m_preemption_timer_handler{this}
+    m_vmcs_cache{this->init_step(vcpu_init_step_t::vmcs_cache)},
+
+    m_msr_bitmap{this, bitmap::default_msr_template(), vmcs_n::address_of_msr_bitmap::addr},
+    m_io_bitmap_a{this, bitmap::default_io_template(), vmcs_n::address_of_io_bitmap_a::addr},
+    m_io_bitmap_b{this, bitmap::default_io_template(), vmcs_n::address_of_io_bitmap_b::addr},
+
+    m_control_register_handler{this->init_step(vcpu_init_step_t::control_register)},
+    m_cpuid_handler{this->init_step(vcpu_init_step_t::cpuid)},
+    m_io_instruction_handler{this->init_step(vcpu_init_step_t::io_instruction)},
+    m_monitor_trap_handler{this->init_step(vcpu_init_step_t::monitor_trap)},
+#if EAPIS_HVE_PAUSE
+    m_pause_handler{this->init_step(vcpu_init_step_t::pause)},
+#endif
+    m_rdmsr_handler{this->init_step(vcpu_init_step_t::rdmsr)},
+#if EAPIS_HVE_RDTSC
+    m_rdtsc_handler{this->init_step(vcpu_init_step_t::rdtsc)},
+#endif
+    m_wrmsr_handler{this->init_step(vcpu_init_step_t::wrmsr)},
+    m_xsetbv_handler{this->init_step(vcpu_init_step_t::xsetbv)},
+
+    m_ept_misconfiguration_handler{this->init_step(vcpu_init_step_t::ept_misconfiguration)},
+    m_ept_violation_handler{this->init_step(vcpu_init_step_t::ept_violation)},
+    m_external_interrupt_handler{this->init_step(vcpu_init_step_t::external_interrupt)},
+#if EAPIS_HVE_HLT
+    m_hlt_handler{this->init_step(vcpu_init_step_t::hlt)},
+#endif
+    m_init_signal_handler{this->init_step(vcpu_init_step_t::init_signal)},
+    m_interrupt_window_handler{this->init_step(vcpu_init_step_t::interrupt_window)},
+    m_sipi_signal_handler{this->init_step(vcpu_init_step_t::sipi_signal)},
+
+    m_ept_handler{this->init_step(vcpu_init_step_t::ept)},
+    m_microcode_handler{this->init_step(vcpu_init_step_t::microcode)},
+    m_vpid_handler{this->init_step(vcpu_init_step_t::vpid)},
+    m_preemption_timer_handler{this->init_step(vcpu_init_step_t::preemption_timer)},
+    m_exit_trace_handler{this->init_step(vcpu_init_step_t::exit_trace)},
+    m_exit_hotspot_handler{this->init_step(vcpu_init_step_t::exit_hotspots)},
+    m_exit_stats_handler{this->init_step(vcpu_init_step_t::exit_stats)},
+    m_guest_profiler{this->init_step(vcpu_init_step_t::guest_profiler)}
 {
     using namespace vmcs_n;
+    this->init_step(vcpu_init_step_t::body);
 
-    address_of_msr_bitmap::set(g_mm->virtptr_to_physint(m_msr_bitmap.get()));
-    address_of_io_bitmap_a::set(g_mm->virtptr_to_physint(m_io_bitmap_a.get()));
-    address_of_io_bitmap_b::set(g_mm->virtptr_to_physint(m_io_bitmap_b.get()));
-
-    primary_processor_based_vm_execution_controls::use_msr_bitmap::enable();
-    primary_processor_based_vm_execution_controls::use_io_bitmaps::enable();
+    this->vmcs_set_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::use_msr_bitmap::mask |
+        primary_processor_based_vm_execution_controls::use_io_bitmaps::mask
+    );
 
     this->enable_vpid();
+
+    this->add_run_delegate(
+        run_delegate_t::create<vcpu, &vcpu::vmentry_delegate>(this)
+    );
+
+    this->init_step(vcpu_init_step_t::num_steps);
+}
+
+//==========================================================================
+// Init Stats
+//==========================================================================
+
+static constexpr std::array<const char *, num_vcpu_init_steps> s_init_step_names = {
+    "vmcs cache",
+    "control register",
+    "cpuid",
+    "io instruction",
+    "monitor trap",
+    "pause",
+    "rdmsr",
+    "rdtsc",
+    "wrmsr",
+    "xsetbv",
+    "ept misconfiguration",
+    "ept violation",
+    "external interrupt",
+    "hlt",
+    "init signal",
+    "interrupt window",
+    "sipi signal",
+    "ept",
+    "microcode",
+    "vpid",
+    "preemption timer",
+    "exit trace",
+    "exit hot spots",
+    "exit stats",
+    "guest profiler",
+    "body"
+};
+
+// Note:
+//
+// Each call closes the previous step, charging it the ticks elapsed since
+// that step began, and opens the next one. Passing num_steps closes the
+// last step without opening another. The return value lets this be used
+// directly in the constructor's member initializer list.
+//
+
+vcpu *
+vcpu::init_step(vcpu_init_step_t step) noexcept
+{
+    const auto now = ::x64::read_tsc::get();
+    auto &state = *m_vcpu_global_state;
+
+    if (m_init_tsc != 0) {
+        state.init_ticks[static_cast<std::size_t>(m_init_step)] += now - m_init_tsc;
+    }
+
+    if (step == vcpu_init_step_t::num_steps) {
+        state.init_count++;
+    }
+
+    m_init_tsc = now;
+    m_init_step = step;
+
+    return this;
+}
+
+void
+vcpu::dump_init_stats() const
+{
+    const auto &state = *m_vcpu_global_state;
+    const auto count = state.init_count.load();
+
+    bfdebug_info(0, "vcpu init stats");
+    bfdebug_subndec(0, "vcpus", count);
+
+    if (count == 0) {
+        return;
+    }
+
+    auto total = 0ULL;
+    for (auto i = 0ULL; i < num_vcpu_init_steps; i++) {
+        const auto ns = state.clock.tsc_to_ns(state.init_ticks[i].load());
+        total += ns;
+
+        bfdebug_subndec(0, s_init_step_names[i], ns / count);
+    }
+
+    bfdebug_subndec(0, "total (ns per vcpu)", total / count);
+}
+
+//==========================================================================
+// VM Entry
+//==========================================================================
+
+// Note:
+//
+// Run delegates are called in the reverse order they are added, so this
+// delegate is called right before the base vCPU launches / resumes. Any
+// state that has to be settled on every VM entry belongs here.
+//
+
+void
+vcpu::vmentry_delegate(bfobject *obj)
+{
+    bfignored(obj);
+
+    m_exit_trace_handler.record();
+
+    m_vmcs_cache.flush();
+    m_vpid_handler.load();
+    m_xsetbv_handler.load_guest_xstate();
+
+#if EAPIS_HVE_RDTSC
+    m_rdtsc_handler.load();
+#endif
+
+    m_preemption_timer_handler.program();
+
+    m_exit_stats_handler.record();
 }
 
 //==========================================================================
@@ -102,6 +239,159 @@ void
 vcpu::disable_vpid()
 { m_vpid_handler.disable(); }
 
+//--------------------------------------------------------------------------
+// VMCS Cache
+//--------------------------------------------------------------------------
+
+vmcs_n::value_type
+vcpu::vmcs_read(vmcs_n::value_type addr)
+{ return m_vmcs_cache.read(addr); }
+
+void
+vcpu::vmcs_write(vmcs_n::value_type addr, vmcs_n::value_type val)
+{ m_vmcs_cache.write(addr, val); }
+
+void
+vcpu::vmcs_set_bits(vmcs_n::value_type addr, vmcs_n::value_type mask)
+{ m_vmcs_cache.set_bits(addr, mask); }
+
+void
+vcpu::vmcs_clear_bits(vmcs_n::value_type addr, vmcs_n::value_type mask)
+{ m_vmcs_cache.clear_bits(addr, mask); }
+
+const vmcs_cache::stats_t &
+vcpu::vmcs_cache_stats() const
+{ return m_vmcs_cache.stats(); }
+
+//--------------------------------------------------------------------------
+// Exit Stats
+//--------------------------------------------------------------------------
+
+const exit_stats_page_t &
+vcpu::exit_stats() const
+{ return m_exit_stats_handler.page(); }
+
+void
+vcpu::dump_exit_stats() const
+{ m_exit_stats_handler.dump_stats(); }
+
+//--------------------------------------------------------------------------
+// Exit Trace
+//--------------------------------------------------------------------------
+
+void
+vcpu::arm_exit_trace()
+{ m_exit_trace_handler.arm(); }
+
+void
+vcpu::enable_exit_trace()
+{ m_exit_trace_handler.enable(); }
+
+void
+vcpu::disable_exit_trace()
+{ m_exit_trace_handler.disable(); }
+
+bool
+vcpu::pop_exit_trace(exit_trace_record_t &rec)
+{ return m_exit_trace_handler.pop(rec); }
+
+//--------------------------------------------------------------------------
+// Exit Hot Spots
+//--------------------------------------------------------------------------
+
+void
+vcpu::set_exit_hotspot_period(uint64_t period)
+{ m_exit_hotspot_handler.set_period(period); }
+
+std::vector<exit_hotspot_entry_t>
+vcpu::exit_hotspots() const
+{ return m_exit_hotspot_handler.hotspots(); }
+
+void
+vcpu::dump_exit_hotspots() const
+{ m_exit_hotspot_handler.dump_hotspots(); }
+
+//--------------------------------------------------------------------------
+// Guest Profiler
+//--------------------------------------------------------------------------
+
+void
+vcpu::start_guest_profiler(
+    uint64_t period_ns, std::size_t depth, std::size_t max_samples)
+{ m_guest_profiler.start(period_ns, depth, max_samples); }
+
+void
+vcpu::stop_guest_profiler()
+{ m_guest_profiler.stop(); }
+
+std::string
+vcpu::guest_profile() const
+{ return m_guest_profiler.folded(); }
+
+void
+vcpu::dump_guest_profile() const
+{ m_guest_profiler.dump_folded(); }
+
+//--------------------------------------------------------------------------
+// Delegate Profiling
+//--------------------------------------------------------------------------
+
+std::vector<delegate_profile *>
+vcpu::delegate_profiles()
+{
+    return {
+        &m_control_register_handler.profile(),
+        &m_cpuid_handler.profile(),
+        &m_io_instruction_handler.profile(),
+        &m_monitor_trap_handler.profile(),
+        &m_rdmsr_handler.profile(),
+#if EAPIS_HVE_RDTSC
+        &m_rdtsc_handler.profile(),
+#endif
+        &m_wrmsr_handler.profile(),
+        &m_xsetbv_handler.profile(),
+        &m_ept_misconfiguration_handler.profile(),
+        &m_ept_violation_handler.profile(),
+        &m_preemption_timer_handler.profile()
+    };
+}
+
+void
+vcpu::enable_delegate_profiling()
+{
+    for (const auto profile : this->delegate_profiles()) {
+        profile->enable();
+    }
+}
+
+void
+vcpu::disable_delegate_profiling()
+{
+    for (const auto profile : this->delegate_profiles()) {
+        profile->disable();
+    }
+}
+
+delegate_profile &
+vcpu::handler_profile(const std::string &name)
+{
+    for (const auto profile : this->delegate_profiles()) {
+        if (name == profile->name()) {
+            return *profile;
+        }
+    }
+
+    throw std::runtime_error("handler_profile: unknown handler: " + name);
+}
+
+void
+vcpu::dump_delegate_profiles()
+{
+    for (const auto profile : this->delegate_profiles()) {
+        profile->dump();
+    }
+}
+
 //--------------------------------------------------------------------------
 // VMX preemption timer
 //--------------------------------------------------------------------------
@@ -144,10 +434,12 @@ void
 vcpu::add_wrcr0_handler(
     vmcs_n::value_type mask,
     const control_register_handler::handler_delegate_t &d)
-{
-    m_control_register_handler.add_wrcr0_handler(d);
-    m_control_register_handler.enable_wrcr0_exiting(mask);
-}
+{ m_control_register_handler.add_wrcr0_handler(mask, d); }
+
+void
+vcpu::remove_wrcr0_handler(
+    const control_register_handler::handler_delegate_t &d)
+{ m_control_register_handler.remove_wrcr0_handler(d); }
 
 void
 vcpu::add_rdcr3_handler(
@@ -169,10 +461,24 @@ void
 vcpu::add_wrcr4_handler(
     vmcs_n::value_type mask,
     const control_register_handler::handler_delegate_t &d)
-{
-    m_control_register_handler.add_wrcr4_handler(d);
-    m_control_register_handler.enable_wrcr4_exiting(mask);
-}
+{ m_control_register_handler.add_wrcr4_handler(mask, d); }
+
+void
+vcpu::remove_wrcr4_handler(
+    const control_register_handler::handler_delegate_t &d)
+{ m_control_register_handler.remove_wrcr4_handler(d); }
+
+void
+vcpu::add_cr3_target(vmcs_n::value_type val)
+{ m_control_register_handler.add_cr3_target(val); }
+
+void
+vcpu::remove_cr3_target(vmcs_n::value_type val)
+{ m_control_register_handler.remove_cr3_target(val); }
+
+void
+vcpu::clear_cr3_targets()
+{ m_control_register_handler.clear_cr3_targets(); }
 
 //--------------------------------------------------------------------------
 // CPUID
@@ -251,6 +557,19 @@ vcpu::add_external_interrupt_handler(
     m_external_interrupt_handler.enable_exiting();
 }
 
+void
+vcpu::add_external_interrupt_handler(
+    uint64_t vector, const external_interrupt_handler::handler_delegate_t &d)
+{
+    m_external_interrupt_handler.add_handler(vector, d);
+    m_external_interrupt_handler.enable_exiting();
+}
+
+void
+vcpu::set_external_interrupt_route(
+    uint64_t vector, external_interrupt_handler::route_t route)
+{ m_external_interrupt_handler.set_route(vector, route); }
+
 void
 vcpu::disable_external_interrupts()
 { m_external_interrupt_handler.disable_exiting(); }
@@ -271,6 +590,47 @@ void
 vcpu::inject_external_interrupt(uint64_t vector)
 { m_interrupt_window_handler.inject_external_interrupt(vector); }
 
+bool
+vcpu::has_pending_interrupts() const
+{ return m_interrupt_window_handler.has_pending(); }
+
+#if EAPIS_HVE_HLT
+
+//--------------------------------------------------------------------------
+// HLT / MWAIT / MONITOR
+//--------------------------------------------------------------------------
+
+void
+vcpu::enable_hlt_exiting()
+{ m_hlt_handler.enable_exiting(); }
+
+void
+vcpu::disable_hlt_exiting()
+{ m_hlt_handler.disable_exiting(); }
+
+void
+vcpu::enable_mwait_exiting()
+{ m_hlt_handler.enable_mwait_exiting(); }
+
+void
+vcpu::disable_mwait_exiting()
+{ m_hlt_handler.disable_mwait_exiting(); }
+
+void
+vcpu::add_wake_delegate(
+    const hlt_handler::wake_delegate_t &d)
+{ m_hlt_handler.add_wake_delegate(d); }
+
+void
+vcpu::set_hlt_poll_window(uint64_t start_ns, uint64_t max_ns)
+{ m_hlt_handler.set_poll_window(start_ns, max_ns); }
+
+const hlt_handler::stats_t &
+vcpu::hlt_stats() const
+{ return m_hlt_handler.stats(); }
+
+#endif
+
 //--------------------------------------------------------------------------
 // IO Instruction
 //--------------------------------------------------------------------------
@@ -325,6 +685,31 @@ void
 vcpu::enable_monitor_trap_flag()
 { m_monitor_trap_handler.enable(); }
 
+#if EAPIS_HVE_PAUSE
+
+//--------------------------------------------------------------------------
+// PAUSE-loop Exiting
+//--------------------------------------------------------------------------
+
+void
+vcpu::enable_pause_loop_exiting(uint64_t gap, uint64_t window)
+{ m_pause_handler.enable_exiting(gap, window); }
+
+void
+vcpu::disable_pause_loop_exiting()
+{ m_pause_handler.disable_exiting(); }
+
+void
+vcpu::add_yield_delegate(
+    const pause_handler::yield_delegate_t &d)
+{ m_pause_handler.add_yield_delegate(d); }
+
+const pause_handler::stats_t &
+vcpu::pause_loop_stats() const
+{ return m_pause_handler.stats(); }
+
+#endif
+
 //--------------------------------------------------------------------------
 // Read MSR
 //--------------------------------------------------------------------------
@@ -366,6 +751,43 @@ vcpu::add_default_rdmsr_handler(
     const ::handler_delegate_t &d)
 { m_rdmsr_handler.set_default_handler(d); }
 
+#if EAPIS_HVE_RDTSC
+
+//--------------------------------------------------------------------------
+// RDTSC
+//--------------------------------------------------------------------------
+
+void
+vcpu::add_rdtsc_handler(
+    const rdtsc_handler::handler_delegate_t &d)
+{ m_rdtsc_handler.add_handler(d); }
+
+void
+vcpu::set_tsc_offset(uint64_t offset)
+{ m_rdtsc_handler.set_offset(offset); }
+
+void
+vcpu::set_tsc_multiplier(uint64_t multiplier)
+{ m_rdtsc_handler.set_multiplier(multiplier); }
+
+void
+vcpu::set_tsc_aux(uint64_t val)
+{ m_rdtsc_handler.set_tsc_aux(val); }
+
+uint64_t
+vcpu::guest_tsc() const
+{ return m_rdtsc_handler.guest_tsc(); }
+
+uint64_t
+vcpu::host_tsc(uint64_t guest_tsc) const
+{ return m_rdtsc_handler.host_tsc(guest_tsc); }
+
+void
+vcpu::set_tsc_deadline_emulated()
+{ m_rdtsc_handler.set_tsc_deadline_emulated(); }
+
+#endif
+
 //--------------------------------------------------------------------------
 // Write MSR
 //--------------------------------------------------------------------------
@@ -416,6 +838,10 @@ vcpu::add_xsetbv_handler(
     const xsetbv_handler::handler_delegate_t &d)
 { m_xsetbv_handler.add_handler(d); }
 
+void
+vcpu::save_guest_xstate(uint64_t mask)
+{ m_xsetbv_handler.save_guest_xstate(mask); }
+
 //--------------------------------------------------------------------------
 // VMX preemption timer
 //--------------------------------------------------------------------------
@@ -437,6 +863,24 @@ preemption_timer_handler::value_t
 vcpu::get_preemption_timer()
 { return m_preemption_timer_handler.get_timer(); }
 
+preemption_timer_handler::timer_id_t
+vcpu::add_timer(
+    uint64_t deadline_ns, const preemption_timer_handler::timer_delegate_t &d)
+{ return m_preemption_timer_handler.add_timer(deadline_ns, d); }
+
+preemption_timer_handler::timer_id_t
+vcpu::add_timer_tsc(
+    uint64_t deadline_tsc, const preemption_timer_handler::timer_delegate_t &d)
+{ return m_preemption_timer_handler.add_timer_tsc(deadline_tsc, d); }
+
+void
+vcpu::cancel_timer(preemption_timer_handler::timer_id_t id)
+{ m_preemption_timer_handler.cancel(id); }
+
+uint64_t
+vcpu::now_ns() const
+{ return m_preemption_timer_handler.now_ns(); }
+
 //==============================================================================
 // Memory Mapping
 //==============================================================================
@@ -0,0 +1,705 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <hve/arch/intel_x64/lapic.h>
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/vioapic.h>
+
+// -----------------------------------------------------------------------------
+// MMIO Decoder
+// -----------------------------------------------------------------------------
+
+//
+// The IOAPIC is only ever accessed using moves to / from a general purpose
+// register (or an immediate on store), so we only decode the following
+// encodings, along with any legacy or REX prefixes:
+//
+// - 0x89 /r: mov r/m16/32/64, r16/32/64
+// - 0x8B /r: mov r16/32/64, r/m16/32/64
+// - 0xC7 /0: mov r/m16/32/64, imm16/32
+//
+// The instruction bytes are controlled by the guest, so anything else (or
+// an encoding that runs past the 15 byte limit) fails to decode, and the
+// guest is given a #GP instead of the access.
+//
+
+namespace eapis::intel_x64
+{
+
+constexpr const auto max_insn_len = 15ULL;
+
+struct mmio_insn_t {
+    uint64_t len;
+    uint64_t opcode;
+    uint64_t reg;
+    uint64_t size;
+    uint64_t imm;
+};
+
+static bool
+decode_mmio(const uint8_t *bytes, mmio_insn_t &insn)
+{
+    uint64_t i = 0;
+    uint64_t rex = 0;
+    bool opsize = false;
+
+    for (; i < max_insn_len; i++) {
+        switch (bytes[i]) {
+            case 0x66:
+                opsize = true;
+                continue;
+
+            case 0x26: case 0x2E: case 0x36: case 0x3E:
+            case 0x64: case 0x65: case 0x67:
+            case 0xF0: case 0xF2: case 0xF3:
+                continue;
+
+            default:
+                break;
+        }
+
+        break;
+    }
+
+    if (i < max_insn_len && (bytes[i] & 0xF0U) == 0x40U) {
+        rex = bytes[i++];
+    }
+
+    if (i + 2 > max_insn_len) {
+        return false;
+    }
+
+    insn.opcode = bytes[i++];
+
+    switch (insn.opcode) {
+        case 0x89:
+        case 0x8B:
+        case 0xC7:
+            break;
+
+        default:
+            return false;
+    }
+
+    const auto modrm = bytes[i++];
+    const auto mod = (modrm >> 6U) & 0x3U;
+    const auto rm = modrm & 0x7U;
+
+    insn.reg = ((modrm >> 3U) & 0x7U) | ((rex & 0x4U) << 1U);
+
+    if (mod == 3) {
+        return false;
+    }
+
+    if ((rex & 0x8U) != 0) {
+        insn.size = 8;
+    }
+    else {
+        insn.size = opsize ? 2 : 4;
+    }
+
+    if (rm == 4) {
+        if (i + 1 > max_insn_len) {
+            return false;
+        }
+
+        const auto sib = bytes[i++];
+        if (mod == 0 && (sib & 0x7U) == 5) {
+            i += 4;
+        }
+    }
+
+    if (mod == 1) {
+        i += 1;
+    }
+
+    if (mod == 2 || (mod == 0 && rm == 5)) {
+        i += 4;
+    }
+
+    if (insn.opcode == 0xC7) {
+        const auto imm_size = insn.size == 2 ? 2ULL : 4ULL;
+
+        if (i + imm_size > max_insn_len) {
+            return false;
+        }
+
+        for (uint64_t b = 0; b < imm_size; b++) {
+            insn.imm |= static_cast<uint64_t>(bytes[i + b]) << (b * 8U);
+        }
+
+        i += imm_size;
+    }
+
+    if (i > max_insn_len) {
+        return false;
+    }
+
+    insn.len = i;
+    return true;
+}
+
+static uint64_t
+get_gpr(gsl::not_null<vcpu_t *> vcpu, uint64_t reg)
+{
+    switch (reg) {
+        case 0: return vcpu->rax();
+        case 1: return vcpu->rcx();
+        case 2: return vcpu->rdx();
+        case 3: return vcpu->rbx();
+        case 4: return vcpu->rsp();
+        case 5: return vcpu->rbp();
+        case 6: return vcpu->rsi();
+        case 7: return vcpu->rdi();
+        case 8: return vcpu->r08();
+        case 9: return vcpu->r09();
+        case 10: return vcpu->r10();
+        case 11: return vcpu->r11();
+        case 12: return vcpu->r12();
+        case 13: return vcpu->r13();
+        case 14: return vcpu->r14();
+        default: return vcpu->r15();
+    }
+}
+
+static void
+set_gpr(gsl::not_null<vcpu_t *> vcpu, uint64_t reg, uint64_t val)
+{
+    switch (reg) {
+        case 0: vcpu->set_rax(val); break;
+        case 1: vcpu->set_rcx(val); break;
+        case 2: vcpu->set_rdx(val); break;
+        case 3: vcpu->set_rbx(val); break;
+        case 4: vcpu->set_rsp(val); break;
+        case 5: vcpu->set_rbp(val); break;
+        case 6: vcpu->set_rsi(val); break;
+        case 7: vcpu->set_rdi(val); break;
+        case 8: vcpu->set_r08(val); break;
+        case 9: vcpu->set_r09(val); break;
+        case 10: vcpu->set_r10(val); break;
+        case 11: vcpu->set_r11(val); break;
+        case 12: vcpu->set_r12(val); break;
+        case 13: vcpu->set_r13(val); break;
+        case 14: vcpu->set_r14(val); break;
+        default: vcpu->set_r15(val); break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+//
+// Low dword bits of an RTE that are read-only to the guest
+//
+constexpr const auto rte_ro_mask =
+    ioapic::redtbl::delivery_status::mask | ioapic::redtbl::remote_irr::mask;
+
+//
+// The x2APIC EOI MSR, and the first of the eight x2APIC ISR MSRs (each of
+// which holds 32 vectors)
+//
+constexpr const auto x2apic_eoi_msr = lapic::x2apic_msr(lapic::eoi::indx);
+constexpr const auto x2apic_isr_msr = lapic::x2apic_msr(0x100U >> 2U);
+
+constexpr const auto no_vector = 0x100ULL;
+
+static uint64_t
+highest_vector(const std::array<uint64_t, 4> &bits)
+{
+    for (auto i = bits.size(); i > 0; i--) {
+        if (bits.at(i - 1) != 0) {
+            return ((i - 1) * 64) + (63 - static_cast<uint64_t>(__builtin_clzll(bits.at(i - 1))));
+        }
+    }
+
+    return no_vector;
+}
+
+static uint64_t
+highest_physical_isr()
+{
+    for (auto i = 8U; i > 0; i--) {
+        const auto isr = ::x64::msrs::get(x2apic_isr_msr + i - 1) & 0xFFFFFFFFULL;
+
+        if (isr != 0) {
+            return ((i - 1) * 32) + (63 - static_cast<uint64_t>(__builtin_clzll(isr)));
+        }
+    }
+
+    return no_vector;
+}
+
+vioapic::vioapic(
+    uintptr_t base, reg_t id
+) :
+    m_base{base},
+    m_id{0}
+{
+    ioapic::id::set(m_id, id);
+    m_rtes.fill(ioapic::redtbl::reset_val);
+}
+
+void
+vioapic::add_vcpu(gsl::not_null<vcpu *> vcpu, uint64_t apic_id)
+{
+    target_t *target = nullptr;
+
+    {
+        std::lock_guard lock(m_mutex);
+
+        target = &m_targets.emplace_back();
+        target->ioapic = this;
+        target->owner = vcpu;
+        target->apic_id = apic_id;
+
+        for (auto &word : target->pending) {
+            word = 0;
+        }
+
+        target->in_service.fill(0);
+    }
+
+    vcpu->add_ept_read_violation_handler(
+        ept_violation_handler::handler_delegate_t::create<target_t, &target_t::handle_read>(target)
+    );
+
+    vcpu->add_ept_write_violation_handler(
+        ept_violation_handler::handler_delegate_t::create<target_t, &target_t::handle_write>(target)
+    );
+
+    vcpu->add_wrmsr_handler(
+        x2apic_eoi_msr,
+        wrmsr_handler::handler_delegate_t::create<target_t, &target_t::handle_eoi>(target)
+    );
+
+    vcpu->add_exit_handler(
+        ::handler_delegate_t::create<target_t, &target_t::handle_exit>(target)
+    );
+
+#if EAPIS_HVE_HLT
+    vcpu->add_wake_delegate(
+        hlt_handler::wake_delegate_t::create<target_t, &target_t::handle_wake>(target)
+    );
+#endif
+}
+
+void
+vioapic::set_irq(pin_t pin, bool level)
+{
+    expects(pin < ioapic::redtbl::size);
+    std::lock_guard lock(m_mutex);
+
+    const auto bit = 1U << pin;
+    const auto old = (m_lines & bit) != 0;
+
+    if (level) {
+        m_lines |= bit;
+    }
+    else {
+        m_lines &= ~bit;
+    }
+
+    if (!level) {
+        return;
+    }
+
+    using namespace ioapic::redtbl;
+    if (trigger_mode::get(m_rtes.at(pin)) == trigger_mode::edge && old) {
+        return;
+    }
+
+    this->service(pin);
+}
+
+void
+vioapic::eoi(uint64_t vector)
+{
+    using namespace ioapic::redtbl;
+    std::lock_guard lock(m_mutex);
+
+    for (pin_t pin = 0; pin < size; pin++) {
+        auto &rte = m_rtes.at(pin);
+
+        if (trigger_mode::get(rte) != trigger_mode::level) {
+            continue;
+        }
+
+        if (vector::get(rte) != vector || remote_irr::is_disabled(rte)) {
+            continue;
+        }
+
+        remote_irr::disable(rte);
+
+        if ((m_lines & (1U << pin)) != 0) {
+            this->service(pin);
+        }
+    }
+}
+
+vioapic::reg_t
+vioapic::read(uint64_t offset)
+{
+    std::lock_guard lock(m_mutex);
+
+    switch (offset) {
+        case ioapic::sel_offset:
+            return m_select;
+
+        case ioapic::win_offset:
+            return this->read_reg(m_select);
+
+        default:
+            return 0;
+    }
+}
+
+void
+vioapic::write(uint64_t offset, reg_t val)
+{
+    switch (offset) {
+        case ioapic::sel_offset: {
+            std::lock_guard lock(m_mutex);
+            m_select = val & 0xFFU;
+            return;
+        }
+
+        case ioapic::win_offset: {
+            std::lock_guard lock(m_mutex);
+            this->write_reg(m_select, val);
+            return;
+        }
+
+        case ioapic::eoi_offset:
+            this->eoi(val & 0xFFU);
+            return;
+
+        default:
+            return;
+    }
+}
+
+vioapic::rte_t
+vioapic::rte(pin_t pin)
+{
+    expects(pin < ioapic::redtbl::size);
+    std::lock_guard lock(m_mutex);
+
+    return m_rtes.at(pin);
+}
+
+void
+vioapic::drain(gsl::not_null<vcpu_t *> vcpu)
+{
+    if (auto target = this->find(vcpu)) {
+        this->drain(*target);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+vioapic::handle_read(
+    target_t &target, gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+{
+    if (bfn::upper(info.gpa) != m_base) {
+        return false;
+    }
+
+    info.ignore_advance = true;
+
+    mmio_insn_t insn{};
+    auto bytes = target.owner->map_gva_4k<uint8_t>(vcpu->rip(), max_insn_len);
+
+    if (!decode_mmio(bytes.get(), insn) || insn.opcode != 0x8B) {
+        bfalert_nhex(0, "vioapic: unsupported mmio read at", vcpu->rip());
+        target.owner->inject_exception(13, 0);
+        return true;
+    }
+
+    const uint64_t val = this->read(bfn::lower(info.gpa));
+
+    if (insn.size == 2) {
+        set_gpr(vcpu, insn.reg, (get_gpr(vcpu, insn.reg) & ~0xFFFFULL) | (val & 0xFFFFULL));
+    }
+    else {
+        set_gpr(vcpu, insn.reg, val);
+    }
+
+    vcpu->set_rip(vcpu->rip() + insn.len);
+
+    this->drain(target);
+    return true;
+}
+
+bool
+vioapic::handle_write(
+    target_t &target, gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+{
+    if (bfn::upper(info.gpa) != m_base) {
+        return false;
+    }
+
+    info.ignore_advance = true;
+
+    mmio_insn_t insn{};
+    auto bytes = target.owner->map_gva_4k<uint8_t>(vcpu->rip(), max_insn_len);
+
+    if (!decode_mmio(bytes.get(), insn) || insn.opcode == 0x8B) {
+        bfalert_nhex(0, "vioapic: unsupported mmio write at", vcpu->rip());
+        target.owner->inject_exception(13, 0);
+        return true;
+    }
+
+    const auto offset = bfn::lower(info.gpa);
+    auto val = insn.opcode == 0x89 ? get_gpr(vcpu, insn.reg) : insn.imm;
+
+    //
+    // A 16-bit write only replaces the low half of the register
+    //
+
+    if (insn.size == 2) {
+        val = (this->read(offset) & 0xFFFF0000ULL) | (val & 0xFFFFULL);
+    }
+
+    this->write(offset, gsl::narrow_cast<reg_t>(val));
+    vcpu->set_rip(vcpu->rip() + insn.len);
+
+    this->drain(target);
+    return true;
+}
+
+bool
+vioapic::handle_eoi(
+    target_t &target, gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    //
+    // A local APIC EOI always retires the highest vector in service. If
+    // that is one of ours, the physical local APIC never saw it, so the
+    // write is consumed here. Otherwise, it belongs to a physical
+    // interrupt and is passed through.
+    //
+
+    const auto vector = highest_vector(target.in_service);
+
+    if (vector == no_vector) {
+        return true;
+    }
+
+    const auto physical = highest_physical_isr();
+
+    if (physical != no_vector && physical > vector) {
+        return true;
+    }
+
+    target.in_service.at(vector >> 6U) &= ~(1ULL << (vector & 0x3FU));
+    info.ignore_write = true;
+
+    this->eoi(vector);
+    this->drain(target);
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+vioapic::reg_t
+vioapic::read_reg(reg_t indx) const
+{
+    switch (indx) {
+        case ioapic::id::indx:
+            return m_id;
+
+        case ioapic::version::indx: {
+            reg_t val = ioapic::version::reset_val;
+            ioapic::version::max_rte::set(val, ioapic::redtbl::size - 1);
+            return val;
+        }
+
+        case ioapic::arbid::indx:
+            return m_id;
+
+        default:
+            break;
+    }
+
+    if (indx < ioapic::redtbl::indx) {
+        return 0;
+    }
+
+    const auto pin = (indx - ioapic::redtbl::indx) >> 1U;
+    if (pin >= ioapic::redtbl::size) {
+        return 0;
+    }
+
+    const auto rte = m_rtes.at(pin);
+
+    if ((indx & 1U) == 0) {
+        return gsl::narrow_cast<reg_t>(rte);
+    }
+
+    return gsl::narrow_cast<reg_t>(rte >> 32U);
+}
+
+void
+vioapic::write_reg(reg_t indx, reg_t val)
+{
+    if (indx == ioapic::id::indx) {
+        ioapic::id::set(m_id, ioapic::id::get(val));
+        return;
+    }
+
+    if (indx < ioapic::redtbl::indx) {
+        return;
+    }
+
+    const auto pin = (indx - ioapic::redtbl::indx) >> 1U;
+    if (pin >= ioapic::redtbl::size) {
+        return;
+    }
+
+    auto &rte = m_rtes.at(pin);
+
+    if ((indx & 1U) == 0) {
+        const auto lo = (rte & rte_ro_mask) | (val & ~rte_ro_mask);
+        rte = (rte & 0xFFFFFFFF00000000ULL) | lo;
+    }
+    else {
+        rte = (rte & 0x00000000FFFFFFFFULL) | (static_cast<rte_t>(val) << 32U);
+    }
+
+    //
+    // If a level triggered pin is still asserted when the guest unmasks
+    // (or reprograms) its entry, the interrupt has to be delivered now,
+    // otherwise it would be lost until the device deasserts and asserts
+    // the line again.
+    //
+
+    using namespace ioapic::redtbl;
+    if (trigger_mode::get(rte) == trigger_mode::level && (m_lines & (1U << pin)) != 0) {
+        this->service(pin);
+    }
+}
+
+void
+vioapic::service(pin_t pin)
+{
+    using namespace ioapic::redtbl;
+    auto &rte = m_rtes.at(pin);
+
+    if (mask_bit::is_enabled(rte)) {
+        return;
+    }
+
+    if (trigger_mode::get(rte) == trigger_mode::level) {
+        if (remote_irr::is_enabled(rte)) {
+            return;
+        }
+
+        remote_irr::enable(rte);
+    }
+
+    this->deliver(rte);
+}
+
+void
+vioapic::deliver(rte_t rte)
+{
+    using namespace ioapic::redtbl;
+
+    const auto vector = vector::get(rte);
+    const auto mode = delivery_mode::get(rte);
+    const auto dest = destination::get(rte);
+
+    if (mode != delivery_mode::fixed && mode != delivery_mode::lowest_priority) {
+        bfalert_nhex(0, "vioapic: unsupported delivery mode", mode);
+        return;
+    }
+
+    for (auto &target : m_targets) {
+        bool match = false;
+
+        if (dest_mode::get(rte) == dest_mode::physical) {
+            match = dest == destination::broadcast || dest == target.apic_id;
+        }
+        else {
+            match = target.apic_id < 8 && (dest & (1ULL << target.apic_id)) != 0;
+        }
+
+        if (!match) {
+            continue;
+        }
+
+        this->post(target, vector);
+
+        if (mode == delivery_mode::lowest_priority) {
+            return;
+        }
+    }
+}
+
+void
+vioapic::post(target_t &target, uint64_t vector)
+{ target.pending.at(vector >> 6U).fetch_or(1ULL << (vector & 0x3FU)); }
+
+void
+vioapic::drain(target_t &target)
+{
+    for (uint64_t i = 0; i < target.pending.size(); i++) {
+        auto &word = target.pending.at(i);
+
+        if (word.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        auto bits = word.exchange(0);
+        target.in_service.at(i) |= bits;
+
+        while (bits != 0) {
+            const auto bit = static_cast<uint64_t>(__builtin_ctzll(bits));
+            bits &= bits - 1;
+
+            target.owner->queue_external_interrupt((i * 64) + bit);
+        }
+    }
+}
+
+vioapic::target_t *
+vioapic::find(gsl::not_null<vcpu_t *> vcpu)
+{
+    std::lock_guard lock(m_mutex);
+
+    for (auto &target : m_targets) {
+        if (static_cast<vcpu_t *>(target.owner) == vcpu.get()) {
+            return &target;
+        }
+    }
+
+    return nullptr;
+}
+
+}
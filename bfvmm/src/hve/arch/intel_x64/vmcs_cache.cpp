@@ -0,0 +1,135 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <bfdebug.h>
+
+namespace eapis::intel_x64
+{
+
+template<typename T>
+static auto
+find(T &entries, std::size_t num, vmcs_n::value_type addr) noexcept
+{
+    for (auto i = 0ULL; i < num; i++) {
+        if (entries[i].addr == addr) {
+            return &entries[i];
+        }
+    }
+
+    return static_cast<typename T::pointer>(nullptr);
+}
+
+vmcs_cache::vmcs_cache(
+    gsl::not_null<vcpu *> vcpu)
+{
+    vcpu->add_exit_handler(
+        ::handler_delegate_t::create<vmcs_cache, &vmcs_cache::handle_exit>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Cache
+// -----------------------------------------------------------------------------
+
+vmcs_n::value_type
+vmcs_cache::read(vmcs_n::value_type addr)
+{
+    m_stats.reads++;
+
+    if (auto entry = find(m_writes, m_num_writes, addr)) {
+        return entry->val;
+    }
+
+    if (auto entry = find(m_reads, m_num_reads, addr)) {
+        return entry->val;
+    }
+
+    auto val = ::intel_x64::vm::read(addr);
+    m_stats.vmreads++;
+
+    if (m_num_reads < num_reads) {
+        m_reads[m_num_reads++] = {addr, val};
+    }
+
+    return val;
+}
+
+void
+vmcs_cache::write(vmcs_n::value_type addr, vmcs_n::value_type val)
+{
+    m_stats.writes++;
+
+    if (auto entry = find(m_writes, m_num_writes, addr)) {
+        entry->val = val;
+        return;
+    }
+
+    if (m_num_writes == num_writes) {
+        this->flush();
+    }
+
+    m_writes[m_num_writes++] = {addr, val};
+}
+
+void
+vmcs_cache::flush()
+{
+    for (auto i = 0ULL; i < m_num_writes; i++) {
+        ::intel_x64::vm::write(m_writes[i].addr, m_writes[i].val);
+    }
+
+    m_stats.vmwrites += m_num_writes;
+
+    m_num_writes = 0;
+    this->invalidate();
+}
+
+void
+vmcs_cache::invalidate() noexcept
+{ m_num_reads = 0; }
+
+void
+vmcs_cache::dump_stats() const
+{
+    bfdebug_info(0, "vmcs cache stats");
+    bfdebug_subndec(0, "reads", m_stats.reads);
+    bfdebug_subndec(0, "vmreads", m_stats.vmreads);
+    bfdebug_subndec(0, "vmreads saved", m_stats.reads - m_stats.vmreads);
+    bfdebug_subndec(0, "writes", m_stats.writes);
+    bfdebug_subndec(0, "vmwrites", m_stats.vmwrites);
+    bfdebug_subndec(0, "vmwrites saved", m_stats.writes - m_stats.vmwrites);
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+vmcs_cache::handle_exit(gsl::not_null<vcpu_t *> vcpu)
+{
+    bfignored(vcpu);
+
+    this->invalidate();
+    return false;
+}
+
+}
@@ -19,6 +19,7 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
 #include <hve/arch/intel_x64/vcpu.h>
 
 namespace eapis::intel_x64
@@ -26,14 +27,18 @@ namespace eapis::intel_x64
 
 static bool
 emulate_ia_32e_mode_switch(
-    control_register_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
     using namespace vmcs_n::guest_cr0;
     using namespace vmcs_n::guest_ia32_efer;
     using namespace vmcs_n::vm_entry_controls;
     using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
 
-    if (unrestricted_guest::is_disabled() || lme::is_disabled()) {
+    const auto controls = vcpu_cast(vcpu)->vmcs_read(
+        vmcs_n::secondary_processor_based_vm_execution_controls::addr
+    );
+
+    if ((controls & unrestricted_guest::mask) == 0 || lme::is_disabled()) {
         return true;
     }
 
@@ -56,10 +61,9 @@ default_wrcr0_handler(
     gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
     using namespace vmcs_n::guest_cr0;
-    bfignored(vcpu);
 
     if (paging::is_enabled() != paging::is_enabled(info.val)) {
-        return emulate_ia_32e_mode_switch(info);
+        return emulate_ia_32e_mode_switch(vcpu, info);
     }
 
     return true;
@@ -79,19 +83,32 @@ static bool
 default_wrcr3_handler(
     gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
-    bfignored(vcpu);
-    bfignored(info);
+    using namespace vmcs_n::guest_cr4;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
 
-    ::intel_x64::vmx::invept_global();
-    return true;
-}
+    // With PCIDs enabled, bit 63 of the source operand asks the processor
+    // not to invalidate the TLB entries of the new PCID, so we don't either.
+    //
+    // Without VPID, the guest runs with VPID 0, whose linear and combined
+    // mappings are already invalidated on every VM entry and exit, so the
+    // only flush required is the one scoped to this vcpu's VPID. Nothing
+    // here needs to touch the EPT (guest-physical) mappings, or any other
+    // vcpu's mappings, which is what the previous global INVEPT did.
+    //
+
+    if (pcid_enable_bit::is_enabled() && ((info.val & (1ULL << 63)) != 0)) {
+        return true;
+    }
 
-static bool
-default_wrcr4_handler(
-    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
-{
-    bfignored(vcpu);
-    bfignored(info);
+    const auto controls = vcpu_cast(vcpu)->vmcs_read(
+        vmcs_n::secondary_processor_based_vm_execution_controls::addr
+    );
+
+    if ((controls & enable_vpid::mask) != 0) {
+        ::intel_x64::vmx::invvpid_single_context(
+            vcpu_cast(vcpu)->vmcs_read(vmcs_n::virtual_processor_identifier::addr)
+        );
+    }
 
     return true;
 }
@@ -109,6 +126,7 @@ control_register_handler::control_register_handler(
     );
 
     this->add_wrcr0_handler(
+        guest_cr0::paging::mask,
         handler_delegate_t::create<default_wrcr0_handler>()
     );
 
@@ -120,10 +138,6 @@ control_register_handler::control_register_handler(
         handler_delegate_t::create<default_wrcr3_handler>()
     );
 
-    this->add_wrcr4_handler(
-        handler_delegate_t::create<default_wrcr4_handler>()
-    );
-
     this->enable_wrcr0_exiting(0);
     this->enable_wrcr4_exiting(0);
 }
@@ -134,8 +148,23 @@ control_register_handler::control_register_handler(
 
 void
 control_register_handler::add_wrcr0_handler(
+    vmcs_n::value_type mask, const handler_delegate_t &d)
+{
+    m_wrcr0_handlers.push_front({mask, d});
+    this->update_wrcr0_mask();
+}
+
+void
+control_register_handler::remove_wrcr0_handler(
     const handler_delegate_t &d)
-{ m_wrcr0_handlers.push_front(d); }
+{
+    m_wrcr0_handlers.remove_if([&d](const auto & entry) {
+        return entry.d == d;
+    });
+
+    m_profile.forget(profile_wrcr0);
+    this->update_wrcr0_mask();
+}
 
 void
 control_register_handler::add_rdcr3_handler(
@@ -149,43 +178,115 @@ control_register_handler::add_wrcr3_handler(
 
 void
 control_register_handler::add_wrcr4_handler(
+    vmcs_n::value_type mask, const handler_delegate_t &d)
+{
+    m_wrcr4_handlers.push_front({mask, d});
+    this->update_wrcr4_mask();
+}
+
+void
+control_register_handler::remove_wrcr4_handler(
     const handler_delegate_t &d)
-{ m_wrcr4_handlers.push_front(d); }
+{
+    m_wrcr4_handlers.remove_if([&d](const auto & entry) {
+        return entry.d == d;
+    });
+
+    m_profile.forget(profile_wrcr4);
+    this->update_wrcr4_mask();
+}
 
 void
 control_register_handler::enable_wrcr0_exiting(
     vmcs_n::value_type mask)
 {
-    using namespace vmcs_n;
-    mask |= m_vcpu->global_state()->ia32_vmx_cr0_fixed0;
-
-    cr0_guest_host_mask::set(mask);
-    cr0_read_shadow::set(guest_cr0::get());
+    m_wrcr0_host_mask = mask;
+    this->update_wrcr0_mask();
 }
 
 void
 control_register_handler::enable_rdcr3_exiting()
 {
     using namespace vmcs_n;
-    primary_processor_based_vm_execution_controls::cr3_store_exiting::enable();
+
+    m_vcpu->vmcs_set_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::cr3_store_exiting::mask
+    );
 }
 
 void
 control_register_handler::enable_wrcr3_exiting()
 {
     using namespace vmcs_n;
-    primary_processor_based_vm_execution_controls::cr3_load_exiting::enable();
+
+    m_vcpu->vmcs_set_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::cr3_load_exiting::mask
+    );
 }
 
 void
 control_register_handler::enable_wrcr4_exiting(
     vmcs_n::value_type mask)
 {
-    using namespace vmcs_n;
-    mask |= m_vcpu->global_state()->ia32_vmx_cr4_fixed0;
+    m_wrcr4_host_mask = mask;
+    this->update_wrcr4_mask();
+}
+
+void
+control_register_handler::add_cr3_target(
+    vmcs_n::value_type val)
+{
+    auto begin = m_cr3_targets.begin();
+    auto end = begin + static_cast<std::ptrdiff_t>(m_num_cr3_targets);
+
+    if (std::find(begin, end, val) != end) {
+        return;
+    }
 
-    cr4_guest_host_mask::set(mask);
-    cr4_read_shadow::set(guest_cr4::get());
+    // IA32_VMX_MISC[24:16] reports how many CR3-target values the CPU
+    // actually honours, which can be fewer than the VMCS has fields for.
+
+    auto supported = std::min<std::size_t>(
+        max_cr3_targets,
+        (::intel_x64::msrs::get(::intel_x64::msrs::ia32_vmx_misc::addr) >> 16) & 0x1FF
+    );
+
+    if (m_num_cr3_targets >= supported) {
+        throw std::runtime_error(
+            "control_register_handler::add_cr3_target: target list full"
+        );
+    }
+
+    m_cr3_targets.at(m_num_cr3_targets++) = val;
+    this->write_cr3_targets();
+}
+
+void
+control_register_handler::remove_cr3_target(
+    vmcs_n::value_type val)
+{
+    auto begin = m_cr3_targets.begin();
+    auto end = begin + static_cast<std::ptrdiff_t>(m_num_cr3_targets);
+
+    auto iter = std::remove(begin, end, val);
+    if (iter == end) {
+        return;
+    }
+
+    std::fill(iter, end, 0);
+    m_num_cr3_targets = static_cast<std::size_t>(iter - begin);
+    this->write_cr3_targets();
+}
+
+void
+control_register_handler::clear_cr3_targets()
+{
+    m_cr3_targets.fill(0);
+    m_num_cr3_targets = 0;
+
+    this->write_cr3_targets();
 }
 
 // -----------------------------------------------------------------------------
@@ -196,8 +297,9 @@ bool
 control_register_handler::handle(gsl::not_null<vcpu_t *> vcpu)
 {
     using namespace vmcs_n::exit_qualification::control_register_access;
+    auto qual = m_vcpu->vmcs_read(vmcs_n::exit_qualification::addr);
 
-    switch (control_register_number::get()) {
+    switch (control_register_number::get(qual)) {
         case 0:
             return handle_cr0(vcpu);
 
@@ -218,8 +320,9 @@ bool
 control_register_handler::handle_cr0(gsl::not_null<vcpu_t *> vcpu)
 {
     using namespace vmcs_n::exit_qualification::control_register_access;
+    auto qual = m_vcpu->vmcs_read(vmcs_n::exit_qualification::addr);
 
-    switch (access_type::get()) {
+    switch (access_type::get(qual)) {
         case access_type::mov_to_cr:
             return handle_wrcr0(vcpu);
 
@@ -244,8 +347,9 @@ bool
 control_register_handler::handle_cr3(gsl::not_null<vcpu_t *> vcpu)
 {
     using namespace vmcs_n::exit_qualification::control_register_access;
+    auto qual = m_vcpu->vmcs_read(vmcs_n::exit_qualification::addr);
 
-    switch (access_type::get()) {
+    switch (access_type::get(qual)) {
         case access_type::mov_to_cr:
             return handle_wrcr3(vcpu);
 
@@ -268,8 +372,9 @@ bool
 control_register_handler::handle_cr4(gsl::not_null<vcpu_t *> vcpu)
 {
     using namespace vmcs_n::exit_qualification::control_register_access;
+    auto qual = m_vcpu->vmcs_read(vmcs_n::exit_qualification::addr);
 
-    switch (access_type::get()) {
+    switch (access_type::get(qual)) {
         case access_type::mov_to_cr:
             return handle_wrcr4(vcpu);
 
@@ -295,7 +400,7 @@ control_register_handler::handle_wrcr0(gsl::not_null<vcpu_t *> vcpu)
 {
     struct info_t info = {
         emulate_rdgpr(vcpu),
-        vmcs_n::cr0_read_shadow::get(),
+        m_vcpu->vmcs_read(vmcs_n::cr0_read_shadow::addr),
         false,
         false
     };
@@ -303,15 +408,24 @@ control_register_handler::handle_wrcr0(gsl::not_null<vcpu_t *> vcpu)
     info.shadow = info.val;
     info.val |= m_vcpu->global_state()->ia32_vmx_cr0_fixed0;
 
-    for (const auto &d : m_wrcr0_handlers) {
-        if (d(vcpu, info)) {
+    auto changed =
+        (info.shadow ^ m_vcpu->vmcs_read(vmcs_n::cr0_read_shadow::addr)) &
+        m_vcpu->vmcs_read(vmcs_n::cr0_guest_host_mask::addr);
+
+    auto walk = m_profile.walk(profile_wrcr0);
+    for (const auto &entry : m_wrcr0_handlers) {
+        if ((entry.mask & changed) == 0) {
+            continue;
+        }
+
+        if (walk(entry.d, vcpu, info)) {
             break;
         }
     }
 
     if (!info.ignore_write) {
         vmcs_n::guest_cr0::set(info.val);
-        vmcs_n::cr0_read_shadow::set(info.shadow);
+        m_vcpu->vmcs_write(vmcs_n::cr0_read_shadow::addr, info.shadow);
     }
 
     if (!info.ignore_advance) {
@@ -331,8 +445,9 @@ control_register_handler::handle_rdcr3(gsl::not_null<vcpu_t *> vcpu)
         false
     };
 
+    auto walk = m_profile.walk(profile_rdcr3);
     for (const auto &d : m_rdcr3_handlers) {
-        if (d(vcpu, info)) {
+        if (walk(d, vcpu, info)) {
             break;
         }
     }
@@ -358,8 +473,9 @@ control_register_handler::handle_wrcr3(gsl::not_null<vcpu_t *> vcpu)
         false
     };
 
+    auto walk = m_profile.walk(profile_wrcr3);
     for (const auto &d : m_wrcr3_handlers) {
-        if (d(vcpu, info)) {
+        if (walk(d, vcpu, info)) {
             break;
         }
     }
@@ -380,7 +496,7 @@ control_register_handler::handle_wrcr4(gsl::not_null<vcpu_t *> vcpu)
 {
     struct info_t info = {
         emulate_rdgpr(vcpu),
-        vmcs_n::cr4_read_shadow::get(),
+        m_vcpu->vmcs_read(vmcs_n::cr4_read_shadow::addr),
         false,
         false
     };
@@ -388,15 +504,24 @@ control_register_handler::handle_wrcr4(gsl::not_null<vcpu_t *> vcpu)
     info.shadow = info.val;
     info.val |= m_vcpu->global_state()->ia32_vmx_cr4_fixed0;
 
-    for (const auto &d : m_wrcr4_handlers) {
-        if (d(vcpu, info)) {
+    auto changed =
+        (info.shadow ^ m_vcpu->vmcs_read(vmcs_n::cr4_read_shadow::addr)) &
+        m_vcpu->vmcs_read(vmcs_n::cr4_guest_host_mask::addr);
+
+    auto walk = m_profile.walk(profile_wrcr4);
+    for (const auto &entry : m_wrcr4_handlers) {
+        if ((entry.mask & changed) == 0) {
+            continue;
+        }
+
+        if (walk(entry.d, vcpu, info)) {
             break;
         }
     }
 
     if (!info.ignore_write) {
         vmcs_n::guest_cr4::set(info.val);
-        vmcs_n::cr4_read_shadow::set(info.shadow);
+        m_vcpu->vmcs_write(vmcs_n::cr4_read_shadow::addr, info.shadow);
     }
 
     if (!info.ignore_advance) {
@@ -406,4 +531,75 @@ control_register_handler::handle_wrcr4(gsl::not_null<vcpu_t *> vcpu)
     return true;
 }
 
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void
+control_register_handler::update_wrcr0_mask()
+{
+    using namespace vmcs_n;
+
+    auto mask = m_wrcr0_host_mask | m_vcpu->global_state()->ia32_vmx_cr0_fixed0;
+    for (const auto &entry : m_wrcr0_handlers) {
+        mask |= entry.mask;
+    }
+
+    auto old_mask = m_vcpu->vmcs_read(cr0_guest_host_mask::addr);
+    if (mask == old_mask) {
+        return;
+    }
+
+    // Bits that were guest owned have a stale shadow. Take their value from
+    // the guest's CR0 so reads return what the guest last wrote. Bits that
+    // become guest owned already hold the guest's value in CR0 itself.
+
+    auto shadow = m_vcpu->vmcs_read(cr0_read_shadow::addr);
+    m_vcpu->vmcs_write(
+        cr0_read_shadow::addr, (shadow & old_mask) | (guest_cr0::get() & ~old_mask)
+    );
+
+    m_vcpu->vmcs_write(cr0_guest_host_mask::addr, mask);
+}
+
+void
+control_register_handler::update_wrcr4_mask()
+{
+    using namespace vmcs_n;
+
+    auto mask = m_wrcr4_host_mask | m_vcpu->global_state()->ia32_vmx_cr4_fixed0;
+    for (const auto &entry : m_wrcr4_handlers) {
+        mask |= entry.mask;
+    }
+
+    auto old_mask = m_vcpu->vmcs_read(cr4_guest_host_mask::addr);
+    if (mask == old_mask) {
+        return;
+    }
+
+    auto shadow = m_vcpu->vmcs_read(cr4_read_shadow::addr);
+    m_vcpu->vmcs_write(
+        cr4_read_shadow::addr, (shadow & old_mask) | (guest_cr4::get() & ~old_mask)
+    );
+
+    m_vcpu->vmcs_write(cr4_guest_host_mask::addr, mask);
+}
+
+void
+control_register_handler::write_cr3_targets()
+{
+    using namespace vmcs_n;
+
+    // Unused fields are zeroed so that a stale value can never match, and
+    // the count is written last so the VMCS never advertises a target
+    // that has not been written yet.
+
+    cr3_target_value0::set(m_cr3_targets[0]);
+    cr3_target_value1::set(m_cr3_targets[1]);
+    cr3_target_value2::set(m_cr3_targets[2]);
+    cr3_target_value3::set(m_cr3_targets[3]);
+
+    cr3_target_count::set(m_num_cr3_targets);
+}
+
 }
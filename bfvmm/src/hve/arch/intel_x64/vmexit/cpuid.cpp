@@ -109,8 +109,9 @@ cpuid_handler::handle(gsl::not_null<vcpu_t *> vcpu)
             info.rdx = rdx;
         }
 
+        auto walk = m_profile.walk(hdlrs->first);
         for (const auto &d : hdlrs->second) {
-            if (d(vcpu, info)) {
+            if (walk(d, vcpu, info)) {
 
                 if (!info.ignore_write) {
                     vcpu->set_rax(set_bits(vcpu->rax(), 0x00000000FFFFFFFFULL, info.rax));
@@ -58,8 +58,9 @@ ept_misconfiguration_handler::handle(gsl::not_null<vcpu_t *> vcpu)
         false
     };
 
+    auto walk = m_profile.walk();
     for (const auto &d : m_handlers) {
-        if (d(vcpu, info)) {
+        if (walk(d, vcpu, info)) {
 
             if (!info.ignore_advance) {
                 return vcpu->advance();
@@ -79,11 +79,11 @@ bool
 ept_violation_handler::handle(gsl::not_null<vcpu_t *> vcpu)
 {
     using namespace vmcs_n;
-    auto qual = exit_qualification::ept_violation::get();
+    auto qual = m_vcpu->vmcs_read(exit_qualification::addr);
 
     struct info_t info = {
-        guest_linear_address::get(),
-        guest_physical_address::get(),
+        m_vcpu->vmcs_read(guest_linear_address::addr),
+        m_vcpu->vmcs_read(guest_physical_address::addr),
         qual,
         true
     };
@@ -108,8 +108,9 @@ ept_violation_handler::handle(gsl::not_null<vcpu_t *> vcpu)
 bool
 ept_violation_handler::handle_read(gsl::not_null<vcpu_t *> vcpu, info_t &info)
 {
+    auto walk = m_profile.walk(0);
     for (const auto &d : m_read_handlers) {
-        if (d(vcpu, info)) {
+        if (walk(d, vcpu, info)) {
 
             if (!info.ignore_advance) {
                 return vcpu->advance();
@@ -131,8 +132,9 @@ ept_violation_handler::handle_read(gsl::not_null<vcpu_t *> vcpu, info_t &info)
 bool
 ept_violation_handler::handle_write(gsl::not_null<vcpu_t *> vcpu, info_t &info)
 {
+    auto walk = m_profile.walk(1);
     for (const auto &d : m_write_handlers) {
-        if (d(vcpu, info)) {
+        if (walk(d, vcpu, info)) {
 
             if (!info.ignore_advance) {
                 return vcpu->advance();
@@ -154,8 +156,9 @@ ept_violation_handler::handle_write(gsl::not_null<vcpu_t *> vcpu, info_t &info)
 bool
 ept_violation_handler::handle_execute(gsl::not_null<vcpu_t *> vcpu, info_t &info)
 {
+    auto walk = m_profile.walk(2);
     for (const auto &d : m_execute_handlers) {
-        if (d(vcpu, info)) {
+        if (walk(d, vcpu, info)) {
 
             if (!info.ignore_advance) {
                 return vcpu->advance();
@@ -44,7 +44,59 @@ external_interrupt_handler::external_interrupt_handler(
 void
 external_interrupt_handler::add_handler(
     const handler_delegate_t &d)
-{ m_handlers.push_front(d); }
+{
+    m_handlers.push_front(d);
+
+    for (auto &entry : m_entries) {
+        if (entry.is_default) {
+            entry.route = route_t::handle;
+        }
+    }
+}
+
+void
+external_interrupt_handler::add_handler(
+    uint64_t vector, const handler_delegate_t &d)
+{
+    expects(vector < num_vectors);
+
+    auto &entry = m_entries[vector];
+    entry.route = route_t::handle;
+    entry.handler = d;
+    entry.is_default = false;
+}
+
+void
+external_interrupt_handler::set_route(
+    uint64_t vector, route_t route)
+{
+    expects(vector < num_vectors);
+
+    auto &entry = m_entries[vector];
+    entry.route = route;
+    entry.is_default = false;
+}
+
+external_interrupt_handler::route_t
+external_interrupt_handler::route(uint64_t vector) const
+{
+    expects(vector < num_vectors);
+    return m_entries[vector].route;
+}
+
+void
+external_interrupt_handler::set_unhandled_policy(route_t policy)
+{
+    expects(policy != route_t::handle);
+    m_unhandled_policy = policy;
+}
+
+uint64_t
+external_interrupt_handler::count(uint64_t vector) const
+{
+    expects(vector < num_vectors);
+    return m_entries[vector].count;
+}
 
 void
 external_interrupt_handler::enable_exiting()
@@ -71,15 +123,39 @@ external_interrupt_handler::handle(gsl::not_null<vcpu_t *> vcpu)
         vmcs_n::vm_exit_interruption_information::vector::get()
     };
 
-    for (const auto &d : m_handlers) {
-        if (d(vcpu, info)) {
+    auto &entry = m_entries[info.vector & (num_vectors - 1)];
+    entry.count++;
+
+    switch (entry.route) {
+        case route_t::handle:
+            if (entry.handler.is_valid() && entry.handler(vcpu, info)) {
+                return true;
+            }
+
+            for (const auto &d : m_handlers) {
+                if (d(vcpu, info)) {
+                    return true;
+                }
+            }
+
+            this->dispatch_unhandled(info.vector);
+            return true;
+
+        case route_t::reflect:
+            m_vcpu->queue_external_interrupt(info.vector);
+            return true;
+
+        default:
             return true;
-        }
     }
+}
 
-    throw std::runtime_error(
-        "Unhandled interrupt vector: " + std::to_string(info.vector)
-    );
+void
+external_interrupt_handler::dispatch_unhandled(uint64_t vector)
+{
+    if (m_unhandled_policy == route_t::reflect) {
+        m_vcpu->queue_external_interrupt(vector);
+    }
 }
 
 }
@@ -0,0 +1,335 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/lapic.h>
+
+namespace eapis::intel_x64
+{
+
+constexpr const auto ia32_apic_base = 0x1BU;
+constexpr const auto x2apic_enable_bit = 10U;
+constexpr const auto x2apic_irr_msr = lapic::x2apic_msr(0x200U >> 2U);
+
+hlt_handler::hlt_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu},
+    m_clock{&vcpu->global_state()->clock}
+{
+    using namespace vmcs_n;
+
+    vcpu->add_handler(
+        exit_reason::basic_exit_reason::hlt,
+        ::handler_delegate_t::create<hlt_handler, &hlt_handler::handle_hlt>(this)
+    );
+
+    vcpu->add_handler(
+        exit_reason::basic_exit_reason::mwait,
+        ::handler_delegate_t::create<hlt_handler, &hlt_handler::handle_mwait>(this)
+    );
+
+    vcpu->add_handler(
+        exit_reason::basic_exit_reason::monitor,
+        ::handler_delegate_t::create<hlt_handler, &hlt_handler::handle_monitor>(this)
+    );
+
+    vcpu->add_exit_handler(
+        ::handler_delegate_t::create<hlt_handler, &hlt_handler::handle_exit>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+hlt_handler::add_wake_delegate(const wake_delegate_t &d)
+{ m_wake_delegates.push_front(d); }
+
+void
+hlt_handler::enable_exiting()
+{
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+    m_vcpu->vmcs_set_bits(addr, hlt_exiting::mask);
+}
+
+void
+hlt_handler::disable_exiting()
+{
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+
+    m_vcpu->vmcs_clear_bits(
+        addr, hlt_exiting::mask | mwait_exiting::mask | monitor_exiting::mask
+    );
+}
+
+void
+hlt_handler::enable_mwait_exiting()
+{
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+    m_vcpu->vmcs_set_bits(addr, mwait_exiting::mask | monitor_exiting::mask);
+}
+
+void
+hlt_handler::disable_mwait_exiting()
+{
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+    m_vcpu->vmcs_clear_bits(addr, mwait_exiting::mask | monitor_exiting::mask);
+}
+
+void
+hlt_handler::set_poll_window(uint64_t start_ns, uint64_t max_ns) noexcept
+{
+    m_poll_start_ns = std::min(start_ns, max_ns);
+    m_poll_max_ns = max_ns;
+    m_poll_ns = std::min(m_poll_ns, max_ns);
+}
+
+uint64_t
+hlt_handler::poll_window() const noexcept
+{ return m_poll_ns; }
+
+const hlt_handler::stats_t &
+hlt_handler::stats() const noexcept
+{ return m_stats; }
+
+void
+hlt_handler::dump_stats() const
+{
+    bfdebug_info(0, "hlt stats");
+    bfdebug_subndec(0, "hlt exits", m_stats.hlt_exits);
+    bfdebug_subndec(0, "mwait exits", m_stats.mwait_exits);
+    bfdebug_subndec(0, "monitor exits", m_stats.monitor_exits);
+    bfdebug_subndec(0, "poll wake-ups", m_stats.poll_wakeups);
+    bfdebug_subndec(0, "sleeps", m_stats.sleeps);
+    bfdebug_subndec(0, "poll grows", m_stats.poll_grows);
+    bfdebug_subndec(0, "poll shrinks", m_stats.poll_shrinks);
+    bfdebug_subndec(0, "poll window (ns)", m_poll_ns);
+    bfdebug_subndec(0, "time polling (ns)", m_stats.poll_ns);
+    bfdebug_subndec(0, "max wake latency (ns)", m_stats.max_wake_latency_ns);
+
+    const auto wakeups = m_stats.poll_wakeups + m_stats.sleeps;
+    if (wakeups != 0) {
+        bfdebug_subndec(0, "avg wake latency (ns)", m_stats.wake_latency_ns / wakeups);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+hlt_handler::handle_hlt(gsl::not_null<vcpu_t *> vcpu)
+{
+    m_stats.hlt_exits++;
+
+    vcpu->advance();
+    return this->idle(vcpu, true);
+}
+
+bool
+hlt_handler::handle_mwait(gsl::not_null<vcpu_t *> vcpu)
+{
+    m_stats.mwait_exits++;
+
+    vcpu->advance();
+    return this->idle(vcpu, false);
+}
+
+bool
+hlt_handler::handle_monitor(gsl::not_null<vcpu_t *> vcpu)
+{
+    m_stats.monitor_exits++;
+    return vcpu->advance();
+}
+
+bool
+hlt_handler::handle_exit(gsl::not_null<vcpu_t *> vcpu)
+{
+    using namespace vmcs_n::guest_activity_state;
+    bfignored(vcpu);
+
+    //
+    // An exit that happens while the guest is still halted (e.g. a
+    // software timer firing) is not a wake-up. The guest is awake once
+    // the activity state is back to active, or once an interrupt has been
+    // queued for injection.
+    //
+
+    if (!m_sleeping) {
+        return true;
+    }
+
+    if (get() == hlt && !m_vcpu->has_pending_interrupts()) {
+        return true;
+    }
+
+    m_sleeping = false;
+
+    const auto block_ns =
+        m_clock->tsc_to_ns(::x64::read_tsc::get() - m_sleep_start);
+
+    this->record_wake(block_ns);
+    this->adapt(block_ns);
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+bool
+hlt_handler::idle(gsl::not_null<vcpu_t *> vcpu, bool can_sleep)
+{
+    const auto start = ::x64::read_tsc::get();
+
+    m_x2apic =
+        (::x64::msrs::get(ia32_apic_base) & (1ULL << x2apic_enable_bit)) != 0;
+
+    if (m_poll_ns != 0) {
+        const auto end = start + m_clock->ns_to_tsc(m_poll_ns);
+
+        auto now = start;
+        auto woke = this->wake_pending(vcpu);
+
+        while (!woke && now < end) {
+            __builtin_ia32_pause();
+
+            now = ::x64::read_tsc::get();
+            woke = this->wake_pending(vcpu);
+        }
+
+        const auto polled_ns = m_clock->tsc_to_ns(now - start);
+        m_stats.poll_ns += polled_ns;
+
+        if (woke) {
+            m_stats.poll_wakeups++;
+            this->record_wake(polled_ns);
+
+            return true;
+        }
+    }
+    else if (this->wake_pending(vcpu)) {
+        this->record_wake(0);
+        return true;
+    }
+
+    if (!can_sleep) {
+        return true;
+    }
+
+    //
+    // Nothing showed up while polling, so put the vCPU to sleep. Resuming
+    // the guest in the HLT activity state halts the physical core until an
+    // interrupt (or a VM exit such as the preemption timer) wakes it.
+    //
+
+    vmcs_n::guest_activity_state::set(vmcs_n::guest_activity_state::hlt);
+
+    m_sleeping = true;
+    m_sleep_start = start;
+    m_stats.sleeps++;
+
+    return true;
+}
+
+bool
+hlt_handler::wake_pending(gsl::not_null<vcpu_t *> vcpu)
+{
+    if (m_vcpu->has_pending_interrupts()) {
+        return true;
+    }
+
+    if (this->physical_irr_pending()) {
+        return true;
+    }
+
+    for (const auto &d : m_wake_delegates) {
+        if (d(vcpu)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//
+// Host interrupts are masked while polling, so an interrupt that arrives
+// for this core sits in the physical LAPIC's IRR until the guest is
+// resumed and the external interrupt exit is taken. Only the x2APIC can
+// be read without a mapping, so the IRR is not checked in xAPIC mode.
+//
+
+bool
+hlt_handler::physical_irr_pending() const
+{
+    if (!m_x2apic) {
+        return false;
+    }
+
+    for (auto i = 0U; i < 8U; i++) {
+        if ((::x64::msrs::get(x2apic_irr_msr + i) & 0xFFFFFFFFULL) != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+hlt_handler::record_wake(uint64_t latency_ns) noexcept
+{
+    m_stats.wake_latency_ns += latency_ns;
+    m_stats.max_wake_latency_ns = std::max(m_stats.max_wake_latency_ns, latency_ns);
+}
+
+//
+// The window is only adjusted after a sleep, i.e. after polling failed.
+// If the wake-up came in shortly after the window closed, a bigger window
+// would have caught it, so grow. If the sleep was longer than the maximum
+// window, polling could never have caught it, so shrink.
+//
+
+void
+hlt_handler::adapt(uint64_t block_ns) noexcept
+{
+    if (block_ns <= m_poll_ns) {
+        return;
+    }
+
+    if (block_ns < m_poll_max_ns) {
+        m_poll_ns = (m_poll_ns == 0) ? m_poll_start_ns : std::min(m_poll_ns << 1U, m_poll_max_ns);
+        m_stats.poll_grows++;
+
+        return;
+    }
+
+    if (m_poll_ns != 0) {
+        m_poll_ns = (m_poll_ns >> 1U) < m_poll_start_ns ? 0 : (m_poll_ns >> 1U);
+        m_stats.poll_shrinks++;
+    }
+}
+
+}
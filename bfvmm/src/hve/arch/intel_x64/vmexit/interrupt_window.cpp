@@ -125,6 +125,10 @@ interrupt_window_handler::inject_external_interrupt(uint64_t vector)
     info_n::set(info);
 }
 
+bool
+interrupt_window_handler::has_pending() const
+{ return !m_interrupt_queue.empty(); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -152,7 +156,11 @@ interrupt_window_handler::enable_exiting()
     using namespace vmcs_n;
 
     if (m_enabled == false) {
-        primary_processor_based_vm_execution_controls::interrupt_window_exiting::enable();
+        m_vcpu->vmcs_set_bits(
+            primary_processor_based_vm_execution_controls::addr,
+            primary_processor_based_vm_execution_controls::interrupt_window_exiting::mask
+        );
+
         m_enabled = true;
     }
 }
@@ -163,7 +171,11 @@ interrupt_window_handler::disable_exiting()
     using namespace vmcs_n;
 
     if (m_enabled == true) {
-        primary_processor_based_vm_execution_controls::interrupt_window_exiting::disable();
+        m_vcpu->vmcs_clear_bits(
+            primary_processor_based_vm_execution_controls::addr,
+            primary_processor_based_vm_execution_controls::interrupt_window_exiting::mask
+        );
+
         m_enabled = false;
     }
 }
@@ -36,8 +36,8 @@ io_instruction_handler::io_instruction_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
     m_vcpu{vcpu},
-    m_io_bitmap_a{vcpu->m_io_bitmap_a.get(), ::x64::pt::page_size},
-    m_io_bitmap_b{vcpu->m_io_bitmap_b.get(), ::x64::pt::page_size}
+    m_io_bitmap_a{&vcpu->m_io_bitmap_a},
+    m_io_bitmap_b{&vcpu->m_io_bitmap_b}
 {
     using namespace vmcs_n;
 
@@ -78,12 +78,12 @@ void
 io_instruction_handler::trap_on_access(vmcs_n::value_type port)
 {
     if (port < 0x8000) {
-        set_bit(m_io_bitmap_a, port);
+        m_io_bitmap_a->set(port);
         return;
     }
 
     if (port < 0x10000) {
-        set_bit(m_io_bitmap_b, port - 0x8000);
+        m_io_bitmap_b->set(port - 0x8000);
         return;
     }
 
@@ -93,20 +93,20 @@ io_instruction_handler::trap_on_access(vmcs_n::value_type port)
 void
 io_instruction_handler::trap_on_all_accesses()
 {
-    gsl::memset(m_io_bitmap_a, 0xFF);
-    gsl::memset(m_io_bitmap_b, 0xFF);
+    m_io_bitmap_a->fill(0, bitmap_policy::size, 0xFF);
+    m_io_bitmap_b->fill(0, bitmap_policy::size, 0xFF);
 }
 
 void
 io_instruction_handler::pass_through_access(vmcs_n::value_type port)
 {
     if (port < 0x8000) {
-        clear_bit(m_io_bitmap_a, port);
+        m_io_bitmap_a->clear(port);
         return;
     }
 
     if (port < 0x10000) {
-        clear_bit(m_io_bitmap_b, port - 0x8000);
+        m_io_bitmap_b->clear(port - 0x8000);
         return;
     }
 
@@ -116,8 +116,8 @@ io_instruction_handler::pass_through_access(vmcs_n::value_type port)
 void
 io_instruction_handler::pass_through_all_accesses()
 {
-    gsl::memset(m_io_bitmap_a, 0x0);
-    gsl::memset(m_io_bitmap_b, 0x0);
+    m_io_bitmap_a->fill(0, bitmap_policy::size, 0x0);
+    m_io_bitmap_b->fill(0, bitmap_policy::size, 0x0);
 }
 
 // -----------------------------------------------------------------------------
@@ -128,7 +128,7 @@ bool
 io_instruction_handler::handle(gsl::not_null<vcpu_t *> vcpu)
 {
     namespace io_instruction = vmcs_n::exit_qualification::io_instruction;
-    auto eq = io_instruction::get();
+    auto eq = m_vcpu->vmcs_read(vmcs_n::exit_qualification::addr);
 
     auto reps = 1ULL;
     if (io_instruction::rep_prefixed::is_enabled(eq)) {
@@ -155,7 +155,7 @@ io_instruction_handler::handle(gsl::not_null<vcpu_t *> vcpu)
     }
 
     if (io_instruction::string_instruction::is_enabled(eq)) {
-        info.address = vmcs_n::guest_linear_address::get();
+        info.address = m_vcpu->vmcs_read(vmcs_n::guest_linear_address::addr);
     }
 
     for (auto i = 0ULL; i < reps; i++) {
@@ -187,8 +187,9 @@ io_instruction_handler::handle_in(gsl::not_null<vcpu_t *> vcpu, info_t &info)
             emulate_in(info);
         }
 
+        auto walk = m_profile.walk(info.port_number);
         for (const auto &d : hdlrs->second) {
-            if (d(vcpu, info)) {
+            if (walk(d, vcpu, info)) {
 
                 if (!info.ignore_write) {
                     store_operand(vcpu, info);
@@ -220,8 +221,9 @@ io_instruction_handler::handle_out(gsl::not_null<vcpu_t *> vcpu, info_t &info)
     if (GSL_LIKELY(hdlrs != m_out_handlers.end())) {
         load_operand(vcpu, info);
 
+        auto walk = m_profile.walk(info.port_number | 0x10000);
         for (const auto &d : hdlrs->second) {
-            if (d(vcpu, info)) {
+            if (walk(d, vcpu, info)) {
 
                 if (!info.ignore_write && !m_emulate[info.port_number]) {
                     emulate_out(info);
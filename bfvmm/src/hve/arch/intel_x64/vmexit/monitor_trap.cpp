@@ -49,7 +49,11 @@ void
 monitor_trap_handler::enable()
 {
     using namespace vmcs_n;
-    primary_processor_based_vm_execution_controls::monitor_trap_flag::enable();
+
+    m_vcpu->vmcs_set_bits(
+        primary_processor_based_vm_execution_controls::addr,
+        primary_processor_based_vm_execution_controls::monitor_trap_flag::mask
+    );
 }
 
 // -----------------------------------------------------------------------------
@@ -65,14 +69,18 @@ monitor_trap_handler::handle(gsl::not_null<vcpu_t *> vcpu)
         false
     };
 
+    auto walk = m_profile.walk();
     for (const auto &d : m_handlers) {
-        if (d(vcpu, info)) {
+        if (walk(d, vcpu, info)) {
             break;
         }
     }
 
     if (!info.ignore_clear) {
-        primary_processor_based_vm_execution_controls::monitor_trap_flag::disable();
+        m_vcpu->vmcs_clear_bits(
+            primary_processor_based_vm_execution_controls::addr,
+            primary_processor_based_vm_execution_controls::monitor_trap_flag::mask
+        );
     }
 
     return true;
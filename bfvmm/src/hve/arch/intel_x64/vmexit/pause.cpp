@@ -0,0 +1,242 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis::intel_x64
+{
+
+//
+// PLE exits that are less than this far apart are considered part of the
+// same streak by default
+//
+constexpr const uint64_t default_interval_ns = 50000;
+
+//
+// Claims the lowest free lock-holder slot, or returns 0 if all 64 are
+// taken
+//
+static uint64_t
+ple_claim(vcpu_global_state_t *state) noexcept
+{
+    auto slots = state->ple_slots.load();
+
+    while (slots != ~0ULL) {
+        const auto bit = 1ULL << static_cast<uint64_t>(__builtin_ctzll(~slots));
+
+        if (state->ple_slots.compare_exchange_weak(slots, slots | bit)) {
+            return bit;
+        }
+    }
+
+    return 0;
+}
+
+pause_handler::pause_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu},
+    m_state{vcpu->global_state()},
+    m_bit{ple_claim(vcpu->global_state())},
+    m_clock{&vcpu->global_state()->clock}
+{
+    using namespace vmcs_n;
+
+    vcpu->add_handler(
+        exit_reason::basic_exit_reason::pause,
+        ::handler_delegate_t::create<pause_handler, &pause_handler::handle>(this)
+    );
+
+    m_interval = this->interval_to_tsc(default_interval_ns);
+
+    if (m_bit != 0) {
+        const auto slot = static_cast<uint64_t>(__builtin_ctzll(m_bit));
+
+        m_state->ple_ids.at(slot) = vcpu->id();
+        m_state->ple_vcpus |= m_bit;
+    }
+}
+
+pause_handler::~pause_handler()
+{
+    m_state->ple_vcpus &= ~m_bit;
+    m_state->ple_spinning &= ~m_bit;
+    m_state->ple_slots &= ~m_bit;
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+pause_handler::add_yield_delegate(const yield_delegate_t &d)
+{ m_yield_delegates.push_front(d); }
+
+void
+pause_handler::enable_exiting(uint64_t gap, uint64_t window)
+{
+    using namespace vmcs_n;
+
+    if (!secondary_processor_based_vm_execution_controls::pause_loop_exiting::is_allowed1()) {
+        throw std::runtime_error("pause_handler: pause-loop exiting not supported");
+    }
+
+    ple_gap::set(gap);
+    ple_window::set(window);
+
+    m_vcpu->vmcs_set_bits(
+        secondary_processor_based_vm_execution_controls::addr,
+        secondary_processor_based_vm_execution_controls::pause_loop_exiting::mask
+    );
+}
+
+void
+pause_handler::disable_exiting()
+{
+    using namespace vmcs_n;
+
+    m_vcpu->vmcs_clear_bits(
+        secondary_processor_based_vm_execution_controls::addr,
+        secondary_processor_based_vm_execution_controls::pause_loop_exiting::mask
+    );
+}
+
+void
+pause_handler::set_streak_threshold(uint64_t threshold, uint64_t interval_ns) noexcept
+{
+    m_threshold = threshold;
+    m_interval = this->interval_to_tsc(interval_ns);
+}
+
+const pause_handler::stats_t &
+pause_handler::stats() const noexcept
+{ return m_stats; }
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+pause_handler::handle(gsl::not_null<vcpu_t *> vcpu)
+{
+    const auto now = ::x64::read_tsc::get();
+    m_stats.ple_exits++;
+
+    if (now - m_last_exit < m_interval) {
+        m_streak++;
+    }
+    else {
+        m_streak = 1;
+    }
+
+    m_last_exit = now;
+
+    if (m_streak < m_threshold) {
+        this->set_spinning(false);
+        return vcpu->advance();
+    }
+
+    m_stats.suspected_lhp++;
+    this->set_spinning(true);
+
+    struct info_t info = {
+        m_streak,
+        vcpu->rip(),
+        vmcs_n::guest_ss_access_rights::dpl::get() == 0,
+        this->candidate(),
+        false
+    };
+
+    for (const auto &d : m_yield_delegates) {
+        if (d(vcpu, info)) {
+            m_stats.yields++;
+
+            //
+            // Once another vCPU has had a chance to run, the streak is
+            // over. Otherwise, every PLE exit that follows would yield
+            // again right away.
+            //
+
+            m_streak = 0;
+            this->set_spinning(false);
+
+            if (!info.ignore_advance) {
+                return vcpu->advance();
+            }
+
+            return true;
+        }
+    }
+
+    return vcpu->advance();
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+uint64_t
+pause_handler::interval_to_tsc(uint64_t interval_ns) const noexcept
+{
+    if (!m_clock->valid()) {
+        return default_interval_tsc;
+    }
+
+    return m_clock->ns_to_tsc(interval_ns);
+}
+
+//
+// Start right after the last vCPU that was handed out, so that repeated
+// yields spread across the VM instead of always boosting the same vCPU
+// (the same idea as KVM's directed yield).
+//
+
+uint64_t
+pause_handler::candidate() const noexcept
+{
+    const auto others = m_state->ple_vcpus.load() & ~m_state->ple_spinning.load() & ~m_bit;
+
+    if (others == 0) {
+        return no_candidate;
+    }
+
+    const auto last = m_state->ple_last_boosted.load();
+    const auto after = (last >= 63U) ? 0 : (others & ~((2ULL << last) - 1));
+
+    const auto indx =
+        static_cast<uint64_t>(__builtin_ctzll(after != 0 ? after : others));
+
+    m_state->ple_last_boosted = indx;
+    return m_state->ple_ids.at(indx).load();
+}
+
+void
+pause_handler::set_spinning(bool spinning) noexcept
+{
+    if (spinning) {
+        m_state->ple_spinning |= m_bit;
+    }
+    else {
+        m_state->ple_spinning &= ~m_bit;
+    }
+}
+
+}
@@ -19,6 +19,9 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <functional>
+
 #include <hve/arch/intel_x64/vcpu.h>
 
 namespace eapis::intel_x64
@@ -27,7 +30,8 @@ namespace eapis::intel_x64
 preemption_timer_handler::preemption_timer_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
-    m_vcpu{vcpu}
+    m_vcpu{vcpu},
+    m_clock{&vcpu->global_state()->clock}
 {
     using namespace vmcs_n;
 
@@ -64,20 +68,196 @@ preemption_timer_handler::disable_exiting()
     pin_based_vm_execution_controls::activate_preemption_timer::disable();
 }
 
+// Note:
+//
+// A raw timer is also recorded as an absolute TSC deadline, so that the
+// software timer service can program the minimum of the two instead of
+// overwriting it, and can restore what is left of it once the last
+// software timer expires.
+//
+
 void
 preemption_timer_handler::set_timer(value_t val)
 {
-    using namespace ::intel_x64::vmcs;
-    preemption_timer_value::set(val);
+    this->write_timer(val);
+
+    if (m_clock->valid()) {
+        m_raw_deadline = ::x64::read_tsc::get() + m_clock->pet_to_tsc(val);
+        m_raw_pending = true;
+    }
 }
 
 preemption_timer_handler::value_t
 preemption_timer_handler::get_timer() const
 {
     using namespace ::intel_x64::vmcs;
+
+    if (m_service_enabled && m_raw_pending) {
+        return this->pet_until(m_raw_deadline);
+    }
+
     return preemption_timer_value::get();
 }
 
+// -----------------------------------------------------------------------------
+// Software Timers
+// -----------------------------------------------------------------------------
+
+uint64_t
+preemption_timer_handler::now_ns() const
+{ return m_clock->now_ns(); }
+
+preemption_timer_handler::timer_id_t
+preemption_timer_handler::add_timer(
+    uint64_t deadline_ns, const timer_delegate_t &d)
+{ return this->add_timer_tsc(m_clock->ns_to_tsc(deadline_ns), d); }
+
+preemption_timer_handler::timer_id_t
+preemption_timer_handler::add_timer_tsc(
+    uint64_t deadline_tsc, const timer_delegate_t &d)
+{
+    if (!m_clock->valid()) {
+        throw std::runtime_error(
+            "preemption_timer_handler::add_timer_tsc: unknown tsc frequency"
+        );
+    }
+
+    const auto id = m_next_id++;
+
+    m_timers.push_back({deadline_tsc, id, d});
+    std::push_heap(m_timers.begin(), m_timers.end(), std::greater<soft_timer_t>());
+
+    if (!m_service_enabled) {
+        m_exiting_before_service =
+            vmcs_n::pin_based_vm_execution_controls::activate_preemption_timer::is_enabled();
+
+        this->enable_exiting();
+        m_service_enabled = true;
+    }
+
+    return id;
+}
+
+void
+preemption_timer_handler::cancel(timer_id_t id)
+{
+    const auto iter =
+        std::find_if(m_timers.begin(), m_timers.end(), [id](const auto & t) {
+        return t.id == id;
+    });
+
+    if (iter == m_timers.end()) {
+        return;
+    }
+
+    m_timers.erase(iter);
+    std::make_heap(m_timers.begin(), m_timers.end(), std::greater<soft_timer_t>());
+}
+
+// Note:
+//
+// Once the last software timer is gone, the raw timer gets back what is
+// left of its deadline. If no raw timer is pending, exiting is turned back
+// off, unless it was already on before the service turned it on. In that
+// case the timer is parked at its maximum instead, as the value saved on
+// the last exit is about 0, and would otherwise cause an exit (and a
+// spurious call to the raw handlers) on every VM entry.
+//
+
+void
+preemption_timer_handler::program()
+{
+    if (!m_service_enabled) {
+        return;
+    }
+
+    if (m_timers.empty()) {
+        if (m_raw_pending) {
+            this->write_timer(this->pet_until(m_raw_deadline));
+        }
+        else if (m_exiting_before_service) {
+            this->write_timer(0xFFFFFFFFULL);
+        }
+        else {
+            this->disable_exiting();
+        }
+
+        m_service_enabled = false;
+        return;
+    }
+
+    auto deadline = m_timers.front().deadline;
+
+    if (m_raw_pending) {
+        deadline = std::min(deadline, m_raw_deadline);
+    }
+
+    this->write_timer(this->pet_until(deadline));
+}
+
+void
+preemption_timer_handler::write_timer(value_t val)
+{
+    using namespace ::intel_x64::vmcs;
+    preemption_timer_value::set(val);
+}
+
+preemption_timer_handler::value_t
+preemption_timer_handler::pet_until(uint64_t deadline) const
+{
+    const auto now = ::x64::read_tsc::get();
+
+    if (deadline <= now) {
+        return 0;
+    }
+
+    return std::min<uint64_t>(m_clock->tsc_to_pet(deadline - now), 0xFFFFFFFFULL);
+}
+
+// Note:
+//
+// The timer decrements each time bit X of the TSC changes, so it can
+// expire up to one PET tick before the TSC reaches the recorded deadline.
+// That tick is allowed for here, otherwise the raw handlers would miss the
+// exit that was meant for them.
+//
+
+bool
+preemption_timer_handler::raw_expired()
+{
+    if (!m_raw_pending) {
+        return false;
+    }
+
+    const auto now = ::x64::read_tsc::get();
+
+    if (m_raw_deadline > now + m_clock->pet_to_tsc(1)) {
+        return false;
+    }
+
+    m_raw_pending = false;
+    return true;
+}
+
+bool
+preemption_timer_handler::expire(gsl::not_null<vcpu_t *> vcpu)
+{
+    bool expired = false;
+    const auto now = ::x64::read_tsc::get();
+
+    while (!m_timers.empty() && m_timers.front().deadline <= now) {
+        std::pop_heap(m_timers.begin(), m_timers.end(), std::greater<soft_timer_t>());
+
+        auto timer = std::move(m_timers.back());
+        m_timers.pop_back();
+
+        timer.d(vcpu);
+        expired = true;
+    }
+
+    return expired;
+}
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -85,12 +265,25 @@ preemption_timer_handler::get_timer() const
 bool
 preemption_timer_handler::handle(gsl::not_null<vcpu_t *> vcpu)
 {
+    const auto service_owned = m_service_enabled;
+    const auto raw_expired = this->raw_expired();
+    const auto expired = this->expire(vcpu);
+
+    if (service_owned && !raw_expired) {
+        return true;
+    }
+
+    auto walk = m_profile.walk();
     for (const auto &d : m_handlers) {
-        if (d(vcpu)) {
+        if (walk(d, vcpu)) {
             return true;
         }
     }
 
+    if (expired || service_owned) {
+        return true;
+    }
+
     throw std::runtime_error(
         "preemption_timer_handler::handle: unhandled vmx-preemption timer exit"
     );
@@ -0,0 +1,422 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+#include <bfthreadcontext.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis::intel_x64
+{
+
+// Note:
+//
+// RDTSCP does not exit, so whatever IA32_TSC_AUX holds on a core is what
+// the guest reads there. Each core remembers which handler's shadow it
+// currently holds (0 meaning the value that was there before any handler
+// took the core over), and the value it held before that. Only the core
+// itself touches its entry, so no locking is needed. Handler IDs are never
+// reused, so a core that still names a destroyed handler is simply
+// rewritten. Cores past the 64th are not tracked; a shadowing vcpu writes
+// the MSR on every VM entry there, and the original value is not restored.
+//
+
+struct tsc_aux_core_t {
+    uint64_t owner;
+    uint64_t host;
+};
+
+constexpr std::size_t tsc_aux_cores = 64;
+
+static std::array<tsc_aux_core_t, tsc_aux_cores> g_tsc_aux_cores{};
+static std::atomic<uint64_t> g_tsc_aux_ids{1};
+
+rdtsc_handler::rdtsc_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu},
+    m_tsc_aux_id{g_tsc_aux_ids++}
+{
+    using namespace vmcs_n;
+
+    vcpu->add_handler(
+        exit_reason::basic_exit_reason::rdtsc,
+        ::handler_delegate_t::create<rdtsc_handler, &rdtsc_handler::handle_rdtsc>(this)
+    );
+
+    vcpu->add_handler(
+        exit_reason::basic_exit_reason::rdtscp,
+        ::handler_delegate_t::create<rdtsc_handler, &rdtsc_handler::handle_rdtscp>(this)
+    );
+
+    if (secondary_processor_based_vm_execution_controls::enable_rdtscp::is_allowed1()) {
+        vcpu->vmcs_set_bits(
+            secondary_processor_based_vm_execution_controls::addr,
+            secondary_processor_based_vm_execution_controls::enable_rdtscp::mask
+        );
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+rdtsc_handler::add_handler(const handler_delegate_t &d)
+{
+    m_handlers.push_front(d);
+    this->enable_exiting();
+}
+
+void
+rdtsc_handler::enable_exiting()
+{
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+    m_vcpu->vmcs_set_bits(addr, rdtsc_exiting::mask);
+}
+
+void
+rdtsc_handler::disable_exiting()
+{
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+    m_vcpu->vmcs_clear_bits(addr, rdtsc_exiting::mask);
+}
+
+// -----------------------------------------------------------------------------
+// Offset / Multiplier / Aux
+// -----------------------------------------------------------------------------
+
+void
+rdtsc_handler::set_offset(uint64_t offset)
+{
+    using namespace vmcs_n;
+
+    m_offset = offset;
+    tsc_offset::set(offset);
+
+    if (offset != 0) {
+        this->enable_tsc_offsetting();
+        this->trap_tsc_deadline();
+    }
+    else if (m_multiplier == multiplier_one) {
+        this->disable_tsc_offsetting();
+    }
+}
+
+uint64_t
+rdtsc_handler::offset() const noexcept
+{ return m_offset; }
+
+void
+rdtsc_handler::set_multiplier(uint64_t multiplier)
+{
+    using namespace vmcs_n;
+
+    if (multiplier == multiplier_one) {
+        m_multiplier = multiplier;
+
+        m_vcpu->vmcs_clear_bits(
+            secondary_processor_based_vm_execution_controls::addr,
+            secondary_processor_based_vm_execution_controls::use_tsc_scaling::mask
+        );
+
+        if (m_offset == 0) {
+            this->disable_tsc_offsetting();
+        }
+
+        return;
+    }
+
+    if (!secondary_processor_based_vm_execution_controls::use_tsc_scaling::is_allowed1()) {
+        throw std::runtime_error("rdtsc_handler: tsc scaling not supported");
+    }
+
+    m_multiplier = multiplier;
+    tsc_multiplier::set(multiplier);
+
+    //
+    // Note that TSC scaling only takes effect when TSC offsetting is also
+    // enabled (the offset may be 0).
+    //
+
+    this->enable_tsc_offsetting();
+
+    m_vcpu->vmcs_set_bits(
+        secondary_processor_based_vm_execution_controls::addr,
+        secondary_processor_based_vm_execution_controls::use_tsc_scaling::mask
+    );
+
+    this->trap_tsc_deadline();
+}
+
+uint64_t
+rdtsc_handler::multiplier() const noexcept
+{ return m_multiplier; }
+
+void
+rdtsc_handler::set_tsc_aux(uint64_t val)
+{
+    if (!m_tsc_aux_shadowed) {
+        m_vcpu->add_rdmsr_handler(
+            ia32_tsc_aux,
+            rdmsr_handler::handler_delegate_t::create<rdtsc_handler, &rdtsc_handler::handle_rdmsr_tsc_aux>(this)
+        );
+
+        m_vcpu->add_wrmsr_handler(
+            ia32_tsc_aux,
+            wrmsr_handler::handler_delegate_t::create<rdtsc_handler, &rdtsc_handler::handle_wrmsr_tsc_aux>(this)
+        );
+
+        m_tsc_aux_shadowed = true;
+    }
+
+    m_tsc_aux = val;
+    m_tsc_aux_dirty = true;
+}
+
+uint64_t
+rdtsc_handler::tsc_aux() const noexcept
+{ return m_tsc_aux; }
+
+uint64_t
+rdtsc_handler::guest_tsc() const
+{
+    const auto tsc = ::x64::read_tsc::get();
+    return time::mul_shift(tsc, m_multiplier, multiplier_shift) + m_offset;
+}
+
+// Note:
+//
+// The offset is two's complement. A guest whose TSC should start behind
+// the host's (e.g. near 0) has a "negative" offset, so the offset is
+// removed with a wrapping subtraction. Only a positive offset can put a
+// guest TSC value before host TSC 0, and such a value is returned as 0.
+//
+
+uint64_t
+rdtsc_handler::host_tsc(uint64_t guest_tsc) const noexcept
+{
+    if (static_cast<int64_t>(m_offset) > 0 && guest_tsc < m_offset) {
+        return 0;
+    }
+
+    const auto scaled = guest_tsc - m_offset;
+
+    if (m_multiplier == multiplier_one) {
+        return scaled;
+    }
+
+    const auto num = static_cast<unsigned __int128>(scaled) << multiplier_shift;
+    return static_cast<uint64_t>((num + m_multiplier - 1) / m_multiplier);
+}
+
+void
+rdtsc_handler::enable_tsc_offsetting()
+{
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+    m_vcpu->vmcs_set_bits(addr, use_tsc_offsetting::mask);
+}
+
+void
+rdtsc_handler::disable_tsc_offsetting()
+{
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+    m_vcpu->vmcs_clear_bits(addr, use_tsc_offsetting::mask);
+}
+
+void
+rdtsc_handler::set_tsc_deadline_emulated() noexcept
+{ m_tsc_deadline_emulated = true; }
+
+void
+rdtsc_handler::trap_tsc_deadline()
+{
+    if (m_tsc_deadline_trapped) {
+        return;
+    }
+
+    m_vcpu->add_rdmsr_handler(
+        ia32_tsc_deadline,
+        rdmsr_handler::handler_delegate_t::create<rdtsc_handler, &rdtsc_handler::handle_rdmsr_tsc_deadline>(this)
+    );
+
+    m_vcpu->add_wrmsr_handler(
+        ia32_tsc_deadline,
+        wrmsr_handler::handler_delegate_t::create<rdtsc_handler, &rdtsc_handler::handle_wrmsr_tsc_deadline>(this)
+    );
+
+    m_tsc_deadline_trapped = true;
+}
+
+void
+rdtsc_handler::load()
+{
+    const auto core = thread_context_cpuid();
+
+    if (core >= tsc_aux_cores) {
+        if (m_tsc_aux_shadowed) {
+            ::x64::msrs::set(ia32_tsc_aux, m_tsc_aux);
+            m_tsc_aux_dirty = false;
+        }
+
+        return;
+    }
+
+    auto &entry = g_tsc_aux_cores.at(core);
+
+    if (!m_tsc_aux_shadowed) {
+        if (entry.owner != 0) {
+            ::x64::msrs::set(ia32_tsc_aux, entry.host);
+            entry.owner = 0;
+        }
+
+        return;
+    }
+
+    if (entry.owner == m_tsc_aux_id && !m_tsc_aux_dirty) {
+        return;
+    }
+
+    if (entry.owner == 0) {
+        entry.host = ::x64::msrs::get(ia32_tsc_aux);
+    }
+
+    ::x64::msrs::set(ia32_tsc_aux, m_tsc_aux);
+
+    entry.owner = m_tsc_aux_id;
+    m_tsc_aux_dirty = false;
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+rdtsc_handler::handle_rdtsc(gsl::not_null<vcpu_t *> vcpu)
+{ return this->handle(vcpu, false); }
+
+bool
+rdtsc_handler::handle_rdtscp(gsl::not_null<vcpu_t *> vcpu)
+{ return this->handle(vcpu, true); }
+
+bool
+rdtsc_handler::handle_rdmsr_tsc_aux(
+    gsl::not_null<vcpu_t *> vcpu, rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = m_tsc_aux;
+    return true;
+}
+
+bool
+rdtsc_handler::handle_wrmsr_tsc_aux(
+    gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    m_tsc_aux = info.val & 0xFFFFFFFFULL;
+    m_tsc_aux_dirty = true;
+
+    info.ignore_write = true;
+    return true;
+}
+
+// Note:
+//
+// Hardware clears IA32_TSC_DEADLINE once the deadline passes, so the
+// guest's value is only returned while the hardware deadline is still
+// armed. A write of a deadline that has already passed is written as 1
+// (rather than 0), so that the timer still fires instead of disarming.
+// Both handlers return false when another handler emulates the MSR, so
+// that the walk falls through to it.
+//
+
+bool
+rdtsc_handler::handle_rdmsr_tsc_deadline(
+    gsl::not_null<vcpu_t *> vcpu, rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    if (m_tsc_deadline_emulated) {
+        return false;
+    }
+
+    if (::x64::msrs::get(ia32_tsc_deadline) == 0) {
+        m_tsc_deadline = 0;
+    }
+
+    info.val = m_tsc_deadline;
+    return true;
+}
+
+bool
+rdtsc_handler::handle_wrmsr_tsc_deadline(
+    gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    if (m_tsc_deadline_emulated) {
+        return false;
+    }
+
+    m_tsc_deadline = info.val;
+
+    if (info.val != 0) {
+        info.val = std::max<uint64_t>(this->host_tsc(info.val), 1);
+    }
+
+    return true;
+}
+
+bool
+rdtsc_handler::handle(gsl::not_null<vcpu_t *> vcpu, bool rdtscp)
+{
+    struct info_t info = {
+        this->guest_tsc(), m_tsc_aux, rdtscp, false, false
+    };
+
+    auto walk = m_profile.walk();
+    for (const auto &d : m_handlers) {
+        if (walk(d, vcpu, info)) {
+            break;
+        }
+    }
+
+    if (!info.ignore_write) {
+        vcpu->set_rax((info.val >> 0) & 0x00000000FFFFFFFF);
+        vcpu->set_rdx((info.val >> 32) & 0x00000000FFFFFFFF);
+
+        if (rdtscp) {
+            vcpu->set_rcx(info.aux & 0x00000000FFFFFFFF);
+        }
+    }
+
+    if (!info.ignore_advance) {
+        return vcpu->advance();
+    }
+
+    return true;
+}
+
+}
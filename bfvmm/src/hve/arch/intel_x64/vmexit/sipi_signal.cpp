@@ -97,8 +97,8 @@ sipi_signal_handler::handle(gsl::not_null<vcpu_t *> vcpu)
     vmcs_n::guest_cr3::set(0);
     vmcs_n::guest_cr4::set(0x00000000 | m_vcpu->global_state()->ia32_vmx_cr4_fixed0);
 
-    vmcs_n::cr0_read_shadow::set(0x60000010);
-    vmcs_n::cr4_read_shadow::set(0);
+    m_vcpu->vmcs_write(vmcs_n::cr0_read_shadow::addr, 0x60000010);
+    m_vcpu->vmcs_write(vmcs_n::cr4_read_shadow::addr, 0);
 
     vmcs_n::guest_cs_selector::set(0xF000);
     vmcs_n::guest_cs_base::set(0xFFFF0000);
@@ -28,7 +28,7 @@ wrmsr_handler::wrmsr_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
     m_vcpu{vcpu},
-    m_msr_bitmap{vcpu->m_msr_bitmap.get(), ::x64::pt::page_size}
+    m_msr_bitmap{&vcpu->m_msr_bitmap}
 {
     using namespace vmcs_n;
 
@@ -64,11 +64,11 @@ void
 wrmsr_handler::trap_on_access(vmcs_n::value_type msr)
 {
     if (msr <= 0x00001FFFUL) {
-        return set_bit(m_msr_bitmap, (msr - 0x00000000UL) + 0x4000);
+        return m_msr_bitmap->set((msr - 0x00000000UL) + 0x4000);
     }
 
     if (msr >= 0xC0000000UL && msr <= 0xC0001FFFUL) {
-        return set_bit(m_msr_bitmap, (msr - 0xC0000000UL) + 0x6000);
+        return m_msr_bitmap->set((msr - 0xC0000000UL) + 0x6000);
     }
 
     throw std::runtime_error("invalid msr: " + std::to_string(msr));
@@ -76,17 +76,17 @@ wrmsr_handler::trap_on_access(vmcs_n::value_type msr)
 
 void
 wrmsr_handler::trap_on_all_accesses()
-{ gsl::memset(m_msr_bitmap.subspan(2048, m_msr_bitmap.size() >> 1), 0xFF); }
+{ m_msr_bitmap->fill(2048, bitmap_policy::size >> 1, 0xFF); }
 
 void
 wrmsr_handler::pass_through_access(vmcs_n::value_type msr)
 {
     if (msr <= 0x00001FFFUL) {
-        return clear_bit(m_msr_bitmap, (msr - 0x00000000UL) + 0x4000);
+        return m_msr_bitmap->clear((msr - 0x00000000UL) + 0x4000);
     }
 
     if (msr >= 0xC0000000UL && msr <= 0xC0001FFFUL) {
-        return clear_bit(m_msr_bitmap, (msr - 0xC0000000UL) + 0x6000);
+        return m_msr_bitmap->clear((msr - 0xC0000000UL) + 0x6000);
     }
 
     throw std::runtime_error("invalid msr: " + std::to_string(msr));
@@ -94,7 +94,7 @@ wrmsr_handler::pass_through_access(vmcs_n::value_type msr)
 
 void
 wrmsr_handler::pass_through_all_accesses()
-{ gsl::memset(m_msr_bitmap.subspan(2048, m_msr_bitmap.size() >> 1), 0x00); }
+{ m_msr_bitmap->fill(2048, bitmap_policy::size >> 1, 0x00); }
 
 // -----------------------------------------------------------------------------
 // Handlers
@@ -134,8 +134,9 @@ wrmsr_handler::handle(gsl::not_null<vcpu_t *> vcpu)
             ((vcpu->rax() & 0x00000000FFFFFFFF) << 0) |
             ((vcpu->rdx() & 0x00000000FFFFFFFF) << 32);
 
+        auto walk = m_profile.walk(hdlrs->first);
         for (const auto &d : hdlrs->second) {
-            if (d(vcpu, info)) {
+            if (walk(d, vcpu, info)) {
 
                 if (!info.ignore_write && !m_emulate[vcpu->rcx()]) {
                     emulate_wrmsr(
@@ -19,15 +19,99 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <new>
+#include <mutex>
+#include <vector>
+
 #include <hve/arch/intel_x64/vcpu.h>
 
 namespace eapis::intel_x64
 {
 
+// -----------------------------------------------------------------------------
+// XSAVE Area Pool
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// XSAVE areas are large (several KB once AVX-512 and AMX are supported), so
+// they are only allocated the first time a vcpu actually needs one, and are
+// returned to a pool instead of the heap so that churning vcpus do not churn
+// the allocator as well.
+//
+
+static std::mutex g_xsave_mutex;
+static std::vector<uint8_t *> g_xsave_pool;
+
+static bool
+xsaves_supported()
+{
+    static const auto s_supported = [] {
+        auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0xD, 0, 1, 0);
+
+        bfignored(ebx);
+        bfignored(ecx);
+        bfignored(edx);
+
+        return (eax & (1U << 3)) != 0;
+    }();
+
+    return s_supported;
+}
+
+static std::size_t
+xsave_area_size()
+{
+    // CPUID.(EAX=0DH,ECX=0):ECX is the size of the standard format area for
+    // every component the processor supports, which also bounds the size of
+    // any compacted area.
+
+    static const auto s_size = [] {
+        auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0xD, 0, 0, 0);
+
+        bfignored(eax);
+        bfignored(ebx);
+        bfignored(edx);
+
+        return static_cast<std::size_t>(ecx);
+    }();
+
+    return s_size;
+}
+
+static uint8_t *
+xsave_area_alloc()
+{
+    std::lock_guard lock(g_xsave_mutex);
+
+    if (!g_xsave_pool.empty()) {
+        auto area = g_xsave_pool.back();
+        g_xsave_pool.pop_back();
+
+        return area;
+    }
+
+    return new (std::align_val_t{64}) uint8_t[xsave_area_size()]();
+}
+
+static void
+xsave_area_free(uint8_t *area)
+{
+    std::lock_guard lock(g_xsave_mutex);
+    g_xsave_pool.push_back(area);
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
 xsetbv_handler::xsetbv_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
-    m_vcpu{vcpu}
+    m_vcpu{vcpu},
+    m_host_xcr0{vcpu->global_state()->host_xcr0},
+    m_guest_xcr0{::intel_x64::xcr0::get()},
+    m_xsave_area{nullptr, xsave_area_free}
 {
     using namespace vmcs_n;
 
@@ -45,6 +129,84 @@ void
 xsetbv_handler::add_handler(const handler_delegate_t &d)
 { m_handlers.push_front(d); }
 
+void
+xsetbv_handler::save_guest_xstate(uint64_t mask)
+{
+    const auto save = mask & m_guest_xcr0;
+
+    if ((save & ~m_saved) != 0) {
+        const auto prev = m_saved;
+
+        // Widening a save that already happened during this exit is rare.
+        // Put the guest's state back and save the union, so that the area
+        // only ever holds a single save.
+
+        this->load_guest_xstate();
+
+        if (!m_xsave_area) {
+            m_xsave_area.reset(xsave_area_alloc());
+        }
+
+        this->xsave(m_xsave_area.get(), save | prev);
+        m_saved = save | prev;
+    }
+
+    if (!m_switched && m_host_xcr0 != m_guest_xcr0) {
+        this->write_xcr0(m_host_xcr0);
+        m_switched = true;
+    }
+}
+
+void
+xsetbv_handler::load_guest_xstate()
+{
+    if (m_switched) {
+        this->write_xcr0(m_guest_xcr0);
+        m_switched = false;
+    }
+
+    if (m_saved != 0) {
+        this->xrstor(m_xsave_area.get(), m_saved);
+        m_saved = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Hardware
+// -----------------------------------------------------------------------------
+
+void
+xsetbv_handler::xsave(uint8_t *area, uint64_t mask) noexcept
+{
+    const auto lo = static_cast<uint32_t>(mask);
+    const auto hi = static_cast<uint32_t>(mask >> 32);
+
+    if (xsaves_supported()) {
+        __asm__ volatile("xsaves64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    }
+    else {
+        __asm__ volatile("xsave64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    }
+}
+
+void
+xsetbv_handler::xrstor(uint8_t *area, uint64_t mask) noexcept
+{
+    const auto lo = static_cast<uint32_t>(mask);
+    const auto hi = static_cast<uint32_t>(mask >> 32);
+
+    if (xsaves_supported()) {
+        __asm__ volatile("xrstors64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    }
+    else {
+        __asm__ volatile("xrstor64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    }
+}
+
+void
+xsetbv_handler::write_xcr0(uint64_t val)
+{ ::intel_x64::xcr0::set(val); }
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -61,14 +223,18 @@ xsetbv_handler::handle(gsl::not_null<vcpu_t *> vcpu)
     info.val |= ((vcpu->rax() & 0x00000000FFFFFFFF) << 0x00);
     info.val |= ((vcpu->rdx() & 0x00000000FFFFFFFF) << 0x20);
 
+    auto walk = m_profile.walk();
     for (const auto &d : m_handlers) {
-        if (d(vcpu, info)) {
+        if (walk(d, vcpu, info)) {
             break;
         }
     }
 
     if (!info.ignore_write) {
-        ::intel_x64::xcr0::set(info.val);
+        this->load_guest_xstate();
+
+        m_guest_xcr0 = info.val;
+        this->write_xcr0(info.val);
     }
 
     if (!info.ignore_advance) {
@@ -19,29 +19,162 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <array>
+#include <atomic>
+#include <utility>
+
+#include <bfdebug.h>
+#include <bfthreadcontext.h>
 #include <hve/arch/intel_x64/vcpu.h>
 
 namespace eapis::intel_x64
 {
 
+// -----------------------------------------------------------------------------
+// Allocator
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Two bitmaps, one bit per VPID. g_leased tracks which IDs are currently
+// owned by a vcpu, and g_used tracks which IDs have ever been handed out,
+// and thus might still have translations cached under them. Both are
+// manipulated with atomics only, so vcpus can be created and destroyed
+// concurrently from any core.
+//
+
+constexpr std::size_t vpid_words = (vpid_handler::max_vpids + 1) / 64;
+
+static std::array<std::atomic<uint64_t>, vpid_words> g_leased{};
+static std::array<std::atomic<uint64_t>, vpid_words> g_used{};
+
+static uint16_t
+vpid_alloc(bool &reused) noexcept
+{
+    for (auto i = 0ULL; i < vpid_words; i++) {
+        auto &word = g_leased[i];
+
+        // VPID 0 is the host's and is never leased
+        const uint64_t reserved = (i == 0) ? 1ULL : 0ULL;
+
+        auto bits = word.load();
+        while (true) {
+            const auto avail = ~(bits | reserved);
+            if (avail == 0) {
+                break;
+            }
+
+            const auto indx = static_cast<uint64_t>(__builtin_ctzll(avail));
+            const auto bit = 1ULL << indx;
+
+            if (word.compare_exchange_weak(bits, bits | bit)) {
+                reused = (g_used[i].fetch_or(bit) & bit) != 0;
+                return static_cast<uint16_t>((i * 64) + indx);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void
+vpid_free(uint16_t id) noexcept
+{
+    if (id != 0) {
+        g_leased[id / 64].fetch_and(~(1ULL << (id % 64)));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
 vpid_handler::vpid_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
     m_vcpu{vcpu}
 {
-    static uint16_t s_id = 1;
-    m_id = s_id++;
+    m_id = vpid_alloc(m_flush);
+
+    if (m_id == 0) {
+        bfalert_info(0, "vpid_handler: out of VPIDs, VPID disabled for this vcpu");
+    }
+
+    vcpu->vmcs_write(vmcs_n::virtual_processor_identifier::addr, m_id);
+}
+
+vpid_handler::~vpid_handler()
+{ vpid_free(static_cast<uint16_t>(m_id)); }
+
+vpid_handler::vpid_handler(vpid_handler &&other) noexcept :
+    m_vcpu{other.m_vcpu},
+    m_id{std::exchange(other.m_id, 0)},
+    m_flush{other.m_flush},
+    m_flushed_cores{other.m_flushed_cores}
+{ }
+
+vpid_handler &
+vpid_handler::operator=(vpid_handler &&other) noexcept
+{
+    if (this != &other) {
+        vpid_free(static_cast<uint16_t>(m_id));
+
+        m_vcpu = other.m_vcpu;
+        m_id = std::exchange(other.m_id, 0);
+        m_flush = other.m_flush;
+        m_flushed_cores = other.m_flushed_cores;
+    }
 
-    vmcs_n::virtual_processor_identifier::set(m_id);
+    return *this;
 }
 
 vmcs_n::value_type vpid_handler::id() const noexcept
 { return m_id; }
 
 void vpid_handler::enable()
-{ vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::enable(); }
+{
+    using namespace vmcs_n;
+
+    if (m_id != 0) {
+        m_vcpu->vmcs_set_bits(
+            secondary_processor_based_vm_execution_controls::addr,
+            secondary_processor_based_vm_execution_controls::enable_vpid::mask
+        );
+    }
+}
 
 void vpid_handler::disable()
-{ vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::disable(); }
+{
+    using namespace vmcs_n;
+
+    m_vcpu->vmcs_clear_bits(
+        secondary_processor_based_vm_execution_controls::addr,
+        secondary_processor_based_vm_execution_controls::enable_vpid::mask
+    );
+}
+
+// Note:
+//
+// A vcpu can be scheduled on any core, so a recycled VPID is flushed once
+// per core, the first time this vcpu enters the guest on that core. Cores
+// past the 64th are not tracked, and flush on every VM entry instead.
+//
+
+void vpid_handler::load()
+{
+    if (!m_flush) {
+        return;
+    }
+
+    const auto core = thread_context_cpuid();
+    const auto bit = (core < 64) ? (1ULL << core) : 0ULL;
+
+    if ((m_flushed_cores & bit) != 0) {
+        return;
+    }
+
+    ::intel_x64::vmx::invvpid_single_context(m_id);
+    m_flushed_cores |= bit;
+}
 
 }
@@ -0,0 +1,290 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/bench.h>
+#include <test/support.h>
+#include <hve/arch/intel_x64/ept.h>
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+constexpr auto page_1g = ::intel_x64::ept::pdpt::page_size;
+constexpr auto page_2m = ::intel_x64::ept::pd::page_size;
+constexpr auto page_4k = ::intel_x64::ept::pt::page_size;
+
+constexpr uint64_t num_lookups = 0x100000;
+
+static std::size_t
+num_pages()
+{ return g_allocated_pages.size(); }
+
+static std::string
+size_str(uint64_t size)
+{
+    if (size >= 0x10000000000ULL) {
+        return std::to_string(size >> 40) + "TB";
+    }
+
+    return std::to_string(size >> 30) + "GB";
+}
+
+static std::string
+pages_str(std::ptrdiff_t pages)
+{
+    return std::to_string(pages) + " pages (" +
+           std::to_string(pages * static_cast<std::ptrdiff_t>(page_4k) / 1024) + " KB)";
+}
+
+static std::string
+name(const std::string &op, uint64_t size)
+{ return op + " " + size_str(size); }
+
+static std::string
+pages_since(std::size_t pages)
+{ return pages_str(static_cast<std::ptrdiff_t>(num_pages()) - static_cast<std::ptrdiff_t>(pages)); }
+
+// A xorshift generator, so that lookups do not walk the map in order
+//
+static uint64_t
+next_addr(uint64_t &state, uint64_t size)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    return state % size;
+}
+
+// Note:
+//
+// Every map / unmap / release is timed over a whole 1:1 layout using the
+// identity helpers, so ns/op is per page of the given granularity. The
+// page column is the change in page-table pages allocated (or freed, when
+// negative) by the operation, which is also its allocation count as the
+// mmap allocates one page at a time.
+//
+
+template<typename MAP, typename UNMAP, typename RELEASE>
+static void
+bench_layout(
+    const char *granularity, uint64_t page_size, uint64_t size,
+    MAP map, UNMAP unmap, RELEASE release)
+{
+    ept::mmap mmap{};
+    const auto ops = size / page_size;
+
+    auto pages = num_pages();
+    auto ns = bench::elapsed_ns([&] { map(mmap, 0, size); });
+    bench::report(name(std::string("map_") + granularity, size), ops, ns,
+                  pages_since(pages));
+
+    auto state = 0x2A2A2A2A2A2A2A2AULL;
+    const auto lookups = num_lookups * bench::scale();
+
+    ns = bench::elapsed_ns([&] {
+        for (auto i = 0ULL; i < lookups; i++) {
+            bench::do_not_optimize(mmap.virt_to_phys(next_addr(state, size)));
+        }
+    });
+    bench::report(name("virt_to_phys", size), lookups, ns);
+
+    ns = bench::elapsed_ns([&] {
+        for (auto i = 0ULL; i < lookups; i++) {
+            bench::do_not_optimize(mmap.entry(next_addr(state, size)).second);
+        }
+    });
+    bench::report(name("entry", size), lookups, ns);
+
+    pages = num_pages();
+    ns = bench::elapsed_ns([&] { unmap(mmap, 0, size); });
+    bench::report(name(std::string("unmap_") + granularity, size), ops, ns,
+                  pages_since(pages));
+
+    pages = num_pages();
+    ns = bench::elapsed_ns([&] { release(mmap, 0, size); });
+    bench::report(name(std::string("release_") + granularity, size), ops, ns,
+                  pages_since(pages));
+}
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+// -----------------------------------------------------------------------------
+
+TEST_CASE("bench: mmap 1g layouts", "[.][bench]")
+{
+    bench::header("mmap: 1g layouts", "page tables");
+
+    for (auto size : {64ULL << 30, 256ULL << 30, 1ULL << 40, 4ULL << 40}) {
+        bench_layout(
+            "1g", page_1g, size,
+            [](auto & m, auto s, auto e) { ept::identity_map_1g(m, s, e); },
+            [](auto & m, auto s, auto e) { ept::identity_unmap_1g(m, s, e); },
+            [](auto & m, auto s, auto e) { ept::identity_release_1g(m, s, e); }
+        );
+    }
+
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("bench: mmap 2m layouts", "[.][bench]")
+{
+    bench::header("mmap: 2m layouts", "page tables");
+
+    for (auto size : {64ULL << 30, 256ULL << 30, 1ULL << 40, 4ULL << 40}) {
+        bench_layout(
+            "2m", page_2m, size,
+            [](auto & m, auto s, auto e) { ept::identity_map_2m(m, s, e); },
+            [](auto & m, auto s, auto e) { ept::identity_unmap_2m(m, s, e); },
+            [](auto & m, auto s, auto e) { ept::identity_release_2m(m, s, e); }
+        );
+    }
+
+    CHECK(g_allocated_pages.empty());
+}
+
+// Note:
+//
+// 4k layouts stop at 64GB, which is already 16M maps and 128MB of page
+// tables. Larger 4k layouts are not something the VMM would ever build.
+//
+
+TEST_CASE("bench: mmap 4k layouts", "[.][bench]")
+{
+    bench::header("mmap: 4k layouts", "page tables");
+
+    for (auto size : {1ULL << 30, 4ULL << 30, 16ULL << 30, 64ULL << 30}) {
+        bench_layout(
+            "4k", page_4k, size,
+            [](auto & m, auto s, auto e) { ept::identity_map_4k(m, s, e); },
+            [](auto & m, auto s, auto e) { ept::identity_unmap_4k(m, s, e); },
+            [](auto & m, auto s, auto e) { ept::identity_release_4k(m, s, e); }
+        );
+    }
+
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("bench: mmap identity map convert", "[.][bench]")
+{
+    bench::header("mmap: identity_map_convert (per 1g region)", "page tables");
+
+    constexpr auto size = 64ULL << 30;
+    const auto ops = size / page_1g;
+
+    ept::mmap mmap{};
+    ept::identity_map_1g(mmap, 0, size);
+
+    auto convert = [&](const char *op, auto func) {
+        const auto pages = num_pages();
+        const auto ns = bench::elapsed_ns([&] {
+            for (auto addr = 0ULL; addr < size; addr += page_1g) {
+                func(mmap, addr);
+            }
+        });
+
+        bench::report(name(op, size), ops, ns,
+                      pages_since(pages));
+    };
+
+    convert("convert_1g_to_2m", [](auto & m, auto a) { ept::identity_map_convert_1g_to_2m(m, a); });
+    convert("convert_2m_to_4k", [](auto & m, auto a) {
+        for (auto addr = a; addr < a + page_1g; addr += page_2m) {
+            ept::identity_map_convert_2m_to_4k(m, addr);
+        }
+    });
+    convert("convert_4k_to_2m", [](auto & m, auto a) {
+        for (auto addr = a; addr < a + page_1g; addr += page_2m) {
+            ept::identity_map_convert_4k_to_2m(m, addr);
+        }
+    });
+    convert("convert_2m_to_1g", [](auto & m, auto a) { ept::identity_map_convert_2m_to_1g(m, a); });
+    convert("convert_1g_to_4k", [](auto & m, auto a) { ept::identity_map_convert_1g_to_4k(m, a); });
+    convert("convert_4k_to_1g", [](auto & m, auto a) { ept::identity_map_convert_4k_to_1g(m, a); });
+}
+
+// Note:
+//
+// identity_map() uses g_mtrrs, which is a singleton that reads the MTRRs
+// once, so each configuration is loaded by rebuilding the singleton from
+// the mocked MSRs. The cost of identity_map() depends on how many 2m
+// regions the MTRR ranges split into 4k maps.
+//
+
+static void
+load_mtrrs()
+{
+    mtrrs m{};
+    *g_mtrrs = std::move(m);
+}
+
+static void
+bench_identity_map(const char *config)
+{
+    for (auto size : {64ULL << 30, 256ULL << 30, 1ULL << 40, 4ULL << 40}) {
+        ept::mmap mmap{};
+
+        const auto pages = num_pages();
+        const auto ns = bench::elapsed_ns([&] { ept::identity_map(mmap, size); });
+
+        bench::report(
+            std::string(config) + " " + size_str(size), size / page_2m, ns,
+            pages_since(pages) + ", " +
+            std::to_string(g_mtrrs->size()) + " ranges"
+        );
+    }
+}
+
+TEST_CASE("bench: mmap identity map with mtrrs", "[.][bench]")
+{
+    bench::header("mmap: identity_map (ops are 2m regions)", "page tables");
+
+    // Everything is write back except the first 1MB
+    //
+    enable_mtrrs(0);
+    load_mtrrs();
+    bench_identity_map("default wb");
+
+    // A typical PC: an uncacheable PCI hole from 3GB to 4GB, with the
+    // firmware's 1MB regions just below it
+    //
+    enable_mtrrs(3);
+    add_variable_range(0, mtrrs::range_t{uc, 0xC0000000, 0x40000000});
+    add_variable_range(1, mtrrs::range_t{uc, 0xBFE00000, 0x100000});
+    add_variable_range(2, mtrrs::range_t{uc, 0xBFF00000, 0x100000});
+    load_mtrrs();
+    bench_identity_map("pci hole");
+
+    // Worst case: every variable range is a 1MB hole that splits a 2m
+    // region into 4k maps
+    //
+    enable_mtrrs(8);
+    for (auto i = 0U; i < 8; i++) {
+        add_variable_range(
+            gsl::narrow_cast<uint8_t>(i), mtrrs::range_t{uc, (i + 1) * 0x40000000ULL + 0x100000, 0x100000}
+        );
+    }
+    load_mtrrs();
+    bench_identity_map("fragmented");
+}
@@ -0,0 +1,232 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <test/bench.h>
+#include <test/support.h>
+#include <hve/arch/intel_x64/ept.h>
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+constexpr auto page_2m = ::intel_x64::ept::pd::page_size;
+constexpr auto page_4k = ::intel_x64::ept::pt::page_size;
+
+constexpr uint64_t ops_per_thread = 0x40000;
+
+// Readers look up a shared, 2m mapped region that is never modified, while
+// each writer maps and unmaps 4k pages in a 1GB slice of its own, so the
+// threads only ever contend on the mmap itself. Unmapped pages keep their
+// page tables, so after the first pass over a slice, writers no longer
+// allocate.
+//
+constexpr uint64_t read_size = 4ULL << 30;
+constexpr uint64_t write_base = 64ULL << 30;
+constexpr uint64_t write_size = 1ULL << 30;
+
+struct thread_result_t {
+    uint64_t ns{};
+    uint64_t reads{};
+    uint64_t writes{};
+    uint64_t errors{};
+};
+
+static uint64_t
+next_rand(uint64_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    return state;
+}
+
+static void
+worker(
+    ept::mmap &mmap, std::size_t id, uint64_t read_pct, uint64_t ops,
+    const std::atomic<bool> &go, thread_result_t &result)
+{
+    auto state = 0x2A2A2A2A2A2A2A2AULL + id;
+    auto write_addr = write_base + (id * write_size);
+    const auto write_end = write_addr + write_size;
+
+    while (!go.load(std::memory_order_acquire))
+    { }
+
+    const auto start = bench::clock::now();
+
+    for (auto i = 0ULL; i < ops; i++) {
+        const auto rand = next_rand(state);
+
+        if (rand % 100 < read_pct) {
+            const auto addr = (rand >> 8) % read_size;
+
+            if ((rand & 0x80) != 0) {
+                if (mmap.virt_to_phys(addr).first != addr) {
+                    result.errors++;
+                }
+            }
+            else {
+                bench::do_not_optimize(mmap.entry(addr).second);
+            }
+
+            result.reads++;
+        }
+        else {
+            mmap.map_4k(write_addr, write_addr);
+            if (mmap.virt_to_phys(write_addr).first != write_addr) {
+                result.errors++;
+            }
+            mmap.unmap(write_addr);
+
+            write_addr += page_4k;
+            if (write_addr == write_end) {
+                write_addr = write_base + (id * write_size);
+            }
+
+            result.writes++;
+        }
+    }
+
+    result.ns = bench::ns_since(start);
+}
+
+static std::vector<thread_result_t>
+run(ept::mmap &mmap, std::size_t num_threads, uint64_t read_pct)
+{
+    std::atomic<bool> go{false};
+    std::vector<thread_result_t> results(num_threads);
+    std::vector<std::thread> threads;
+
+    const auto ops = ops_per_thread * bench::scale();
+
+    for (auto i = 0ULL; i < num_threads; i++) {
+        threads.emplace_back(
+            worker, std::ref(mmap), i, read_pct, ops, std::cref(go), std::ref(results[i])
+        );
+    }
+
+    go.store(true, std::memory_order_release);
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    return results;
+}
+
+static std::vector<std::size_t>
+thread_counts()
+{
+    const auto max = std::max(std::thread::hardware_concurrency(), 1U);
+    std::vector<std::size_t> counts;
+
+    for (auto i = 1U; i < max; i *= 2) {
+        counts.push_back(i);
+    }
+
+    counts.push_back(max);
+    return counts;
+}
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// ept::mmap holds its mutex for the whole of every operation. In the unit
+// test build the mutex records how long callers spend blocked on it (see
+// mmap::lock_wait()), which is reported per operation, along with how many
+// times per operation a caller had to block. Throughput is the total
+// number of operations (a write is a map_4k, virt_to_phys and unmap, so it
+// takes the lock three times) over the wall time of the slowest thread, and
+// the scaling column is relative to one thread.
+//
+// The threads share nothing but the mmap, so running this under TSan
+// (-fsanitize=thread) checks the mmap itself for races, which is how a
+// lock-free mmap should be validated.
+//
+
+TEST_CASE("bench: mmap contention", "[.][bench]")
+{
+    const auto counts = thread_counts();
+    const auto max_threads = counts.back();
+
+    ept::mmap mmap{};
+    ept::identity_map_2m(mmap, 0, read_size);
+
+    for (auto read_pct : {100ULL, 95ULL, 75ULL, 50ULL}) {
+        bench::header(
+            ("mmap: contention, " + std::to_string(read_pct) + "% reads").c_str(),
+            "  Mops/s  scaling  lock wait ns/op  blocks/op"
+        );
+
+        auto base_mops = 0.0;
+
+        for (auto num_threads : counts) {
+            mmap.reset_lock_wait();
+
+            const auto results = run(mmap, num_threads, read_pct);
+            const auto [wait_ns, waits] = mmap.lock_wait();
+
+            uint64_t ops = 0;
+            uint64_t wall_ns = 0;
+            uint64_t thread_ns = 0;
+
+            for (const auto &result : results) {
+                ops += result.reads + result.writes;
+                wall_ns = std::max(wall_ns, result.ns);
+                thread_ns += result.ns;
+
+                CHECK(result.errors == 0);
+            }
+
+            const auto mops = static_cast<double>(ops) * 1000.0 / static_cast<double>(wall_ns);
+
+            const auto wait_per_op = static_cast<double>(wait_ns) / static_cast<double>(ops);
+            const auto blocks_per_op = static_cast<double>(waits) / static_cast<double>(ops);
+
+            if (num_threads == 1) {
+                base_mops = mops;
+            }
+
+            char extra[64];
+            std::snprintf(
+                extra, sizeof(extra), "%8.2f %8.2fx %16.1f %10.2f",
+                mops, mops / base_mops, wait_per_op, blocks_per_op
+            );
+
+            bench::report(
+                std::to_string(num_threads) + "/" + std::to_string(max_threads) + " threads",
+                ops, thread_ns, extra
+            );
+        }
+    }
+}
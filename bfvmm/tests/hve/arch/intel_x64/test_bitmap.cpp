@@ -0,0 +1,165 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+
+constexpr const auto test_field = vmcs_n::address_of_msr_bitmap::addr;
+constexpr const auto test_policy = bitmap_policy{}.set(0x10).set(0x11);
+
+class bitmap_vcpu : public vcpu
+{
+public:
+
+    using vcpu::vcpu;
+
+    void vmcs_write(vmcs_n::value_type addr, vmcs_n::value_type val) override
+    {
+        if (addr == test_field) {
+            writes.push_back(val);
+        }
+
+        vcpu::vmcs_write(addr, val);
+    }
+
+    std::vector<vmcs_n::value_type> writes;
+};
+
+static bool
+is_set(const uint8_t *page, std::size_t bit)
+{ return (page[bit >> 3] & (1U << (bit & 7))) != 0; }
+
+TEST_CASE("bitmap: address is written through the vcpu")
+{
+    auto vcpu = make_vcpu<bitmap_vcpu>();
+    auto tmpl = bitmap::make_template(test_policy);
+
+    const auto before = g_vmcs_fields[test_field];
+    bitmap b{vcpu.get(), tmpl, test_field};
+
+    CHECK(g_vmcs_fields[test_field] == before);
+    CHECK(vcpu->writes.size() == 1);
+    CHECK(vcpu->vmcs_read(test_field) == vcpu->writes.back());
+}
+
+TEST_CASE("bitmap: bitmaps share their template")
+{
+    auto vcpu = make_vcpu<bitmap_vcpu>();
+    auto tmpl = bitmap::make_template(test_policy);
+
+    bitmap b1{vcpu.get(), tmpl, test_field};
+    bitmap b2{vcpu.get(), tmpl, test_field};
+
+    CHECK(b1.is_shared());
+    CHECK(b2.is_shared());
+    CHECK(b1.data() == tmpl.get());
+    CHECK(b2.data() == tmpl.get());
+
+    REQUIRE(vcpu->writes.size() == 2);
+    CHECK(vcpu->writes.at(0) == vcpu->writes.at(1));
+}
+
+TEST_CASE("bitmap: set")
+{
+    auto vcpu = make_vcpu<bitmap_vcpu>();
+    auto tmpl = bitmap::make_template(test_policy);
+
+    bitmap b{vcpu.get(), tmpl, test_field};
+
+    b.set(0x10);
+    CHECK(b.is_shared());
+    CHECK(vcpu->writes.size() == 1);
+
+    b.set(0x20);
+    CHECK_FALSE(b.is_shared());
+    CHECK(b.data() != tmpl.get());
+    CHECK(is_set(b.data(), 0x10));
+    CHECK(is_set(b.data(), 0x20));
+    CHECK_FALSE(is_set(tmpl.get(), 0x20));
+
+    REQUIRE(vcpu->writes.size() == 2);
+    CHECK(vcpu->writes.at(0) != vcpu->writes.at(1));
+}
+
+TEST_CASE("bitmap: clear")
+{
+    auto vcpu = make_vcpu<bitmap_vcpu>();
+    auto tmpl = bitmap::make_template(test_policy);
+
+    bitmap b{vcpu.get(), tmpl, test_field};
+
+    b.clear(0x20);
+    CHECK(b.is_shared());
+
+    b.clear(0x10);
+    CHECK_FALSE(b.is_shared());
+    CHECK_FALSE(is_set(b.data(), 0x10));
+    CHECK(is_set(b.data(), 0x11));
+    CHECK(is_set(tmpl.get(), 0x10));
+}
+
+TEST_CASE("bitmap: fill")
+{
+    auto vcpu = make_vcpu<bitmap_vcpu>();
+    auto tmpl = bitmap::make_template(test_policy);
+
+    bitmap b{vcpu.get(), tmpl, test_field};
+
+    b.fill(0x100, 0x100, 0x00);
+    CHECK(b.is_shared());
+
+    b.fill(0, 0x100, 0xFF);
+    CHECK_FALSE(b.is_shared());
+    CHECK(b.data()[0] == 0xFF);
+    CHECK(b.data()[0xFF] == 0xFF);
+    CHECK(b.data()[0x100] == 0x00);
+    CHECK(tmpl.get()[0] == 0x00);
+}
+
+TEST_CASE("bitmap: only privatised once")
+{
+    auto vcpu = make_vcpu<bitmap_vcpu>();
+    auto tmpl = bitmap::make_template(test_policy);
+
+    bitmap b{vcpu.get(), tmpl, test_field};
+
+    b.set(0x20);
+    const auto page = b.data();
+
+    b.set(0x30);
+    b.clear(0x10);
+    b.fill(0x200, 0x10, 0xFF);
+
+    CHECK(b.data() == page);
+    CHECK(vcpu->writes.size() == 2);
+}
+
+#endif
@@ -0,0 +1,249 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <functional>
+#include <list>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+
+using test_list_t = std::list<std::function<bool()>>;
+
+constexpr uint64_t test_key = 0x42;
+
+static bool
+walk_list(delegate_profile &profile, const test_list_t &list, uint64_t key = test_key)
+{
+    auto walk = profile.walk(key);
+    for (const auto &d : list) {
+        if (walk(d)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static const delegate_profile::delegate_stats_t &
+stats_of(const delegate_profile &profile, const test_list_t::value_type &d)
+{ return profile.delegates().at(&d); }
+
+TEST_CASE("delegate profile: nothing is recorded while disabled")
+{
+    delegate_profile profile{"test"};
+    test_list_t list{[] { return true; }};
+
+    CHECK(walk_list(profile, list));
+    CHECK(profile.lists().empty());
+    CHECK(profile.delegates().empty());
+}
+
+TEST_CASE("delegate profile: walks, calls and hits are counted")
+{
+    delegate_profile profile{"test"};
+    test_list_t list{
+        [] { return false; },
+        [] { return true; },
+        [] { return false; }
+    };
+
+    profile.enable();
+
+    CHECK(walk_list(profile, list));
+    CHECK(walk_list(profile, list));
+
+    const auto &stats = profile.lists().at(test_key);
+    CHECK(stats.walks == 2);
+    CHECK(stats.calls == 4);
+    CHECK(stats.hits == 2);
+
+    auto iter = list.begin();
+    CHECK(stats_of(profile, *iter).calls == 2);
+    CHECK(stats_of(profile, *iter).hits == 0);
+
+    ++iter;
+    CHECK(stats_of(profile, *iter).calls == 2);
+    CHECK(stats_of(profile, *iter).hits == 2);
+
+    ++iter;
+    CHECK(profile.delegates().count(&*iter) == 0);
+}
+
+TEST_CASE("delegate profile: a walk that nothing handles")
+{
+    delegate_profile profile{"test"};
+    test_list_t list{
+        [] { return false; },
+        [] { return false; }
+    };
+
+    profile.enable();
+    CHECK_FALSE(walk_list(profile, list));
+
+    const auto &stats = profile.lists().at(test_key);
+    CHECK(stats.walks == 1);
+    CHECK(stats.calls == 2);
+    CHECK(stats.hits == 0);
+}
+
+TEST_CASE("delegate profile: positions follow the list")
+{
+    delegate_profile profile{"test"};
+    test_list_t list{
+        [] { return false; },
+        [] { return false; }
+    };
+
+    profile.enable();
+    walk_list(profile, list);
+
+    CHECK(stats_of(profile, list.front()).position == 0);
+    CHECK(stats_of(profile, list.back()).position == 1);
+    CHECK(stats_of(profile, list.front()).key == test_key);
+
+    // A delegate pushed to the front moves the others down, and the
+    // positions recorded by the next walk reflect that
+
+    list.push_front([] { return false; });
+    walk_list(profile, list);
+
+    auto iter = list.begin();
+    CHECK(stats_of(profile, *iter++).position == 0);
+    CHECK(stats_of(profile, *iter++).position == 1);
+    CHECK(stats_of(profile, *iter++).position == 2);
+}
+
+TEST_CASE("delegate profile: lists are kept apart")
+{
+    delegate_profile profile{"test"};
+    test_list_t list1{[] { return true; }};
+    test_list_t list2{[] { return true; }};
+
+    profile.enable();
+    walk_list(profile, list1, 1);
+    walk_list(profile, list2, 2);
+    walk_list(profile, list2, 2);
+
+    CHECK(profile.lists().at(1).walks == 1);
+    CHECK(profile.lists().at(2).walks == 2);
+    CHECK(stats_of(profile, list1.front()).key == 1);
+    CHECK(stats_of(profile, list2.front()).key == 2);
+}
+
+TEST_CASE("delegate profile: forget drops one list")
+{
+    delegate_profile profile{"test"};
+    test_list_t list1{[] { return true; }};
+    test_list_t list2{[] { return true; }};
+
+    profile.enable();
+    walk_list(profile, list1, 1);
+    walk_list(profile, list2, 2);
+
+    profile.forget(1);
+
+    CHECK(profile.lists().count(1) == 0);
+    CHECK(profile.delegates().count(&list1.front()) == 0);
+    CHECK(profile.lists().count(2) == 1);
+    CHECK(profile.delegates().count(&list2.front()) == 1);
+}
+
+TEST_CASE("delegate profile: a removed delegate's stats are not inherited")
+{
+    delegate_profile profile{"test"};
+    test_list_t list{[] { return true; }};
+
+    profile.enable();
+    walk_list(profile, list);
+    walk_list(profile, list);
+
+    list.clear();
+    profile.forget(test_key);
+
+    list.emplace_front([] { return true; });
+    walk_list(profile, list);
+
+    CHECK(stats_of(profile, list.front()).calls == 1);
+    CHECK(profile.lists().at(test_key).walks == 1);
+}
+
+TEST_CASE("delegate profile: reset")
+{
+    delegate_profile profile{"test"};
+    test_list_t list{[] { return true; }};
+
+    profile.enable();
+    walk_list(profile, list);
+    profile.reset();
+
+    CHECK(profile.lists().empty());
+    CHECK(profile.delegates().empty());
+    CHECK_NOTHROW(profile.dump());
+}
+
+static bool
+test_wrcr0_handler(
+    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    return true;
+}
+
+TEST_CASE("delegate profile: handlers forget a list when a delegate is removed")
+{
+    g_vmcs_fields[vmcs_n::exit_qualification::addr] = 0;
+    g_vmcs_fields[vmcs_n::guest_cr0::addr] = 0;
+
+    auto vcpu = make_vcpu();
+    control_register_handler handler{vcpu.get()};
+
+    auto d = control_register_handler::handler_delegate_t::create<test_wrcr0_handler>();
+    handler.add_wrcr0_handler(::intel_x64::cr0::task_switched::mask, d);
+
+    handler.profile().enable();
+
+    vcpu->vmcs_write(vmcs_n::cr0_read_shadow::addr, 0);
+    vcpu->set_rax(::intel_x64::cr0::task_switched::mask);
+    CHECK(handler.handle(vcpu.get()));
+
+    const auto &profile = handler.profile();
+    CHECK(profile.lists().count(control_register_handler::profile_wrcr0) == 1);
+
+    handler.remove_wrcr0_handler(d);
+
+    CHECK(profile.lists().count(control_register_handler::profile_wrcr0) == 0);
+    for (const auto &[ptr, stats] : profile.delegates()) {
+        bfignored(ptr);
+        CHECK(stats.key != control_register_handler::profile_wrcr0);
+    }
+}
+
+#endif
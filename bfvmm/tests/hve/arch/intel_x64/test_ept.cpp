@@ -19,45 +19,75 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
 #include <test/support.h>
-#include <hve/arch/intel_x64/ept.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
 using namespace eapis::intel_x64;
 
-TEST_CASE("constructor")
+TEST_CASE("ept: set_eptp")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-
-    CHECK_NOTHROW(ept_handler(eapis, &g_eapis_vcpu_global_state));
-}
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
 
-TEST_CASE("set_eptp")
-{
-    setup_eapis_test_support();
+    vcpu_global_state_t state;
+    auto vcpu = make_vcpu(0, &state);
+    ept_handler handler{vcpu.get()};
 
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+    g_vmcs_fields[vmcs_n::ept_pointer::addr] = 0;
+    state.ia32_vmx_cr0_fixed0 =
+        ::intel_x64::cr0::paging::mask | ::intel_x64::cr0::protection_enable::mask;
 
     auto mm = ept::mmap{};
 
     handler.set_eptp(&mm);
-    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::is_enabled());
+    CHECK((vcpu->vmcs_read(addr) & enable_ept::mask) != 0);
+    CHECK((vcpu->vmcs_read(addr) & unrestricted_guest::mask) != 0);
+    CHECK(vmcs_n::ept_pointer::phys_addr::get() == mm.eptp());
+    CHECK(state.ia32_vmx_cr0_fixed0 == 0);
 
     handler.set_eptp(nullptr);
-    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::is_disabled());
+    CHECK((vcpu->vmcs_read(addr) & enable_ept::mask) == 0);
+    CHECK((vcpu->vmcs_read(addr) & unrestricted_guest::mask) == 0);
+    CHECK(vmcs_n::ept_pointer::phys_addr::get() == 0);
+    CHECK(
+        state.ia32_vmx_cr0_fixed0 == (
+            ::intel_x64::cr0::paging::mask | ::intel_x64::cr0::protection_enable::mask
+        )
+    );
+}
+
+TEST_CASE("ept: set_eptp more than once")
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    vcpu_global_state_t state;
+    auto vcpu = make_vcpu(0, &state);
+    ept_handler handler{vcpu.get()};
+
+    g_vmcs_fields[vmcs_n::ept_pointer::addr] = 0;
+    state.ia32_vmx_cr0_fixed0 = ::intel_x64::cr0::paging::mask;
+
+    auto mm = ept::mmap{};
 
     handler.set_eptp(&mm);
     handler.set_eptp(&mm);
     handler.set_eptp(&mm);
-    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::is_enabled());
+    CHECK((vcpu->vmcs_read(addr) & enable_ept::mask) != 0);
+    CHECK(state.ia32_vmx_cr0_fixed0 == 0);
 
     handler.set_eptp(nullptr);
-    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::is_disabled());
+    handler.set_eptp(nullptr);
+    CHECK((vcpu->vmcs_read(addr) & enable_ept::mask) == 0);
+    CHECK(
+        state.ia32_vmx_cr0_fixed0 == (
+            ::intel_x64::cr0::paging::mask | ::intel_x64::cr0::protection_enable::mask
+        )
+    );
 }
+
+#endif
@@ -0,0 +1,243 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+
+// Each vcpu already owns a hot spot handler, so the tests drive that one
+// instead of adding a second
+//
+namespace eapis::intel_x64
+{
+struct vcpu_test {
+    static exit_hotspot_handler &hotspots(vcpu &vcpu)
+    { return vcpu.m_exit_hotspot_handler; }
+};
+
+struct exit_hotspot_handler_test {
+    static void sample(exit_hotspot_handler &handler, uint64_t rip, uint64_t reason = 10)
+    { handler.sample(reason, rip, 0x1000); }
+
+    static const exit_hotspot_entry_t &entry(exit_hotspot_handler &handler, std::size_t index)
+    { return handler.m_entries.at(index); }
+
+    static uint64_t used(exit_hotspot_handler &handler)
+    { return handler.m_used; }
+
+    static uint64_t samples(exit_hotspot_handler &handler)
+    { return handler.m_samples; }
+};
+}
+
+using hotspot_test = exit_hotspot_handler_test;
+
+static std::size_t
+find(exit_hotspot_handler &handler, uint64_t rip)
+{
+    for (auto i = 0ULL; i < exit_hotspot_num_entries; i++) {
+        if (hotspot_test::entry(handler, i).count != 0 && hotspot_test::entry(handler, i).rip == rip) {
+            return i;
+        }
+    }
+
+    return exit_hotspot_num_entries;
+}
+
+// Note:
+//
+// The hash is private to the handler, so the slot a tuple hashes to is
+// found by sampling it into an empty table
+//
+static std::size_t
+home(exit_hotspot_handler &handler, uint64_t rip)
+{
+    handler.set_period(0);
+    hotspot_test::sample(handler, rip);
+
+    return find(handler, rip);
+}
+
+TEST_CASE("exit hotspots: new tuples take an empty slot")
+{
+    MockRepository mocks;
+    auto vcpu = make_vcpu(0);
+    auto &handler = vcpu_test::hotspots(*vcpu);
+
+    hotspot_test::sample(handler, 0x1000);
+    hotspot_test::sample(handler, 0x2000);
+    hotspot_test::sample(handler, 0x1000, 12);
+
+    CHECK(hotspot_test::used(handler) == 3);
+    CHECK(hotspot_test::samples(handler) == 3);
+
+    const auto &entry = hotspot_test::entry(handler, find(handler, 0x2000));
+    CHECK(entry.rip == 0x2000);
+    CHECK(entry.cr3 == 0x1000);
+    CHECK(entry.count == 1);
+    CHECK(entry.error == 0);
+    CHECK(entry.reason == 10);
+}
+
+TEST_CASE("exit hotspots: known tuples are incremented")
+{
+    MockRepository mocks;
+    auto vcpu = make_vcpu(0);
+    auto &handler = vcpu_test::hotspots(*vcpu);
+
+    hotspot_test::sample(handler, 0x1000);
+    hotspot_test::sample(handler, 0x1000);
+    hotspot_test::sample(handler, 0x1000);
+
+    CHECK(hotspot_test::used(handler) == 1);
+    CHECK(hotspot_test::samples(handler) == 3);
+    CHECK(hotspot_test::entry(handler, find(handler, 0x1000)).count == 3);
+}
+
+TEST_CASE("exit hotspots: probing wraps around the end of the table")
+{
+    MockRepository mocks;
+    auto vcpu = make_vcpu(0);
+    auto &handler = vcpu_test::hotspots(*vcpu);
+
+    constexpr auto last = exit_hotspot_num_entries - 1;
+    std::vector<uint64_t> rips;
+
+    for (auto rip = 0x1000ULL; rips.size() < 2; rip += 0x1000) {
+        REQUIRE(rip < 0x10000000);
+
+        if (home(handler, rip) == last) {
+            rips.push_back(rip);
+        }
+    }
+
+    handler.set_period(0);
+
+    hotspot_test::sample(handler, rips[0]);
+    hotspot_test::sample(handler, rips[1]);
+    CHECK(find(handler, rips[0]) == last);
+    CHECK(find(handler, rips[1]) == 0);
+
+    hotspot_test::sample(handler, rips[1]);
+    CHECK(hotspot_test::used(handler) == 2);
+    CHECK(hotspot_test::entry(handler, 0).count == 2);
+    CHECK(hotspot_test::entry(handler, last).count == 1);
+}
+
+TEST_CASE("exit hotspots: a full table evicts the smallest count")
+{
+    MockRepository mocks;
+    auto vcpu = make_vcpu(0);
+    auto &handler = vcpu_test::hotspots(*vcpu);
+
+    constexpr auto victim = 0x5000ULL;
+
+    for (auto i = 1ULL; i <= exit_hotspot_num_entries; i++) {
+        hotspot_test::sample(handler, i * 0x1000);
+    }
+
+    for (auto i = 1ULL; i <= exit_hotspot_num_entries; i++) {
+        if (i * 0x1000 != victim) {
+            hotspot_test::sample(handler, i * 0x1000);
+            hotspot_test::sample(handler, i * 0x1000);
+            hotspot_test::sample(handler, i * 0x1000);
+        }
+    }
+
+    REQUIRE(hotspot_test::used(handler) == exit_hotspot_num_entries);
+    const auto slot = find(handler, victim);
+
+    hotspot_test::sample(handler, 0x100000, 12);
+
+    CHECK(hotspot_test::used(handler) == exit_hotspot_num_entries);
+    CHECK(find(handler, victim) == exit_hotspot_num_entries);
+    CHECK(find(handler, 0x100000) == slot);
+
+    const auto &entry = hotspot_test::entry(handler, slot);
+    CHECK(entry.count == 2);
+    CHECK(entry.error == 1);
+    CHECK(entry.reason == 12);
+}
+
+TEST_CASE("exit hotspots: an evicting tuple inherits the evicted count as its error")
+{
+    MockRepository mocks;
+    auto vcpu = make_vcpu(0);
+    auto &handler = vcpu_test::hotspots(*vcpu);
+
+    for (auto i = 1ULL; i <= exit_hotspot_num_entries; i++) {
+        for (auto j = 0; j < 4; j++) {
+            hotspot_test::sample(handler, i * 0x1000);
+        }
+    }
+
+    // Every count is 4, so the first tuple takes a slot with count 5 and
+    // error 4. Its count is now the only one above 4, so the second takes
+    // one of the other slots, not the first tuple's.
+
+    hotspot_test::sample(handler, 0x100000);
+    const auto first = find(handler, 0x100000);
+
+    REQUIRE(first != exit_hotspot_num_entries);
+    CHECK(hotspot_test::entry(handler, first).count == 5);
+    CHECK(hotspot_test::entry(handler, first).error == 4);
+
+    hotspot_test::sample(handler, 0x200000);
+    const auto second = find(handler, 0x200000);
+
+    REQUIRE(second != exit_hotspot_num_entries);
+    CHECK(second != first);
+    CHECK(hotspot_test::entry(handler, second).count == 5);
+    CHECK(hotspot_test::entry(handler, second).error == 4);
+
+    // Once the evicting tuple is in the table, it is counted like any
+    // other, and keeps its error
+
+    hotspot_test::sample(handler, 0x100000);
+    CHECK(find(handler, 0x100000) == first);
+    CHECK(hotspot_test::entry(handler, first).count == 6);
+    CHECK(hotspot_test::entry(handler, first).error == 4);
+}
+
+TEST_CASE("exit hotspots: set_period clears the table")
+{
+    MockRepository mocks;
+    auto vcpu = make_vcpu(0);
+    auto &handler = vcpu_test::hotspots(*vcpu);
+
+    hotspot_test::sample(handler, 0x1000);
+    handler.set_period(10);
+
+    CHECK(hotspot_test::used(handler) == 0);
+    CHECK(hotspot_test::samples(handler) == 0);
+    CHECK(handler.hotspots().empty());
+}
+
+#endif
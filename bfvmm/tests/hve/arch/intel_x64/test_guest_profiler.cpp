@@ -0,0 +1,255 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <map>
+#include <string>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+
+constexpr const uint64_t test_stack = 0x10000;
+constexpr const uint64_t test_mmio = 0xFEE00000;
+
+class test_guest_profiler : public guest_profiler
+{
+public:
+
+    test_guest_profiler(gsl::not_null<vcpu *> vcpu, std::size_t depth) :
+        guest_profiler{vcpu}
+    {
+        using namespace vmcs_n;
+
+        g_vmcs_fields[guest_cr0::addr] = 0;
+        g_vmcs_fields[guest_ia32_efer::addr] = guest_ia32_efer::lma::mask;
+        g_vmcs_fields[guest_cs_access_rights::addr] = guest_cs_access_rights::l::mask;
+
+        m_depth = depth;
+        m_samples = std::make_unique<sample_t[]>(default_max_samples);
+        m_max_samples = default_max_samples;
+    }
+
+    bool is_ram(uint64_t gpa) const override
+    { return bfn::upper(gpa) != test_mmio; }
+
+    std::pair<uint64_t, uint64_t> read_frame(uint64_t fp) const override
+    {
+        reads++;
+
+        if (fp == throws_at) {
+            throw 42;
+        }
+
+        return frames.at(fp);
+    }
+
+    uint64_t walk_from(uint64_t fp)
+    {
+        m_vcpu->set_rbp(fp);
+        return this->walk(sample);
+    }
+
+    void record(uint64_t cr3, std::initializer_list<uint64_t> stack)
+    {
+        auto &s = m_samples[m_num_samples++];
+
+        s.cr3 = cr3;
+        s.cpl = 0;
+        s.depth = 0;
+
+        for (const auto frame : stack) {
+            s.frames[s.depth++] = frame;
+        }
+    }
+
+    std::map<uint64_t, std::pair<uint64_t, uint64_t>> frames;
+    uint64_t throws_at{};
+    mutable std::size_t reads{};
+    sample_t sample{};
+};
+
+static std::string
+line(uint64_t cr3, std::initializer_list<uint64_t> stack, uint64_t count)
+{
+    auto str = bfn::to_string(cr3, 16) + ";cpl0";
+    for (const auto frame : stack) {
+        str += ";" + bfn::to_string(frame, 16);
+    }
+
+    return str + " " + std::to_string(count) + "\n";
+}
+
+TEST_CASE("guest_profiler: walk follows the frame chain")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), guest_profiler::max_depth};
+
+    p.frames[test_stack] = {test_stack + 0x40, 0x1001};
+    p.frames[test_stack + 0x40] = {test_stack + 0x100, 0x1002};
+    p.frames[test_stack + 0x100] = {0, 0x1003};
+
+    CHECK(p.walk_from(test_stack) == 4);
+    CHECK(p.sample.frames[1] == 0x1001);
+    CHECK(p.sample.frames[2] == 0x1002);
+    CHECK(p.sample.frames[3] == 0x1003);
+}
+
+TEST_CASE("guest_profiler: walk is skipped outside of 64-bit mode")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), guest_profiler::max_depth};
+
+    p.frames[test_stack] = {0, 0x1001};
+    g_vmcs_fields[vmcs_n::guest_ia32_efer::addr] = 0;
+
+    CHECK(p.walk_from(test_stack) == 1);
+    CHECK(p.reads == 0);
+}
+
+TEST_CASE("guest_profiler: walk stops at the depth limit")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), 2};
+
+    p.frames[test_stack] = {test_stack + 0x40, 0x1001};
+    p.frames[test_stack + 0x40] = {test_stack + 0x100, 0x1002};
+    p.frames[test_stack + 0x100] = {0, 0x1003};
+
+    CHECK(p.walk_from(test_stack) == 3);
+    CHECK(p.reads == 2);
+}
+
+TEST_CASE("guest_profiler: walk stops at a bad frame pointer")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), guest_profiler::max_depth};
+
+    CHECK(p.walk_from(0) == 1);
+    CHECK(p.walk_from(test_stack + 4) == 1);
+    CHECK(p.walk_from(0x0000800000000000) == 1);
+    CHECK(p.reads == 0);
+}
+
+TEST_CASE("guest_profiler: walk stops at a frame that is not ram")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), guest_profiler::max_depth};
+
+    p.frames[test_mmio - 0x40] = {test_mmio + 0x40, 0x1001};
+    p.frames[test_mmio + 0x40] = {0, 0x1002};
+
+    CHECK(p.walk_from(test_mmio - 0x40) == 2);
+    CHECK(p.reads == 1);
+}
+
+TEST_CASE("guest_profiler: walk stops at a frame that straddles into mmio")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), guest_profiler::max_depth};
+
+    p.frames[test_mmio - 8] = {0, 0x1001};
+
+    CHECK(p.walk_from(test_mmio - 8) == 1);
+    CHECK(p.reads == 0);
+}
+
+TEST_CASE("guest_profiler: walk stops on any exception")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), guest_profiler::max_depth};
+
+    p.frames[test_stack] = {test_stack + 0x40, 0x1001};
+    p.throws_at = test_stack + 0x40;
+
+    CHECK(p.walk_from(test_stack) == 2);
+    CHECK(p.walk_from(test_stack + 0x80) == 1);
+}
+
+TEST_CASE("guest_profiler: walk stops at a null return address")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), guest_profiler::max_depth};
+
+    p.frames[test_stack] = {test_stack + 0x40, 0};
+
+    CHECK(p.walk_from(test_stack) == 1);
+    CHECK(p.reads == 1);
+}
+
+TEST_CASE("guest_profiler: walk stops when the stack does not grow up")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), guest_profiler::max_depth};
+
+    p.frames[test_stack] = {test_stack, 0x1001};
+    p.frames[test_stack + 0x40] = {test_stack, 0x1002};
+    p.frames[test_stack + 0x80] = {test_stack + 0x80 + 0x200000, 0x1003};
+
+    CHECK(p.walk_from(test_stack) == 2);
+    CHECK(p.walk_from(test_stack + 0x40) == 2);
+    CHECK(p.walk_from(test_stack + 0x80) == 2);
+    CHECK(p.reads == 3);
+}
+
+TEST_CASE("guest_profiler: folded is empty without samples")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), 0};
+
+    CHECK(p.folded().empty());
+}
+
+TEST_CASE("guest_profiler: folded aggregates stacks root first")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), 0};
+
+    p.record(0x2000, {0x1003, 0x1002, 0x1001});
+    p.record(0x1000, {0x1005});
+    p.record(0x2000, {0x1003, 0x1002, 0x1001});
+
+    CHECK(p.samples() == 3);
+    CHECK(p.folded() ==
+          line(0x1000, {0x1005}, 1) +
+          line(0x2000, {0x1001, 0x1002, 0x1003}, 2));
+}
+
+TEST_CASE("guest_profiler: folded keeps address spaces apart")
+{
+    auto vcpu = make_vcpu();
+    test_guest_profiler p{vcpu.get(), 0};
+
+    p.record(0x1000, {0x1003, 0x1001});
+    p.record(0x2000, {0x1003, 0x1001});
+
+    CHECK(p.folded() ==
+          line(0x1000, {0x1001, 0x1003}, 1) +
+          line(0x2000, {0x1001, 0x1003}, 1));
+}
+
+#endif
@@ -0,0 +1,138 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <vector>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/lapic_timer.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+#if EAPIS_HVE_RDTSC
+
+using namespace eapis::intel_x64;
+using namespace lapic::lvt::timer;
+
+constexpr const uint64_t test_offset = 1000000;
+
+class lapic_timer_vcpu : public vcpu
+{
+public:
+
+    using vcpu::vcpu;
+
+    preemption_timer_handler::timer_id_t add_timer_tsc(
+        uint64_t deadline_tsc, const preemption_timer_handler::timer_delegate_t &d) override
+    {
+        bfignored(d);
+
+        deadlines.push_back(deadline_tsc);
+        return deadlines.size();
+    }
+
+    void cancel_timer(preemption_timer_handler::timer_id_t id) override
+    { bfignored(id); }
+
+    std::vector<uint64_t> deadlines;
+};
+
+static void
+write_msr(lapic_timer_handler &timer, vcpu *vcpu, uint32_t msr, uint64_t val)
+{
+    wrmsr_handler::info_t info = {msr, val, false, false};
+
+    CHECK(timer.handle_wrmsr(vcpu, info));
+    CHECK(info.ignore_write);
+}
+
+static void
+set_mode(lapic_timer_handler &timer, vcpu *vcpu, lapic::value_t m)
+{
+    lapic::value_t lvt = 0x30;
+    mode::set(lvt, m);
+
+    write_msr(timer, vcpu, lapic::x2apic_msr(lapic::lvt::timer::indx), lvt);
+}
+
+TEST_CASE("lapic timer: tsc deadline without offset or scaling")
+{
+    auto vcpu = make_vcpu<lapic_timer_vcpu>();
+    lapic_timer_handler timer{vcpu.get()};
+
+    set_mode(timer, vcpu.get(), mode::tsc_deadline);
+    write_msr(timer, vcpu.get(), lapic_timer_handler::ia32_tsc_deadline, 5000000);
+
+    CHECK(vcpu->deadlines == std::vector<uint64_t>{5000000});
+}
+
+TEST_CASE("lapic timer: tsc deadline is converted to host ticks")
+{
+    auto vcpu = make_vcpu<lapic_timer_vcpu>();
+    lapic_timer_handler timer{vcpu.get()};
+
+    vcpu->set_tsc_offset(test_offset);
+    set_mode(timer, vcpu.get(), mode::tsc_deadline);
+
+    write_msr(timer, vcpu.get(), lapic_timer_handler::ia32_tsc_deadline, test_offset + 4000000);
+    CHECK(vcpu->deadlines.back() == 4000000);
+
+    vcpu->set_tsc_multiplier(rdtsc_handler::multiplier_one * 2);
+
+    write_msr(timer, vcpu.get(), lapic_timer_handler::ia32_tsc_deadline, test_offset + 4000000);
+    CHECK(vcpu->deadlines.back() == 2000000);
+
+    rdmsr_handler::info_t info = {lapic_timer_handler::ia32_tsc_deadline, 0, false, false};
+    CHECK(timer.handle_rdmsr(vcpu.get(), info));
+    CHECK(info.val == test_offset + 4000000);
+}
+
+TEST_CASE("lapic timer: host deadline is rounded up")
+{
+    auto vcpu = make_vcpu<lapic_timer_vcpu>();
+    lapic_timer_handler timer{vcpu.get()};
+
+    vcpu->set_tsc_offset(test_offset);
+    vcpu->set_tsc_multiplier(rdtsc_handler::multiplier_one * 3);
+    set_mode(timer, vcpu.get(), mode::tsc_deadline);
+
+    write_msr(timer, vcpu.get(), lapic_timer_handler::ia32_tsc_deadline, test_offset + 10);
+    CHECK(vcpu->deadlines.back() == 4);
+
+    write_msr(timer, vcpu.get(), lapic_timer_handler::ia32_tsc_deadline, test_offset - 10);
+    CHECK(vcpu->deadlines.back() == 0);
+}
+
+TEST_CASE("lapic timer: tsc deadline is ignored in other modes")
+{
+    auto vcpu = make_vcpu<lapic_timer_vcpu>();
+    lapic_timer_handler timer{vcpu.get()};
+
+    set_mode(timer, vcpu.get(), mode::one_shot);
+    write_msr(timer, vcpu.get(), lapic_timer_handler::ia32_tsc_deadline, 5000000);
+
+    CHECK(vcpu->deadlines.empty());
+}
+
+#endif
+#endif
@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/static_vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+
+namespace eapis::intel_x64
+{
+
+struct static_vcpu_test {
+
+    template<typename V, typename H>
+    static constexpr bool first_of_reason() noexcept
+    { return V::template first_of_reason<H>(); }
+
+    template<typename V, vmcs_n::value_type reason>
+    static bool dispatch(V *vcpu)
+    { return vcpu->template dispatch<reason>(vcpu); }
+};
+
+}
+
+constexpr auto cpuid_reason = vmcs_n::exit_reason::basic_exit_reason::cpuid;
+constexpr auto rdtsc_reason = vmcs_n::exit_reason::basic_exit_reason::rdtsc;
+
+static std::vector<int> s_calls;
+
+template<int N, vmcs_n::value_type reason>
+struct test_static_handler {
+    static constexpr auto exit_reason = reason;
+    static bool s_result;
+
+    explicit test_static_handler(gsl::not_null<vcpu *> vcpu) :
+        owner{vcpu}
+    { }
+
+    bool handle(gsl::not_null<vcpu_t *> vcpu)
+    {
+        bfignored(vcpu);
+
+        s_calls.push_back(N);
+        return s_result;
+    }
+
+    vcpu *owner;
+};
+
+template<int N, vmcs_n::value_type reason>
+bool test_static_handler<N, reason>::s_result = false;
+
+using cpuid_a = test_static_handler<1, cpuid_reason>;
+using cpuid_b = test_static_handler<2, cpuid_reason>;
+using rdtsc_c = test_static_handler<3, rdtsc_reason>;
+
+using test_vcpu = static_vcpu<cpuid_a, rdtsc_c, cpuid_b>;
+
+static std::unique_ptr<test_vcpu>
+make_test_vcpu(bool a, bool b, bool c)
+{
+    s_calls.clear();
+
+    cpuid_a::s_result = a;
+    cpuid_b::s_result = b;
+    rdtsc_c::s_result = c;
+
+    return make_vcpu<test_vcpu>();
+}
+
+TEST_CASE("static vcpu: first of reason")
+{
+    static_assert(static_vcpu_test::first_of_reason<test_vcpu, cpuid_a>());
+    static_assert(!static_vcpu_test::first_of_reason<test_vcpu, cpuid_b>());
+    static_assert(static_vcpu_test::first_of_reason<test_vcpu, rdtsc_c>());
+
+    CHECK(static_vcpu_test::first_of_reason<test_vcpu, cpuid_a>());
+    CHECK_FALSE(static_vcpu_test::first_of_reason<test_vcpu, cpuid_b>());
+    CHECK(static_vcpu_test::first_of_reason<test_vcpu, rdtsc_c>());
+}
+
+TEST_CASE("static vcpu: handlers are owned by the vcpu")
+{
+    auto vcpu = make_test_vcpu(false, false, false);
+
+    CHECK(vcpu->handler<cpuid_a>().owner == vcpu.get());
+    CHECK(vcpu->handler<cpuid_b>().owner == vcpu.get());
+    CHECK(vcpu->handler<rdtsc_c>().owner == vcpu.get());
+}
+
+TEST_CASE("static vcpu: chain stops at the first handler that returns true")
+{
+    auto vcpu = make_test_vcpu(true, true, true);
+
+    CHECK(static_vcpu_test::dispatch<test_vcpu, cpuid_reason>(vcpu.get()));
+    CHECK(s_calls == std::vector<int>{1});
+}
+
+TEST_CASE("static vcpu: chain runs in template argument order")
+{
+    auto vcpu = make_test_vcpu(false, true, true);
+
+    CHECK(static_vcpu_test::dispatch<test_vcpu, cpuid_reason>(vcpu.get()));
+    CHECK(s_calls == std::vector<int>{1, 2});
+}
+
+TEST_CASE("static vcpu: chain falls through when no handler returns true")
+{
+    auto vcpu = make_test_vcpu(false, false, true);
+
+    CHECK_FALSE(static_vcpu_test::dispatch<test_vcpu, cpuid_reason>(vcpu.get()));
+    CHECK(s_calls == std::vector<int>{1, 2});
+}
+
+TEST_CASE("static vcpu: chains only contain their own reason")
+{
+    auto vcpu = make_test_vcpu(true, true, false);
+
+    CHECK_FALSE(static_vcpu_test::dispatch<test_vcpu, rdtsc_reason>(vcpu.get()));
+    CHECK(s_calls == std::vector<int>{3});
+}
+
+#endif
@@ -0,0 +1,240 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <vector>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vioapic.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace ioapic::redtbl;
+
+constexpr const uint64_t test_vector = 0x30;
+constexpr const uint64_t test_pin = 4;
+
+class vioapic_vcpu : public vcpu
+{
+public:
+
+    using vcpu::vcpu;
+
+    void queue_external_interrupt(uint64_t vector) override
+    { queued.push_back(vector); }
+
+    std::vector<uint64_t> queued;
+};
+
+static vioapic::reg_t
+read_reg(vioapic &io, vioapic::reg_t indx)
+{
+    io.write(ioapic::sel_offset, indx);
+    return io.read(ioapic::win_offset);
+}
+
+static void
+write_rte(vioapic &io, uint64_t pin, vioapic::rte_t rte)
+{
+    const auto reg = gsl::narrow_cast<vioapic::reg_t>(indx + (pin * 2));
+
+    io.write(ioapic::sel_offset, reg);
+    io.write(ioapic::win_offset, gsl::narrow_cast<vioapic::reg_t>(rte));
+    io.write(ioapic::sel_offset, reg + 1);
+    io.write(ioapic::win_offset, gsl::narrow_cast<vioapic::reg_t>(rte >> 32U));
+}
+
+static vioapic::rte_t
+make_rte(uint64_t trigger, uint64_t dest = 0, uint64_t mode = delivery_mode::fixed)
+{
+    vioapic::rte_t rte = 0;
+
+    vector::set(rte, test_vector);
+    delivery_mode::set(rte, mode);
+    dest_mode::set(rte, dest_mode::physical);
+    trigger_mode::set(rte, trigger);
+    destination::set(rte, dest);
+
+    return rte;
+}
+
+static std::vector<uint64_t>
+drain(vioapic &io, vioapic_vcpu *vcpu)
+{
+    io.drain(vcpu);
+
+    auto queued = std::move(vcpu->queued);
+    vcpu->queued.clear();
+
+    return queued;
+}
+
+TEST_CASE("vioapic: id and version")
+{
+    vioapic io{ioapic::default_base, 2};
+
+    CHECK(ioapic::id::get(read_reg(io, ioapic::id::indx)) == 2);
+    CHECK(ioapic::version::max_rte::get(read_reg(io, ioapic::version::indx)) == size - 1);
+
+    io.write(ioapic::sel_offset, ioapic::id::indx);
+    io.write(ioapic::win_offset, 5U << ioapic::id::from);
+    CHECK(ioapic::id::get(read_reg(io, ioapic::id::indx)) == 5);
+
+    CHECK(read_reg(io, indx + (size * 2)) == 0);
+    CHECK(io.read(ioapic::eoi_offset) == 0);
+}
+
+TEST_CASE("vioapic: redirection table")
+{
+    vioapic io{};
+
+    for (uint64_t pin = 0; pin < size; pin++) {
+        CHECK(mask_bit::is_enabled(io.rte(pin)));
+    }
+
+    auto rte = make_rte(trigger_mode::level, 0xAB);
+    remote_irr::enable(rte);
+
+    write_rte(io, test_pin, rte);
+    remote_irr::disable(rte);
+
+    CHECK(io.rte(test_pin) == rte);
+    CHECK(read_reg(io, gsl::narrow_cast<vioapic::reg_t>(indx + (test_pin * 2) + 1)) == (0xABU << 24U));
+    CHECK_THROWS(io.rte(size));
+}
+
+TEST_CASE("vioapic: masked pins are not delivered")
+{
+    auto vcpu = make_vcpu<vioapic_vcpu>();
+    vioapic io{};
+    io.add_vcpu(vcpu.get(), 0);
+
+    io.assert_irq(test_pin);
+    CHECK(drain(io, vcpu.get()).empty());
+}
+
+TEST_CASE("vioapic: edge triggered delivery")
+{
+    auto vcpu = make_vcpu<vioapic_vcpu>();
+    vioapic io{};
+    io.add_vcpu(vcpu.get(), 0);
+
+    write_rte(io, test_pin, make_rte(trigger_mode::edge));
+
+    io.assert_irq(test_pin);
+    CHECK(drain(io, vcpu.get()) == std::vector<uint64_t>{test_vector});
+
+    io.assert_irq(test_pin);
+    CHECK(drain(io, vcpu.get()).empty());
+
+    io.deassert_irq(test_pin);
+    io.assert_irq(test_pin);
+    CHECK(drain(io, vcpu.get()) == std::vector<uint64_t>{test_vector});
+}
+
+TEST_CASE("vioapic: level triggered delivery and eoi")
+{
+    auto vcpu = make_vcpu<vioapic_vcpu>();
+    vioapic io{};
+    io.add_vcpu(vcpu.get(), 0);
+
+    write_rte(io, test_pin, make_rte(trigger_mode::level));
+
+    io.assert_irq(test_pin);
+    CHECK(drain(io, vcpu.get()) == std::vector<uint64_t>{test_vector});
+    CHECK(remote_irr::is_enabled(io.rte(test_pin)));
+
+    io.assert_irq(test_pin);
+    CHECK(drain(io, vcpu.get()).empty());
+
+    io.eoi(test_vector);
+    CHECK(drain(io, vcpu.get()) == std::vector<uint64_t>{test_vector});
+
+    io.deassert_irq(test_pin);
+    io.write(ioapic::eoi_offset, test_vector);
+
+    CHECK(remote_irr::is_disabled(io.rte(test_pin)));
+    CHECK(drain(io, vcpu.get()).empty());
+}
+
+TEST_CASE("vioapic: unmasking an asserted level triggered pin delivers")
+{
+    auto vcpu = make_vcpu<vioapic_vcpu>();
+    vioapic io{};
+    io.add_vcpu(vcpu.get(), 0);
+
+    auto rte = make_rte(trigger_mode::level);
+    mask_bit::enable(rte);
+    write_rte(io, test_pin, rte);
+
+    io.assert_irq(test_pin);
+    CHECK(drain(io, vcpu.get()).empty());
+
+    mask_bit::disable(rte);
+    write_rte(io, test_pin, rte);
+    CHECK(drain(io, vcpu.get()) == std::vector<uint64_t>{test_vector});
+}
+
+TEST_CASE("vioapic: destinations")
+{
+    auto vcpu0 = make_vcpu<vioapic_vcpu>(0);
+    auto vcpu1 = make_vcpu<vioapic_vcpu>(1);
+
+    vioapic io{};
+    io.add_vcpu(vcpu0.get(), 0);
+    io.add_vcpu(vcpu1.get(), 1);
+
+    auto pulse = [&](vioapic::rte_t rte) {
+        write_rte(io, test_pin, rte);
+        io.assert_irq(test_pin);
+        io.deassert_irq(test_pin);
+
+        return std::make_pair(drain(io, vcpu0.get()).size(), drain(io, vcpu1.get()).size());
+    };
+
+    CHECK(pulse(make_rte(trigger_mode::edge, 1)) == std::make_pair(0UL, 1UL));
+    CHECK(pulse(make_rte(trigger_mode::edge, destination::broadcast)) == std::make_pair(1UL, 1UL));
+    CHECK(pulse(make_rte(trigger_mode::edge, 2)) == std::make_pair(0UL, 0UL));
+
+    auto logical = make_rte(trigger_mode::edge, 0x3);
+    dest_mode::set(logical, dest_mode::logical);
+    CHECK(pulse(logical) == std::make_pair(1UL, 1UL));
+
+    auto lowest = make_rte(trigger_mode::edge, destination::broadcast, delivery_mode::lowest_priority);
+    const auto [n0, n1] = pulse(lowest);
+    CHECK(n0 + n1 == 1);
+
+    CHECK(pulse(make_rte(trigger_mode::edge, 0, delivery_mode::nmi)) == std::make_pair(0UL, 0UL));
+}
+
+TEST_CASE("vioapic: drain of an unknown vcpu")
+{
+    auto vcpu = make_vcpu<vioapic_vcpu>();
+    vioapic io{};
+
+    CHECK_NOTHROW(io.drain(vcpu.get()));
+    CHECK(vcpu->queued.empty());
+}
+
+#endif
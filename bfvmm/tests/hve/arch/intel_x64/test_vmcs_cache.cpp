@@ -0,0 +1,186 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+
+constexpr const vmcs_n::value_type test_field = vmcs_n::exit_qualification::addr;
+
+TEST_CASE("vmcs cache: reads are cached until invalidated")
+{
+    auto vcpu = make_vcpu();
+    vmcs_cache cache{vcpu.get()};
+
+    g_vmcs_fields[test_field] = 1;
+    CHECK(cache.read(test_field) == 1);
+
+    g_vmcs_fields[test_field] = 2;
+    CHECK(cache.read(test_field) == 1);
+    CHECK(cache.stats().reads == 2);
+    CHECK(cache.stats().vmreads == 1);
+
+    CHECK(!cache.handle_exit(vcpu.get()));
+    CHECK(cache.read(test_field) == 2);
+    CHECK(cache.stats().vmreads == 2);
+}
+
+TEST_CASE("vmcs cache: writes are deferred and coalesced")
+{
+    auto vcpu = make_vcpu();
+    vmcs_cache cache{vcpu.get()};
+
+    g_vmcs_fields[test_field] = 0;
+
+    cache.write(test_field, 5);
+    cache.write(test_field, 6);
+
+    CHECK(g_vmcs_fields[test_field] == 0);
+    CHECK(cache.read(test_field) == 6);
+
+    cache.flush();
+    CHECK(g_vmcs_fields[test_field] == 6);
+    CHECK(cache.stats().writes == 2);
+    CHECK(cache.stats().vmwrites == 1);
+}
+
+TEST_CASE("vmcs cache: bit updates from several handlers are not lost")
+{
+    auto vcpu = make_vcpu();
+    vmcs_cache cache{vcpu.get()};
+
+    g_vmcs_fields[addr] = 0;
+
+    cache.set_bits(addr, hlt_exiting::mask);
+    cache.set_bits(addr, rdtsc_exiting::mask);
+    cache.clear_bits(addr, hlt_exiting::mask);
+    cache.set_bits(addr, monitor_trap_flag::mask);
+
+    cache.flush();
+
+    CHECK(g_vmcs_fields[addr] == (rdtsc_exiting::mask | monitor_trap_flag::mask));
+    CHECK(cache.stats().vmreads == 1);
+    CHECK(cache.stats().vmwrites == 1);
+}
+
+TEST_CASE("vmcs cache: a full write buffer is flushed early")
+{
+    auto vcpu = make_vcpu();
+    vmcs_cache cache{vcpu.get()};
+
+    for (auto i = 0ULL; i <= vmcs_cache::num_writes; i++) {
+        g_vmcs_fields[0x10000 + i] = 0;
+        cache.write(0x10000 + i, i + 1);
+    }
+
+    CHECK(cache.stats().vmwrites == vmcs_cache::num_writes);
+    cache.flush();
+
+    for (auto i = 0ULL; i <= vmcs_cache::num_writes; i++) {
+        CHECK(g_vmcs_fields[0x10000 + i] == i + 1);
+    }
+}
+
+TEST_CASE("vmcs cache: flush drops cached reads")
+{
+    auto vcpu = make_vcpu();
+    vmcs_cache cache{vcpu.get()};
+
+    g_vmcs_fields[test_field] = 1;
+    CHECK(cache.read(test_field) == 1);
+
+    cache.write(addr, 0);
+    cache.flush();
+
+    g_vmcs_fields[test_field] = 3;
+    CHECK(cache.read(test_field) == 3);
+}
+
+TEST_CASE("vmcs cache: the vcpu routes control writes through the cache")
+{
+    auto vcpu = make_vcpu();
+    const auto before = g_vmcs_fields[addr];
+
+    //
+    // The bitmaps are enabled by the vCPU's constructor, and nothing is
+    // written to the VMCS until the cache is flushed on VM entry
+    //
+
+    CHECK((vcpu->vmcs_read(addr) & use_msr_bitmap::mask) != 0);
+    CHECK((vcpu->vmcs_read(addr) & use_io_bitmaps::mask) != 0);
+
+    vcpu->enable_monitor_trap_flag();
+
+#if EAPIS_HVE_HLT
+    vcpu->enable_hlt_exiting();
+    CHECK((vcpu->vmcs_read(addr) & hlt_exiting::mask) != 0);
+#endif
+
+#if EAPIS_HVE_RDTSC
+    vcpu->set_tsc_offset(1);
+    CHECK((vcpu->vmcs_read(addr) & use_tsc_offsetting::mask) != 0);
+#endif
+
+    CHECK((vcpu->vmcs_read(addr) & monitor_trap_flag::mask) != 0);
+    CHECK((vcpu->vmcs_read(addr) & use_msr_bitmap::mask) != 0);
+    CHECK(g_vmcs_fields[addr] == before);
+}
+
+static bool
+test_wrcr0_handler(
+    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    return false;
+}
+
+TEST_CASE("vmcs cache: secondary controls and cr masks go through the cache")
+{
+    namespace secondary = vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    auto vcpu = make_vcpu();
+
+    const auto controls = g_vmcs_fields[secondary::addr];
+    const auto cr0_mask = g_vmcs_fields[vmcs_n::cr0_guest_host_mask::addr];
+
+    vcpu->add_wrcr0_handler(
+        0x8, control_register_handler::handler_delegate_t::create<test_wrcr0_handler>()
+    );
+    vcpu->disable_vpid();
+
+    CHECK((vcpu->vmcs_read(vmcs_n::cr0_guest_host_mask::addr) & 0x8) != 0);
+    CHECK((vcpu->vmcs_read(secondary::addr) & secondary::enable_vpid::mask) == 0);
+
+    CHECK(g_vmcs_fields[secondary::addr] == controls);
+    CHECK(g_vmcs_fields[vmcs_n::cr0_guest_host_mask::addr] == cr0_mask);
+}
+
+#endif
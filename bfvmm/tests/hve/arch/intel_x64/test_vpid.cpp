@@ -19,38 +19,128 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
 #include <test/support.h>
-#include <hve/arch/intel_x64/vpid.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
 using namespace eapis::intel_x64;
 
-TEST_CASE("constructor")
+// Note:
+//
+// The VPID allocator is global to the test binary, so these tests rely on
+// running in order and on every vcpu / handler being gone by the end of
+// each test. The vcpu itself always leases the lowest free VPID first.
+//
+
+TEST_CASE("vpid: constructor")
+{
+    auto vcpu = make_vcpu();
+    vpid_handler handler{vcpu.get()};
+
+    CHECK(handler.id() == 2);
+    CHECK(vcpu->vmcs_read(vmcs_n::virtual_processor_identifier::addr) == 2);
+}
+
+TEST_CASE("vpid: leases are returned and recycled")
 {
-    setup_eapis_test_support();
+    auto vcpu = make_vcpu();
+
+    {
+        vpid_handler handler1{vcpu.get()};
+        vpid_handler handler2{vcpu.get()};
+
+        CHECK(handler1.id() == 2);
+        CHECK(handler2.id() == 3);
+    }
+
+    vpid_handler handler{vcpu.get()};
+    CHECK(handler.id() == 2);
+}
+
+TEST_CASE("vpid: move transfers the lease")
+{
+    auto vcpu = make_vcpu();
+
+    vpid_handler handler1{vcpu.get()};
+    vpid_handler handler2{std::move(handler1)};
+
+    CHECK(handler2.id() == 2);
+    CHECK(handler1.id() == 0);      // NOLINT
+
+    vpid_handler handler3{vcpu.get()};
+    CHECK(handler3.id() == 3);
+}
 
+TEST_CASE("vpid: a fresh vpid is never flushed")
+{
     MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = vpid_handler(eapis, &g_eapis_vcpu_global_state);
+    mocks.OnCallFunc(thread_context_cpuid).Return(0);
+    mocks.NeverCallFunc(::intel_x64::vmx::invvpid_single_context);
+
+    auto vcpu = make_vcpu();
+    vpid_handler handler1{vcpu.get()};
+    vpid_handler handler2{vcpu.get()};
+    vpid_handler handler3{vcpu.get()};
 
-    CHECK(handler.id() == 1);
+    CHECK(handler3.id() == 4);
+    handler3.load();
 }
 
-TEST_CASE("enable / disable")
+TEST_CASE("vpid: a recycled vpid is flushed once per core")
 {
-    setup_eapis_test_support();
+    MockRepository mocks;
+
+    auto vcpu = make_vcpu();
+    vpid_handler handler{vcpu.get()};
+
+    mocks.OnCallFunc(thread_context_cpuid).Return(0);
+    mocks.ExpectCallFunc(::intel_x64::vmx::invvpid_single_context);
+    handler.load();
+    handler.load();
+
+    mocks.OnCallFunc(thread_context_cpuid).Return(1);
+    mocks.ExpectCallFunc(::intel_x64::vmx::invvpid_single_context);
+    handler.load();
+    handler.load();
+
+    mocks.OnCallFunc(thread_context_cpuid).Return(0);
+    handler.load();
+}
 
+TEST_CASE("vpid: cores past the 64th flush on every load")
+{
     MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = vpid_handler(eapis, &g_eapis_vcpu_global_state);
+    mocks.OnCallFunc(thread_context_cpuid).Return(64);
+
+    auto vcpu = make_vcpu();
+    vpid_handler handler{vcpu.get()};
 
-    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::is_disabled());
+    mocks.ExpectCallFunc(::intel_x64::vmx::invvpid_single_context);
+    mocks.ExpectCallFunc(::intel_x64::vmx::invvpid_single_context);
+    handler.load();
+    handler.load();
+}
+
+TEST_CASE("vpid: enable / disable")
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    auto vcpu = make_vcpu();
+    vpid_handler handler{vcpu.get()};
+
+    handler.disable();
+    CHECK((vcpu->vmcs_read(addr) & enable_vpid::mask) == 0);
 
     handler.enable();
-    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::is_enabled());
+    CHECK((vcpu->vmcs_read(addr) & enable_vpid::mask) != 0);
 
     handler.disable();
-    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::is_disabled());
+    CHECK((vcpu->vmcs_read(addr) & enable_vpid::mask) == 0);
 }
+
+#endif
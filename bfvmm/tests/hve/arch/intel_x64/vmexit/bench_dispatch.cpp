@@ -0,0 +1,378 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <array>
+#include <memory>
+#include <string>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/bench.h>
+#include <test/support.h>
+#include <hve/arch/intel_x64/static_vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+using namespace eapis::intel_x64;
+
+constexpr uint64_t num_exits = 0x100000;
+constexpr uint64_t key = 42;
+
+static const std::array<uint64_t, 3> s_counts = {1, 10, 100};
+
+// The key is loaded into every register a handler might key on (rax for
+// CPUID, rcx for RDMSR and dx for IO)
+//
+template<typename V = vcpu>
+static std::unique_ptr<V>
+make_bench_vcpu(uint64_t exit_qualification)
+{
+    g_vmcs_fields[vmcs_n::exit_qualification::addr] = exit_qualification;
+
+    auto vcpu = make_vcpu<V>();
+
+    vcpu->set_rax(key);
+    vcpu->set_rcx(key);
+    vcpu->set_rdx(key);
+
+    return vcpu;
+}
+
+template<typename F>
+static void
+run(const std::string &name, F &&f)
+{
+    const auto ops = num_exits * bench::scale();
+
+    const auto ns = bench::elapsed_ns([&] {
+        for (auto i = 0ULL; i < ops; i++) {
+            bench::do_not_optimize(f());
+        }
+    });
+
+    bench::report(name, ops, ns);
+}
+
+static std::string
+name(const char *handler, const char *pattern, uint64_t count)
+{ return std::string(handler) + " " + pattern + " " + std::to_string(count); }
+
+// Note:
+//
+// The hit delegate sets ignore_write and ignore_advance so that handle()
+// neither writes back to the guest registers nor calls advance(). What is
+// left is the dispatch itself: the key lookup and the walk of the delegate
+// list. The handlers are also told to emulate the key, so the mocked
+// cpuid/rdmsr/in/out is never executed.
+//
+
+template<typename INFO>
+bool
+bench_hit(gsl::not_null<vcpu_t *> vcpu, INFO &info)
+{
+    bfignored(vcpu);
+
+    info.ignore_write = true;
+    info.ignore_advance = true;
+
+    return true;
+}
+
+template<typename INFO>
+bool
+bench_miss(gsl::not_null<vcpu_t *> vcpu, INFO &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    return false;
+}
+
+bool
+bench_ept_hit(
+    gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    return true;
+}
+
+bool
+bench_default(gsl::not_null<vcpu_t *> vcpu)
+{
+    bfignored(vcpu);
+    return true;
+}
+
+// Note:
+//
+// Each keyed handler is measured with three patterns:
+//
+// - "hit first": count delegates on one key, the first one called handles
+//   the exit (delegates are called most recently added first)
+// - "hit last": count delegates on one key, only the last one called
+//   handles the exit, so the whole list is walked
+// - "miss": count keys are registered, but not the key that exits, so the
+//   cost is the failed lookup
+//
+// The exit qualification is read through the vCPU's VMCS cache, which,
+// unlike a real exit, is never invalidated here, so only the first read of
+// each case reaches the (mocked) vmread.
+//
+
+template<typename H, typename ADD>
+static void
+bench_keyed(const char *handler, uint64_t exit_qualification, ADD add)
+{
+    using info_t = typename H::info_t;
+
+    const auto hit = H::handler_delegate_t::template create<bench_hit<info_t>>();
+    const auto miss = H::handler_delegate_t::template create<bench_miss<info_t>>();
+
+    for (const auto count : s_counts) {
+        auto vcpu = make_bench_vcpu(exit_qualification);
+        H h{vcpu.get()};
+
+        for (auto i = 1ULL; i < count; i++) {
+            add(h, key, miss);
+        }
+        add(h, key, hit);
+
+        run(name(handler, "hit first", count), [&] { return h.handle(vcpu.get()); });
+    }
+
+    for (const auto count : s_counts) {
+        auto vcpu = make_bench_vcpu(exit_qualification);
+        H h{vcpu.get()};
+
+        add(h, key, hit);
+        for (auto i = 1ULL; i < count; i++) {
+            add(h, key, miss);
+        }
+
+        run(name(handler, "hit last", count), [&] { return h.handle(vcpu.get()); });
+    }
+
+    for (const auto count : s_counts) {
+        auto vcpu = make_bench_vcpu(exit_qualification);
+        H h{vcpu.get()};
+
+        for (auto i = 0ULL; i < count; i++) {
+            add(h, key + 1 + i, hit);
+        }
+
+        run(name(handler, "miss", count), [&] { return h.handle(vcpu.get()); });
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+// -----------------------------------------------------------------------------
+
+TEST_CASE("bench: cpuid_handler::handle", "[.][bench]")
+{
+    bench::header("cpuid_handler::handle (delegates)");
+
+    bench_keyed<cpuid_handler>("cpuid", 0, [](auto & h, uint64_t leaf, const auto & d) {
+        h.add_handler(leaf, d);
+        h.emulate(leaf);
+    });
+}
+
+TEST_CASE("bench: rdmsr_handler::handle", "[.][bench]")
+{
+    bench::header("rdmsr_handler::handle (delegates)");
+
+    bench_keyed<rdmsr_handler>("rdmsr", 0, [](auto & h, uint64_t msr, const auto & d) {
+        h.add_handler(msr, d);
+        h.emulate(msr);
+    });
+}
+
+TEST_CASE("bench: io_instruction_handler::handle", "[.][bench]")
+{
+    bench::header("io_instruction_handler::handle (delegates, 1 byte OUT DX)");
+
+    // An exit qualification of 0 is a one byte OUT, with the port in DX
+    //
+    bench_keyed<io_instruction_handler>("io", 0, [](auto & h, uint64_t port, const auto & d) {
+        h.add_handler(port, d, d);
+        h.emulate(port);
+    });
+}
+
+TEST_CASE("bench: ept_violation_handler::handle", "[.][bench]")
+{
+    bench::header("ept_violation_handler::handle (delegates, read)");
+
+    using namespace vmcs_n::exit_qualification::ept_violation;
+
+    const auto hit = ept_violation_handler::handler_delegate_t::create<bench_ept_hit>();
+    const auto miss =
+        ept_violation_handler::handler_delegate_t::create<bench_miss<ept_violation_handler::info_t>>();
+
+    // The EPT violation handler is not keyed, so a miss is every delegate
+    // declining the violation, which then falls through to the default
+    // handler (without one, handle() throws)
+    //
+
+    for (const auto count : s_counts) {
+        auto vcpu = make_bench_vcpu(data_read::mask);
+        ept_violation_handler h{vcpu.get()};
+
+        for (auto i = 1ULL; i < count; i++) {
+            h.add_read_handler(miss);
+        }
+        h.add_read_handler(hit);
+
+        run(name("ept", "hit first", count), [&] { return h.handle(vcpu.get()); });
+    }
+
+    for (const auto count : s_counts) {
+        auto vcpu = make_bench_vcpu(data_read::mask);
+        ept_violation_handler h{vcpu.get()};
+
+        h.add_read_handler(hit);
+        for (auto i = 1ULL; i < count; i++) {
+            h.add_read_handler(miss);
+        }
+
+        run(name("ept", "hit last", count), [&] { return h.handle(vcpu.get()); });
+    }
+
+    for (const auto count : s_counts) {
+        auto vcpu = make_bench_vcpu(data_read::mask);
+        ept_violation_handler h{vcpu.get()};
+
+        for (auto i = 0ULL; i < count; i++) {
+            h.add_read_handler(miss);
+        }
+        h.set_default_read_handler(::handler_delegate_t::create<bench_default>());
+
+        run(name("ept", "miss", count), [&] { return h.handle(vcpu.get()); });
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Static vs Delegate Dispatch
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The base vCPU's exit dispatch looks up the list of ::handler_delegate_t
+// registered for the exit reason and calls each one until one returns true,
+// after which it resumes the guest. The resume cannot be looped on a host,
+// so both paths below are timed through the ::handler_delegate_t that each
+// one registers with the base vCPU, which is the call that dispatch makes:
+//
+// - delegate: cpuid_handler::handle, which looks up the leaf, walks its
+//   delegate list and writes the result back to the guest registers
+// - static: static_vcpu::dispatch<cpuid>, which calls the static handler
+//   inline
+//
+// Both handlers do the same work for the guest: they return the same
+// values in rax, rbx, rcx and rdx, and neither advances the guest.
+//
+
+namespace eapis::intel_x64
+{
+
+struct static_vcpu_test {
+
+    template<typename V, vmcs_n::value_type reason>
+    static ::handler_delegate_t
+    dispatch_delegate(V *vcpu)
+    { return ::handler_delegate_t::create<V, &V::template dispatch<reason>>(vcpu); }
+};
+
+}
+
+bool
+bench_cpuid_result(
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.rax = key;
+    info.rbx = key;
+    info.rcx = key;
+    info.rdx = key;
+
+    info.ignore_advance = true;
+    return true;
+}
+
+struct bench_static_cpuid_handler {
+    static constexpr auto exit_reason =
+        vmcs_n::exit_reason::basic_exit_reason::cpuid;
+
+    explicit bench_static_cpuid_handler(gsl::not_null<vcpu *> vcpu)
+    { bfignored(vcpu); }
+
+    bool handle(gsl::not_null<vcpu_t *> vcpu)
+    {
+        if (vcpu->rax() != key) {
+            return false;
+        }
+
+        vcpu->set_rax(key);
+        vcpu->set_rbx(key);
+        vcpu->set_rcx(key);
+        vcpu->set_rdx(key);
+
+        return true;
+    }
+};
+
+TEST_CASE("bench: static_vcpu dispatch", "[.][bench]")
+{
+    using static_cpuid_vcpu = static_vcpu<bench_static_cpuid_handler>;
+    constexpr auto reason = bench_static_cpuid_handler::exit_reason;
+
+    bench::header("static_vcpu dispatch vs cpuid_handler delegate (hit)");
+
+    {
+        auto vcpu = make_bench_vcpu(0);
+        cpuid_handler h{vcpu.get()};
+
+        h.add_handler(key, cpuid_handler::handler_delegate_t::create<bench_cpuid_result>());
+        h.emulate(key);
+
+        auto d = ::handler_delegate_t::create<cpuid_handler, &cpuid_handler::handle>(&h);
+        run("cpuid delegate", [&] { return d(vcpu.get()); });
+    }
+
+    {
+        auto vcpu = make_bench_vcpu<static_cpuid_vcpu>(0);
+
+        auto d = static_vcpu_test::dispatch_delegate<static_cpuid_vcpu, reason>(vcpu.get());
+        run("cpuid static", [&] { return d(vcpu.get()); });
+    }
+}
+
+#endif
@@ -19,620 +19,487 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
 #include <test/support.h>
-#include <hve/arch/intel_x64/vmexit/control_register.h>
+#include <hve/arch/intel_x64/vcpu.h>
 
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
-bool
+using namespace eapis::intel_x64;
+
+using handler_delegate_t = control_register_handler::handler_delegate_t;
+
+constexpr uint64_t qual_wrcr0 = 0x00;
+constexpr uint64_t qual_rdcr0 = 0x10;
+constexpr uint64_t qual_clts = 0x20;
+constexpr uint64_t qual_lmsw = 0x30;
+constexpr uint64_t qual_wrcr3 = 0x03;
+constexpr uint64_t qual_rdcr3 = 0x13;
+constexpr uint64_t qual_wrcr4 = 0x04;
+constexpr uint64_t qual_rdcr4 = 0x14;
+constexpr uint64_t qual_wrcr1 = 0x01;
+
+static uint64_t s_calls = 0;
+
+static bool
 test_handler(
-    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
-    bfignored(vmcs);
+    bfignored(vcpu);
     bfignored(info);
 
+    s_calls++;
     return false;
 }
 
-bool
+static bool
 test_handler_ignore_write(
-    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
-    bfignored(vmcs);
+    bfignored(vcpu);
 
     info.ignore_write = true;
     return false;
 }
 
-bool
+static bool
 test_handler_ignore_advance(
-    gsl::not_null<vmcs_t *> vmcs, control_register_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
-    bfignored(vmcs);
+    bfignored(vcpu);
 
     info.ignore_advance = true;
     return false;
 }
 
-TEST_CASE("constructor/destruction")
+static uint64_t s_ts_calls = 0;
+static uint64_t s_am_calls = 0;
+
+static bool
+test_handler_ts(
+    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
+    bfignored(vcpu);
+    bfignored(info);
 
-    CHECK_NOTHROW(control_register_handler(eapis, &g_eapis_vcpu_global_state));
+    s_ts_calls++;
+    return false;
 }
 
-TEST_CASE("add handlers")
+static bool
+test_handler_am(
+    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    CHECK_NOTHROW(
-        handler.add_wrcr0_handler(
-            control_register_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
-
-    CHECK_NOTHROW(
-        handler.add_rdcr3_handler(
-            control_register_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
-
-    CHECK_NOTHROW(
-        handler.add_wrcr3_handler(
-            control_register_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
+    bfignored(vcpu);
+    bfignored(info);
 
-    CHECK_NOTHROW(
-        handler.add_wrcr4_handler(
-            control_register_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
+    s_am_calls++;
+    return false;
 }
 
-TEST_CASE("enable exiting")
+static std::unique_ptr<vcpu>
+make_cr_vcpu(vcpu_global_state_t *state = nullptr)
 {
-    setup_eapis_test_support();
+    s_calls = 0;
+    s_ts_calls = 0;
+    s_am_calls = 0;
 
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    CHECK_NOTHROW(
-        handler.enable_wrcr0_exiting(0xFFFFFFFFFFFFFFFF)
-    );
-
-    CHECK_NOTHROW(
-        handler.enable_wrcr4_exiting(0xFFFFFFFFFFFFFFFF)
-    );
+    g_vmcs_fields[vmcs_n::guest_cr0::addr] = 0;
+    g_vmcs_fields[vmcs_n::guest_cr3::addr] = 0;
+    g_vmcs_fields[vmcs_n::guest_cr4::addr] = 0;
+    g_msrs[::intel_x64::msrs::ia32_vmx_misc::addr] = 4ULL << 16;
 
-    CHECK_NOTHROW(handler.enable_rdcr3_exiting());
-    CHECK_NOTHROW(handler.enable_wrcr3_exiting());
+    return make_vcpu<vcpu>(0, state);
 }
 
-TEST_CASE("wrcr0 log")
+static bool
+exit_on(control_register_handler &handler, vcpu *vcpu, uint64_t qual)
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000000ULL
-    );
-
-    handler.add_wrcr0_handler(
-        control_register_handler::handler_delegate_t::create<test_handler>()
-    );
-
-    handler.enable_log();
-
-    CHECK(handler.handle(vmcs) == true);
-    CHECK_NOTHROW(handler.dump_log());
+    g_vmcs_fields[vmcs_n::exit_qualification::addr] = qual;
+    return handler.handle(vcpu);
 }
 
-TEST_CASE("wrcr0 exit")
+TEST_CASE("control register: wrcr0")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    g_save_state.rax = 42;
-    vmcs_n::guest_cr0::set(0);
-    vmcs_n::cr0_read_shadow::set(0);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000000ULL
-    );
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
     handler.add_wrcr0_handler(
-        control_register_handler::handler_delegate_t::create<test_handler>()
+        0xFFFFFFFFFFFFFFFF, handler_delegate_t::create<test_handler>()
     );
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(vmcs_n::guest_cr0::get() == 42);
-    CHECK(vmcs_n::cr0_read_shadow::get() == 42);
+    vcpu->set_rax(0x8);
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr0));
+    CHECK(s_calls == 1);
+
+    CHECK(vmcs_n::guest_cr0::get() == (0x8 | vcpu->global_state()->ia32_vmx_cr0_fixed0));
+    CHECK(vcpu->vmcs_read(vmcs_n::cr0_read_shadow::addr) == 0x8);
 }
 
-TEST_CASE("wrcr0 exit, ignore write")
+TEST_CASE("control register: wrcr0 ignore write")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    g_save_state.rax = 42;
-    vmcs_n::guest_cr0::set(0);
-    vmcs_n::cr0_read_shadow::set(0);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000000ULL
-    );
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
     handler.add_wrcr0_handler(
-        control_register_handler::handler_delegate_t::create<test_handler_ignore_write>()
+        0xFFFFFFFFFFFFFFFF, handler_delegate_t::create<test_handler_ignore_write>()
     );
 
-    CHECK(handler.handle(vmcs) == true);
+    vcpu->set_rax(0x8);
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr0));
     CHECK(vmcs_n::guest_cr0::get() == 0);
-    CHECK(vmcs_n::cr0_read_shadow::get() == 0);
 }
 
-TEST_CASE("wrcr0 exit, ignore advance")
+TEST_CASE("control register: wrcr0 ignore advance")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    g_save_state.rip = 0;
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000000ULL
-    );
-
-    ::intel_x64::vm::write(
-        vmcs_n::vm_exit_instruction_length::addr, 42
-    );
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
     handler.add_wrcr0_handler(
-        control_register_handler::handler_delegate_t::create<test_handler_ignore_advance>()
+        0xFFFFFFFFFFFFFFFF, handler_delegate_t::create<test_handler_ignore_advance>()
     );
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rip == 0);
-}
+    g_vmcs_fields[vmcs_n::vm_exit_instruction_length::addr] = 3;
 
-TEST_CASE("cr0 mov_from_cr not supported")
-{
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000010ULL
-    );
-
-    CHECK_THROWS(handler.handle(vmcs));
+    vcpu->set_rip(0x1000);
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr0));
+    CHECK(vcpu->rip() == 0x1000);
 }
 
-TEST_CASE("cr0 clts not supported")
+TEST_CASE("control register: rdcr3")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000020ULL
+    handler.add_rdcr3_handler(
+        handler_delegate_t::create<test_handler>()
     );
 
-    CHECK_THROWS(handler.handle(vmcs));
-}
-
-TEST_CASE("cr0 lmsw not supported")
-{
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000030ULL
-    );
+    vmcs_n::guest_cr3::set(0x1000);
 
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK(exit_on(handler, vcpu.get(), qual_rdcr3));
+    CHECK(s_calls == 1);
+    CHECK(vcpu->rax() == 0x1000);
 }
 
-TEST_CASE("wrcr3 log")
+TEST_CASE("control register: wrcr3")
 {
     MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    mocks.NeverCallFunc(::intel_x64::vmx::invvpid_single_context);
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000003ULL
-    );
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
     handler.add_wrcr3_handler(
-        control_register_handler::handler_delegate_t::create<test_handler>()
+        handler_delegate_t::create<test_handler>()
     );
 
-    handler.enable_log();
+    vcpu->disable_vpid();
+    vcpu->set_rax(0x1000);
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK_NOTHROW(handler.dump_log());
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr3));
+    CHECK(s_calls == 1);
+    CHECK(vmcs_n::guest_cr3::get() == 0x1000);
 }
 
-TEST_CASE("wrcr3 exit")
+TEST_CASE("control register: wrcr3 flushes this vcpu's vpid")
 {
     MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    g_save_state.rax = 42;
-    vmcs_n::guest_cr3::set(0);
+    mocks.ExpectCallFunc(::intel_x64::vmx::invvpid_single_context);
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000003ULL
-    );
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    handler.add_wrcr3_handler(
-        control_register_handler::handler_delegate_t::create<test_handler>()
-    );
+    vcpu->enable_vpid();
+    vcpu->set_rax(0x1000);
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(vmcs_n::guest_cr3::get() == 42);
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr3));
+    CHECK(vmcs_n::guest_cr3::get() == 0x1000);
 }
 
-TEST_CASE("wrcr3 exit, ignore write")
+TEST_CASE("control register: wrcr3 with pcid no-flush bit")
 {
     MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    mocks.NeverCallFunc(::intel_x64::vmx::invvpid_single_context);
 
-    g_save_state.rax = 42;
-    vmcs_n::guest_cr3::set(0);
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000003ULL
-    );
-
-    handler.add_wrcr3_handler(
-        control_register_handler::handler_delegate_t::create<test_handler_ignore_write>()
-    );
+    vcpu->enable_vpid();
+    vmcs_n::guest_cr4::set(vmcs_n::guest_cr4::pcid_enable_bit::mask);
+    vcpu->set_rax(0x1000 | (1ULL << 63));
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(vmcs_n::guest_cr3::get() == 0);
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr3));
+    CHECK(vmcs_n::guest_cr3::get() == 0x1000);
 }
 
-TEST_CASE("wrcr3 exit, ignore advance")
+TEST_CASE("control register: no-flush bit is ignored without pcid")
 {
     MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    mocks.ExpectCallFunc(::intel_x64::vmx::invvpid_single_context);
 
-    g_save_state.rip = 0;
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000003ULL
-    );
-
-    ::intel_x64::vm::write(
-        vmcs_n::vm_exit_instruction_length::addr, 42
-    );
-
-    handler.add_wrcr3_handler(
-        control_register_handler::handler_delegate_t::create<test_handler_ignore_advance>()
-    );
+    vcpu->enable_vpid();
+    vcpu->set_rax(0x1000 | (1ULL << 63));
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rip == 0);
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr3));
+    CHECK(vmcs_n::guest_cr3::get() == 0x1000);
 }
 
-TEST_CASE("rdcr3 log")
+TEST_CASE("control register: wrcr4")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000013ULL
-    );
-
-    handler.add_rdcr3_handler(
-        control_register_handler::handler_delegate_t::create<test_handler>()
+    handler.add_wrcr4_handler(
+        0xFFFFFFFFFFFFFFFF, handler_delegate_t::create<test_handler>()
     );
 
-    handler.enable_log();
+    vcpu->set_rax(0x20);
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr4));
+    CHECK(s_calls == 1);
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK_NOTHROW(handler.dump_log());
+    CHECK(vmcs_n::guest_cr4::get() == (0x20 | vcpu->global_state()->ia32_vmx_cr4_fixed0));
+    CHECK(vcpu->vmcs_read(vmcs_n::cr4_read_shadow::addr) == 0x20);
 }
 
-TEST_CASE("rdcr3 exit")
+TEST_CASE("control register: unsupported accesses")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    g_save_state.rax = 0;
-    vmcs_n::guest_cr3::set(42);
+    CHECK_THROWS(exit_on(handler, vcpu.get(), qual_wrcr1));
+}
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000013ULL
-    );
+TEST_CASE("control register: unsupported cr0 accesses")
+{
+    auto vcpu1 = make_cr_vcpu();
+    control_register_handler handler1{vcpu1.get()};
+    CHECK_THROWS(exit_on(handler1, vcpu1.get(), qual_rdcr0));
 
-    handler.add_rdcr3_handler(
-        control_register_handler::handler_delegate_t::create<test_handler>()
-    );
+    auto vcpu2 = make_cr_vcpu();
+    control_register_handler handler2{vcpu2.get()};
+    CHECK_THROWS(exit_on(handler2, vcpu2.get(), qual_clts));
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rax == 42);
+    auto vcpu3 = make_cr_vcpu();
+    control_register_handler handler3{vcpu3.get()};
+    CHECK_THROWS(exit_on(handler3, vcpu3.get(), qual_lmsw));
 }
 
-TEST_CASE("rdcr3 exit, ignore write")
+TEST_CASE("control register: unsupported cr4 accesses")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    g_save_state.rax = 0;
-    vmcs_n::guest_cr3::set(42);
+    CHECK_THROWS(exit_on(handler, vcpu.get(), qual_rdcr4));
+}
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000013ULL
-    );
+TEST_CASE("control register: wrcr0 mask follows handlers")
+{
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    handler.add_rdcr3_handler(
-        control_register_handler::handler_delegate_t::create<test_handler_ignore_write>()
-    );
+    auto d = handler_delegate_t::create<test_handler>();
+    auto base = vcpu->vmcs_read(vmcs_n::cr0_guest_host_mask::addr);
+
+    handler.add_wrcr0_handler(0x8, d);
+    CHECK(vcpu->vmcs_read(vmcs_n::cr0_guest_host_mask::addr) == (base | 0x8));
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rax == 0);
+    handler.remove_wrcr0_handler(d);
+    CHECK(vcpu->vmcs_read(vmcs_n::cr0_guest_host_mask::addr) == base);
 }
 
-TEST_CASE("rdcr3 exit, ignore advance")
+TEST_CASE("control register: wrcr0 mask is the union of all owners")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    vcpu_global_state_t state;
+    auto vcpu = make_cr_vcpu(&state);
 
-    g_save_state.rip = 0;
+    state.ia32_vmx_cr0_fixed0 = ::intel_x64::cr0::numeric_error::mask;
+    control_register_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000013ULL
-    );
+    auto ts = handler_delegate_t::create<test_handler_ts>();
+    auto am = handler_delegate_t::create<test_handler_am>();
 
-    ::intel_x64::vm::write(
-        vmcs_n::vm_exit_instruction_length::addr, 42
-    );
+    handler.enable_wrcr0_exiting(::intel_x64::cr0::write_protect::mask);
+    handler.add_wrcr0_handler(::intel_x64::cr0::task_switched::mask, ts);
+    handler.add_wrcr0_handler(::intel_x64::cr0::alignment_mask::mask, am);
 
-    handler.add_rdcr3_handler(
-        control_register_handler::handler_delegate_t::create<test_handler_ignore_advance>()
-    );
+    auto mask = vcpu->vmcs_read(vmcs_n::cr0_guest_host_mask::addr);
+    CHECK((mask & ::intel_x64::cr0::numeric_error::mask) != 0);
+    CHECK((mask & ::intel_x64::cr0::write_protect::mask) != 0);
+    CHECK((mask & ::intel_x64::cr0::task_switched::mask) != 0);
+    CHECK((mask & ::intel_x64::cr0::alignment_mask::mask) != 0);
+    CHECK((mask & ::intel_x64::cr0::paging::mask) != 0);
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rip == 0);
-}
+    handler.remove_wrcr0_handler(ts);
 
-TEST_CASE("cr3 clts not supported")
-{
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    mask = vcpu->vmcs_read(vmcs_n::cr0_guest_host_mask::addr);
+    CHECK((mask & ::intel_x64::cr0::task_switched::mask) == 0);
+    CHECK((mask & ::intel_x64::cr0::alignment_mask::mask) != 0);
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000023ULL
-    );
+    handler.enable_wrcr0_exiting(0);
 
-    CHECK_THROWS(handler.handle(vmcs));
+    mask = vcpu->vmcs_read(vmcs_n::cr0_guest_host_mask::addr);
+    CHECK((mask & ::intel_x64::cr0::write_protect::mask) == 0);
+    CHECK((mask & ::intel_x64::cr0::numeric_error::mask) != 0);
 }
 
-TEST_CASE("cr3 lmsw not supported")
+TEST_CASE("control register: wrcr0 keeps fixed0 bits out of the shadow")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    vcpu_global_state_t state;
+    auto vcpu = make_cr_vcpu(&state);
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000033ULL
-    );
+    state.ia32_vmx_cr0_fixed0 = ::intel_x64::cr0::numeric_error::mask;
+    control_register_handler handler{vcpu.get()};
 
-    CHECK_THROWS(handler.handle(vmcs));
+    vcpu->vmcs_write(vmcs_n::cr0_read_shadow::addr, 0);
+    vcpu->set_rax(0);
+
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr0));
+    CHECK(vmcs_n::guest_cr0::get() == ::intel_x64::cr0::numeric_error::mask);
+    CHECK(vcpu->vmcs_read(vmcs_n::cr0_read_shadow::addr) == 0);
 }
 
-TEST_CASE("wrcr4 log")
+TEST_CASE("control register: wrcr0 only calls handlers whose bits changed")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000004ULL
+    handler.add_wrcr0_handler(
+        ::intel_x64::cr0::task_switched::mask, handler_delegate_t::create<test_handler_ts>()
     );
-
-    handler.add_wrcr4_handler(
-        control_register_handler::handler_delegate_t::create<test_handler>()
+    handler.add_wrcr0_handler(
+        ::intel_x64::cr0::alignment_mask::mask, handler_delegate_t::create<test_handler_am>()
     );
 
-    handler.enable_log();
+    vcpu->vmcs_write(vmcs_n::cr0_read_shadow::addr, 0);
+    vcpu->set_rax(::intel_x64::cr0::alignment_mask::mask);
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK_NOTHROW(handler.dump_log());
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr0));
+    CHECK(s_ts_calls == 0);
+    CHECK(s_am_calls == 1);
 }
 
-TEST_CASE("wrcr4 exit")
+TEST_CASE("control register: wrcr0 that changes no owned bit calls no handler")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    g_save_state.rax = 42;
-    vmcs_n::guest_cr4::set(0);
-    vmcs_n::cr4_read_shadow::set(0);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000004ULL
+    handler.add_wrcr0_handler(
+        ::intel_x64::cr0::task_switched::mask, handler_delegate_t::create<test_handler_ts>()
     );
 
-    handler.add_wrcr4_handler(
-        control_register_handler::handler_delegate_t::create<test_handler>()
+    vcpu->vmcs_write(
+        vmcs_n::cr0_read_shadow::addr, ::intel_x64::cr0::task_switched::mask
     );
+    vcpu->set_rax(::intel_x64::cr0::task_switched::mask);
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(vmcs_n::guest_cr4::get() == 42);
-    CHECK(vmcs_n::cr4_read_shadow::get() == 42);
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr0));
+    CHECK(s_ts_calls == 0);
 }
 
-TEST_CASE("wrcr4 exit, ignore write")
+TEST_CASE("control register: wrcr4 mask and changed bits")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    vcpu_global_state_t state;
+    auto vcpu = make_cr_vcpu(&state);
 
-    g_save_state.rax = 42;
-    vmcs_n::guest_cr4::set(0);
-    vmcs_n::cr4_read_shadow::set(0);
+    state.ia32_vmx_cr4_fixed0 = ::intel_x64::cr4::vmx_enable_bit::mask;
+    control_register_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000004ULL
-    );
+    auto pge = handler_delegate_t::create<test_handler_ts>();
+    auto pae = handler_delegate_t::create<test_handler_am>();
 
-    handler.add_wrcr4_handler(
-        control_register_handler::handler_delegate_t::create<test_handler_ignore_write>()
-    );
+    handler.add_wrcr4_handler(::intel_x64::cr4::page_global_enable::mask, pge);
+    handler.add_wrcr4_handler(::intel_x64::cr4::physical_address_extensions::mask, pae);
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(vmcs_n::guest_cr4::get() == 0);
-    CHECK(vmcs_n::cr4_read_shadow::get() == 0);
-}
+    auto mask = vcpu->vmcs_read(vmcs_n::cr4_guest_host_mask::addr);
+    CHECK((mask & ::intel_x64::cr4::vmx_enable_bit::mask) != 0);
+    CHECK((mask & ::intel_x64::cr4::page_global_enable::mask) != 0);
+    CHECK((mask & ::intel_x64::cr4::physical_address_extensions::mask) != 0);
 
-TEST_CASE("wrcr4 exit, ignore advance")
-{
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    vcpu->vmcs_write(vmcs_n::cr4_read_shadow::addr, 0);
+    vcpu->set_rax(::intel_x64::cr4::page_global_enable::mask);
 
-    g_save_state.rip = 0;
+    CHECK(exit_on(handler, vcpu.get(), qual_wrcr4));
+    CHECK(s_ts_calls == 1);
+    CHECK(s_am_calls == 0);
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000004ULL
+    CHECK(
+        vmcs_n::guest_cr4::get() == (
+            ::intel_x64::cr4::page_global_enable::mask |
+            ::intel_x64::cr4::vmx_enable_bit::mask
+        )
     );
-
-    ::intel_x64::vm::write(
-        vmcs_n::vm_exit_instruction_length::addr, 42
+    CHECK(
+        vcpu->vmcs_read(vmcs_n::cr4_read_shadow::addr) ==
+        ::intel_x64::cr4::page_global_enable::mask
     );
 
-    handler.add_wrcr4_handler(
-        control_register_handler::handler_delegate_t::create<test_handler_ignore_advance>()
-    );
+    handler.remove_wrcr4_handler(pae);
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rip == 0);
+    mask = vcpu->vmcs_read(vmcs_n::cr4_guest_host_mask::addr);
+    CHECK((mask & ::intel_x64::cr4::physical_address_extensions::mask) == 0);
 }
 
-TEST_CASE("cr4 mov_from_cr not supported")
+TEST_CASE("control register: cr3 targets")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000014ULL
-    );
-
-    CHECK_THROWS(handler.handle(vmcs));
-}
-
-TEST_CASE("cr4 clts not supported")
-{
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000024ULL
-    );
-
-    CHECK_THROWS(handler.handle(vmcs));
+    using namespace vmcs_n;
+
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
+
+    CHECK(handler.cr3_targets() == 0);
+
+    handler.add_cr3_target(0x1000);
+    handler.add_cr3_target(0x1000);
+    CHECK(handler.cr3_targets() == 1);
+    CHECK(cr3_target_count::get() == 1);
+    CHECK(cr3_target_value0::get() == 0x1000);
+
+    handler.add_cr3_target(0x2000);
+    handler.add_cr3_target(0x3000);
+    handler.add_cr3_target(0x4000);
+    CHECK(cr3_target_count::get() == 4);
+    CHECK(cr3_target_value3::get() == 0x4000);
+    CHECK_THROWS(handler.add_cr3_target(0x5000));
+
+    handler.remove_cr3_target(0x2000);
+    CHECK(cr3_target_count::get() == 3);
+    CHECK(cr3_target_value0::get() == 0x1000);
+    CHECK(cr3_target_value1::get() == 0x3000);
+    CHECK(cr3_target_value2::get() == 0x4000);
+    CHECK(cr3_target_value3::get() == 0);
+
+    handler.remove_cr3_target(0x5000);
+    CHECK(cr3_target_count::get() == 3);
+
+    handler.clear_cr3_targets();
+    CHECK(handler.cr3_targets() == 0);
+    CHECK(cr3_target_count::get() == 0);
+    CHECK(cr3_target_value0::get() == 0);
 }
 
-TEST_CASE("cr4 lmsw not supported")
+TEST_CASE("control register: cr3 targets are bounded by ia32_vmx_misc")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cr_vcpu();
+    control_register_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x0000000000000034ULL
-    );
+    g_msrs[::intel_x64::msrs::ia32_vmx_misc::addr] = 2ULL << 16;
 
-    CHECK_THROWS(handler.handle(vmcs));
-}
+    handler.add_cr3_target(0x1000);
+    handler.add_cr3_target(0x2000);
+    CHECK_THROWS(handler.add_cr3_target(0x3000));
+    CHECK(vmcs_n::cr3_target_count::get() == 2);
 
-TEST_CASE("invalid cr")
-{
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = control_register_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr,
-        0x000000000000000AULL
-    );
+    g_msrs[::intel_x64::msrs::ia32_vmx_misc::addr] = 0;
 
-    CHECK_THROWS(handler.handle(vmcs));
+    handler.clear_cr3_targets();
+    CHECK_THROWS(handler.add_cr3_target(0x1000));
 }
 
 #endif
@@ -19,19 +19,26 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
 #include <test/support.h>
-#include <hve/arch/intel_x64/vmexit/cpuid.h>
+#include <hve/arch/intel_x64/vcpu.h>
 
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
-bool
+using namespace eapis::intel_x64;
+
+using handler_delegate_t = cpuid_handler::handler_delegate_t;
+
+static uint64_t s_default_calls = 0;
+
+static bool
 test_handler(
-    gsl::not_null<vmcs_t *> vmcs, cpuid_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
 {
-    bfignored(vmcs);
+    bfignored(vcpu);
 
     info.rax = 42;
     info.rbx = 42;
@@ -41,169 +48,190 @@ test_handler(
     return true;
 }
 
-bool
+static bool
 test_handler_returns_false(
-    gsl::not_null<vmcs_t *> vmcs, cpuid_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
 {
-    bfignored(vmcs);
+    bfignored(vcpu);
     bfignored(info);
 
     return false;
 }
 
-bool
+static bool
 test_handler_ignore_write(
-    gsl::not_null<vmcs_t *> vmcs, cpuid_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
 {
-    bfignored(vmcs);
+    bfignored(vcpu);
 
+    info.rax = 42;
     info.ignore_write = true;
     return true;
 }
 
-bool
+static bool
 test_handler_ignore_advance(
-    gsl::not_null<vmcs_t *> vmcs, cpuid_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
 {
-    bfignored(vmcs);
+    bfignored(vcpu);
 
     info.ignore_advance = true;
     return true;
 }
 
-TEST_CASE("constructor/destruction")
+static bool
+test_handler_emulated(
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
 {
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
+    bfignored(vcpu);
+
+    CHECK(info.rax == 0);
+    CHECK(info.rbx == 0);
+    CHECK(info.rcx == 0);
+    CHECK(info.rdx == 0);
 
-    CHECK_NOTHROW(cpuid_handler(eapis, &g_eapis_vcpu_global_state));
+    return true;
 }
 
-TEST_CASE("add handlers")
+static bool
+test_default_handler(gsl::not_null<vcpu_t *> vcpu)
 {
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    bfignored(vcpu);
 
-    CHECK_NOTHROW(
-        handler.add_handler(
-            42, cpuid_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
+    s_default_calls++;
+    return true;
 }
 
-TEST_CASE("cpuid log")
+static std::unique_ptr<vcpu>
+make_cpuid_vcpu(uint64_t leaf)
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    s_default_calls = 0;
+    g_vmcs_fields[vmcs_n::vm_exit_instruction_length::addr] = 2;
+
+    auto vcpu = make_vcpu();
+
+    vcpu->set_rip(0x1000);
+    vcpu->set_rax(leaf);
+    vcpu->set_rbx(0);
+    vcpu->set_rcx(0);
+    vcpu->set_rdx(0);
 
-    g_save_state.rax = 42;
+    return vcpu;
+}
 
-    handler.add_handler(
-        42, cpuid_handler::handler_delegate_t::create<test_handler>()
-    );
+TEST_CASE("cpuid: exit")
+{
+    auto vcpu = make_cpuid_vcpu(42);
+    cpuid_handler handler{vcpu.get()};
 
-    handler.enable_log();
+    handler.add_handler(42, handler_delegate_t::create<test_handler>());
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK_NOTHROW(handler.dump_log());
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(vcpu->rax() == 42);
+    CHECK(vcpu->rbx() == 42);
+    CHECK(vcpu->rcx() == 42);
+    CHECK(vcpu->rdx() == 42);
+    CHECK(vcpu->rip() == 0x1002);
 }
 
-TEST_CASE("cpuid exit")
+TEST_CASE("cpuid: only the low 32 bits are written")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cpuid_vcpu(42);
+    cpuid_handler handler{vcpu.get()};
+
+    handler.add_handler(42, handler_delegate_t::create<test_handler>());
+    vcpu->set_rbx(0xFFFFFFFF00000000);
 
-    g_save_state.rax = 42;
-    g_save_state.rbx = 0;
-    g_save_state.rcx = 0;
-    g_save_state.rdx = 0;
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(vcpu->rbx() == 0xFFFFFFFF0000002A);
+}
+
+TEST_CASE("cpuid: ignore write")
+{
+    auto vcpu = make_cpuid_vcpu(42);
+    cpuid_handler handler{vcpu.get()};
 
-    handler.add_handler(
-        42, cpuid_handler::handler_delegate_t::create<test_handler>()
-    );
+    handler.add_handler(42, handler_delegate_t::create<test_handler_ignore_write>());
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rax == 42);
-    CHECK(g_save_state.rbx == 42);
-    CHECK(g_save_state.rcx == 42);
-    CHECK(g_save_state.rdx == 42);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(vcpu->rax() == 42);
+    CHECK(vcpu->rbx() == 0);
+    CHECK(vcpu->rcx() == 0);
+    CHECK(vcpu->rdx() == 0);
 }
 
-TEST_CASE("cpuid exit, ignore write")
+TEST_CASE("cpuid: ignore advance")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cpuid_vcpu(42);
+    cpuid_handler handler{vcpu.get()};
+
+    handler.add_handler(42, handler_delegate_t::create<test_handler_ignore_advance>());
 
-    g_save_state.rax = 42;
-    g_save_state.rbx = 0;
-    g_save_state.rcx = 0;
-    g_save_state.rdx = 0;
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(vcpu->rip() == 0x1000);
+}
+
+TEST_CASE("cpuid: emulated leaves start from zero")
+{
+    auto vcpu = make_cpuid_vcpu(42);
+    cpuid_handler handler{vcpu.get()};
 
-    handler.add_handler(
-        42, cpuid_handler::handler_delegate_t::create<test_handler_ignore_write>()
-    );
+    handler.emulate(42);
+    handler.add_handler(42, handler_delegate_t::create<test_handler_emulated>());
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rax == 42);
-    CHECK(g_save_state.rbx == 0);
-    CHECK(g_save_state.rcx == 0);
-    CHECK(g_save_state.rdx == 0);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(vcpu->rax() == 0);
 }
 
-TEST_CASE("cpuid exit, ignore advance")
+TEST_CASE("cpuid: handlers run newest first")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cpuid_vcpu(42);
+    cpuid_handler handler{vcpu.get()};
 
-    g_save_state.rip = 0;
-    g_save_state.rax = 42;
+    handler.add_handler(42, handler_delegate_t::create<test_handler>());
+    handler.add_handler(42, handler_delegate_t::create<test_handler_ignore_write>());
 
-    ::intel_x64::vm::write(
-        vmcs_n::vm_exit_instruction_length::addr, 42
-    );
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(vcpu->rbx() == 0);
+}
 
-    handler.add_handler(
-        42, cpuid_handler::handler_delegate_t::create<test_handler_ignore_advance>()
-    );
+TEST_CASE("cpuid: vmx is hidden from the guest")
+{
+    auto vcpu = make_cpuid_vcpu(::intel_x64::cpuid::feature_information::addr);
+    cpuid_handler handler{vcpu.get()};
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rip == 0);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK((vcpu->rcx() & ::intel_x64::cpuid::feature_information::ecx::vmx::mask) == 0);
 }
 
-TEST_CASE("cpuid exit, no handler")
+TEST_CASE("cpuid: no handler")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cpuid_vcpu(42);
+    cpuid_handler handler{vcpu.get()};
 
-    g_save_state.rax = 0;
-    CHECK(handler.handle(vmcs) == false);
+    CHECK_FALSE(handler.handle(vcpu.get()));
 }
 
-TEST_CASE("cpuid exit, returns false")
+TEST_CASE("cpuid: returns false")
 {
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = cpuid_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_cpuid_vcpu(42);
+    cpuid_handler handler{vcpu.get()};
+
+    handler.add_handler(42, handler_delegate_t::create<test_handler_returns_false>());
 
-    g_save_state.rax = 42;
+    CHECK_FALSE(handler.handle(vcpu.get()));
+}
+
+TEST_CASE("cpuid: default handler")
+{
+    auto vcpu = make_cpuid_vcpu(42);
+    cpuid_handler handler{vcpu.get()};
 
-    handler.add_handler(
-        42, cpuid_handler::handler_delegate_t::create<test_handler_returns_false>()
-    );
+    handler.add_handler(42, handler_delegate_t::create<test_handler_returns_false>());
+    handler.set_default_handler(::handler_delegate_t::create<test_default_handler>());
 
-    CHECK(handler.handle(vmcs) == false);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(s_default_calls == 1);
 }
 
 #endif
@@ -19,153 +19,114 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
 #include <test/support.h>
-#include <hve/arch/intel_x64/vmexit/ept_misconfiguration.h>
+#include <hve/arch/intel_x64/vcpu.h>
 
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
-bool
+using namespace eapis::intel_x64;
+
+using handler_delegate_t = ept_misconfiguration_handler::handler_delegate_t;
+
+static bool
 test_handler(
-    gsl::not_null<vmcs_t *> vmcs, ept_misconfiguration_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, ept_misconfiguration_handler::info_t &info)
 {
-    bfignored(info);
-    bfignored(vmcs);
+    bfignored(vcpu);
+
+    CHECK(info.gva == 0x1000);
+    CHECK(info.gpa == 0x2000);
 
     return true;
 }
 
-bool
+static bool
 test_handler_returns_false(
-    gsl::not_null<vmcs_t *> vmcs, ept_misconfiguration_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, ept_misconfiguration_handler::info_t &info)
 {
+    bfignored(vcpu);
     bfignored(info);
-    bfignored(vmcs);
 
     return false;
 }
 
-bool
+static bool
 test_handler_ignore_advance(
-    gsl::not_null<vmcs_t *> vmcs, ept_misconfiguration_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, ept_misconfiguration_handler::info_t &info)
 {
-    bfignored(vmcs);
+    bfignored(vcpu);
 
     info.ignore_advance = true;
     return true;
 }
 
-TEST_CASE("constructor/destruction")
-{
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-
-    CHECK_NOTHROW(ept_misconfiguration_handler(eapis, &g_eapis_vcpu_global_state));
-}
-
-TEST_CASE("add handlers")
+static std::unique_ptr<vcpu>
+make_misconfiguration_vcpu()
 {
-    setup_eapis_test_support();
+    g_vmcs_fields[vmcs_n::guest_linear_address::addr] = 0x1000;
+    g_vmcs_fields[vmcs_n::guest_physical_address::addr] = 0x2000;
+    g_vmcs_fields[vmcs_n::vm_exit_instruction_length::addr] = 3;
 
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_misconfiguration_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_vcpu();
+    vcpu->set_rip(0x1000);
 
-    CHECK_NOTHROW(
-        handler.add_handler(
-            ept_misconfiguration_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
+    return vcpu;
 }
 
-TEST_CASE("ept misconfiguration log")
+TEST_CASE("ept misconfiguration: exit")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_misconfiguration_handler(eapis, &g_eapis_vcpu_global_state);
-
-    handler.add_handler(
-        ept_misconfiguration_handler::handler_delegate_t::create<test_handler>()
-    );
+    auto vcpu = make_misconfiguration_vcpu();
+    ept_misconfiguration_handler handler{vcpu.get()};
 
-    handler.enable_log();
+    handler.add_handler(handler_delegate_t::create<test_handler>());
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK_NOTHROW(handler.dump_log());
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(vcpu->rip() == 0x1003);
 }
 
-TEST_CASE("ept misconfiguration exit")
+TEST_CASE("ept misconfiguration: ignore advance")
 {
-    setup_eapis_test_support();
+    auto vcpu = make_misconfiguration_vcpu();
+    ept_misconfiguration_handler handler{vcpu.get()};
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_misconfiguration_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.add_handler(handler_delegate_t::create<test_handler_ignore_advance>());
 
-    handler.add_handler(
-        ept_misconfiguration_handler::handler_delegate_t::create<test_handler>()
-    );
-
-    CHECK(handler.handle(vmcs) == true);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(vcpu->rip() == 0x1000);
 }
 
-TEST_CASE("ept misconfiguration exit, ignore advance")
+TEST_CASE("ept misconfiguration: falls through to an older handler")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_misconfiguration_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_misconfiguration_vcpu();
+    ept_misconfiguration_handler handler{vcpu.get()};
 
-    g_save_state.rip = 0;
+    handler.add_handler(handler_delegate_t::create<test_handler>());
+    handler.add_handler(handler_delegate_t::create<test_handler_returns_false>());
 
-    ::intel_x64::vm::write(
-        vmcs_n::vm_exit_instruction_length::addr, 42
-    );
-
-    handler.add_handler(
-        ept_misconfiguration_handler::handler_delegate_t::create<test_handler_ignore_advance>()
-    );
-
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rip == 0);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(vcpu->rip() == 0x1003);
 }
 
-TEST_CASE("ept misconfiguration exit, no handler")
+TEST_CASE("ept misconfiguration: no handler")
 {
-    setup_eapis_test_support();
+    auto vcpu = make_misconfiguration_vcpu();
+    ept_misconfiguration_handler handler{vcpu.get()};
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_misconfiguration_handler(eapis, &g_eapis_vcpu_global_state);
-
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK_THROWS(handler.handle(vcpu.get()));
 }
 
-TEST_CASE("ept misconfiguration exit, returns false")
+TEST_CASE("ept misconfiguration: returns false")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_misconfiguration_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_misconfiguration_vcpu();
+    ept_misconfiguration_handler handler{vcpu.get()};
 
-    handler.add_handler(
-        ept_misconfiguration_handler::handler_delegate_t::create<test_handler_returns_false>()
-    );
+    handler.add_handler(handler_delegate_t::create<test_handler_returns_false>());
 
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK_THROWS(handler.handle(vcpu.get()));
 }
 
 #endif
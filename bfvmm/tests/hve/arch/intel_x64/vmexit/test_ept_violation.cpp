@@ -19,368 +19,208 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
 #include <test/support.h>
-#include <hve/arch/intel_x64/vmexit/ept_violation.h>
+#include <hve/arch/intel_x64/vcpu.h>
 
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
-bool
+using namespace eapis::intel_x64;
+
+using handler_delegate_t = ept_violation_handler::handler_delegate_t;
+
+constexpr uint64_t qual_read = 0x1;
+constexpr uint64_t qual_write = 0x2;
+constexpr uint64_t qual_execute = 0x4;
+
+static uint64_t s_calls = 0;
+static uint64_t s_default_calls = 0;
+
+static bool
 test_handler(
-    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
 {
-    bfignored(info);
-    bfignored(vmcs);
+    bfignored(vcpu);
 
+    CHECK(info.gva == 0x1000);
+    CHECK(info.gpa == 0x2000);
+
+    s_calls++;
     return true;
 }
 
-bool
+static bool
 test_handler_returns_false(
-    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
 {
+    bfignored(vcpu);
     bfignored(info);
-    bfignored(vmcs);
 
     return false;
 }
 
-bool
+static bool
 test_handler_ignore_advance(
-    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
 {
-    bfignored(vmcs);
+    bfignored(vcpu);
 
     info.ignore_advance = true;
     return true;
 }
 
-TEST_CASE("constructor/destruction")
-{
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-
-    CHECK_NOTHROW(ept_violation_handler(eapis, &g_eapis_vcpu_global_state));
-}
-
-TEST_CASE("add handlers")
+static bool
+test_default_handler(gsl::not_null<vcpu_t *> vcpu)
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
-
-    CHECK_NOTHROW(
-        handler.add_read_handler(
-            ept_violation_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
-
-    CHECK_NOTHROW(
-        handler.add_write_handler(
-            ept_violation_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
-
-    CHECK_NOTHROW(
-        handler.add_execute_handler(
-            ept_violation_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
-}
-
-TEST_CASE("ept violation log")
-{
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 1
-    );
-
-    handler.add_read_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler>()
-    );
-
-    handler.enable_log();
-
-    CHECK(handler.handle(vmcs) == true);
-    CHECK_NOTHROW(handler.dump_log());
-}
-
-TEST_CASE("ept read violation exit")
-{
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 1
-    );
-
-    handler.add_read_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler>()
-    );
-
-    CHECK(handler.handle(vmcs) == true);
-}
-
-TEST_CASE("ept read violation exit, ignore advance")
-{
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    bfignored(vcpu);
 
-    g_save_state.rip = 0;
-
-    ::intel_x64::vm::write(
-        vmcs_n::vm_exit_instruction_length::addr, 42
-    );
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 1
-    );
-
-    handler.add_read_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler_ignore_advance>()
-    );
-
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rip == 0);
+    s_default_calls++;
+    return true;
 }
 
-TEST_CASE("ept read violation exit, no handler")
+static std::unique_ptr<vcpu>
+make_violation_vcpu()
 {
-    setup_eapis_test_support();
+    s_calls = 0;
+    s_default_calls = 0;
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    g_vmcs_fields[vmcs_n::guest_linear_address::addr] = 0x1000;
+    g_vmcs_fields[vmcs_n::guest_physical_address::addr] = 0x2000;
+    g_vmcs_fields[vmcs_n::vm_exit_instruction_length::addr] = 3;
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 1
-    );
+    auto vcpu = make_vcpu();
+    vcpu->set_rip(0x1000);
 
-    CHECK_THROWS(handler.handle(vmcs));
+    return vcpu;
 }
 
-TEST_CASE("ept read violation exit, returns false")
+static bool
+exit_on(ept_violation_handler &handler, vcpu *vcpu, uint64_t qual)
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 1
-    );
-
-    handler.add_read_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler_returns_false>()
-    );
-
-    CHECK_THROWS(handler.handle(vmcs));
+    g_vmcs_fields[vmcs_n::exit_qualification::addr] = qual;
+    return handler.handle(vcpu);
 }
 
-TEST_CASE("ept write violation exit")
+TEST_CASE("ept violation: read")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_violation_vcpu();
+    ept_violation_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 2
-    );
+    handler.add_read_handler(handler_delegate_t::create<test_handler>());
+    handler.add_write_handler(handler_delegate_t::create<test_handler_returns_false>());
+    handler.add_execute_handler(handler_delegate_t::create<test_handler_returns_false>());
 
-    handler.add_write_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler>()
-    );
-
-    CHECK(handler.handle(vmcs) == true);
+    CHECK(exit_on(handler, vcpu.get(), qual_read));
+    CHECK(s_calls == 1);
+    CHECK(vcpu->rip() == 0x1003);
 }
 
-TEST_CASE("ept write violation exit, ignore advance")
+TEST_CASE("ept violation: write")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
-
-    g_save_state.rip = 0;
-
-    ::intel_x64::vm::write(
-        vmcs_n::vm_exit_instruction_length::addr, 42
-    );
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 2
-    );
+    auto vcpu = make_violation_vcpu();
+    ept_violation_handler handler{vcpu.get()};
 
-    handler.add_write_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler_ignore_advance>()
-    );
+    handler.add_read_handler(handler_delegate_t::create<test_handler_returns_false>());
+    handler.add_write_handler(handler_delegate_t::create<test_handler>());
+    handler.add_execute_handler(handler_delegate_t::create<test_handler_returns_false>());
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rip == 0);
+    CHECK(exit_on(handler, vcpu.get(), qual_write));
+    CHECK(s_calls == 1);
+    CHECK(vcpu->rip() == 0x1003);
 }
 
-TEST_CASE("ept write violation exit, no handler")
+TEST_CASE("ept violation: execute")
 {
-    setup_eapis_test_support();
+    auto vcpu = make_violation_vcpu();
+    ept_violation_handler handler{vcpu.get()};
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.add_read_handler(handler_delegate_t::create<test_handler_returns_false>());
+    handler.add_write_handler(handler_delegate_t::create<test_handler_returns_false>());
+    handler.add_execute_handler(handler_delegate_t::create<test_handler>());
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 2
-    );
-
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK(exit_on(handler, vcpu.get(), qual_execute));
+    CHECK(s_calls == 1);
+    CHECK(vcpu->rip() == 0x1003);
 }
 
-TEST_CASE("ept write violation exit, returns false")
+TEST_CASE("ept violation: read takes precedence over write")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_violation_vcpu();
+    ept_violation_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 2
-    );
+    handler.add_read_handler(handler_delegate_t::create<test_handler>());
 
-    handler.add_write_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler_returns_false>()
-    );
-
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK(exit_on(handler, vcpu.get(), qual_read | qual_write));
+    CHECK(s_calls == 1);
 }
 
-TEST_CASE("ept execute violation exit")
+TEST_CASE("ept violation: ignore advance")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_violation_vcpu();
+    ept_violation_handler handler{vcpu.get()};
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 4
-    );
+    handler.add_write_handler(handler_delegate_t::create<test_handler_ignore_advance>());
 
-    handler.add_execute_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler>()
-    );
-
-    CHECK(handler.handle(vmcs) == true);
+    CHECK(exit_on(handler, vcpu.get(), qual_write));
+    CHECK(vcpu->rip() == 0x1000);
 }
 
-TEST_CASE("ept execute violation exit, ignore advance")
+TEST_CASE("ept violation: default handlers")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
-
-    g_save_state.rip = 0;
-
-    ::intel_x64::vm::write(
-        vmcs_n::vm_exit_instruction_length::addr, 42
-    );
+    auto vcpu1 = make_violation_vcpu();
+    ept_violation_handler handler1{vcpu1.get()};
+    handler1.add_read_handler(handler_delegate_t::create<test_handler_returns_false>());
+    handler1.set_default_read_handler(::handler_delegate_t::create<test_default_handler>());
+    CHECK(exit_on(handler1, vcpu1.get(), qual_read));
+    CHECK(s_default_calls == 1);
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 4
-    );
+    auto vcpu2 = make_violation_vcpu();
+    ept_violation_handler handler2{vcpu2.get()};
+    handler2.set_default_write_handler(::handler_delegate_t::create<test_default_handler>());
+    CHECK(exit_on(handler2, vcpu2.get(), qual_write));
+    CHECK(s_default_calls == 1);
 
-    handler.add_execute_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler_ignore_advance>()
-    );
-
-    CHECK(handler.handle(vmcs) == true);
-    CHECK(g_save_state.rip == 0);
+    auto vcpu3 = make_violation_vcpu();
+    ept_violation_handler handler3{vcpu3.get()};
+    handler3.set_default_execute_handler(::handler_delegate_t::create<test_default_handler>());
+    CHECK(exit_on(handler3, vcpu3.get(), qual_execute));
+    CHECK(s_default_calls == 1);
 }
 
-TEST_CASE("ept execute violation exit, no handler")
+TEST_CASE("ept violation: no handler")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu1 = make_violation_vcpu();
+    ept_violation_handler handler1{vcpu1.get()};
+    CHECK_THROWS(exit_on(handler1, vcpu1.get(), qual_read));
 
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 4
-    );
+    auto vcpu2 = make_violation_vcpu();
+    ept_violation_handler handler2{vcpu2.get()};
+    CHECK_THROWS(exit_on(handler2, vcpu2.get(), qual_write));
 
-    CHECK_THROWS(handler.handle(vmcs));
+    auto vcpu3 = make_violation_vcpu();
+    ept_violation_handler handler3{vcpu3.get()};
+    CHECK_THROWS(exit_on(handler3, vcpu3.get(), qual_execute));
 }
 
-TEST_CASE("ept execute violation exit, returns false")
+TEST_CASE("ept violation: returns false")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 4
-    );
+    auto vcpu = make_violation_vcpu();
+    ept_violation_handler handler{vcpu.get()};
 
-    handler.add_execute_handler(
-        ept_violation_handler::handler_delegate_t::create<test_handler_returns_false>()
-    );
+    handler.add_read_handler(handler_delegate_t::create<test_handler_returns_false>());
 
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK_THROWS(exit_on(handler, vcpu.get(), qual_read));
 }
 
-TEST_CASE("ept violation exit, invalid qualification")
+TEST_CASE("ept violation: unknown access")
 {
-    setup_eapis_test_support();
+    auto vcpu = make_violation_vcpu();
+    ept_violation_handler handler{vcpu.get()};
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
-
-    ::intel_x64::vm::write(
-        vmcs_n::exit_qualification::addr, 0xF00
-    );
-
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK_THROWS(exit_on(handler, vcpu.get(), 0));
 }
 
-
 #endif
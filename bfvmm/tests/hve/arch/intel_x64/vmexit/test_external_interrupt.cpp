@@ -19,67 +19,103 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
+#include <vector>
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
 #include <test/support.h>
-#include <hve/arch/intel_x64/vmexit/external_interrupt.h>
+#include <hve/arch/intel_x64/vcpu.h>
 
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
-bool
-test_handler(
-    gsl::not_null<vmcs_t *> vmcs, external_interrupt_handler::info_t &info)
+using namespace eapis::intel_x64;
+
+using route_t = external_interrupt_handler::route_t;
+
+class interrupt_vcpu : public vcpu
 {
+public:
+
+    using vcpu::vcpu;
+
+    void queue_external_interrupt(uint64_t vector) override
+    { queued.push_back(vector); }
+
+    std::vector<uint64_t> queued;
+};
+
+static uint64_t s_vector_calls = 0;
+static uint64_t s_fallback_calls = 0;
+
+static bool
+test_vector_handler(
+    gsl::not_null<vcpu_t *> vcpu, external_interrupt_handler::info_t &info)
+{
+    bfignored(vcpu);
     bfignored(info);
-    bfignored(vmcs);
 
+    s_vector_calls++;
     return true;
 }
 
-bool
-test_handler_returns_false(
-    gsl::not_null<vmcs_t *> vmcs, external_interrupt_handler::info_t &info)
+static bool
+test_vector_handler_returns_false(
+    gsl::not_null<vcpu_t *> vcpu, external_interrupt_handler::info_t &info)
 {
+    bfignored(vcpu);
     bfignored(info);
-    bfignored(vmcs);
 
+    s_vector_calls++;
     return false;
 }
 
-TEST_CASE("constructor/destruction")
+static bool
+test_fallback(
+    gsl::not_null<vcpu_t *> vcpu, external_interrupt_handler::info_t &info)
 {
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
+    bfignored(vcpu);
+    bfignored(info);
 
-    CHECK_NOTHROW(external_interrupt_handler(eapis, &g_eapis_vcpu_global_state));
+    s_fallback_calls++;
+    return true;
 }
 
-TEST_CASE("add handlers")
+static bool
+test_fallback_returns_false(
+    gsl::not_null<vcpu_t *> vcpu, external_interrupt_handler::info_t &info)
 {
-    setup_eapis_test_support();
+    bfignored(vcpu);
+    bfignored(info);
 
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = external_interrupt_handler(eapis, &g_eapis_vcpu_global_state);
+    s_fallback_calls++;
+    return false;
+}
 
-    CHECK_NOTHROW(
-        handler.add_handler(
-            external_interrupt_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
+static std::unique_ptr<interrupt_vcpu>
+make_interrupt_vcpu()
+{
+    s_vector_calls = 0;
+    s_fallback_calls = 0;
+
+    return make_vcpu<interrupt_vcpu>();
 }
 
-TEST_CASE("enable/disable")
+static bool
+exit_on(external_interrupt_handler &handler, interrupt_vcpu *vcpu, uint64_t vector)
 {
-    setup_eapis_test_support();
+    g_vmcs_fields[vmcs_n::vm_exit_interruption_information::addr] = vector;
+    return handler.handle(vcpu);
+}
 
+TEST_CASE("external interrupt: enable / disable exiting")
+{
     using namespace vmcs_n::vm_exit_controls;
     using namespace vmcs_n::pin_based_vm_execution_controls;
 
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = external_interrupt_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_interrupt_vcpu();
+    external_interrupt_handler handler{vcpu.get()};
 
     handler.enable_exiting();
     CHECK(external_interrupt_exiting::is_enabled());
@@ -90,67 +126,98 @@ TEST_CASE("enable/disable")
     CHECK(acknowledge_interrupt_on_exit::is_disabled());
 }
 
-TEST_CASE("external interrupt log")
+TEST_CASE("external interrupt: vectors are reflected by default")
 {
-    setup_eapis_test_support();
+    auto vcpu = make_interrupt_vcpu();
+    external_interrupt_handler handler{vcpu.get()};
+
+    CHECK(handler.route(0x30) == route_t::reflect);
+    CHECK(exit_on(handler, vcpu.get(), 0x30));
+    CHECK(vcpu->queued == std::vector<uint64_t>{0x30});
+    CHECK(handler.count(0x30) == 1);
+}
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = external_interrupt_handler(eapis, &g_eapis_vcpu_global_state);
+TEST_CASE("external interrupt: per vector handler")
+{
+    auto vcpu = make_interrupt_vcpu();
+    external_interrupt_handler handler{vcpu.get()};
 
     handler.add_handler(
-        external_interrupt_handler::handler_delegate_t::create<test_handler>()
+        0x30, external_interrupt_handler::handler_delegate_t::create<test_vector_handler>()
     );
 
-    handler.enable_log();
+    CHECK(handler.route(0x30) == route_t::handle);
+    CHECK(handler.route(0x31) == route_t::reflect);
 
-    CHECK(handler.handle(vmcs) == true);
-    CHECK_NOTHROW(handler.dump_log());
+    CHECK(exit_on(handler, vcpu.get(), 0x30));
+    CHECK(s_vector_calls == 1);
+    CHECK(vcpu->queued.empty());
+
+    CHECK(exit_on(handler, vcpu.get(), 0x31));
+    CHECK(s_vector_calls == 1);
+    CHECK(vcpu->queued == std::vector<uint64_t>{0x31});
 }
 
-TEST_CASE("external interrupt exit")
+TEST_CASE("external interrupt: fallback keeps per vector routes")
 {
-    setup_eapis_test_support();
+    auto vcpu = make_interrupt_vcpu();
+    external_interrupt_handler handler{vcpu.get()};
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = external_interrupt_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.add_handler(
+        0x30, external_interrupt_handler::handler_delegate_t::create<test_vector_handler_returns_false>()
+    );
+    handler.set_route(0x31, route_t::drop);
 
     handler.add_handler(
-        external_interrupt_handler::handler_delegate_t::create<test_handler>()
+        external_interrupt_handler::handler_delegate_t::create<test_fallback>()
     );
 
-    CHECK(handler.handle(vmcs) == true);
+    CHECK(handler.route(0x30) == route_t::handle);
+    CHECK(handler.route(0x31) == route_t::drop);
+    CHECK(handler.route(0x32) == route_t::handle);
+
+    CHECK(exit_on(handler, vcpu.get(), 0x30));
+    CHECK(s_vector_calls == 1);
+    CHECK(s_fallback_calls == 1);
+
+    CHECK(exit_on(handler, vcpu.get(), 0x31));
+    CHECK(s_fallback_calls == 1);
+
+    CHECK(exit_on(handler, vcpu.get(), 0x32));
+    CHECK(s_fallback_calls == 2);
+
+    CHECK(vcpu->queued.empty());
 }
 
-TEST_CASE("external interrupt exit, no handler")
+TEST_CASE("external interrupt: drop")
 {
-    setup_eapis_test_support();
+    auto vcpu = make_interrupt_vcpu();
+    external_interrupt_handler handler{vcpu.get()};
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = external_interrupt_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.set_route(0x30, route_t::drop);
 
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK(exit_on(handler, vcpu.get(), 0x30));
+    CHECK(vcpu->queued.empty());
+    CHECK(handler.count(0x30) == 1);
 }
 
-TEST_CASE("external interrupt exit, returns false")
+TEST_CASE("external interrupt: unhandled vectors follow the policy")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = external_interrupt_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_interrupt_vcpu();
+    external_interrupt_handler handler{vcpu.get()};
 
     handler.add_handler(
-        external_interrupt_handler::handler_delegate_t::create<test_handler_returns_false>()
+        external_interrupt_handler::handler_delegate_t::create<test_fallback_returns_false>()
     );
 
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK(exit_on(handler, vcpu.get(), 0x30));
+    CHECK(vcpu->queued == std::vector<uint64_t>{0x30});
+
+    handler.set_unhandled_policy(route_t::drop);
+
+    CHECK(exit_on(handler, vcpu.get(), 0x31));
+    CHECK(s_fallback_calls == 2);
+    CHECK(vcpu->queued == std::vector<uint64_t>{0x30});
 }
 
 #endif
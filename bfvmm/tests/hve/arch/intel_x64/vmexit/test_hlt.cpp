@@ -0,0 +1,197 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+#if EAPIS_HVE_HLT
+
+using namespace eapis::intel_x64;
+
+constexpr const uint64_t ia32_apic_base = 0x1B;
+constexpr const uint64_t x2apic_irr_msr = 0x820;
+
+class hlt_vcpu : public vcpu
+{
+public:
+
+    using vcpu::vcpu;
+
+    bool has_pending_interrupts() const override
+    { return pending; }
+
+    bool pending{false};
+};
+
+static vcpu_global_state_t *
+test_state(uint64_t freq_hz)
+{
+    static vcpu_global_state_t s_state;
+
+    s_state.clock = time::clock{freq_hz, 0};
+    return &s_state;
+}
+
+static bool
+is_halted()
+{
+    return g_vmcs_fields[vmcs_n::guest_activity_state::addr] ==
+           vmcs_n::guest_activity_state::hlt;
+}
+
+static std::unique_ptr<hlt_vcpu>
+make_hlt_vcpu(uint64_t freq_hz = 1000000000ULL)
+{
+    g_msrs[ia32_apic_base] = 0;
+    g_vmcs_fields[vmcs_n::guest_activity_state::addr] = vmcs_n::guest_activity_state::active;
+
+    return make_vcpu<hlt_vcpu>(0, test_state(freq_hz));
+}
+
+TEST_CASE("hlt: mwait and monitor run natively by default")
+{
+    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+
+    auto vcpu = make_hlt_vcpu();
+    hlt_handler handler{vcpu.get()};
+
+    auto is_set = [&](auto mask) {
+        return (vcpu->vmcs_read(addr) & mask) != 0;
+    };
+
+    handler.enable_exiting();
+    CHECK(is_set(hlt_exiting::mask));
+    CHECK(!is_set(mwait_exiting::mask));
+    CHECK(!is_set(monitor_exiting::mask));
+
+    handler.enable_mwait_exiting();
+    CHECK(is_set(mwait_exiting::mask));
+    CHECK(is_set(monitor_exiting::mask));
+
+    handler.disable_exiting();
+    CHECK(!is_set(hlt_exiting::mask));
+    CHECK(!is_set(mwait_exiting::mask));
+}
+
+TEST_CASE("hlt: a pending interrupt wakes the vcpu without sleeping")
+{
+    auto vcpu = make_hlt_vcpu();
+    hlt_handler handler{vcpu.get()};
+
+    vcpu->pending = true;
+
+    CHECK(handler.handle_hlt(vcpu.get()));
+    CHECK(!is_halted());
+    CHECK(handler.stats().sleeps == 0);
+}
+
+TEST_CASE("hlt: the physical irr wakes the vcpu")
+{
+    auto vcpu = make_hlt_vcpu();
+    hlt_handler handler{vcpu.get()};
+
+    g_msrs[ia32_apic_base] = 1ULL << 10U;
+    g_msrs[x2apic_irr_msr + 3] = 0x10;
+
+    CHECK(handler.handle_hlt(vcpu.get()));
+    CHECK(!is_halted());
+    CHECK(handler.stats().sleeps == 0);
+
+    g_msrs[x2apic_irr_msr + 3] = 0;
+
+    CHECK(handler.handle_hlt(vcpu.get()));
+    CHECK(is_halted());
+    CHECK(handler.stats().sleeps == 1);
+}
+
+TEST_CASE("hlt: an idle vcpu sleeps until it is woken")
+{
+    auto vcpu = make_hlt_vcpu();
+    hlt_handler handler{vcpu.get()};
+
+    CHECK(handler.handle_hlt(vcpu.get()));
+    CHECK(is_halted());
+    CHECK(handler.stats().sleeps == 1);
+
+    CHECK(handler.handle_exit(vcpu.get()));
+    CHECK(handler.stats().poll_grows == 0);
+
+    vcpu->pending = true;
+
+    CHECK(handler.handle_exit(vcpu.get()));
+    CHECK(handler.stats().poll_grows == 1);
+    CHECK(handler.poll_window() == 10000);
+
+    CHECK(handler.handle_exit(vcpu.get()));
+    CHECK(handler.stats().poll_grows == 1);
+}
+
+TEST_CASE("hlt: a long sleep shrinks the poll window")
+{
+    auto vcpu = make_hlt_vcpu();
+    hlt_handler handler{vcpu.get()};
+
+    CHECK(handler.handle_hlt(vcpu.get()));
+    vcpu->pending = true;
+    CHECK(handler.handle_exit(vcpu.get()));
+    CHECK(handler.poll_window() == 10000);
+
+    //
+    // At 1 KHz every TSC tick is a millisecond, so any sleep is longer
+    // than the maximum window
+    //
+
+    vcpu->pending = false;
+    test_state(1000);
+
+    g_vmcs_fields[vmcs_n::guest_activity_state::addr] = vmcs_n::guest_activity_state::active;
+    CHECK(handler.handle_hlt(vcpu.get()));
+    CHECK(is_halted());
+
+    vcpu->pending = true;
+    CHECK(handler.handle_exit(vcpu.get()));
+    CHECK(handler.stats().poll_shrinks == 1);
+    CHECK(handler.poll_window() == 0);
+}
+
+TEST_CASE("hlt: mwait polls but never sleeps")
+{
+    auto vcpu = make_hlt_vcpu();
+    hlt_handler handler{vcpu.get()};
+
+    handler.enable_mwait_exiting();
+
+    CHECK(handler.handle_mwait(vcpu.get()));
+    CHECK(!is_halted());
+    CHECK(handler.stats().mwait_exits == 1);
+    CHECK(handler.stats().sleeps == 0);
+
+    CHECK(handler.handle_monitor(vcpu.get()));
+    CHECK(handler.stats().monitor_exits == 1);
+}
+
+#endif
+#endif
@@ -19,195 +19,103 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
 #include <test/support.h>
-#include <hve/arch/intel_x64/vmexit/interrupt_window.h>
+#include <hve/arch/intel_x64/vcpu.h>
 
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
-bool
-test_handler(
-    gsl::not_null<vmcs_t *> vmcs, interrupt_window_handler::info_t &info)
-{
-    bfignored(vmcs);
-    bfignored(info);
-
-    return true;
-}
-
-bool
-test_handler_returns_false(
-    gsl::not_null<vmcs_t *> vmcs, interrupt_window_handler::info_t &info)
-{
-    bfignored(vmcs);
-    bfignored(info);
-
-    return false;
-}
-
-bool
-test_handler_ignore_disable(
-    gsl::not_null<vmcs_t *> vmcs, interrupt_window_handler::info_t &info)
-{
-    bfignored(vmcs);
-    bfignored(info);
-
-    info.ignore_disable = true;
-    return true;
-}
-
-TEST_CASE("constructor/destruction")
-{
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-
-    CHECK_NOTHROW(interrupt_window_handler(eapis, &g_eapis_vcpu_global_state));
-}
-
-TEST_CASE("add handlers")
-{
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
-
-    CHECK_NOTHROW(
-        handler.add_handler(
-            interrupt_window_handler::handler_delegate_t::create<test_handler>()
-        )
-    );
+using namespace eapis::intel_x64;
 
-    handler.dump_log();
-}
+namespace info_n = vmcs_n::vm_entry_interruption_information;
 
-TEST_CASE("enable/disable")
+static bool
+window_exiting(vcpu *vcpu)
 {
-    setup_eapis_test_support();
     using namespace vmcs_n::primary_processor_based_vm_execution_controls;
-
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
-
-    handler.enable_exiting();
-    CHECK(interrupt_window_exiting::is_enabled());
-
-    handler.disable_exiting();
-    CHECK(interrupt_window_exiting::is_disabled());
+    return (vcpu->vmcs_read(addr) & interrupt_window_exiting::mask) != 0;
 }
 
-void
-reset_window()
+TEST_CASE("interrupt window: queue enables exiting")
 {
-    using namespace vmcs_n;
+    auto vcpu = make_vcpu();
+    interrupt_window_handler handler{vcpu.get()};
 
-    guest_rflags::interrupt_enable_flag::enable();
-    guest_interruptibility_state::blocking_by_sti::disable();
-    guest_interruptibility_state::blocking_by_mov_ss::disable();
+    CHECK_FALSE(handler.has_pending());
 
-    guest_activity_state::set(guest_activity_state::active);
+    handler.queue_external_interrupt(0x30);
+    CHECK(handler.has_pending());
+    CHECK(window_exiting(vcpu.get()));
 }
 
-TEST_CASE("is_open")
+TEST_CASE("interrupt window: exit injects and disables exiting")
 {
-    using namespace vmcs_n;
-
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
-
-    reset_window();
-    guest_rflags::interrupt_enable_flag::disable();
-    CHECK(handler.is_open() == false);
-
-    reset_window();
-    guest_interruptibility_state::blocking_by_sti::enable();
-    CHECK(handler.is_open() == false);
-
-    reset_window();
-    guest_interruptibility_state::blocking_by_mov_ss::enable();
-    CHECK(handler.is_open() == false);
+    auto vcpu = make_vcpu();
+    interrupt_window_handler handler{vcpu.get()};
 
-    reset_window();
-    guest_activity_state::set(guest_activity_state::shutdown);
-    CHECK(handler.is_open() == false);
+    g_vmcs_fields[info_n::addr] = 0;
 
-    reset_window();
-    CHECK(handler.is_open() == true);
-}
+    handler.queue_external_interrupt(0x30);
+    CHECK(handler.handle(vcpu.get()));
 
-TEST_CASE("inject")
-{
-    MockRepository mocks;
-    auto eapis = setup_eapis(mocks);
-    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+    auto info = info_n::get();
+    CHECK(info_n::vector::get(info) == 0x30);
+    CHECK(info_n::interruption_type::get(info) == info_n::interruption_type::external_interrupt);
+    CHECK(info_n::valid_bit::is_enabled(info));
 
-    CHECK_NOTHROW(handler.inject(0));
+    CHECK_FALSE(handler.has_pending());
+    CHECK_FALSE(window_exiting(vcpu.get()));
 }
 
-TEST_CASE("interrupt window exit")
+TEST_CASE("interrupt window: vectors are injected in order")
 {
-    setup_eapis_test_support();
+    auto vcpu = make_vcpu();
+    interrupt_window_handler handler{vcpu.get()};
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+    handler.queue_external_interrupt(0x30);
+    handler.queue_external_interrupt(0x31);
 
-    handler.add_handler(
-        interrupt_window_handler::handler_delegate_t::create<test_handler>()
-    );
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(info_n::vector::get() == 0x30);
+    CHECK(window_exiting(vcpu.get()));
 
-    CHECK(handler.handle(vmcs) == true);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(info_n::vector::get() == 0x31);
+    CHECK_FALSE(window_exiting(vcpu.get()));
 }
 
-TEST_CASE("interrupt window exit, no handler")
+TEST_CASE("interrupt window: exit with nothing queued")
 {
-    setup_eapis_test_support();
-
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_vcpu();
+    interrupt_window_handler handler{vcpu.get()};
 
-    CHECK_THROWS(handler.handle(vmcs));
+    CHECK_THROWS(handler.handle(vcpu.get()));
 }
 
-TEST_CASE("interrupt window exit, ignore disable")
+TEST_CASE("interrupt window: inject exception")
 {
-    setup_eapis_test_support();
+    g_vmcs_fields[vmcs_n::vm_entry_exception_error_code::addr] = 0;
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+    auto vcpu = make_vcpu();
+    interrupt_window_handler handler{vcpu.get()};
 
-    handler.add_handler(
-        interrupt_window_handler::handler_delegate_t::create<test_handler_ignore_disable>()
-    );
-
-    using namespace vmcs_n::primary_processor_based_vm_execution_controls;
-    handler.enable_exiting();
-
-    CHECK_NOTHROW(handler.handle(vmcs));
-    CHECK(interrupt_window_exiting::is_enabled());
-}
-
-TEST_CASE("interrupt window exit, returns false")
-{
-    setup_eapis_test_support();
+    handler.inject_exception(3, 42);
 
-    MockRepository mocks;
-    auto vmcs = setup_vmcs(mocks);
-    auto eapis = setup_eapis(mocks);
-    auto handler = interrupt_window_handler(eapis, &g_eapis_vcpu_global_state);
+    auto info = info_n::get();
+    CHECK(info_n::vector::get(info) == 3);
+    CHECK(info_n::interruption_type::get(info) == info_n::interruption_type::hardware_exception);
+    CHECK(info_n::deliver_error_code_bit::is_disabled(info));
+    CHECK(vmcs_n::vm_entry_exception_error_code::get() == 0);
 
-    handler.add_handler(
-        interrupt_window_handler::handler_delegate_t::create<test_handler_returns_false>()
-    );
+    handler.inject_exception(14, 42);
 
-    CHECK_THROWS(handler.handle(vmcs));
+    info = info_n::get();
+    CHECK(info_n::vector::get(info) == 14);
+    CHECK(info_n::deliver_error_code_bit::is_enabled(info));
+    CHECK(vmcs_n::vm_entry_exception_error_code::get() == 42);
 }
 
 #endif
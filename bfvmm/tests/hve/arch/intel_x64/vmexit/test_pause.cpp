@@ -0,0 +1,188 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+#if EAPIS_HVE_PAUSE
+
+using namespace eapis::intel_x64;
+
+// Each vcpu already owns a pause handler (and with it, a lock-holder
+// slot), so the tests drive that one instead of adding a second
+//
+namespace eapis::intel_x64
+{
+struct vcpu_test {
+    static pause_handler &pause(vcpu &vcpu)
+    { return vcpu.m_pause_handler; }
+};
+}
+
+static pause_handler::info_t s_info{};
+static uint64_t s_yields = 0;
+static bool s_handled = true;
+
+static bool
+test_yield(gsl::not_null<vcpu_t *> vcpu, pause_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    s_info = info;
+    s_yields++;
+
+    return s_handled;
+}
+
+static vcpu_global_state_t *
+test_state(uint64_t freq_hz)
+{
+    static vcpu_global_state_t s_state;
+
+    s_state.clock = time::clock{freq_hz, 0};
+    s_state.ple_last_boosted = 0;
+
+    s_info = {};
+    s_yields = 0;
+    s_handled = true;
+
+    return &s_state;
+}
+
+// A long interval, so that a slow test run does not break a streak
+//
+constexpr const uint64_t test_interval_ns = 1000000000ULL;
+
+static void
+add_yield(pause_handler &handler)
+{
+    handler.set_streak_threshold(2, test_interval_ns);
+    handler.add_yield_delegate(
+        pause_handler::yield_delegate_t::create<test_yield>()
+    );
+}
+
+TEST_CASE("pause: back to back exits yield")
+{
+    auto vcpu = make_vcpu(0, test_state(1000000000ULL));
+    auto &handler = vcpu_test::pause(*vcpu);
+    add_yield(handler);
+
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(s_yields == 0);
+
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(s_yields == 1);
+    CHECK(s_info.streak == 2);
+    CHECK(handler.stats().yields == 1);
+
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(s_yields == 1);
+}
+
+TEST_CASE("pause: an uncalibrated clock still detects streaks")
+{
+    auto vcpu = make_vcpu(0, test_state(0));
+    auto &handler = vcpu_test::pause(*vcpu);
+    add_yield(handler);
+
+    handler.set_streak_threshold(2, 50000);
+
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(s_yields == 1);
+    CHECK(handler.stats().suspected_lhp == 1);
+}
+
+TEST_CASE("pause: the candidate is a vcpu that is not spinning")
+{
+    auto state = test_state(1000000000ULL);
+
+    auto vcpu0 = make_vcpu(0, state);
+    auto vcpu1 = make_vcpu(1, state);
+
+    auto &handler0 = vcpu_test::pause(*vcpu0);
+    auto &handler1 = vcpu_test::pause(*vcpu1);
+
+    add_yield(handler0);
+    add_yield(handler1);
+
+    CHECK(handler0.handle(vcpu0.get()));
+    CHECK(handler0.handle(vcpu0.get()));
+    CHECK(s_yields == 1);
+    CHECK(s_info.candidate == 1);
+
+    s_handled = false;
+
+    CHECK(handler1.handle(vcpu1.get()));
+    CHECK(handler1.handle(vcpu1.get()));
+    CHECK(s_yields == 2);
+    CHECK(s_info.candidate == 0);
+
+    CHECK(handler0.handle(vcpu0.get()));
+    CHECK(handler0.handle(vcpu0.get()));
+    CHECK(s_yields == 3);
+    CHECK(s_info.candidate == pause_handler::no_candidate);
+}
+
+TEST_CASE("pause: a lone vcpu has no candidate")
+{
+    auto vcpu = make_vcpu(0, test_state(1000000000ULL));
+    auto &handler = vcpu_test::pause(*vcpu);
+    add_yield(handler);
+
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(s_info.candidate == pause_handler::no_candidate);
+}
+
+TEST_CASE("pause: vcpus 64 apart do not share a slot")
+{
+    auto state = test_state(1000000000ULL);
+
+    auto vcpu0 = make_vcpu(0, state);
+    auto vcpu64 = make_vcpu(64, state);
+
+    auto &handler0 = vcpu_test::pause(*vcpu0);
+    add_yield(handler0);
+
+    CHECK(handler0.handle(vcpu0.get()));
+    CHECK(handler0.handle(vcpu0.get()));
+    CHECK(s_info.candidate == 64);
+
+    vcpu64.reset();
+
+    auto vcpu1 = make_vcpu(1, state);
+    auto &handler1 = vcpu_test::pause(*vcpu1);
+    add_yield(handler1);
+
+    CHECK(handler1.handle(vcpu1.get()));
+    CHECK(handler1.handle(vcpu1.get()));
+    CHECK(s_info.candidate == 0);
+}
+
+#endif
+#endif
@@ -0,0 +1,209 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+
+// A 1 GHz TSC with a PET that ticks with the TSC, so that nanoseconds,
+// TSC ticks and PET ticks are all the same unit
+//
+constexpr const uint64_t test_freq_hz = 1000000000ULL;
+constexpr const uint64_t one_ms = 1000000ULL;
+constexpr const uint64_t max_pet = 0xFFFFFFFFULL;
+
+static uint64_t s_raw_calls = 0;
+
+static bool
+test_raw_handler(gsl::not_null<vcpu_t *> vcpu)
+{
+    bfignored(vcpu);
+
+    s_raw_calls++;
+    return true;
+}
+
+static void
+test_timer(gsl::not_null<vcpu_t *> vcpu)
+{ bfignored(vcpu); }
+
+static vcpu_global_state_t *
+test_state()
+{
+    static vcpu_global_state_t s_state;
+
+    s_state.clock = time::clock{test_freq_hz, 0};
+    return &s_state;
+}
+
+static uint64_t
+timer_value()
+{ return g_vmcs_fields[vmcs_n::preemption_timer_value::addr]; }
+
+TEST_CASE("preemption timer: a shorter raw timer is not overwritten")
+{
+    auto vcpu = make_vcpu(0, test_state());
+    preemption_timer_handler timer{vcpu.get()};
+
+    timer.add_timer(
+        timer.now_ns() + 1000 * one_ms,
+        preemption_timer_handler::timer_delegate_t::create<test_timer>()
+    );
+
+    timer.set_timer(100);
+    timer.program();
+
+    CHECK(timer_value() <= 100);
+}
+
+TEST_CASE("preemption timer: a shorter soft timer wins")
+{
+    auto vcpu = make_vcpu(0, test_state());
+    preemption_timer_handler timer{vcpu.get()};
+
+    timer.set_timer(max_pet);
+    const auto id = timer.add_timer(
+        timer.now_ns() + one_ms,
+        preemption_timer_handler::timer_delegate_t::create<test_timer>()
+    );
+
+    timer.program();
+    CHECK(timer_value() <= one_ms);
+    CHECK(timer.get_timer() > one_ms);
+
+    timer.cancel(id);
+    timer.program();
+
+    CHECK(timer_value() > one_ms);
+    CHECK(timer_value() <= max_pet);
+}
+
+TEST_CASE("preemption timer: raw handlers wait for the raw deadline")
+{
+    auto vcpu = make_vcpu(0, test_state());
+    preemption_timer_handler timer{vcpu.get()};
+
+    s_raw_calls = 0;
+    timer.add_handler(
+        preemption_timer_handler::handler_delegate_t::create<test_raw_handler>()
+    );
+
+    timer.set_timer(max_pet);
+    timer.add_timer(
+        timer.now_ns(),
+        preemption_timer_handler::timer_delegate_t::create<test_timer>()
+    );
+
+    timer.program();
+    CHECK(timer.handle(vcpu.get()));
+    CHECK(s_raw_calls == 0);
+
+    timer.set_timer(0);
+    timer.add_timer(
+        timer.now_ns() + 1000 * one_ms,
+        preemption_timer_handler::timer_delegate_t::create<test_timer>()
+    );
+
+    timer.program();
+    CHECK(timer_value() == 0);
+    CHECK(timer.handle(vcpu.get()));
+    CHECK(s_raw_calls == 1);
+}
+
+TEST_CASE("preemption timer: raw timer without soft timers")
+{
+    auto vcpu = make_vcpu(0, test_state());
+    preemption_timer_handler timer{vcpu.get()};
+
+    s_raw_calls = 0;
+    timer.add_handler(
+        preemption_timer_handler::handler_delegate_t::create<test_raw_handler>()
+    );
+
+    timer.set_timer(42);
+    timer.program();
+
+    CHECK(timer_value() == 42);
+    CHECK(timer.get_timer() == 42);
+    CHECK(timer.handle(vcpu.get()));
+    CHECK(s_raw_calls == 1);
+}
+
+TEST_CASE("preemption timer: exiting is turned off after the last soft timer")
+{
+    using namespace vmcs_n::pin_based_vm_execution_controls;
+
+    auto vcpu = make_vcpu(0, test_state());
+    preemption_timer_handler timer{vcpu.get()};
+
+    activate_preemption_timer::disable();
+    timer.add_handler(
+        preemption_timer_handler::handler_delegate_t::create<test_raw_handler>()
+    );
+
+    timer.add_timer(
+        timer.now_ns(),
+        preemption_timer_handler::timer_delegate_t::create<test_timer>()
+    );
+
+    timer.program();
+    CHECK(activate_preemption_timer::is_enabled());
+
+    CHECK(timer.handle(vcpu.get()));
+    timer.program();
+    CHECK(activate_preemption_timer::is_disabled());
+}
+
+TEST_CASE("preemption timer: exiting that was already on is parked")
+{
+    using namespace vmcs_n::pin_based_vm_execution_controls;
+
+    auto vcpu = make_vcpu(0, test_state());
+    preemption_timer_handler timer{vcpu.get()};
+
+    s_raw_calls = 0;
+    timer.add_handler(
+        preemption_timer_handler::handler_delegate_t::create<test_raw_handler>()
+    );
+
+    timer.enable_exiting();
+    timer.add_timer(
+        timer.now_ns(),
+        preemption_timer_handler::timer_delegate_t::create<test_timer>()
+    );
+
+    g_vmcs_fields[vmcs_n::preemption_timer_value::addr] = 0;
+    CHECK(timer.handle(vcpu.get()));
+    timer.program();
+
+    CHECK(activate_preemption_timer::is_enabled());
+    CHECK(timer_value() == max_pet);
+    CHECK(s_raw_calls == 0);
+}
+
+#endif
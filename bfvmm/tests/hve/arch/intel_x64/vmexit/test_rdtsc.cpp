@@ -0,0 +1,215 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+#if EAPIS_HVE_RDTSC
+
+using namespace eapis::intel_x64;
+
+constexpr const uint64_t test_offset = 1000;
+
+TEST_CASE("rdtsc: rdtscp is enabled")
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    auto vcpu = make_vcpu();
+    rdtsc_handler handler{vcpu.get()};
+
+    CHECK((vcpu->vmcs_read(addr) & enable_rdtscp::mask) != 0);
+}
+
+TEST_CASE("rdtsc: tsc aux is loaded on vm entry")
+{
+    MockRepository mocks;
+    mocks.OnCallFunc(thread_context_cpuid).Return(1);
+
+    auto vcpu = make_vcpu();
+    rdtsc_handler handler{vcpu.get()};
+
+    g_msrs[rdtsc_handler::ia32_tsc_aux] = 0;
+    handler.set_tsc_aux(5);
+    handler.load();
+
+    CHECK(g_msrs[rdtsc_handler::ia32_tsc_aux] == 5);
+
+    wrmsr_handler::info_t info = {rdtsc_handler::ia32_tsc_aux, 0x100000006, false, false};
+    CHECK(handler.handle_wrmsr_tsc_aux(vcpu.get(), info));
+    CHECK(info.ignore_write);
+    CHECK(handler.tsc_aux() == 6);
+
+    handler.load();
+    CHECK(g_msrs[rdtsc_handler::ia32_tsc_aux] == 6);
+}
+
+TEST_CASE("rdtsc: tsc aux follows the vcpu across cores")
+{
+    MockRepository mocks;
+
+    auto vcpu = make_vcpu();
+    rdtsc_handler handler{vcpu.get()};
+
+    mocks.OnCallFunc(thread_context_cpuid).Return(2);
+    handler.set_tsc_aux(5);
+    handler.load();
+
+    mocks.OnCallFunc(thread_context_cpuid).Return(3);
+    g_msrs[rdtsc_handler::ia32_tsc_aux] = 0;
+    handler.load();
+
+    CHECK(g_msrs[rdtsc_handler::ia32_tsc_aux] == 5);
+}
+
+TEST_CASE("rdtsc: tsc aux is reloaded after another vcpu ran")
+{
+    MockRepository mocks;
+    mocks.OnCallFunc(thread_context_cpuid).Return(4);
+
+    auto vcpu = make_vcpu();
+    rdtsc_handler handler1{vcpu.get()};
+    rdtsc_handler handler2{vcpu.get()};
+
+    handler1.set_tsc_aux(5);
+    handler2.set_tsc_aux(6);
+
+    handler1.load();
+    handler2.load();
+    CHECK(g_msrs[rdtsc_handler::ia32_tsc_aux] == 6);
+
+    handler1.load();
+    CHECK(g_msrs[rdtsc_handler::ia32_tsc_aux] == 5);
+}
+
+TEST_CASE("rdtsc: tsc aux is restored for a vcpu without a shadow")
+{
+    MockRepository mocks;
+    mocks.OnCallFunc(thread_context_cpuid).Return(5);
+
+    auto vcpu = make_vcpu();
+    rdtsc_handler shadowed{vcpu.get()};
+    rdtsc_handler plain{vcpu.get()};
+
+    g_msrs[rdtsc_handler::ia32_tsc_aux] = 42;
+    plain.load();
+    CHECK(g_msrs[rdtsc_handler::ia32_tsc_aux] == 42);
+
+    shadowed.set_tsc_aux(5);
+    shadowed.load();
+    CHECK(g_msrs[rdtsc_handler::ia32_tsc_aux] == 5);
+
+    plain.load();
+    CHECK(g_msrs[rdtsc_handler::ia32_tsc_aux] == 42);
+
+    shadowed.load();
+    CHECK(g_msrs[rdtsc_handler::ia32_tsc_aux] == 5);
+}
+
+TEST_CASE("rdtsc: host tsc inverts guest tsc")
+{
+    auto vcpu = make_vcpu();
+    rdtsc_handler handler{vcpu.get()};
+
+    const auto multiplier = rdtsc_handler::multiplier_one * 3;
+
+    handler.set_offset(test_offset);
+    handler.set_multiplier(multiplier);
+
+    for (const auto guest : {test_offset + 1, test_offset + 10, test_offset + 3000}) {
+        const auto host = handler.host_tsc(guest);
+
+        CHECK(time::mul_shift(host, multiplier, rdtsc_handler::multiplier_shift) + test_offset >= guest);
+        CHECK(time::mul_shift(host - 1, multiplier, rdtsc_handler::multiplier_shift) + test_offset < guest);
+    }
+}
+
+TEST_CASE("rdtsc: host tsc handles a negative offset")
+{
+    auto vcpu = make_vcpu();
+    rdtsc_handler handler{vcpu.get()};
+
+    handler.set_offset(0 - test_offset);
+
+    CHECK(handler.host_tsc(0) == test_offset);
+    CHECK(handler.host_tsc(4000) == test_offset + 4000);
+
+    handler.set_multiplier(rdtsc_handler::multiplier_one * 2);
+    CHECK(handler.host_tsc(4000) == (test_offset + 4000) / 2);
+
+    wrmsr_handler::info_t winfo = {rdtsc_handler::ia32_tsc_deadline, 4000, false, false};
+    CHECK(handler.handle_wrmsr_tsc_deadline(vcpu.get(), winfo));
+    CHECK(winfo.val == (test_offset + 4000) / 2);
+}
+
+TEST_CASE("rdtsc: tsc deadline is converted to host ticks")
+{
+    auto vcpu = make_vcpu();
+    rdtsc_handler handler{vcpu.get()};
+
+    handler.set_offset(test_offset);
+
+    wrmsr_handler::info_t winfo = {rdtsc_handler::ia32_tsc_deadline, test_offset + 4000, false, false};
+    CHECK(handler.handle_wrmsr_tsc_deadline(vcpu.get(), winfo));
+    CHECK(!winfo.ignore_write);
+    CHECK(winfo.val == 4000);
+
+    rdmsr_handler::info_t rinfo = {rdtsc_handler::ia32_tsc_deadline, 0, false, false};
+
+    g_msrs[rdtsc_handler::ia32_tsc_deadline] = 4000;
+    CHECK(handler.handle_rdmsr_tsc_deadline(vcpu.get(), rinfo));
+    CHECK(rinfo.val == test_offset + 4000);
+
+    g_msrs[rdtsc_handler::ia32_tsc_deadline] = 0;
+    CHECK(handler.handle_rdmsr_tsc_deadline(vcpu.get(), rinfo));
+    CHECK(rinfo.val == 0);
+
+    winfo = {rdtsc_handler::ia32_tsc_deadline, test_offset - 10, false, false};
+    CHECK(handler.handle_wrmsr_tsc_deadline(vcpu.get(), winfo));
+    CHECK(winfo.val == 1);
+
+    winfo = {rdtsc_handler::ia32_tsc_deadline, 0, false, false};
+    CHECK(handler.handle_wrmsr_tsc_deadline(vcpu.get(), winfo));
+    CHECK(winfo.val == 0);
+}
+
+TEST_CASE("rdtsc: tsc deadline can be emulated elsewhere")
+{
+    auto vcpu = make_vcpu();
+    rdtsc_handler handler{vcpu.get()};
+
+    handler.set_offset(test_offset);
+    handler.set_tsc_deadline_emulated();
+
+    wrmsr_handler::info_t winfo = {rdtsc_handler::ia32_tsc_deadline, test_offset + 4000, false, false};
+    CHECK(!handler.handle_wrmsr_tsc_deadline(vcpu.get(), winfo));
+    CHECK(winfo.val == test_offset + 4000);
+
+    rdmsr_handler::info_t rinfo = {rdtsc_handler::ia32_tsc_deadline, 0, false, false};
+    CHECK(!handler.handle_rdmsr_tsc_deadline(vcpu.get(), rinfo));
+}
+
+#endif
+#endif
@@ -0,0 +1,223 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace eapis::intel_x64;
+
+constexpr const uint64_t test_guest_xcr0 = 0x7;
+constexpr const uint64_t test_host_xcr0 = 0xE7;
+
+struct xstate_op_t {
+    char op;
+    uint64_t val;
+    uint8_t *area;
+
+    bool operator==(const xstate_op_t &other) const
+    { return op == other.op && val == other.val; }
+};
+
+class test_xsetbv_handler : public xsetbv_handler
+{
+public:
+
+    test_xsetbv_handler(gsl::not_null<vcpu *> vcpu, uint64_t guest_xcr0) :
+        xsetbv_handler{vcpu}
+    {
+        vcpu->set_rax(guest_xcr0 & 0xFFFFFFFF);
+        vcpu->set_rdx(guest_xcr0 >> 32);
+
+        this->handle(vcpu);
+        ops.clear();
+    }
+
+    void xsave(uint8_t *area, uint64_t mask) noexcept override
+    { ops.push_back({'s', mask, area}); }
+
+    void xrstor(uint8_t *area, uint64_t mask) noexcept override
+    { ops.push_back({'r', mask, area}); }
+
+    void write_xcr0(uint64_t val) override
+    { ops.push_back({'x', val, nullptr}); }
+
+    std::vector<xstate_op_t> ops;
+};
+
+static vcpu_global_state_t *
+test_state(uint64_t host_xcr0)
+{
+    static vcpu_global_state_t s_state;
+
+    s_state.host_xcr0 = host_xcr0;
+    return &s_state;
+}
+
+TEST_CASE("xsetbv: guest write sets xcr0")
+{
+    auto vcpu = make_vcpu(0, test_state(test_host_xcr0));
+    test_xsetbv_handler handler{vcpu.get(), test_guest_xcr0};
+
+    vcpu->set_rax(0x3);
+    vcpu->set_rdx(0);
+
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(handler.guest_xcr0() == 0x3);
+    CHECK(handler.ops == std::vector<xstate_op_t>{{'x', 0x3, nullptr}});
+}
+
+TEST_CASE("xsetbv: nothing is touched unless state is used")
+{
+    auto vcpu = make_vcpu(0, test_state(test_host_xcr0));
+    test_xsetbv_handler handler{vcpu.get(), test_guest_xcr0};
+
+    handler.load_guest_xstate();
+    CHECK(handler.ops.empty());
+}
+
+TEST_CASE("xsetbv: host xcr0 comes from the global state")
+{
+    auto vcpu = make_vcpu(0, test_state(test_host_xcr0));
+    test_xsetbv_handler handler{vcpu.get(), test_guest_xcr0};
+
+    handler.save_guest_xstate(xsetbv_handler::xstate_avx512);
+    CHECK(handler.ops == std::vector<xstate_op_t>{{'x', test_host_xcr0, nullptr}});
+
+    handler.ops.clear();
+    handler.load_guest_xstate();
+    CHECK(handler.ops == std::vector<xstate_op_t>{{'x', test_guest_xcr0, nullptr}});
+}
+
+TEST_CASE("xsetbv: no switch when host and guest xcr0 match")
+{
+    auto vcpu = make_vcpu(0, test_state(test_host_xcr0));
+    test_xsetbv_handler handler{vcpu.get(), test_host_xcr0};
+
+    handler.save_guest_xstate(xsetbv_handler::xstate_avx512);
+    handler.load_guest_xstate();
+
+    CHECK(handler.ops == std::vector<xstate_op_t>{
+        {'s', xsetbv_handler::xstate_avx512, nullptr},
+        {'r', xsetbv_handler::xstate_avx512, nullptr}
+    });
+}
+
+TEST_CASE("xsetbv: state is saved once per exit")
+{
+    auto vcpu = make_vcpu(0, test_state(test_host_xcr0));
+    test_xsetbv_handler handler{vcpu.get(), test_host_xcr0};
+
+    handler.save_guest_xstate(0x20);
+    handler.save_guest_xstate(0x20);
+    handler.load_guest_xstate();
+    handler.load_guest_xstate();
+
+    CHECK(handler.ops == std::vector<xstate_op_t>{
+        {'s', 0x20, nullptr},
+        {'r', 0x20, nullptr}
+    });
+}
+
+TEST_CASE("xsetbv: widening a save restores and saves the union")
+{
+    auto vcpu = make_vcpu(0, test_state(test_host_xcr0));
+    test_xsetbv_handler handler{vcpu.get(), test_host_xcr0};
+
+    handler.save_guest_xstate(0x20);
+    handler.save_guest_xstate(0x40);
+    handler.load_guest_xstate();
+
+    CHECK(handler.ops == std::vector<xstate_op_t>{
+        {'s', 0x20, nullptr},
+        {'r', 0x20, nullptr},
+        {'s', 0x60, nullptr},
+        {'r', 0x60, nullptr}
+    });
+}
+
+TEST_CASE("xsetbv: only state enabled by the guest is saved")
+{
+    auto vcpu = make_vcpu(0, test_state(test_host_xcr0));
+    test_xsetbv_handler handler{vcpu.get(), test_guest_xcr0};
+
+    handler.save_guest_xstate(xsetbv_handler::xstate_avx512 | 0x4);
+    handler.load_guest_xstate();
+
+    CHECK(handler.ops == std::vector<xstate_op_t>{
+        {'s', 0x4, nullptr},
+        {'x', test_host_xcr0, nullptr},
+        {'x', test_guest_xcr0, nullptr},
+        {'r', 0x4, nullptr}
+    });
+}
+
+TEST_CASE("xsetbv: guest write restores saved state first")
+{
+    auto vcpu = make_vcpu(0, test_state(test_host_xcr0));
+    test_xsetbv_handler handler{vcpu.get(), test_guest_xcr0};
+
+    handler.save_guest_xstate(0x4);
+    handler.ops.clear();
+
+    vcpu->set_rax(0x3);
+    vcpu->set_rdx(0);
+    handler.handle(vcpu.get());
+
+    CHECK(handler.ops == std::vector<xstate_op_t>{
+        {'x', test_guest_xcr0, nullptr},
+        {'r', 0x4, nullptr},
+        {'x', 0x3, nullptr}
+    });
+}
+
+TEST_CASE("xsetbv: xsave areas are returned to the pool")
+{
+    auto vcpu = make_vcpu(0, test_state(test_host_xcr0));
+
+    uint8_t *area{};
+    {
+        test_xsetbv_handler handler{vcpu.get(), test_host_xcr0};
+
+        handler.save_guest_xstate(0x4);
+        REQUIRE(handler.ops.size() == 1);
+
+        area = handler.ops.front().area;
+        handler.load_guest_xstate();
+
+        CHECK(handler.ops.back().area == area);
+    }
+
+    test_xsetbv_handler handler{vcpu.get(), test_host_xcr0};
+    handler.save_guest_xstate(0x4);
+
+    REQUIRE(handler.ops.size() == 1);
+    CHECK(handler.ops.front().area == area);
+}
+
+#endif
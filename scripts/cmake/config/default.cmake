@@ -49,3 +49,19 @@ set(EAPIS_SOURCE_BFVMM_DIR ${CMAKE_SOURCE_DIR}/../../../bfvmm
     CACHE INTERNAL
     "bfvmm source dir"
 )
+
+# ------------------------------------------------------------------------------
+# Optional Handlers
+# ------------------------------------------------------------------------------
+
+set(EAPIS_HVE_HLT ON CACHE BOOL
+    "Build the HLT / MWAIT / MONITOR handler into eapis_hve"
+)
+
+set(EAPIS_HVE_PAUSE ON CACHE BOOL
+    "Build the PAUSE-loop exiting handler into eapis_hve"
+)
+
+set(EAPIS_HVE_RDTSC ON CACHE BOOL
+    "Build the RDTSC / TSC virtualization handler into eapis_hve"
+)
@@ -19,13 +19,33 @@
 # OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 # SOFTWARE.
 
+# ------------------------------------------------------------------------------
+# eapis_hve_defines
+# ------------------------------------------------------------------------------
+
+# Returns the DEFINES needed to compile out the optional handlers that are
+# turned off (see EAPIS_HVE_* in config/default.cmake). Anything that includes
+# the eapis vcpu must be built with the same DEFINES as eapis_hve.
+#
+macro(eapis_hve_defines OUT)
+    set(${OUT})
+    foreach(_handler HLT PAUSE RDTSC)
+        if(NOT EAPIS_HVE_${_handler})
+            list(APPEND ${OUT} DEFINES EAPIS_HVE_${_handler}=0)
+        endif()
+    endforeach()
+endmacro(eapis_hve_defines)
+
 # ------------------------------------------------------------------------------
 # eapis_vmm_extension
 # ------------------------------------------------------------------------------
 
 function(eapis_add_vmm_executable NAME)
+    eapis_hve_defines(EAPIS_HVE_DEFINES)
+
     list(APPEND ARGN
         LIBRARIES eapis_hve
+        ${EAPIS_HVE_DEFINES}
     )
 
     add_vmm_executable(